@@ -0,0 +1,607 @@
+// wav-marker-bench
+//
+// Generates synthetic wave and label files and times the wav-marker binary on them.
+// Every scenario is run with a warm page cache and with a cold one (the input and label
+// files are dropped from the cache with posix_fadvise before each run), and the report
+// gives p50/p99 latency, throughput in MB/s and labels/s.
+//
+// The scenarios sweep one dimension at a time around a baseline of a 16MB stereo 16 bit
+// file with 100 labels: file size, sample format, chunk layout and label count.
+
+#define _GNU_SOURCE
+#define _FILE_OFFSET_BITS 64
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#define MEGABYTE (1024ull * 1024ull)
+#define GIGABYTE (1024ull * MEGABYTE)
+
+// The chunk layouts the generator can write
+typedef enum
+{
+    LayoutPlain,       // fmt and data only
+    LayoutFormatExtra, // an 18 byte fmt chunk
+    LayoutOddChunks,   // odd sized chunks with padding bytes before and after the data
+    LayoutManyLists,   // 200 LIST INFO chunks after the data
+    LAYOUTS_COUNT
+} Layout;
+
+static const char *LayoutNames[LAYOUTS_COUNT] = {"plain", "fmt-extra", "odd-chunks", "many-lists"};
+
+typedef struct
+{
+    const char *sweep;
+    uint64_t dataSize; // bytes of sample data
+    uint16_t channels;
+    uint16_t bitsPerSample;
+    Layout layout;
+    uint32_t labelsCount;
+} Scenario;
+
+typedef struct
+{
+    const char *binaryPath;
+    const char *directory;
+    int runsCount;
+    uint64_t maxSize;
+} BenchOptions;
+
+static void putUInt16(char *out_Bytes, uint16_t value)
+{
+    out_Bytes[0] = (char)(value & 0xFF);
+    out_Bytes[1] = (char)(value >> 8);
+}
+
+static void putUInt32(char *out_Bytes, uint32_t value)
+{
+    for (int i = 0; i < 4; i++)
+    {
+        out_Bytes[i] = (char)((value >> (8 * i)) & 0xFF);
+    }
+}
+
+static void putUInt64(char *out_Bytes, uint64_t value)
+{
+    for (int i = 0; i < 8; i++)
+    {
+        out_Bytes[i] = (char)((value >> (8 * i)) & 0xFF);
+    }
+}
+
+static int writeAll(int fd, const void *bytes, size_t size)
+{
+    const char *position = (const char *)bytes;
+    while (size > 0)
+    {
+        ssize_t writtenBytes = write(fd, position, size);
+        if (writtenBytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        position += writtenBytes;
+        size -= (size_t)writtenBytes;
+    }
+
+    return 0;
+}
+
+static int writeChunk(int fd, const char *chunkID, const void *data, uint32_t size)
+{
+    char header[8];
+    memcpy(header, chunkID, 4);
+    putUInt32(&header[4], size);
+    if ((writeAll(fd, header, sizeof(header)) < 0) || (writeAll(fd, data, size) < 0))
+    {
+        return -1;
+    }
+
+    return (size % 2 != 0) ? writeAll(fd, "\0", 1) : 0;
+}
+
+// Extra chunk data of any size, filled with something that isn't all zeros
+static char *makeFiller(size_t size)
+{
+    char *filler = malloc(size > 0 ? size : 1);
+    if (filler != NULL)
+    {
+        for (size_t i = 0; i < size; i++)
+        {
+            filler[i] = (char)('a' + (i % 26));
+        }
+    }
+    return filler;
+}
+
+// Writes a wave file with dataSize bytes of noise. Files too large for RIFF are written as RF64
+static int generateWaveFile(const char *path, const Scenario *scenario)
+{
+    int returnCode = 0;
+    char *noise = NULL;
+    char *filler = makeFiller(1024);
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if ((fd < 0) || (filler == NULL))
+    {
+        fprintf(stderr, "Could not create %s\n", path);
+        returnCode = -1;
+        goto CleanUpAndExit;
+    }
+
+    uint16_t blockAlign = (uint16_t)(scenario->channels * scenario->bitsPerSample / 8);
+    uint32_t sampleRate = 48000;
+
+    // The chunks other than data, so the RIFF size can be worked out first
+    uint32_t formatSize = (scenario->layout == LayoutFormatExtra) ? 18 : 16;
+    uint64_t otherChunksSize = 8 + formatSize;
+    if (scenario->layout == LayoutOddChunks)
+    {
+        otherChunksSize += (8 + 604) + (8 + 42);
+    }
+    else if (scenario->layout == LayoutManyLists)
+    {
+        for (int i = 0; i < 200; i++)
+        {
+            uint32_t listSize = 4 + 8 + 17 + (uint32_t)(i % 7);
+            otherChunksSize += 8 + listSize + (listSize % 2);
+        }
+    }
+
+    uint64_t riffSize = 4 + otherChunksSize + 8 + scenario->dataSize + (scenario->dataSize % 2);
+    bool isRF64 = riffSize + 36 >= UINT32_MAX;
+
+    char header[12];
+    memcpy(header, isRF64 ? "RF64" : "RIFF", 4);
+    memcpy(&header[8], "WAVE", 4);
+    if (isRF64)
+    {
+        riffSize += 36;
+        putUInt32(&header[4], UINT32_MAX);
+    }
+    else
+    {
+        putUInt32(&header[4], (uint32_t)riffSize);
+    }
+    if (writeAll(fd, header, sizeof(header)) < 0)
+    {
+        returnCode = -1;
+        goto CleanUpAndExit;
+    }
+
+    if (isRF64)
+    {
+        char dataSize64[28];
+        putUInt64(&dataSize64[0], riffSize);
+        putUInt64(&dataSize64[8], scenario->dataSize);
+        putUInt64(&dataSize64[16], scenario->dataSize / blockAlign);
+        putUInt32(&dataSize64[24], 0);
+        if (writeChunk(fd, "ds64", dataSize64, sizeof(dataSize64)) < 0)
+        {
+            returnCode = -1;
+            goto CleanUpAndExit;
+        }
+    }
+
+    char format[18];
+    putUInt16(&format[0], scenario->bitsPerSample == 32 ? 3 : 1);
+    putUInt16(&format[2], scenario->channels);
+    putUInt32(&format[4], sampleRate);
+    putUInt32(&format[8], sampleRate * blockAlign);
+    putUInt16(&format[12], blockAlign);
+    putUInt16(&format[14], scenario->bitsPerSample);
+    putUInt16(&format[16], 0);
+    if (writeChunk(fd, "fmt ", format, formatSize) < 0)
+    {
+        returnCode = -1;
+        goto CleanUpAndExit;
+    }
+
+    if ((scenario->layout == LayoutOddChunks) && (writeChunk(fd, "bext", filler, 603) < 0))
+    {
+        returnCode = -1;
+        goto CleanUpAndExit;
+    }
+
+    // The sample data is noise from a xorshift generator, so no filesystem can dedupe or compress it away
+    char dataHeader[8] = {'d', 'a', 't', 'a'};
+    putUInt32(&dataHeader[4], isRF64 ? UINT32_MAX : (uint32_t)scenario->dataSize);
+    if (writeAll(fd, dataHeader, sizeof(dataHeader)) < 0)
+    {
+        returnCode = -1;
+        goto CleanUpAndExit;
+    }
+
+    size_t noiseSize = 4 * MEGABYTE;
+    noise = malloc(noiseSize);
+    if (noise == NULL)
+    {
+        fprintf(stderr, "Memory Allocation Error: Could not allocate memory for noise\n");
+        returnCode = -1;
+        goto CleanUpAndExit;
+    }
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    for (size_t i = 0; i < noiseSize; i += 8)
+    {
+        state ^= state << 13;
+        state ^= state >> 7;
+        state ^= state << 17;
+        memcpy(&noise[i], &state, 8);
+    }
+
+    uint64_t remainingBytes = scenario->dataSize + (scenario->dataSize % 2);
+    while (remainingBytes > 0)
+    {
+        size_t pieceSize = remainingBytes < noiseSize ? (size_t)remainingBytes : noiseSize;
+        if (writeAll(fd, noise, pieceSize) < 0)
+        {
+            returnCode = -1;
+            goto CleanUpAndExit;
+        }
+        remainingBytes -= pieceSize;
+    }
+
+    if (scenario->layout == LayoutOddChunks)
+    {
+        if (writeChunk(fd, "iXML", filler, 41) < 0)
+        {
+            returnCode = -1;
+            goto CleanUpAndExit;
+        }
+    }
+    else if (scenario->layout == LayoutManyLists)
+    {
+        for (int i = 0; i < 200; i++)
+        {
+            char list[4 + 8 + 17 + 6];
+            uint32_t textSize = 17 + (uint32_t)(i % 7);
+            memcpy(list, "INFOICMT", 8);
+            putUInt32(&list[8], textSize);
+            memcpy(&list[12], filler, textSize);
+            if (writeChunk(fd, "LIST", list, 12 + textSize) < 0)
+            {
+                returnCode = -1;
+                goto CleanUpAndExit;
+            }
+        }
+    }
+
+    // Cold runs can only drop pages that are already on disk
+    if (fsync(fd) < 0)
+    {
+        returnCode = -1;
+        goto CleanUpAndExit;
+    }
+
+CleanUpAndExit:
+
+    if ((returnCode < 0) && (fd >= 0))
+        fprintf(stderr, "Error writing %s\n", path);
+    if (fd >= 0)
+        close(fd);
+    if (noise != NULL)
+        free(noise);
+    if (filler != NULL)
+        free(filler);
+
+    return returnCode;
+}
+
+// Writes an Audacity label file with labels spread evenly over the length of the audio
+static int generateLabelFile(const char *path, const Scenario *scenario)
+{
+    FILE *labelFile = fopen(path, "w");
+    if (labelFile == NULL)
+    {
+        fprintf(stderr, "Could not create %s\n", path);
+        return -1;
+    }
+
+    uint16_t blockAlign = (uint16_t)(scenario->channels * scenario->bitsPerSample / 8);
+    double duration = (double)(scenario->dataSize / blockAlign) / 48000.0;
+    double step = duration / (scenario->labelsCount + 1);
+    for (uint32_t i = 0; i < scenario->labelsCount; i++)
+    {
+        double startTime = step * (i + 1);
+        fprintf(labelFile, "%.6f\t%.6f\tLabel %u\n", startTime, startTime, i + 1);
+    }
+
+    int returnCode = 0;
+    if ((fflush(labelFile) != 0) || (fsync(fileno(labelFile)) < 0))
+    {
+        fprintf(stderr, "Error writing %s\n", path);
+        returnCode = -1;
+    }
+    fclose(labelFile);
+
+    return returnCode;
+}
+
+static void dropFromPageCache(const char *path)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd >= 0)
+    {
+        posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+        close(fd);
+    }
+}
+
+static double getMonotonicSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
+
+// Runs wav-marker once and returns how long it took, or a negative number if it failed
+static double runWavMarker(const BenchOptions *options, const char *wavePath, const char *labelPath, const char *outputPath)
+{
+    double startTime = getMonotonicSeconds();
+
+    pid_t pid = fork();
+    if (pid < 0)
+    {
+        return -1;
+    }
+    if (pid == 0)
+    {
+        int nullFd = open("/dev/null", O_WRONLY);
+        if (nullFd >= 0)
+        {
+            dup2(nullFd, STDOUT_FILENO);
+            close(nullFd);
+        }
+        execl(options->binaryPath, options->binaryPath, wavePath, labelPath, outputPath, (char *)NULL);
+        _exit(127);
+    }
+
+    int status = 0;
+    while (waitpid(pid, &status, 0) < 0)
+    {
+        if (errno != EINTR)
+            return -1;
+    }
+
+    double elapsedSeconds = getMonotonicSeconds() - startTime;
+    if (!WIFEXITED(status) || (WEXITSTATUS(status) != 0))
+    {
+        return -1;
+    }
+
+    return elapsedSeconds;
+}
+
+static int compareDoubles(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return (x > y) - (x < y);
+}
+
+// Nearest rank percentile of sorted values
+static double getPercentile(const double *sortedValues, int count, double percentile)
+{
+    int rank = (int)((percentile / 100.0) * count + 0.999999);
+    if (rank < 1)
+        rank = 1;
+    if (rank > count)
+        rank = count;
+    return sortedValues[rank - 1];
+}
+
+static int runScenario(const BenchOptions *options, const Scenario *scenario)
+{
+    int returnCode = 0;
+    char wavePath[4096];
+    char labelPath[4096];
+    char outputPath[4096];
+    snprintf(wavePath, sizeof(wavePath), "%s/bench-input.wav", options->directory);
+    snprintf(labelPath, sizeof(labelPath), "%s/bench-labels.txt", options->directory);
+    snprintf(outputPath, sizeof(outputPath), "%s/bench-output.wav", options->directory);
+
+    double *timings = malloc(sizeof(double) * (size_t)options->runsCount);
+    if (timings == NULL)
+    {
+        fprintf(stderr, "Memory Allocation Error: Could not allocate memory for timings\n");
+        return -1;
+    }
+
+    if ((generateWaveFile(wavePath, scenario) < 0) || (generateLabelFile(labelPath, scenario) < 0))
+    {
+        returnCode = -1;
+        goto CleanUpAndExit;
+    }
+
+    char format[32];
+    snprintf(format, sizeof(format), "%uch/%ubit", scenario->channels, scenario->bitsPerSample);
+
+    for (int cold = 0; cold <= 1; cold++)
+    {
+        // One untimed run to warm the cache and check the scenario works at all
+        if (!cold && (runWavMarker(options, wavePath, labelPath, outputPath) < 0))
+        {
+            fprintf(stderr, "%s failed on the %s scenario\n", options->binaryPath, scenario->sweep);
+            returnCode = -1;
+            goto CleanUpAndExit;
+        }
+
+        for (int run = 0; run < options->runsCount; run++)
+        {
+            unlink(outputPath);
+            if (cold)
+            {
+                dropFromPageCache(wavePath);
+                dropFromPageCache(labelPath);
+            }
+
+            timings[run] = runWavMarker(options, wavePath, labelPath, outputPath);
+            if (timings[run] < 0)
+            {
+                fprintf(stderr, "%s failed on the %s scenario\n", options->binaryPath, scenario->sweep);
+                returnCode = -1;
+                goto CleanUpAndExit;
+            }
+        }
+
+        qsort(timings, (size_t)options->runsCount, sizeof(double), compareDoubles);
+        double p50 = getPercentile(timings, options->runsCount, 50);
+        double p99 = getPercentile(timings, options->runsCount, 99);
+
+        printf("%-8s %10.1f %-10s %-11s %8u %-5s %10.3f %10.3f %10.1f %12.0f\n",
+               scenario->sweep, (double)scenario->dataSize / MEGABYTE, format, LayoutNames[scenario->layout], scenario->labelsCount,
+               cold ? "cold" : "warm", p50 * 1000, p99 * 1000, (double)scenario->dataSize / MEGABYTE / p50, scenario->labelsCount / p50);
+        fflush(stdout);
+    }
+
+CleanUpAndExit:
+
+    unlink(wavePath);
+    unlink(labelPath);
+    unlink(outputPath);
+    free(timings);
+
+    return returnCode;
+}
+
+// Accepts plain byte counts and K, M or G suffixes
+static uint64_t parseSize(const char *text)
+{
+    char *end = NULL;
+    uint64_t size = strtoull(text, &end, 10);
+    switch (*end)
+    {
+    case 'K':
+    case 'k':
+        return size * 1024;
+    case 'M':
+    case 'm':
+        return size * MEGABYTE;
+    case 'G':
+    case 'g':
+        return size * GIGABYTE;
+    default:
+        return size;
+    }
+}
+
+int main(int argc, char **argv)
+{
+    BenchOptions options = {
+        .binaryPath = "./wav-marker",
+        .directory = "/tmp",
+        .runsCount = 10,
+        .maxSize = 256 * MEGABYTE};
+
+    for (int i = 1; i < argc; i++)
+    {
+        if ((strcmp(argv[i], "--binary") == 0) && (i + 1 < argc))
+        {
+            options.binaryPath = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--dir") == 0) && (i + 1 < argc))
+        {
+            options.directory = argv[++i];
+        }
+        else if ((strcmp(argv[i], "--runs") == 0) && (i + 1 < argc))
+        {
+            options.runsCount = atoi(argv[++i]);
+        }
+        else if ((strcmp(argv[i], "--max-size") == 0) && (i + 1 < argc))
+        {
+            options.maxSize = parseSize(argv[++i]);
+        }
+        else
+        {
+            printf("Usage: wav-marker-bench [--binary PATH] [--dir DIR] [--runs N] [--max-size SIZE]\n"
+                   "Files larger than --max-size (256M by default, up to 8G) are skipped\n");
+            return 1;
+        }
+    }
+
+    if (options.runsCount < 1)
+    {
+        fprintf(stderr, "--runs needs a number of runs greater than 0\n");
+        return 1;
+    }
+
+    const Scenario baseline = {
+        .sweep = "",
+        .dataSize = 16 * MEGABYTE,
+        .channels = 2,
+        .bitsPerSample = 16,
+        .layout = LayoutPlain,
+        .labelsCount = 100};
+
+    Scenario scenarios[64];
+    int scenariosCount = 0;
+
+    const uint64_t sizes[] = {1 * MEGABYTE, 16 * MEGABYTE, 256 * MEGABYTE, 1 * GIGABYTE, 4 * GIGABYTE, 8 * GIGABYTE};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++)
+    {
+        scenarios[scenariosCount] = baseline;
+        scenarios[scenariosCount].sweep = "size";
+        scenarios[scenariosCount].dataSize = sizes[i];
+        scenariosCount++;
+    }
+
+    const uint16_t formats[][2] = {{1, 16}, {2, 16}, {2, 24}, {6, 24}, {8, 32}};
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++)
+    {
+        scenarios[scenariosCount] = baseline;
+        scenarios[scenariosCount].sweep = "format";
+        scenarios[scenariosCount].channels = formats[i][0];
+        scenarios[scenariosCount].bitsPerSample = formats[i][1];
+        scenariosCount++;
+    }
+
+    for (int i = 0; i < LAYOUTS_COUNT; i++)
+    {
+        scenarios[scenariosCount] = baseline;
+        scenarios[scenariosCount].sweep = "layout";
+        scenarios[scenariosCount].layout = (Layout)i;
+        scenariosCount++;
+    }
+
+    const uint32_t labelCounts[] = {1, 100, 10000, 1000000};
+    for (size_t i = 0; i < sizeof(labelCounts) / sizeof(labelCounts[0]); i++)
+    {
+        scenarios[scenariosCount] = baseline;
+        scenarios[scenariosCount].sweep = "labels";
+        scenarios[scenariosCount].labelsCount = labelCounts[i];
+        scenariosCount++;
+    }
+
+    printf("%-8s %10s %-10s %-11s %8s %-5s %10s %10s %10s %12s\n",
+           "sweep", "MB", "format", "layout", "labels", "cache", "p50 ms", "p99 ms", "MB/s", "labels/s");
+
+    int failedCount = 0;
+    for (int i = 0; i < scenariosCount; i++)
+    {
+        // Keep the sample data a whole number of frames
+        uint16_t blockAlign = (uint16_t)(scenarios[i].channels * scenarios[i].bitsPerSample / 8);
+        scenarios[i].dataSize -= scenarios[i].dataSize % blockAlign;
+
+        if (scenarios[i].dataSize > options.maxSize)
+        {
+            continue;
+        }
+        if (runScenario(&options, &scenarios[i]) < 0)
+        {
+            failedCount++;
+        }
+    }
+
+    return failedCount > 0 ? 1 : 0;
+}
@@ -0,0 +1,144 @@
+// wav-marker-check
+//
+// Checks the parts of the library whose results must agree with each other exactly, over far more
+// inputs than the benchmark files hold. The library is compiled into this program so its internal
+// functions can be called directly.
+//
+// Exported label times must read back to the frame they were written from, at every sample rate, and
+// the vector kernels of timesToIndices must give the same frames as timeToIndex in every rounding mode.
+// Build it with the same -m flags as the library to check the kernel those flags select.
+
+#include "../wavmarker.c"
+
+#define RANDOM_FRAMES_COUNT 200000
+
+static const uint32_t SampleRates[] = {8000, 11025, 16000, 22050, 32000, 44100, 48000, 88200, 96000, 176400, 192000,
+                                       352800, 384000, 705600, 768000, 999999, 1000000, 1000001, 2822400, 5644800, 11289600};
+
+#define SAMPLE_RATES_COUNT (sizeof(SampleRates) / sizeof(SampleRates[0]))
+
+// xorshift64, so every run checks the same frames
+static uint64_t nextRandom(uint64_t *state)
+{
+    *state ^= *state << 13;
+    *state ^= *state >> 7;
+    *state ^= *state << 17;
+    return *state;
+}
+
+// Exports a frame the way wm_export_labels does and reads it back the way a label file is read
+static bool isExportTimeReadBack(uint64_t frame, uint32_t sampleRate)
+{
+    char text[32];
+    size_t length = putExportTime(text, frame, sampleRate);
+    LabelTime time;
+    bool isNegative = false;
+    if (!parseLabelTime(text, text + length, &time, &isNegative) || isNegative)
+    {
+        fprintf(stderr, "Export time %.*s of frame %llu at %u Hz can't be read back\n", (int)length, text, (unsigned long long)frame, sampleRate);
+        return false;
+    }
+
+    uint64_t readFrame = timeToIndex(time, sampleRate, WM_ROUND_DOWN);
+    if (readFrame != frame)
+    {
+        fprintf(stderr, "Frame %llu at %u Hz was exported as %.*s and read back as frame %llu\n", (unsigned long long)frame, sampleRate,
+                (int)length, text, (unsigned long long)readFrame);
+        return false;
+    }
+    return true;
+}
+
+static int checkExportTimes(void)
+{
+    uint64_t state = 0x9E3779B97F4A7C15ull;
+    uint64_t checkedCount = 0;
+    for (size_t r = 0; r < SAMPLE_RATES_COUNT; r++)
+    {
+        uint32_t sampleRate = SampleRates[r];
+
+        // Every frame of the first two seconds, the frames around the last one a cue point can hold, and random ones in between.
+        // Region ends can be up to 2^32 frames after a cue point, so the random frames go up to 2^33
+        for (uint64_t frame = 0; frame < 2 * (uint64_t)sampleRate; frame++, checkedCount++)
+        {
+            if (!isExportTimeReadBack(frame, sampleRate))
+                return 1;
+        }
+        for (uint64_t frame = UINT32_MAX - 1000; frame < (uint64_t)UINT32_MAX + 1000; frame++, checkedCount++)
+        {
+            if (!isExportTimeReadBack(frame, sampleRate))
+                return 1;
+        }
+        for (int i = 0; i < RANDOM_FRAMES_COUNT; i++, checkedCount++)
+        {
+            if (!isExportTimeReadBack(nextRandom(&state) >> 31, sampleRate))
+                return 1;
+        }
+    }
+
+    printf("Export times: %llu frames at %zu sample rates read back exactly\n", (unsigned long long)checkedCount, SAMPLE_RATES_COUNT);
+    return 0;
+}
+
+// The vector kernels are used below MAX_VECTOR_SAMPLE_RATE, the last rates check the scalar loop still takes over above it
+static const uint32_t VectorSampleRates[] = {8000, 11025, 22050, 44100, 48000, 96000, 192000, 352800, 384000, 705600, 768000,
+                                             MAX_VECTOR_SAMPLE_RATE - 1, MAX_VECTOR_SAMPLE_RATE, 4000000000u};
+static const wm_rounding Roundings[] = {WM_ROUND_DOWN, WM_ROUND_NEAREST, WM_ROUND_UP};
+
+#define TIMES_COUNT 1001 // Odd, so every kernel has a tail left for the scalar loop
+#define TIMES_RUNS_COUNT 300
+
+static int checkTimesToIndices(void)
+{
+    static uint32_t seconds[TIMES_COUNT];
+    static uint32_t nanoseconds[TIMES_COUNT];
+    static uint64_t frames[TIMES_COUNT];
+    uint64_t state = 0xD1B54A32D192ED03ull;
+    uint64_t checkedCount = 0;
+
+    for (size_t r = 0; r < sizeof(VectorSampleRates) / sizeof(VectorSampleRates[0]); r++)
+    {
+        uint32_t sampleRate = VectorSampleRates[r];
+        for (int run = 0; run < TIMES_RUNS_COUNT; run++)
+        {
+            for (uint32_t i = 0; i < TIMES_COUNT; i++)
+            {
+                // Mostly the start or middle of a frame moved a nanosecond either way, where rounding goes wrong first,
+                // and some times anywhere in the second
+                uint64_t randomValue = nextRandom(&state);
+                uint64_t frame = (randomValue >> 8) % sampleRate;
+                int64_t time = (int64_t)((frame * 1000000000u + ((randomValue & 1) ? 500000000u : 0)) / sampleRate) + (int64_t)((randomValue >> 1) % 3) - 1;
+                if ((randomValue & 0x18) == 0)
+                    time = (int64_t)((randomValue >> 32) % 1000000000u);
+                nanoseconds[i] = (uint32_t)((time < 0) ? 0 : ((time > 999999999) ? 999999999 : time));
+                seconds[i] = ((randomValue & 0xE0) == 0) ? UINT32_MAX : (uint32_t)(nextRandom(&state) >> 32);
+            }
+            for (size_t m = 0; m < sizeof(Roundings) / sizeof(Roundings[0]); m++)
+            {
+                timesToIndices(seconds, nanoseconds, TIMES_COUNT, sampleRate, Roundings[m], frames);
+                for (uint32_t i = 0; i < TIMES_COUNT; i++, checkedCount++)
+                {
+                    LabelTime time = {.seconds = seconds[i], .nanoseconds = nanoseconds[i]};
+                    uint64_t expectedFrame = timeToIndex(time, sampleRate, Roundings[m]);
+                    if (frames[i] != expectedFrame)
+                    {
+                        fprintf(stderr, "%u.%09u seconds at %u Hz with rounding %d is frame %llu, timesToIndices gave %llu\n", seconds[i], nanoseconds[i],
+                                sampleRate, (int)Roundings[m], (unsigned long long)expectedFrame, (unsigned long long)frames[i]);
+                        return 1;
+                    }
+                }
+            }
+        }
+    }
+
+    printf("Label times: %llu times in 3 rounding modes match timeToIndex\n", (unsigned long long)checkedCount / 3);
+    return 0;
+}
+
+int main(void)
+{
+    int failuresCount = 0;
+    failuresCount += checkExportTimes();
+    failuresCount += checkTimesToIndices();
+    return failuresCount > 0 ? 1 : 0;
+}
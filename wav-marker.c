@@ -6,151 +6,167 @@
  * and creates a new .wav file with embedded cue points and text for each label
  * in a format that works with the podcasting application Forecast
  *
+ * The work is done by libwavmarker (wavmarker.c), this file is the command line around it
+ *
  * Extended from wavecuepoint.c
  * Originally created by Jim McGowan on 2012-11-29
  * Turned into a commandline utility by David Hilowitz on 2016-11-19
  * And modified by Tim Moore on 2022-10-14
  */
 
+#define _FILE_OFFSET_BITS 64 // off_t handles files larger than 4GB on 32 bit systems too
+
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 #include <stdbool.h>
 #include <errno.h>
-#include <ctype.h>
-
-#define WAVE_FORMAT_PCM 0x0001
-#define WAVE_FORMAT_IEEE_FLOAT 0x0003
-
-// Some Structs that we use to represent and manipulate Chunks in the Wave files
-
-// The header of a wave file
+#include <limits.h>
+#include <stdarg.h>
+#include <time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+
+#include "wavmarker.h"
+
+// Options selected on the command line that change how the output is produced
 typedef struct
 {
-    char chunkID[4];  // Must be "RIFF" (0x52494646)
-    char dataSize[4]; // Byte count for the rest of the file (i.e. file length - 8 bytes)
-    char riffType[4]; // Must be "WAVE" (0x57415645)
-} WaveHeader;
+    bool inPlace;    // Rewrite the marker chunks of the input file instead of creating a new output file
+    bool syncOutput; // fsync the output before finishing
+    size_t copyBufferSize;
+    int copyBuffersCount;
+    bool useHugePages; // Back the copy buffers with huge pages
+    bool useIoRing;    // Write the output through io_uring
+    bool directIo;     // Keep the copied sample data out of the page cache
+    wm_merge_mode mergeMode;
+    wm_rounding rounding; // How label times between two samples are turned into a sample
+    wm_checksum_mode checksumMode;
+    wm_silence_level silenceLevel; // Mark the silences found in the sample data
+    double silenceThresholdDb;
+    double silenceMinSeconds;
+    wm_snap_mode snapMode; // Move the labels to a zero crossing or a quiet sample near them
+    double snapWindowSeconds;
+    uint32_t peakSamplesPerPixel; // Write waveform peaks next to each output, 0 for none
+    int peakLevelsCount;
+    bool measuresLoudness; // Print the loudness of each output and of the segments between its markers
+    bool exportLabels; // Write the markers of the wave files out as label files instead
+} MarkerOptions;
 
-// The format chunk of a wave file
 typedef struct
 {
-    char chunkID[4];                  // String: must be "fmt " (0x666D7420).
-    char chunkDataSize[4];            // Unsigned 4-byte little endian int: Byte count for the remainder of the chunk: 16 + extraFormatbytes.
-    char compressionCode[2];          // Unsigned 2-byte little endian int
-    char numberOfChannels[2];         // Unsigned 2-byte little endian int
-    char sampleRate[4];               // Unsigned 4-byte little endian int
-    char averageBytesPerSecond[4];    // Unsigned 4-byte little endian int: This value indicates how many bytes of wave data must be streamed to a D/A converter per second in order to play the wave file. This information is useful when determining if data can be streamed from the source fast enough to keep up with playback. = SampleRate * BlockAlign.
-    char blockAlign[2];               // Unsigned 2-byte little endian int: The number of bytes per sample slice. This value is not affected by the number of channels and can be calculated with the formula: blockAlign = significantBitsPerSample / 8 * numberOfChannels
-    char significantBitsPerSample[2]; // Unsigned 2-byte little endian int
-} FormatChunk;
-
-// CuePoint: each individual 'label' in a wave file is represented by a cue point.
+    uint64_t wallStart;
+    uint64_t cpuStart;
+} PhaseTimer;
+
+void startPhase(PhaseTimer *timer);
+
+// Adds the time since startPhase to the phase.  The library times its own phases, this is for the ones around it
+void endPhase(PhaseTimer *timer, wm_stats *stats, wm_phase phase);
+
+void addStats(wm_stats *total, const wm_stats *stats);
+
+// Adds the counters of a context to stats and starts the context counting from zero again
+void collectStats(wm_context *context, wm_stats *stats);
+
+void printStats(FILE *stream, const wm_stats *stats, bool asJson);
+
+// Progress messages go to stdout unless they have been turned off, which batch mode does while its workers run
+static bool ShowProgress = true;
+
+void printProgress(const char *format, ...);
+
+// The message callback of every context, progress goes through printProgress and warnings to stderr
+void printContextMessage(void *userData, wm_message_type type, const char *message);
+
+// One line of a batch manifest, and how it went
 typedef struct
 {
-    char cuePointID[4];        // a unique ID for the Cue Point.
-    char playOrderPosition[4]; // Unsigned 4-byte little endian int: If a Playlist chunk is present in the Wave file, this the sample number at which this cue point will occur during playback of the entire play list as defined by the play list's order.  **Otherwise set to same as sample offset??***  Set to 0 when there is no playlist.
-    char dataChunkID[4];       // Unsigned 4-byte little endian int: The ID of the chunk containing the sample data that corresponds to this cue point.  If there is no playlist, this should be 'data'.
-    char chunkStart[4];        // Unsigned 4-byte little endian int: The byte offset into the Wave List Chunk of the chunk containing the sample that corresponds to this cue point. This is the same chunk described by the Data Chunk ID value. If no Wave List Chunk exists in the Wave file, this value is 0.
-    char blockStart[4];        // Unsigned 4-byte little endian int: The byte offset into the "data" or "slnt" Chunk to the start of the block containing the sample. The start of a block is defined as the first byte in uncompressed PCM wave data or the last byte in compressed wave data where decompression can begin to find the value of the corresponding sample value.
-    char frameOffset[4];       // Unsigned 4-byte little endian int: The offset into the block (specified by Block Start) for the sample that corresponds to the cue point.
-} CuePoint;
-
-// CuePoints are stored in a CueChunk
+    char *inFilePath;
+    char *labelFilePath;
+    char *outFilePath;
+    off_t inputFileSize; // Jobs are started largest first
+    int lineNumber;
+    int returnCode;
+    double elapsedSeconds;
+    bool hasChecksum;
+    uint32_t fileChecksum; // CRC-32C of the output file
+    bool hasLoudness;
+    uint32_t sampleRate;
+    wm_loudness loudness; // Of the whole output file
+    wm_loudness *loudnessSegments; // A copy of the segments, the context moves on to the next job
+    size_t loudnessSegmentsCount;
+} BatchJob;
+
+// The jobs of one batch worker.  The worker takes jobs from the head, idle workers steal from the tail
 typedef struct
 {
-    char chunkID[4];        // String: Must be "cue " (0x63756520).
-    char chunkDataSize[4];  // Unsigned 4-byte little endian int: Byte count for the remainder of the chunk: 4 (size of cuePointsCount) + (24 (size of CuePoint struct) * number of CuePoints).
-    char cuePointsCount[4]; // Unsigned 4-byte little endian int: Length of cuePoints[].
-    CuePoint *cuePoints;
-} CueChunk;
+    pthread_mutex_t lock;
+    size_t *jobIndices;
+    size_t head;
+    size_t tail;
+} BatchQueue;
 
-// Cue Labels are stored in a ListChunk
-typedef struct
-{
-    char chunkID[4];       // String: Must be "LIST" (0x4C495354).
-    char chunkDataSize[4]; // Unsigned 4-byte little endian int: Byte count for the remainder of the chunk: 4 (size of TypeID) + Label chunks.
-    char typeID[4];        // String: Must be "adtl" (0x6164746C).
-    char *labelChunks;
-} ListChunk;
-
-// Some chunks we don't care about the contents and will just copy them from the input file to the output,
-// so this struct just stores positions of such chunks in the input file
 typedef struct
 {
-    long startOffset; // in bytes
-    size_t size;      // in bytes
-} ChunkLocation;
+    BatchJob *jobs;
+    BatchQueue *queues; // One per worker
+    int workersCount;
+    const MarkerOptions *options;
+} BatchPool;
 
 typedef struct
 {
-    uint32_t locations[500];
-    char labels[500][500]; // Hacky Storage for Label strings. 500 characters per label should be plenty
-    size_t labelLengths[500];
-    uint32_t count;
-} LabelInfo;
+    BatchPool *pool;
+    int workerIndex;
+    wm_stats stats; // Everything this worker did, added to the totals once it is done
+} BatchWorker;
 
-LabelInfo readLabelFile(FILE *labelFile, FormatChunk formatChunk);
+// Creates a context set up the way the options ask for. Every thread that marks files needs one of its own
+static wm_context *createContext(const MarkerOptions *options);
+static uint64_t parseSize(const char *text);
 
-int writeOutputFile(FILE *inputFile, FILE *outputFile, ChunkLocation formatChunkExtraBytes, ChunkLocation dataChunkLocation, int otherChunksCount, ChunkLocation *otherChunkLocations, LabelInfo labelInfo, WaveHeader *waveHeader, FormatChunk *formatChunk, CueChunk cueChunk, ListChunk listChunk, size_t listChunkSize);
+// The main function
 
-// For such chunks that we will copy over from input to output, this function does that in 1MB pieces
-int writeChunkLocationFromInputFileToOutputFile(ChunkLocation chunk, FILE *inputFile, FILE *outputFile);
+static int addLabelsToWaveFile(wm_context *context, char *inFilePath, char *labelFilePath, char *outFilePath, const MarkerOptions *options, wm_stats *stats);
 
-// All data in a Wave file must be little endian.
-// These are functions to convert 2- and 4-byte unsigned ints to and from little endian, if needed
+// Same as addLabelsToWaveFile, but reads the input and writes the output in a single forward pass. "-" stands for stdin or stdout
+static int addLabelsToWaveStream(wm_context *context, char *inFilePath, char *labelFilePath, char *outFilePath, wm_stats *stats);
 
-enum HostEndiannessType
-{
-    EndiannessUndefined = 0,
-    LittleEndian,
-    BigEndian
-};
+// Prints the CRC-32C of the output file and of each of its chunks
+static void printChecksums(wm_context *context, const char *outFilePath);
 
-static enum HostEndiannessType HostEndianness = EndiannessUndefined;
+// Prints the integrated loudness and true peak of the output file and of each segment between its markers
+static void printLoudness(wm_context *context, const char *outFilePath);
+static void printLoudnessValues(const char *indent, const char *outFilePath, uint32_t sampleRate, const wm_loudness *file, const wm_loudness *segments, size_t segmentsCount);
 
-enum HostEndiannessType getHostEndianness(void);
-uint32_t littleEndianBytesToUInt32(char littleEndianBytes[4]);
-void uint32ToLittleEndianBytes(uint32_t uInt32Value, char out_LittleEndianBytes[4]);
-uint16_t littleEndianBytesToUInt16(char littleEndianBytes[2]);
-void uint16ToLittleEndianBytes(uint16_t uInt16Value, char out_LittleEndianBytes[2]);
+// Writes each level of the peaks of the output file next to it as OUTPUTFILE.SAMPLES.dat
+static int writePeakFiles(wm_context *context, const char *outFilePath, const MarkerOptions *options);
 
-uint32_t timeToIndex(float timestamp, FormatChunk formatChunk);
+// Writes the markers of a wave file to a label file, "-" stands for stdout
+static int exportLabelsFromWaveFile(wm_context *context, char *inFilePath, char *labelFilePath, wm_stats *stats);
 
-// The main function
+// Runs every job in the manifest on a pool of worker threads and prints a report of how each one went
+static int runBatch(char *manifestFilePath, int workersCount, const MarkerOptions *options, wm_stats *stats);
 
-static int addLabelsToWaveFile(char *inFilePath, char *labelFilePath, char *outFilePath)
+static int addLabelsToWaveFile(wm_context *context, char *inFilePath, char *labelFilePath, char *outFilePath, const MarkerOptions *options, wm_stats *stats)
 {
-
     int returnCode = 0;
+    int inputFd = -1;
+    int labelFd = -1;
+    int outputFd = -1;
+    wm_status status = WM_OK;
+    PhaseTimer phaseTimer;
 
-    // Prepare some variables to hold data read from the input file
-    FILE *inputFile = NULL;
-    WaveHeader *waveHeader = NULL;
-    FormatChunk *formatChunk = NULL;
-    ChunkLocation formatChunkExtraBytes = {0, 0};
-    ChunkLocation dataChunkLocation = {0, 0};
-    const int maxOtherChunks = 256; // How many other chunks can we expect to find?  Who knows! So lets pull 256 out of the air.  That's a nice computery number.
-    int otherChunksCount = 0;
-    ChunkLocation otherChunkLocations[maxOtherChunks];
-
-    FILE *labelFile = NULL;
-    CueChunk cueChunk = {
-        .chunkID = {0},
-        .chunkDataSize = {0},
-        .cuePointsCount = {0},
-        .cuePoints = NULL};
-    ListChunk listChunk = {
-        .chunkID = {0},
-        .chunkDataSize = {0},
-        .typeID = {0},
-        .labelChunks = NULL};
-    FILE *outputFile = NULL;
-
-    // Open the Input File
-    inputFile = fopen(inFilePath, "rb");
-    if (inputFile == NULL)
+    startPhase(&phaseTimer);
+
+    // Open the Input File, in place updates need to write to it as well
+    inputFd = open(inFilePath, options->inPlace ? O_RDWR : O_RDONLY);
+    if (inputFd < 0)
     {
         fprintf(stderr, "Could not open input file %s\n", inFilePath);
         returnCode = -1;
@@ -158,830 +174,1221 @@ static int addLabelsToWaveFile(char *inFilePath, char *labelFilePath, char *outF
     }
 
     // Open the Label file
-    labelFile = fopen(labelFilePath, "rb");
-    if (labelFile == NULL)
+    labelFd = open(labelFilePath, O_RDONLY);
+    if (labelFd < 0)
     {
         fprintf(stderr, "Could not open label file %s\n", labelFilePath);
         returnCode = -1;
         goto CleanUpAndExit;
     }
 
-    // Get & check the input file header
-    fprintf(stdout, "Reading input wave file.\n");
+    endPhase(&phaseTimer, stats, WM_PHASE_OPEN);
 
-    waveHeader = (WaveHeader *)malloc(sizeof(WaveHeader));
-    if (waveHeader == NULL)
+    status = wm_read_labels(context, labelFd);
+    if (status != WM_OK)
     {
-        fprintf(stderr, "Memory Allocation Error: Could not allocate memory for Wave File Header\n");
-        returnCode = -1;
         goto CleanUpAndExit;
     }
 
-    fread(waveHeader, sizeof(WaveHeader), 1, inputFile);
-    if (ferror(inputFile) != 0)
+    if (options->inPlace)
     {
-        fprintf(stderr, "Error reading input file %s\n", inFilePath);
-        returnCode = -1;
+        status = wm_add_markers_in_place(context, inputFd);
         goto CleanUpAndExit;
     }
 
-    if (strncmp(&(waveHeader->chunkID[0]), "RIFF", 4) != 0)
+    // Opening the output truncates it, which would lose the input if they are the same file
+    struct stat inputStat;
+    struct stat outputStat;
+    if ((fstat(inputFd, &inputStat) == 0) && (stat(outFilePath, &outputStat) == 0) && (inputStat.st_dev == outputStat.st_dev) && (inputStat.st_ino == outputStat.st_ino))
     {
-        fprintf(stderr, "Input file is not a RIFF file\n");
+        fprintf(stderr, "Output file %s is the input file, use --in-place to update it\n", outFilePath);
         returnCode = -1;
         goto CleanUpAndExit;
     }
 
-    if (strncmp(&(waveHeader->riffType[0]), "WAVE", 4) != 0)
+    // Open the output file for writing
+    startPhase(&phaseTimer);
+    outputFd = open(outFilePath, O_RDWR | O_CREAT | O_TRUNC, 0666);
+    if (outputFd < 0)
     {
-        fprintf(stderr, "Input file is not a WAVE file\n");
+        fprintf(stderr, "Could not open output file %s\nError: %d\n", outFilePath, errno);
         returnCode = -1;
         goto CleanUpAndExit;
     }
+    endPhase(&phaseTimer, stats, WM_PHASE_OPEN);
 
-    uint32_t remainingFileSize = littleEndianBytesToUInt32(waveHeader->dataSize) - sizeof(waveHeader->riffType); // dataSize does not counf the chunkID or the dataSize, so remove the riffType size to get the length of the rest of the file.
+    status = wm_add_markers(context, inputFd, outputFd);
 
-    if (remainingFileSize <= 0)
+    // Don't leave a broken wave file behind
+    if (status != WM_OK)
     {
-        fprintf(stderr, "Input file is an empty WAVE file\n");
-        returnCode = -1;
-        goto CleanUpAndExit;
+        unlink(outFilePath);
     }
-
-    // Start reading in the rest of the wave file
-    while (1)
+    else
     {
-        char nextChunkID[4];
-
-        // Read the ID of the next chunk in the file, and bail if we hit End Of File
-        fread(&nextChunkID[0], sizeof(nextChunkID), 1, inputFile);
-        if (feof(inputFile))
+        if (options->checksumMode != WM_CHECKSUM_NONE)
         {
-            break;
+            printChecksums(context, outFilePath);
         }
-
-        if (ferror(inputFile) != 0)
+        if (options->measuresLoudness)
         {
-            fprintf(stderr, "Error reading input file %s\n", inFilePath);
-            returnCode = -1;
-            goto CleanUpAndExit;
+            printLoudness(context, outFilePath);
+        }
+        if (options->peakSamplesPerPixel > 0)
+        {
+            returnCode = writePeakFiles(context, outFilePath, options);
         }
+    }
 
-        // See which kind of chunk we have
+CleanUpAndExit:
 
-        if (strncmp(&nextChunkID[0], "fmt ", 4) == 0)
-        {
-            // We found the format chunk
+    if (status != WM_OK)
+    {
+        fprintf(stderr, "%s\n", wm_error_message(context));
+        returnCode = -1;
+    }
 
-            formatChunk = (FormatChunk *)malloc(sizeof(FormatChunk));
-            if (formatChunk == NULL)
-            {
-                fprintf(stderr, "Memory Allocation Error: Could not allocate memory for Wave File Format Chunk\n");
-                returnCode = -1;
-                goto CleanUpAndExit;
-            }
+    if (inputFd >= 0)
+        close(inputFd);
+    if (labelFd >= 0)
+        close(labelFd);
+    if (outputFd >= 0)
+        close(outputFd);
+    collectStats(context, stats);
 
-            fseek(inputFile, -4, SEEK_CUR);
-            fread(formatChunk, sizeof(FormatChunk), 1, inputFile);
-            if (ferror(inputFile) != 0)
-            {
-                fprintf(stderr, "Error reading input file %s\n", inFilePath);
-                returnCode = -1;
-                goto CleanUpAndExit;
-            }
+    return returnCode;
+}
 
-            uint16_t compressionCode = littleEndianBytesToUInt16(formatChunk->compressionCode);
-            if (compressionCode != WAVE_FORMAT_PCM && compressionCode != WAVE_FORMAT_IEEE_FLOAT)
-            {
-                fprintf(stderr, "Compressed audio formats are not supported\n");
-                returnCode = -1;
-                goto CleanUpAndExit;
-            }
+static int addLabelsToWaveStream(wm_context *context, char *inFilePath, char *labelFilePath, char *outFilePath, wm_stats *stats)
+{
+    int returnCode = 0;
+    int inputFd = -1;
+    int labelFd = -1;
+    int outputFd = -1;
+    wm_status status = WM_OK;
+    PhaseTimer phaseTimer;
 
-            // Note: For compressed audio data there may be extra bytes appended to the format chunk,
-            // but as we are only handling uncompressed data we shouldn't encounter them
+    startPhase(&phaseTimer);
 
-            // There may or may not be extra data at the end of the fomat chunk.  For uncompressed audio there should be no need, but some files may still have it.
-            // if formatChunk.chunkDataSize > 16 (16 = the number of bytes for the format chunk, not counting the 4 byte ID and the chunkDataSize itself) there is extra data
-            uint32_t extraFormatBytesCount = littleEndianBytesToUInt32(formatChunk->chunkDataSize) - 16;
-            if (extraFormatBytesCount > 0)
-            {
-                formatChunkExtraBytes.startOffset = ftell(inputFile);
-                formatChunkExtraBytes.size = extraFormatBytesCount;
-                fseek(inputFile, extraFormatBytesCount, SEEK_CUR);
-                if (extraFormatBytesCount % 2 != 0)
-                {
-                    fseek(inputFile, 1, SEEK_CUR);
-                }
-            }
+    inputFd = (strcmp(inFilePath, "-") == 0) ? STDIN_FILENO : open(inFilePath, O_RDONLY);
+    if (inputFd < 0)
+    {
+        fprintf(stderr, "Could not open input file %s\n", inFilePath);
+        returnCode = -1;
+        goto CleanUpAndExit;
+    }
 
-            printf("Got Format Chunk\n");
-        }
+    labelFd = open(labelFilePath, O_RDONLY);
+    if (labelFd < 0)
+    {
+        fprintf(stderr, "Could not open label file %s\n", labelFilePath);
+        returnCode = -1;
+        goto CleanUpAndExit;
+    }
 
-        else if (strncmp(&nextChunkID[0], "data", 4) == 0)
-        {
-            // We found the data chunk
-            dataChunkLocation.startOffset = ftell(inputFile) - (long)sizeof(nextChunkID);
+    outputFd = (strcmp(outFilePath, "-") == 0) ? STDOUT_FILENO : open(outFilePath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (outputFd < 0)
+    {
+        fprintf(stderr, "Could not open output file %s\nError: %d\n", outFilePath, errno);
+        returnCode = -1;
+        goto CleanUpAndExit;
+    }
 
-            // The next 4 bytes are the chunk data size - the size of the sample data
-            char sampleDataSizeBytes[4];
-            fread(sampleDataSizeBytes, sizeof(char), 4, inputFile);
-            if (ferror(inputFile) != 0)
-            {
-                fprintf(stderr, "Error reading input file %s\n", inFilePath);
-                returnCode = -1;
-                goto CleanUpAndExit;
-            }
-            uint32_t sampleDataSize = littleEndianBytesToUInt32(sampleDataSizeBytes);
+    endPhase(&phaseTimer, stats, WM_PHASE_OPEN);
 
-            dataChunkLocation.size = sizeof(nextChunkID) + sizeof(sampleDataSizeBytes) + sampleDataSize;
+    status = wm_read_labels(context, labelFd);
+    if (status == WM_OK)
+    {
+        status = wm_add_markers_stream(context, inputFd, outputFd);
+    }
 
-            // Skip to the end of the chunk.  Chunks must be aligned to 2 byte boundaries, but any padding at the end of a chunk is not included in the chunkDataSize
-            fseek(inputFile, sampleDataSize, SEEK_CUR);
-            if (sampleDataSize % 2 != 0)
-            {
-                fseek(inputFile, 1, SEEK_CUR);
-            }
+CleanUpAndExit:
 
-            printf("Got Data Chunk\n");
-        }
+    if (status != WM_OK)
+    {
+        fprintf(stderr, "%s\n", wm_error_message(context));
+        returnCode = -1;
+    }
 
-        else if (strncmp(&nextChunkID[0], "cue ", 4) == 0)
-        {
-            // We found an existing Cue Chunk
+    if ((inputFd >= 0) && (inputFd != STDIN_FILENO))
+        close(inputFd);
+    if (labelFd >= 0)
+        close(labelFd);
+    if ((outputFd >= 0) && (outputFd != STDOUT_FILENO))
+        close(outputFd);
+    collectStats(context, stats);
 
-            char cueChunkDataSizeBytes[4];
-            fread(cueChunkDataSizeBytes, sizeof(char), 4, inputFile);
-            if (ferror(inputFile) != 0)
-            {
-                fprintf(stderr, "Error reading input file %s\n", inFilePath);
-                returnCode = -1;
-                goto CleanUpAndExit;
-            }
-            uint32_t cueChunkDataSize = littleEndianBytesToUInt32(cueChunkDataSizeBytes);
+    return returnCode;
+}
 
-            // Skip over the chunk's data, and any padding byte
-            fseek(inputFile, cueChunkDataSize, SEEK_CUR);
-            if (cueChunkDataSize % 2 != 0)
-            {
-                fseek(inputFile, 1, SEEK_CUR);
-            }
+static void printChecksums(wm_context *context, const char *outFilePath)
+{
+    uint32_t fileChecksum = 0;
+    const wm_chunk_checksum *chunks = NULL;
+    size_t chunksCount = wm_get_checksums(context, &fileChecksum, &chunks);
 
-            printf("Found Existing Cue Chunk\n");
-        }
+    printProgress("CRC-32C %08x  %s\n", fileChecksum, outFilePath);
+    for (size_t i = 0; i < chunksCount; i++)
+    {
+        printProgress("  %.4s  %08x  %llu bytes\n", chunks[i].chunk_id, chunks[i].crc32c, (unsigned long long)chunks[i].size);
+    }
+}
 
-        else
+static void printLoudness(wm_context *context, const char *outFilePath)
+{
+    uint32_t sampleRate = 0;
+    wm_loudness file;
+    const wm_loudness *segments = NULL;
+    size_t segmentsCount = wm_get_loudness(context, &sampleRate, &file, &segments);
+    printLoudnessValues("", outFilePath, sampleRate, &file, segments, segmentsCount);
+}
+
+static void printLoudnessValues(const char *indent, const char *outFilePath, uint32_t sampleRate, const wm_loudness *file, const wm_loudness *segments, size_t segmentsCount)
+{
+    printProgress("%sLoudness %.1f LUFS, true peak %.1f dBTP  %s\n", indent, file->integrated_lufs, file->true_peak_dbtp, outFilePath);
+    for (size_t i = 0; i < segmentsCount; i++)
+    {
+        printProgress("%s  %.3f to %.3f  %.1f LUFS  %.1f dBTP\n", indent, (double)segments[i].start_frame / sampleRate,
+                      (double)(segments[i].start_frame + segments[i].frames_count) / sampleRate, segments[i].integrated_lufs, segments[i].true_peak_dbtp);
+    }
+}
+
+static int writePeakFiles(wm_context *context, const char *outFilePath, const MarkerOptions *options)
+{
+    for (int level = 0; level < options->peakLevelsCount; level++)
+    {
+        uint32_t samplesPerPixel = 0;
+        wm_get_peaks(context, level, &samplesPerPixel, NULL, NULL);
+
+        char peakFilePath[PATH_MAX];
+        if (snprintf(peakFilePath, sizeof(peakFilePath), "%s.%u.dat", outFilePath, samplesPerPixel) >= (int)sizeof(peakFilePath))
         {
-            bool isadtl = false;
+            fprintf(stderr, "The peaks file name for %s is too long\n", outFilePath);
+            return -1;
+        }
+        int peakFd = open(peakFilePath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+        if (peakFd < 0)
+        {
+            fprintf(stderr, "Could not open peaks file %s\nError: %d\n", peakFilePath, errno);
+            return -1;
+        }
+        wm_status status = wm_write_peaks(context, level, peakFd);
+        close(peakFd);
+        if (status != WM_OK)
+        {
+            fprintf(stderr, "%s\n", wm_error_message(context));
+            unlink(peakFilePath);
+            return -1;
+        }
+        printProgress("Wrote peaks to %s\n", peakFilePath);
+    }
+    return 0;
+}
 
-            if ((strncmp(&nextChunkID[0], "LIST", 4) == 0))
-            {
-                char listTypeID[4];
+static int exportLabelsFromWaveFile(wm_context *context, char *inFilePath, char *labelFilePath, wm_stats *stats)
+{
+    int returnCode = 0;
+    int inputFd = -1;
+    int labelFd = -1;
+    wm_status status = WM_OK;
+    PhaseTimer phaseTimer;
 
-                char chunkDataSizeBytes[4] = {0};
-                fread(chunkDataSizeBytes, sizeof(char), 4, inputFile);
-                if (ferror(inputFile) != 0)
-                {
-                    fprintf(stderr, "Error reading input file %s\n", inFilePath);
-                    returnCode = -1;
-                    goto CleanUpAndExit;
-                }
-                uint32_t chunkDataSize = littleEndianBytesToUInt32(chunkDataSizeBytes);
+    startPhase(&phaseTimer);
 
-                fread(&listTypeID[0], sizeof(listTypeID), 1, inputFile);
-                if (feof(inputFile))
-                {
-                    break;
-                }
+    inputFd = open(inFilePath, O_RDONLY);
+    if (inputFd < 0)
+    {
+        fprintf(stderr, "Could not open input file %s\n", inFilePath);
+        returnCode = -1;
+        goto CleanUpAndExit;
+    }
 
-                if (ferror(inputFile) != 0)
-                {
-                    fprintf(stderr, "Error reading input file %s\n", inFilePath);
-                    returnCode = -1;
-                    goto CleanUpAndExit;
-                }
+    labelFd = (strcmp(labelFilePath, "-") == 0) ? STDOUT_FILENO : open(labelFilePath, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (labelFd < 0)
+    {
+        fprintf(stderr, "Could not open label file %s\nError: %d\n", labelFilePath, errno);
+        returnCode = -1;
+        goto CleanUpAndExit;
+    }
 
-                if ((strncmp(&listTypeID[0], "adtl", 4) == 0))
-                {
-                    isadtl = true;
-                    printf("Found Existing Label Chunk\n");
-                    // Skip over the chunk's data, and any padding byte
-                    fseek(inputFile, chunkDataSize - (sizeof(char) * 4), SEEK_CUR);
-                    if (chunkDataSize % 2 != 0)
-                    {
-                        fseek(inputFile, 1, SEEK_CUR);
-                    }
-                }
-                else
-                {
-                    // if its not an adtl type go back and save chunk info
-                    fseek(inputFile, (-1 * (long)((sizeof(char) * 4) + sizeof(listTypeID))), SEEK_CUR);
-                }
-            }
+    endPhase(&phaseTimer, stats, WM_PHASE_OPEN);
 
-            if (!isadtl)
-            {
-                // We have found a chunk type that we are not going to work with.  Just note the location so we can copy it to the output file later
+    status = wm_export_labels(context, inputFd, labelFd);
 
-                if (otherChunksCount >= maxOtherChunks)
-                {
-                    fprintf(stderr, "Input file has more chunks than the maximum supported by this program (%d)\n", maxOtherChunks);
-                    returnCode = -1;
-                    goto CleanUpAndExit;
-                }
+CleanUpAndExit:
 
-                otherChunkLocations[otherChunksCount].startOffset = ftell(inputFile) - (long)sizeof(nextChunkID);
+    if (status != WM_OK)
+    {
+        fprintf(stderr, "%s\n", wm_error_message(context));
+        returnCode = -1;
+    }
 
-                char chunkDataSizeBytes[4] = {0};
-                fread(chunkDataSizeBytes, sizeof(char), 4, inputFile);
-                if (ferror(inputFile) != 0)
-                {
-                    fprintf(stderr, "Error reading input file %s\n", inFilePath);
-                    returnCode = -1;
-                    goto CleanUpAndExit;
-                }
-                uint32_t chunkDataSize = littleEndianBytesToUInt32(chunkDataSizeBytes);
+    if (inputFd >= 0)
+        close(inputFd);
+    if ((labelFd >= 0) && (labelFd != STDOUT_FILENO))
+        close(labelFd);
+    collectStats(context, stats);
 
-                otherChunkLocations[otherChunksCount].size = sizeof(nextChunkID) + sizeof(chunkDataSizeBytes) + chunkDataSize;
+    return returnCode;
+}
 
-                // Skip over the chunk's data, and any padding byte
-                fseek(inputFile, chunkDataSize, SEEK_CUR);
-                if (chunkDataSize % 2 != 0)
-                {
-                    fseek(inputFile, 1, SEEK_CUR);
-                }
+static wm_context *createContext(const MarkerOptions *options)
+{
+    wm_context *context = wm_context_create();
+    if (context == NULL)
+    {
+        fprintf(stderr, "Memory Allocation Error: Could not allocate memory for a wav-marker context\n");
+        return NULL;
+    }
 
-                otherChunksCount++;
+    wm_set_message_callback(context, printContextMessage, NULL);
+    wm_set_sync_output(context, options->syncOutput);
+    wm_set_io_backend(context, options->useIoRing ? WM_IO_BACKEND_IO_URING : WM_IO_BACKEND_SYNC);
+    wm_set_direct_io(context, options->directIo);
+    wm_set_merge_mode(context, options->mergeMode);
+    wm_set_rounding(context, options->rounding);
+    wm_set_checksums(context, options->checksumMode);
+    if ((options->silenceLevel != WM_SILENCE_OFF) &&
+        (wm_set_auto_silence(context, options->silenceLevel, options->silenceThresholdDb, options->silenceMinSeconds, NULL) != WM_OK))
+    {
+        fprintf(stderr, "%s\n", wm_error_message(context));
+        wm_context_destroy(context);
+        return NULL;
+    }
+    if (wm_set_snap(context, options->snapMode, options->snapWindowSeconds) != WM_OK)
+    {
+        fprintf(stderr, "%s\n", wm_error_message(context));
+        wm_context_destroy(context);
+        return NULL;
+    }
+    if (wm_set_peaks(context, options->peakSamplesPerPixel, options->peakLevelsCount) != WM_OK)
+    {
+        fprintf(stderr, "%s\n", wm_error_message(context));
+        wm_context_destroy(context);
+        return NULL;
+    }
+    wm_set_loudness(context, options->measuresLoudness);
+    if (wm_set_copy_buffers(context, options->copyBufferSize, options->copyBuffersCount, options->useHugePages) != WM_OK)
+    {
+        fprintf(stderr, "%s\n", wm_error_message(context));
+        wm_context_destroy(context);
+        return NULL;
+    }
+    return context;
+}
 
-                fprintf(stdout, "Found chunk type \'%c%c%c%c\', size: %d bytes\n", nextChunkID[0], nextChunkID[1], nextChunkID[2], nextChunkID[3], chunkDataSize);
-            }
-        }
+// Reads a size in bytes with an optional K, M or G suffix, or returns 0 if the text is anything else or the size doesn't fit
+static uint64_t parseSize(const char *text)
+{
+    if ((*text < '0') || (*text > '9'))
+    {
+        return 0;
     }
 
-    // Did we get enough data from the input file to proceed?
+    char *end = NULL;
+    errno = 0;
+    uint64_t size = strtoull(text, &end, 10);
+    uint64_t multiplier = 1;
+    switch (*end)
+    {
+    case 'K':
+    case 'k':
+        multiplier = 1024;
+        end++;
+        break;
+    case 'M':
+    case 'm':
+        multiplier = 1024 * 1024;
+        end++;
+        break;
+    case 'G':
+    case 'g':
+        multiplier = 1024 * 1024 * 1024;
+        end++;
+        break;
+    default:
+        break;
+    }
+    if ((*end != '\0') || (errno == ERANGE) || (size > UINT64_MAX / multiplier))
+    {
+        return 0;
+    }
+    return size * multiplier;
+}
 
-    if ((formatChunk == NULL) || (dataChunkLocation.size == 0))
+void printProgress(const char *format, ...)
+{
+    if (!ShowProgress)
     {
-        fprintf(stderr, "Input file did not contain any format data or did not contain any sample data\n");
-        returnCode = -1;
-        goto CleanUpAndExit;
+        return;
     }
 
-    // Read in the Label File
-    fprintf(stdout, "Reading label file.\n");
+    va_list arguments;
+    va_start(arguments, format);
+    vfprintf(stdout, format, arguments);
+    va_end(arguments);
+}
 
-    LabelInfo labelInfo = readLabelFile(labelFile, *formatChunk);
+void printContextMessage(void *userData, wm_message_type type, const char *message)
+{
+    (void)userData;
 
-    // Did we get any LabelInfo?
-    if (labelInfo.count < 1)
+    if (type == WM_MESSAGE_WARNING)
     {
-        fprintf(stderr, "Did not find any cue point locations in the label file\n");
-        returnCode = -1;
-        goto CleanUpAndExit;
+        fputs(message, stderr);
+    }
+    else
+    {
+        printProgress("%s", message);
     }
+}
+
+static uint64_t getClockNanoseconds(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
 
-    fprintf(stdout, "Read %d cue locations from label file.\nPreparing new cue chunk.\n", labelInfo.count);
+void startPhase(PhaseTimer *timer)
+{
+    timer->wallStart = getClockNanoseconds(CLOCK_MONOTONIC);
+    timer->cpuStart = getClockNanoseconds(CLOCK_THREAD_CPUTIME_ID);
+}
+
+void endPhase(PhaseTimer *timer, wm_stats *stats, wm_phase phase)
+{
+    stats->phase_wall_nanoseconds[phase] += getClockNanoseconds(CLOCK_MONOTONIC) - timer->wallStart;
+    stats->phase_cpu_nanoseconds[phase] += getClockNanoseconds(CLOCK_THREAD_CPUTIME_ID) - timer->cpuStart;
+}
 
-    // Create CuePointStructs for each cue location
-    cueChunk.cuePoints = malloc(sizeof(CuePoint) * labelInfo.count);
-    if (cueChunk.cuePoints == NULL)
+void addStats(wm_stats *total, const wm_stats *stats)
+{
+    for (int i = 0; i < WM_PHASES_COUNT; i++)
     {
-        fprintf(stderr, "Memory Allocation Error: Could not allocate memory for Cue Points data\n");
-        returnCode = -1;
-        goto CleanUpAndExit;
+        total->phase_wall_nanoseconds[i] += stats->phase_wall_nanoseconds[i];
+        total->phase_cpu_nanoseconds[i] += stats->phase_cpu_nanoseconds[i];
     }
+    total->bytes_read += stats->bytes_read;
+    total->bytes_written += stats->bytes_written;
+    total->bytes_mapped += stats->bytes_mapped;
+    total->read_calls += stats->read_calls;
+    total->write_calls += stats->write_calls;
+    total->copy_calls += stats->copy_calls;
+    total->map_calls += stats->map_calls;
+    total->sync_calls += stats->sync_calls;
+    total->ring_calls += stats->ring_calls;
+    for (int i = 0; i < WM_COPY_STRATEGIES_COUNT; i++)
+    {
+        total->copied_bytes[i] += stats->copied_bytes[i];
+    }
+}
 
-    fprintf(stdout, "Preparing new label chunk.\n");
+void collectStats(wm_context *context, wm_stats *stats)
+{
+    wm_stats contextStats;
+    wm_get_stats(context, &contextStats);
+    wm_reset_stats(context);
+    addStats(stats, &contextStats);
+}
 
-    size_t listChunkSize = 0;
+static const char *StatsPhaseNames[WM_PHASES_COUNT] = {"open", "scan", "labels", "build", "write", "fsync"};
+static const char *CopyStrategyNames[WM_COPY_STRATEGIES_COUNT] = {"clone", "copy_file_range", "sendfile", "read_write", "direct"};
 
-    // calculate size of List Chunk
-    for (uint32_t i = 0; i < labelInfo.count; i++)
+void printStats(FILE *stream, const wm_stats *stats, bool asJson)
+{
+    if (asJson)
     {
-        // chunkID (4) + Chunk Data Size (4) + Cuepoint ID (4) + Text
-        listChunkSize += (12 + labelInfo.labelLengths[i]);
-        // add padding byte
-        if ((labelInfo.labelLengths[i] % 2) != 0)
+        fprintf(stream, "{\"phases\": {");
+        for (int i = 0; i < WM_PHASES_COUNT; i++)
+        {
+            fprintf(stream, "%s\"%s\": {\"wall_ms\": %.3f, \"cpu_ms\": %.3f}", i > 0 ? ", " : "", StatsPhaseNames[i],
+                    (double)stats->phase_wall_nanoseconds[i] / 1e6, (double)stats->phase_cpu_nanoseconds[i] / 1e6);
+        }
+        fprintf(stream, "}, \"bytes_read\": %llu, \"bytes_written\": %llu, \"bytes_mapped\": %llu",
+                (unsigned long long)stats->bytes_read, (unsigned long long)stats->bytes_written, (unsigned long long)stats->bytes_mapped);
+        fprintf(stream, ", \"syscalls\": {\"read\": %llu, \"write\": %llu, \"copy\": %llu, \"mmap\": %llu, \"fsync\": %llu, \"io_uring_enter\": %llu}",
+                (unsigned long long)stats->read_calls, (unsigned long long)stats->write_calls, (unsigned long long)stats->copy_calls,
+                (unsigned long long)stats->map_calls, (unsigned long long)stats->sync_calls, (unsigned long long)stats->ring_calls);
+        fprintf(stream, ", \"copied_bytes\": {");
+        for (int i = 0; i < WM_COPY_STRATEGIES_COUNT; i++)
         {
-            listChunkSize++;
+            fprintf(stream, "%s\"%s\": %llu", i > 0 ? ", " : "", CopyStrategyNames[i], (unsigned long long)stats->copied_bytes[i]);
         }
+        fprintf(stream, "}}\n");
+        return;
     }
 
-    listChunk.labelChunks = malloc(sizeof(char) * listChunkSize);
-    if (listChunk.labelChunks == NULL)
+    fprintf(stream, "%-8s %12s %12s\n", "phase", "wall ms", "cpu ms");
+    for (int i = 0; i < WM_PHASES_COUNT; i++)
     {
-        fprintf(stderr, "Memory Allocation Error: Could not allocate memory for Label data\n");
-        returnCode = -1;
-        goto CleanUpAndExit;
+        fprintf(stream, "%-8s %12.3f %12.3f\n", StatsPhaseNames[i], (double)stats->phase_wall_nanoseconds[i] / 1e6, (double)stats->phase_cpu_nanoseconds[i] / 1e6);
+    }
+    fprintf(stream, "read %llu bytes in %llu calls, wrote %llu bytes in %llu calls, mapped %llu bytes in %llu calls\n",
+            (unsigned long long)stats->bytes_read, (unsigned long long)stats->read_calls, (unsigned long long)stats->bytes_written,
+            (unsigned long long)stats->write_calls, (unsigned long long)stats->bytes_mapped, (unsigned long long)stats->map_calls);
+    fprintf(stream, "%llu kernel copy calls, %llu fsync calls, %llu io_uring_enter calls\n", (unsigned long long)stats->copy_calls,
+            (unsigned long long)stats->sync_calls, (unsigned long long)stats->ring_calls);
+    for (int i = 0; i < WM_COPY_STRATEGIES_COUNT; i++)
+    {
+        fprintf(stream, "copied with %s: %llu bytes\n", CopyStrategyNames[i], (unsigned long long)stats->copied_bytes[i]);
     }
+}
 
-    size_t listChunkIndex = 0;
-
-    for (uint32_t i = 0; i < labelInfo.count; i++)
-    {
-        // Cues
-        uint32ToLittleEndianBytes(i + 1, cueChunk.cuePoints[i].cuePointID);
-        uint32ToLittleEndianBytes(labelInfo.locations[i], cueChunk.cuePoints[i].playOrderPosition);
-        cueChunk.cuePoints[i].dataChunkID[0] = 'd';
-        cueChunk.cuePoints[i].dataChunkID[1] = 'a';
-        cueChunk.cuePoints[i].dataChunkID[2] = 't';
-        cueChunk.cuePoints[i].dataChunkID[3] = 'a';
-        uint32ToLittleEndianBytes(0, cueChunk.cuePoints[i].chunkStart);
-        uint32ToLittleEndianBytes(0, cueChunk.cuePoints[i].blockStart);
-        uint32ToLittleEndianBytes(labelInfo.locations[i], cueChunk.cuePoints[i].frameOffset);
-
-        // Labels
-        listChunk.labelChunks[listChunkIndex++] = 'l';
-        listChunk.labelChunks[listChunkIndex++] = 'a';
-        listChunk.labelChunks[listChunkIndex++] = 'b';
-        listChunk.labelChunks[listChunkIndex++] = 'l';
-        char labelLength[4];
-        uint32ToLittleEndianBytes(labelInfo.labelLengths[i] + 4, labelLength);
-        listChunk.labelChunks[listChunkIndex++] = labelLength[0];
-        listChunk.labelChunks[listChunkIndex++] = labelLength[1];
-        listChunk.labelChunks[listChunkIndex++] = labelLength[2];
-        listChunk.labelChunks[listChunkIndex++] = labelLength[3];
-        listChunk.labelChunks[listChunkIndex++] = cueChunk.cuePoints[i].cuePointID[0];
-        listChunk.labelChunks[listChunkIndex++] = cueChunk.cuePoints[i].cuePointID[1];
-        listChunk.labelChunks[listChunkIndex++] = cueChunk.cuePoints[i].cuePointID[2];
-        listChunk.labelChunks[listChunkIndex++] = cueChunk.cuePoints[i].cuePointID[3];
-        for (uint32_t j = 0; j < labelInfo.labelLengths[i]; j++)
-        {
-            listChunk.labelChunks[listChunkIndex++] = labelInfo.labels[i][j];
-        }
-        // add padding if odd length
-        if ((labelInfo.labelLengths[i] % 2) != 0)
-        {
-            listChunk.labelChunks[listChunkIndex++] = 0;
-        }
-    }
-
-    // Populate the CueChunk Struct
-    cueChunk.chunkID[0] = 'c';
-    cueChunk.chunkID[1] = 'u';
-    cueChunk.chunkID[2] = 'e';
-    cueChunk.chunkID[3] = ' ';
-    uint32ToLittleEndianBytes(4 + (sizeof(CuePoint) * labelInfo.count), cueChunk.chunkDataSize); // See struct definition
-    uint32ToLittleEndianBytes(labelInfo.count, cueChunk.cuePointsCount);
-
-    listChunk.chunkID[0] = 'L';
-    listChunk.chunkID[1] = 'I';
-    listChunk.chunkID[2] = 'S';
-    listChunk.chunkID[3] = 'T';
-    uint32ToLittleEndianBytes(4 + (sizeof(char) * listChunkSize), listChunk.chunkDataSize);
-    listChunk.typeID[0] = 'a';
-    listChunk.typeID[1] = 'd';
-    listChunk.typeID[2] = 't';
-    listChunk.typeID[3] = 'l';
+static double getMonotonicSeconds(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double)now.tv_sec + (double)now.tv_nsec / 1e9;
+}
 
-    // Open the output file for writing
-    outputFile = fopen(outFilePath, "w+b");
-    if (outputFile == NULL)
+// Takes the next job from the front of the queue, which is where the largest jobs are
+static bool popBatchJobFromFront(BatchQueue *queue, size_t *out_JobIndex)
+{
+    bool found = false;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail)
     {
-        fprintf(stderr, "Could not open output file %s\nError: %d\n", outFilePath, errno);
-        returnCode = -1;
-        goto CleanUpAndExit;
+        *out_JobIndex = queue->jobIndices[queue->head++];
+        found = true;
     }
+    pthread_mutex_unlock(&queue->lock);
+    return found;
+}
 
-    returnCode = writeOutputFile(inputFile, outputFile, formatChunkExtraBytes, dataChunkLocation, otherChunksCount, otherChunkLocations, labelInfo, waveHeader, formatChunk, cueChunk, listChunk, listChunkSize);
-    if (returnCode < 0)
+// Steals a job from the back of another worker's queue, taking its smallest job so the owner keeps the big ones it is about to start
+static bool popBatchJobFromBack(BatchQueue *queue, size_t *out_JobIndex)
+{
+    bool found = false;
+    pthread_mutex_lock(&queue->lock);
+    if (queue->head < queue->tail)
     {
-        goto CleanUpAndExit;
+        *out_JobIndex = queue->jobIndices[--queue->tail];
+        found = true;
     }
-
-    printf("Finished.\n");
-
-CleanUpAndExit:
-
-    if (inputFile != NULL)
-        fclose(inputFile);
-    if (waveHeader != NULL)
-        free(waveHeader);
-    if (formatChunk != NULL)
-        free(formatChunk);
-    if (labelFile != NULL)
-        fclose(labelFile);
-    if (cueChunk.cuePoints != NULL)
-        free(cueChunk.cuePoints);
-    if (listChunk.labelChunks != NULL)
-        free(listChunk.labelChunks);
-    if (outputFile != NULL)
-        fclose(outputFile);
-
-    return returnCode;
+    pthread_mutex_unlock(&queue->lock);
+    return found;
 }
 
-LabelInfo readLabelFile(FILE *labelFile, FormatChunk formatChunk)
+static void *runBatchWorker(void *argument)
 {
-    // The label file should follow the standard format exported by audacity "startTime(sec) \t endTime(sec) \t Label \n" endTime will be ignored
-    LabelInfo labelInfo = {
-        .locations = {0},
-        .labels = {0},
-        .labelLengths = {0},
-        .count = 0};
+    BatchWorker *worker = (BatchWorker *)argument;
+    BatchPool *pool = worker->pool;
 
-    int lineNumber = 1;
+    // One context for all the jobs of this worker, so its buffers are reused from one file to the next.
+    // Without one the jobs are left to the other workers
+    wm_context *context = createContext(pool->options);
+    if (context == NULL)
+    {
+        return NULL;
+    }
 
-    while (!feof(labelFile))
+    while (1)
     {
-        float startTime = 0.0;
-        char labelString[500]; // Labels are unlikely to exceed 500 characters.
+        size_t jobIndex = 0;
+        bool found = popBatchJobFromFront(&pool->queues[worker->workerIndex], &jobIndex);
 
-        if (fscanf(labelFile, "%f%*f%*c%[^\r\n]%*c", &startTime, &labelString) != 2)
+        // Our own queue is empty, so go and help the others.  No jobs are added once the pool is running,
+        // so once every queue is empty we are done
+        for (int i = 1; !found && (i < pool->workersCount); i++)
         {
-
-            fprintf(stderr, "Line %d in label file is not formatted correctly it should be \"startTime(sec) \\t endTime(sec) \\t Label \\n\"", lineNumber);
+            found = popBatchJobFromBack(&pool->queues[(worker->workerIndex + i) % pool->workersCount], &jobIndex);
         }
-        else
+        if (!found)
         {
-            if (startTime <= 48660)
-            {
-                labelInfo.locations[labelInfo.count] = timeToIndex(startTime, formatChunk);
-                strcpy(labelInfo.labels[labelInfo.count], labelString);
-                labelInfo.labelLengths[labelInfo.count] = strlen(labelString) + 1;
-                labelInfo.count++;
-            }
-            else
-            {
-                fprintf(stderr, "Line %d in label file contains a value larger than the max possible wav length (48,660.0 seconds)\n", lineNumber);
-            }
+            break;
         }
 
-        int nextChar = fgetc(labelFile);
-
-        if (nextChar == '\r')
+        BatchJob *job = &pool->jobs[jobIndex];
+        double startTime = getMonotonicSeconds();
+        if (pool->options->exportLabels)
         {
-            // This is a Classic Mac line ending '\r' or the start of a Windows line ending '\r\n'
-            // If this is the start of a '\r\n', gobble up the '\n' too
-            int peekAheadChar = fgetc(labelFile);
-            if ((peekAheadChar != EOF) && (peekAheadChar != '\n'))
-            {
-                ungetc(peekAheadChar, labelFile);
-            }
+            job->returnCode = exportLabelsFromWaveFile(context, job->inFilePath, job->labelFilePath, &worker->stats);
         }
-
-        nextChar = fgetc(labelFile);
-        if (!feof(labelFile))
+        else
         {
-            if (nextChar == '\r')
+            job->returnCode = addLabelsToWaveFile(context, job->inFilePath, job->labelFilePath, job->outFilePath, pool->options, &worker->stats);
+            job->hasChecksum = (job->returnCode == 0) && (wm_get_checksums(context, &job->fileChecksum, NULL) > 0);
+
+            // The progress messages are off while the workers run, so the loudness is kept for the report
+            const wm_loudness *segments = NULL;
+            size_t segmentsCount = wm_get_loudness(context, &job->sampleRate, &job->loudness, &segments);
+            job->hasLoudness = (job->returnCode == 0) && (segmentsCount > 0);
+            if (job->hasLoudness)
             {
-                // This is a Classic Mac line ending '\r' or the start of a Windows line ending '\r\n'
-                // If this is the start of a '\r\n', gobble up the '\n' too
-                int peekAheadChar = fgetc(labelFile);
-                if ((peekAheadChar != EOF) && (peekAheadChar != '\n'))
+                job->loudnessSegments = malloc(sizeof(wm_loudness) * segmentsCount);
+                if (job->loudnessSegments != NULL)
                 {
-                    ungetc(peekAheadChar, labelFile);
+                    memcpy(job->loudnessSegments, segments, sizeof(wm_loudness) * segmentsCount);
+                    job->loudnessSegmentsCount = segmentsCount;
+                }
+                else
+                {
+                    fprintf(stderr, "Out of memory keeping the loudness segments of %s\n", job->outFilePath);
                 }
-            }
-            else
-            {
-                ungetc(nextChar, labelFile);
             }
         }
-
-        lineNumber++;
+        job->elapsedSeconds = getMonotonicSeconds() - startTime;
     }
 
-    return labelInfo;
+    wm_context_destroy(context);
+    return NULL;
 }
 
-int writeOutputFile(FILE *inputFile, FILE *outputFile, ChunkLocation formatChunkExtraBytes, ChunkLocation dataChunkLocation, int otherChunksCount, ChunkLocation *otherChunkLocations, LabelInfo labelInfo, WaveHeader *waveHeader, FormatChunk *formatChunk, CueChunk cueChunk, ListChunk listChunk, size_t listChunkSize)
+static int compareBatchJobsBySize(const void *a, const void *b)
 {
-    fprintf(stdout, "Writing output file.\n");
+    const BatchJob *jobA = *(const BatchJob *const *)a;
+    const BatchJob *jobB = *(const BatchJob *const *)b;
 
-    // Update the file header chunk to have the new data size
-    uint32_t fileDataSize = 0;
-    fileDataSize += 4; // the 4 bytes for the Riff Type "WAVE"
-    fileDataSize += sizeof(FormatChunk);
-    fileDataSize += formatChunkExtraBytes.size;
-    if (formatChunkExtraBytes.size % 2 != 0)
-    {
-        fileDataSize++; // Padding byte for 2byte alignment
-    }
+    // Largest first
+    if (jobA->inputFileSize != jobB->inputFileSize)
+        return jobA->inputFileSize < jobB->inputFileSize ? 1 : -1;
+    return jobA->lineNumber - jobB->lineNumber;
+}
 
-    fileDataSize += dataChunkLocation.size;
-    if (dataChunkLocation.size % 2 != 0)
+static int runBatch(char *manifestFilePath, int workersCount, const MarkerOptions *options, wm_stats *stats)
+{
+    int returnCode = 0;
+    FILE *manifestFile = NULL;
+    char *manifest = NULL;
+    size_t manifestSize = 0;
+    BatchJob *jobs = NULL;
+    size_t jobsCount = 0;
+    BatchJob **sortedJobs = NULL;
+    BatchQueue *queues = NULL;
+    BatchWorker *workers = NULL;
+    pthread_t *threads = NULL;
+    int queuesCreated = 0;
+    int threadsStarted = 0;
+
+    // Read the whole manifest, the job paths point straight into it
+    manifestFile = fopen(manifestFilePath, "rb");
+    if (manifestFile == NULL)
     {
-        fileDataSize++;
+        fprintf(stderr, "Could not open batch manifest %s\n", manifestFilePath);
+        returnCode = -1;
+        goto CleanUpAndExit;
     }
 
-    for (int i = 0; i < otherChunksCount; i++)
+    size_t manifestCapacity = 0;
+    size_t readBytes = 0;
+    do
     {
-        fileDataSize += otherChunkLocations[i].size;
-        if (otherChunkLocations[i].size % 2 != 0)
+        if (manifestSize + 4096 + 1 > manifestCapacity)
         {
-            fileDataSize++;
+            manifestCapacity = manifestCapacity > 0 ? manifestCapacity * 2 : 65536;
+            char *newManifest = realloc(manifest, manifestCapacity);
+            if (newManifest == NULL)
+            {
+                fprintf(stderr, "Memory Allocation Error: Could not allocate memory for batch manifest\n");
+                returnCode = -1;
+                goto CleanUpAndExit;
+            }
+            manifest = newManifest;
         }
+        readBytes = fread(&manifest[manifestSize], sizeof(char), manifestCapacity - manifestSize - 1, manifestFile);
+        manifestSize += readBytes;
+    } while (readBytes > 0);
+    if (manifest == NULL)
+    {
+        fprintf(stderr, "Batch manifest %s is empty\n", manifestFilePath);
+        returnCode = -1;
+        goto CleanUpAndExit;
     }
-    fileDataSize += 4; // 4 bytes for CueChunk ID "cue "
-    fileDataSize += 4; // UInt32 for CueChunk.chunkDataSize
-    fileDataSize += 4; // UInt32 for CueChunk.cuePointsCount
-    fileDataSize += (sizeof(CuePoint) * labelInfo.count);
-
-    fileDataSize += 4; // 4 bytes for ListChunk ID "LIST"
-    fileDataSize += 4; // UInt32 for ListChunk.chunkDataSize
-    fileDataSize += 4; // 4 bytes for TypeID "adtl"
-    fileDataSize += (sizeof(char) * listChunkSize);
+    manifest[manifestSize] = 0;
 
-    uint32ToLittleEndianBytes(fileDataSize, waveHeader->dataSize);
-
-    // Write out the header to the new file
-    if (fwrite(waveHeader, sizeof(*waveHeader), 1, outputFile) < 1)
+    // Each line is "WAVFILE \t LABELFILE \t OUTPUTFILE", the output is left out for in place updates and exports.  Blank lines and lines starting with # are skipped
+    bool hasOutputFile = !options->inPlace && !options->exportLabels;
+    size_t linesCount = 1;
+    for (size_t i = 0; i < manifestSize; i++)
     {
-        fprintf(stderr, "Error writing header to output file.\n");
-        return -1;
+        if (manifest[i] == '\n')
+            linesCount++;
     }
 
-    // Write out the format chunk
-    if (fwrite(formatChunk, sizeof(FormatChunk), 1, outputFile) < 1)
+    jobs = calloc(linesCount, sizeof(BatchJob));
+    if (jobs == NULL)
     {
-        fprintf(stderr, "Error writing format chunk to output file.\n");
-        return -1;
+        fprintf(stderr, "Memory Allocation Error: Could not allocate memory for batch jobs\n");
+        returnCode = -1;
+        goto CleanUpAndExit;
     }
-    else if (formatChunkExtraBytes.size > 0)
+
+    char *line = manifest;
+    int lineNumber = 1;
+    while (line != NULL)
     {
-        if (writeChunkLocationFromInputFileToOutputFile(formatChunkExtraBytes, inputFile, outputFile) < 0)
+        char *nextLine = strchr(line, '\n');
+        if (nextLine != NULL)
         {
-            return -1;
+            *nextLine++ = 0;
         }
-        if (formatChunkExtraBytes.size % 2 != 0)
+        size_t lineLength = strlen(line);
+        if ((lineLength > 0) && (line[lineLength - 1] == '\r'))
         {
-            if (fwrite("\0", sizeof(char), 1, outputFile) < 1)
+            line[--lineLength] = 0;
+        }
+
+        if ((lineLength > 0) && (line[0] != '#'))
+        {
+            char *fields[3] = {line, NULL, NULL};
+            int fieldsCount = 1;
+            for (char *tab = strchr(line, '\t'); (tab != NULL) && (fieldsCount < 3); tab = strchr(tab + 1, '\t'))
+            {
+                *tab = 0;
+                fields[fieldsCount++] = tab + 1;
+            }
+
+            if (fieldsCount != (hasOutputFile ? 3 : 2))
+            {
+                fprintf(stderr, "Line %d in batch manifest is not formatted correctly it should be \"%s\"\n", lineNumber, hasOutputFile ? "WAVFILE \\t LABELFILE \\t OUTPUTFILE" : "WAVFILE \\t LABELFILE");
+                returnCode = -1;
+                goto CleanUpAndExit;
+            }
+
+            BatchJob *job = &jobs[jobsCount++];
+            job->inFilePath = fields[0];
+            job->labelFilePath = fields[1];
+            job->outFilePath = fields[2];
+            job->lineNumber = lineNumber;
+            job->returnCode = -1;
+
+            struct stat inputStat;
+            if (stat(job->inFilePath, &inputStat) == 0)
             {
-                fprintf(stderr, "Error writing padding character to output file.\n");
-                return -1;
+                job->inputFileSize = inputStat.st_size;
             }
         }
+
+        line = nextLine;
+        lineNumber++;
     }
 
-    // Write out the data chunk
-    if (writeChunkLocationFromInputFileToOutputFile(dataChunkLocation, inputFile, outputFile) < 0)
+    if (jobsCount == 0)
     {
-        return -1;
+        fprintf(stderr, "Batch manifest %s does not contain any jobs\n", manifestFilePath);
+        returnCode = -1;
+        goto CleanUpAndExit;
     }
-    if (dataChunkLocation.size % 2 != 0)
+
+    if ((size_t)workersCount > jobsCount)
     {
-        if (fwrite("\0", sizeof(char), 1, outputFile) < 1)
-        {
-            fprintf(stderr, "Error writing padding character to output file.\n");
-            return -1;
-        }
+        workersCount = (int)jobsCount;
+    }
+
+    // Deal the jobs out largest first, round robin, so every worker starts on one of the big files and the small ones fill in the gaps at the end
+    sortedJobs = malloc(sizeof(BatchJob *) * jobsCount);
+    queues = calloc((size_t)workersCount, sizeof(BatchQueue));
+    workers = calloc((size_t)workersCount, sizeof(BatchWorker));
+    threads = calloc((size_t)workersCount, sizeof(pthread_t));
+    if ((sortedJobs == NULL) || (queues == NULL) || (workers == NULL) || (threads == NULL))
+    {
+        fprintf(stderr, "Memory Allocation Error: Could not allocate memory for batch workers\n");
+        returnCode = -1;
+        goto CleanUpAndExit;
     }
 
-    // Write out the start of new Cue Chunk: chunkID, dataSize and cuePointsCount
-    if (fwrite(&cueChunk, sizeof(cueChunk.chunkID) + sizeof(cueChunk.chunkDataSize) + sizeof(cueChunk.cuePointsCount), 1, outputFile) < 1)
+    for (size_t i = 0; i < jobsCount; i++)
     {
-        fprintf(stderr, "Error writing cue chunk header to output file.\n");
-        return -1;
+        sortedJobs[i] = &jobs[i];
     }
+    qsort(sortedJobs, jobsCount, sizeof(BatchJob *), compareBatchJobsBySize);
 
-    // Write out the Cue Points
-    for (uint32_t i = 0; i < littleEndianBytesToUInt32(cueChunk.cuePointsCount); i++)
+    for (int i = 0; i < workersCount; i++)
     {
-        if (fwrite(&(cueChunk.cuePoints[i]), sizeof(CuePoint), 1, outputFile) < 1)
+        queues[i].jobIndices = malloc(sizeof(size_t) * (jobsCount / (size_t)workersCount + 1));
+        if (queues[i].jobIndices == NULL)
         {
-            fprintf(stderr, "Error writing cue point to output file.\n");
-            return -1;
+            fprintf(stderr, "Memory Allocation Error: Could not allocate memory for batch workers\n");
+            returnCode = -1;
+            goto CleanUpAndExit;
         }
+        pthread_mutex_init(&queues[i].lock, NULL);
+        queuesCreated++;
+    }
+    for (size_t i = 0; i < jobsCount; i++)
+    {
+        BatchQueue *queue = &queues[i % (size_t)workersCount];
+        queue->jobIndices[queue->tail++] = (size_t)(sortedJobs[i] - jobs);
     }
 
-    // Write out adtl chunk
+    fprintf(stdout, "Running %zu jobs on %d workers.\n", jobsCount, workersCount);
+    fflush(stdout);
 
-    // Write out the start of new List Chunk: chunkID, dataSize and TypeID
-    if (fwrite(&listChunk, sizeof(listChunk.chunkID) + sizeof(listChunk.chunkDataSize) + sizeof(listChunk.typeID), 1, outputFile) < 1)
+    // The workers only print errors, progress messages from several files at once would be unreadable
+    ShowProgress = false;
+
+    BatchPool pool = {
+        .jobs = jobs,
+        .queues = queues,
+        .workersCount = workersCount,
+        .options = options};
+    double batchStartTime = getMonotonicSeconds();
+
+    for (int i = 0; i < workersCount; i++)
+    {
+        workers[i].pool = &pool;
+        workers[i].workerIndex = i;
+        if (pthread_create(&threads[i], NULL, runBatchWorker, &workers[i]) != 0)
+        {
+            fprintf(stderr, "Could not start batch worker %d\n", i);
+            break;
+        }
+        threadsStarted++;
+    }
+    if (threadsStarted == 0)
     {
-        fprintf(stderr, "Error writing adtl chunk header to output file.\n");
-        return -1;
+        returnCode = -1;
+        goto CleanUpAndExit;
     }
-
-    // Write out the Labels
-    if (fwrite(&listChunk.labelChunks[0], listChunkSize, 1, outputFile) < 1)
+    for (int i = 0; i < threadsStarted; i++)
     {
-        fprintf(stderr, "Error writing labels to output file.\n");
-        return -1;
+        pthread_join(threads[i], NULL);
+        addStats(stats, &workers[i].stats);
     }
 
-    if ((listChunkSize % 2) != 0)
+    double batchElapsedSeconds = getMonotonicSeconds() - batchStartTime;
+    ShowProgress = true;
+
+    // Report on every job in manifest order
+    size_t failedJobsCount = 0;
+    fprintf(stdout, "\nBatch report:\n");
+    for (size_t i = 0; i < jobsCount; i++)
     {
-        if (fwrite("\0", sizeof(char), 1, outputFile) < 1)
+        BatchJob *job = &jobs[i];
+        if (job->returnCode < 0)
         {
-            fprintf(stderr, "Error writing padding character to output file.\n");
-            return -1;
+            failedJobsCount++;
+        }
+        fprintf(stdout, "  line %-5d %-6s %9.3fs %10.1f MB  %s", job->lineNumber, job->returnCode < 0 ? "FAILED" : "ok", job->elapsedSeconds, (double)job->inputFileSize / (1024.0 * 1024.0), job->inFilePath);
+        if (job->hasChecksum)
+        {
+            fprintf(stdout, "  CRC-32C %08x", job->fileChecksum);
+        }
+        fprintf(stdout, "\n");
+        if (job->hasLoudness)
+        {
+            printLoudnessValues("    ", job->outFilePath, job->sampleRate, &job->loudness, job->loudnessSegments, job->loudnessSegmentsCount);
         }
     }
+    fprintf(stdout, "%zu of %zu jobs succeeded in %.3fs.\n", jobsCount - failedJobsCount, jobsCount, batchElapsedSeconds);
+
+    if (failedJobsCount > 0)
+    {
+        returnCode = -1;
+    }
+
+CleanUpAndExit:
 
-    // Write out the other chunks from the input file
-    for (int i = 0; i < otherChunksCount; i++)
+    if (manifestFile != NULL)
+        fclose(manifestFile);
+    for (int i = 0; i < queuesCreated; i++)
+    {
+        pthread_mutex_destroy(&queues[i].lock);
+    }
+    if (queues != NULL)
     {
-        if (writeChunkLocationFromInputFileToOutputFile(otherChunkLocations[i], inputFile, outputFile) < 0)
+        for (int i = 0; i < workersCount; i++)
         {
-            return -1;
+            if (queues[i].jobIndices != NULL)
+                free(queues[i].jobIndices);
         }
-        if (otherChunkLocations[i].size % 2 != 0)
+        free(queues);
+    }
+    if (workers != NULL)
+        free(workers);
+    if (threads != NULL)
+        free(threads);
+    if (sortedJobs != NULL)
+        free(sortedJobs);
+    if (jobs != NULL)
+    {
+        for (size_t i = 0; i < jobsCount; i++)
         {
-            if (fwrite("\0", sizeof(char), 1, outputFile) < 1)
-            {
-                fprintf(stderr, "Error writing padding character to output file.\n");
-                return -1;
-            }
+            if (jobs[i].loudnessSegments != NULL)
+                free(jobs[i].loudnessSegments);
         }
+        free(jobs);
     }
+    if (manifest != NULL)
+        free(manifest);
 
-    return 0;
+    return returnCode;
 }
 
-int writeChunkLocationFromInputFileToOutputFile(ChunkLocation chunk, FILE *inputFile, FILE *outputFile)
+int main(int argc, char **argv)
 {
-    // note the position of the input file to restore later
-    long inputFileOrigLocation = ftell(inputFile);
-
-    if (fseek(inputFile, chunk.startOffset, SEEK_SET) < 0)
+    char *inFilePath = NULL;
+    char *labelFilePath = NULL;
+    char *outFilePath = NULL;
+    char *manifestFilePath = NULL;
+    long workersCount = sysconf(_SC_NPROCESSORS_ONLN);
+    MarkerOptions options = {
+        .inPlace = false,
+        .syncOutput = false,
+        .copyBufferSize = 2 * 1024 * 1024,
+        .copyBuffersCount = 4,
+        .useHugePages = false,
+        .useIoRing = false,
+        .directIo = false,
+        .mergeMode = WM_MERGE_NONE,
+        .rounding = WM_ROUND_DOWN,
+        .checksumMode = WM_CHECKSUM_NONE,
+        .silenceLevel = WM_SILENCE_OFF,
+        .silenceThresholdDb = -50.0,
+        .silenceMinSeconds = 2.0,
+        .snapMode = WM_SNAP_OFF,
+        .snapWindowSeconds = 0.005,
+        .peakSamplesPerPixel = 0,
+        .peakLevelsCount = 1,
+        .measuresLoudness = false,
+        .exportLabels = false};
+    bool showStats = false;
+    bool showStatsAsJson = false;
+    wm_stats stats;
+    memset(&stats, 0, sizeof(stats));
+
+    // "wav-marker export" goes the other way, from the markers of wave files to label files
+    int argIndex = 1;
+    if ((argc > 1) && (strcmp(argv[1], "export") == 0))
     {
-        fprintf(stderr, "Error: could not seek input file to location %ld", chunk.startOffset);
-        return -1;
+        options.exportLabels = true;
+        argIndex++;
     }
 
-    size_t remainingBytesToWrite = chunk.size;
-    while (remainingBytesToWrite >= 1024)
+    while ((argIndex < argc) && (strncmp(argv[argIndex], "--", 2) == 0))
     {
-        char buffer[1024];
-
-        fread(buffer, sizeof(char), 1024, inputFile);
-        if (ferror(inputFile) != 0)
+        if (strcmp(argv[argIndex], "--in-place") == 0)
         {
-            fprintf(stderr, "Copy chunk: Error reading input file");
-            fseek(inputFile, inputFileOrigLocation, SEEK_SET);
-            return -1;
+            options.inPlace = true;
         }
-
-        if (fwrite(buffer, sizeof(char), 1024, outputFile) < 1)
+        else if (strcmp(argv[argIndex], "--fsync") == 0)
         {
-            fprintf(stderr, "Copy chunk: Error writing output file");
-            fseek(inputFile, inputFileOrigLocation, SEEK_SET);
-            return -1;
+            options.syncOutput = true;
         }
-        remainingBytesToWrite -= 1024;
-    }
-
-    if (remainingBytesToWrite > 0)
-    {
-        char buffer[remainingBytesToWrite];
-
-        fread(buffer, sizeof(char), remainingBytesToWrite, inputFile);
-        if (ferror(inputFile) != 0)
+        else if ((strcmp(argv[argIndex], "--buffer-size") == 0) && (argIndex + 1 < argc))
         {
-            fprintf(stderr, "Copy chunk: Error reading input file");
-            fseek(inputFile, inputFileOrigLocation, SEEK_SET);
-            return -1;
+            options.copyBufferSize = (size_t)parseSize(argv[++argIndex]);
+            if (options.copyBufferSize == 0)
+            {
+                fprintf(stderr, "--buffer-size needs a size greater than 0, with an optional K, M or G suffix\n");
+                return 1;
+            }
         }
-
-        if (fwrite(buffer, sizeof(char), remainingBytesToWrite, outputFile) < 1)
+        else if ((strcmp(argv[argIndex], "--buffers") == 0) && (argIndex + 1 < argc))
         {
-            fprintf(stderr, "Copy chunk: Error writing output file");
-            fseek(inputFile, inputFileOrigLocation, SEEK_SET);
-            return -1;
+            char *end = NULL;
+            long buffersCount = strtol(argv[++argIndex], &end, 10);
+            if ((end == argv[argIndex]) || (*end != '\0') || (buffersCount < 1) || (buffersCount > 64))
+            {
+                fprintf(stderr, "--buffers needs a number of buffers from 1 to 64\n");
+                return 1;
+            }
+            options.copyBuffersCount = (int)buffersCount;
+        }
+        else if (strcmp(argv[argIndex], "--huge-pages") == 0)
+        {
+            options.useHugePages = true;
+        }
+        else if (strcmp(argv[argIndex], "--io-uring") == 0)
+        {
+            options.useIoRing = true;
+        }
+        else if (strcmp(argv[argIndex], "--direct") == 0)
+        {
+            options.directIo = true;
+        }
+        else if ((strcmp(argv[argIndex], "--merge") == 0) || (strcmp(argv[argIndex], "--merge=upsert") == 0))
+        {
+            options.mergeMode = WM_MERGE_UPSERT;
+        }
+        else if (strcmp(argv[argIndex], "--merge=keep") == 0)
+        {
+            options.mergeMode = WM_MERGE_KEEP;
+        }
+        else if (strcmp(argv[argIndex], "--round=down") == 0)
+        {
+            options.rounding = WM_ROUND_DOWN;
+        }
+        else if (strcmp(argv[argIndex], "--round=nearest") == 0)
+        {
+            options.rounding = WM_ROUND_NEAREST;
+        }
+        else if (strcmp(argv[argIndex], "--round=up") == 0)
+        {
+            options.rounding = WM_ROUND_UP;
+        }
+        else if (strcmp(argv[argIndex], "--checksum") == 0)
+        {
+            options.checksumMode = WM_CHECKSUM_COMPUTE;
+        }
+        else if (strcmp(argv[argIndex], "--checksum=verify") == 0)
+        {
+            options.checksumMode = WM_CHECKSUM_VERIFY;
+        }
+        else if ((strcmp(argv[argIndex], "--auto-silence") == 0) || (strcmp(argv[argIndex], "--auto-silence=rms") == 0))
+        {
+            options.silenceLevel = WM_SILENCE_RMS;
+        }
+        else if (strcmp(argv[argIndex], "--auto-silence=peak") == 0)
+        {
+            options.silenceLevel = WM_SILENCE_PEAK;
+        }
+        else if ((strcmp(argv[argIndex], "--silence-threshold") == 0) && (argIndex + 1 < argc))
+        {
+            char *end = NULL;
+            options.silenceThresholdDb = strtod(argv[++argIndex], &end);
+            if ((end == argv[argIndex]) || (*end != '\0') || !(options.silenceThresholdDb <= 0.0))
+            {
+                fprintf(stderr, "--silence-threshold needs a level in dBFS of 0 or less, like -50\n");
+                return 1;
+            }
+        }
+        else if ((strcmp(argv[argIndex], "--snap") == 0) || (strcmp(argv[argIndex], "--snap=zero") == 0))
+        {
+            options.snapMode = WM_SNAP_ZERO_CROSSING;
+        }
+        else if (strcmp(argv[argIndex], "--snap=quiet") == 0)
+        {
+            options.snapMode = WM_SNAP_QUIET;
+        }
+        else if ((strcmp(argv[argIndex], "--snap-window") == 0) && (argIndex + 1 < argc))
+        {
+            char *end = NULL;
+            double windowMilliseconds = strtod(argv[++argIndex], &end);
+            if ((end == argv[argIndex]) || (*end != '\0') || !(windowMilliseconds >= 0.0) || (windowMilliseconds > 1000.0))
+            {
+                fprintf(stderr, "--snap-window needs a number of milliseconds from 0 to 1000\n");
+                return 1;
+            }
+            options.snapWindowSeconds = windowMilliseconds / 1000.0;
+        }
+        else if (strcmp(argv[argIndex], "--peaks") == 0)
+        {
+            options.peakSamplesPerPixel = 256;
+        }
+        else if (strncmp(argv[argIndex], "--peaks=", 8) == 0)
+        {
+            char *end = NULL;
+            long samplesPerPixel = strtol(argv[argIndex] + 8, &end, 10);
+            if ((end == argv[argIndex] + 8) || (*end != '\0') || (samplesPerPixel < 1) || (samplesPerPixel > 1048576))
+            {
+                fprintf(stderr, "--peaks needs a number of samples per peak from 1 to 1048576\n");
+                return 1;
+            }
+            options.peakSamplesPerPixel = (uint32_t)samplesPerPixel;
+        }
+        else if (strcmp(argv[argIndex], "--loudness") == 0)
+        {
+            options.measuresLoudness = true;
         }
+        else if ((strcmp(argv[argIndex], "--peak-levels") == 0) && (argIndex + 1 < argc))
+        {
+            // How many levels fit depends on the frames per peak, so the upper limit is left to wm_set_peaks
+            char *end = NULL;
+            long levelsCount = strtol(argv[++argIndex], &end, 10);
+            if ((end == argv[argIndex]) || (*end != '\0') || (levelsCount < 1) || (levelsCount > INT_MAX))
+            {
+                fprintf(stderr, "--peak-levels needs a number of levels greater than 0\n");
+                return 1;
+            }
+            options.peakLevelsCount = (int)levelsCount;
+        }
+        else if ((strcmp(argv[argIndex], "--silence-duration") == 0) && (argIndex + 1 < argc))
+        {
+            char *end = NULL;
+            options.silenceMinSeconds = strtod(argv[++argIndex], &end);
+            if ((end == argv[argIndex]) || (*end != '\0') || !(options.silenceMinSeconds >= 0.0))
+            {
+                fprintf(stderr, "--silence-duration needs a number of seconds\n");
+                return 1;
+            }
+        }
+        else if ((strcmp(argv[argIndex], "--stats") == 0) || (strcmp(argv[argIndex], "--stats=text") == 0))
+        {
+            showStats = true;
+        }
+        else if (strcmp(argv[argIndex], "--stats=json") == 0)
+        {
+            showStats = true;
+            showStatsAsJson = true;
+        }
+        else if ((strcmp(argv[argIndex], "--batch") == 0) && (argIndex + 1 < argc))
+        {
+            manifestFilePath = argv[++argIndex];
+        }
+        else if ((strcmp(argv[argIndex], "--jobs") == 0) && (argIndex + 1 < argc))
+        {
+            char *end = NULL;
+            workersCount = strtol(argv[++argIndex], &end, 10);
+            if ((end == argv[argIndex]) || (*end != '\0') || (workersCount < 1) || (workersCount > INT_MAX))
+            {
+                fprintf(stderr, "--jobs needs a number of workers greater than 0\n");
+                return 1;
+            }
+        }
+        else
+        {
+            fprintf(stderr, "Unknown option %s\n", argv[argIndex]);
+            return 1;
+        }
+        argIndex++;
     }
 
-    return 0;
-}
-
-enum HostEndiannessType getHostEndianness()
-{
-    int i = 1;
-    char *p = (char *)&i;
-
-    if (p[0] == 1)
-        return LittleEndian;
-    else
-        return BigEndian;
-}
-
-uint32_t littleEndianBytesToUInt32(char littleEndianBytes[4])
-{
-    if (HostEndianness == EndiannessUndefined)
+    if (options.exportLabels && (options.inPlace || (options.mergeMode != WM_MERGE_NONE)))
     {
-        HostEndianness = getHostEndianness();
+        fprintf(stderr, "export only reads the wave files, --in-place and --merge don't apply to it\n");
+        return 1;
     }
-
-    uint32_t uInt32Value;
-    char *uintValueBytes = (char *)&uInt32Value;
-
-    if (HostEndianness == LittleEndian)
+    if ((options.exportLabels || options.inPlace) && (options.checksumMode != WM_CHECKSUM_NONE))
+    {
+        fprintf(stderr, "--checksum needs an output file, the sample data isn't copied by --in-place or export\n");
+        return 1;
+    }
+    if ((options.exportLabels || options.inPlace) && (options.peakSamplesPerPixel > 0))
     {
-        uintValueBytes[0] = littleEndianBytes[0];
-        uintValueBytes[1] = littleEndianBytes[1];
-        uintValueBytes[2] = littleEndianBytes[2];
-        uintValueBytes[3] = littleEndianBytes[3];
+        fprintf(stderr, "--peaks needs an output file, the sample data isn't copied by --in-place or export\n");
+        return 1;
     }
-    else
+    if ((options.exportLabels || options.inPlace) && options.measuresLoudness)
+    {
+        fprintf(stderr, "--loudness needs an output file, the sample data isn't copied by --in-place or export\n");
+        return 1;
+    }
+    if (options.exportLabels && (options.snapMode != WM_SNAP_OFF))
+    {
+        fprintf(stderr, "export writes the markers where they are, --snap doesn't apply to it\n");
+        return 1;
+    }
+    if ((options.exportLabels || options.inPlace) && (options.silenceLevel != WM_SILENCE_OFF))
     {
-        uintValueBytes[0] = littleEndianBytes[3];
-        uintValueBytes[1] = littleEndianBytes[2];
-        uintValueBytes[2] = littleEndianBytes[1];
-        uintValueBytes[3] = littleEndianBytes[0];
+        fprintf(stderr, "--auto-silence needs an output file, the sample data isn't read by --in-place or export\n");
+        return 1;
     }
 
-    return uInt32Value;
-}
+    if (manifestFilePath != NULL)
+    {
+        if (argIndex != argc)
+        {
+            fprintf(stderr, "Files are given in the manifest in batch mode\n");
+            return 1;
+        }
+        int batchReturnCode = runBatch(manifestFilePath, workersCount > 0 ? (int)workersCount : 1, &options, &stats);
+        if (showStats)
+        {
+            printStats(stderr, &stats, showStatsAsJson);
+        }
+        return batchReturnCode < 0 ? 1 : 0;
+    }
 
-void uint32ToLittleEndianBytes(uint32_t uInt32Value, char out_LittleEndianBytes[4])
-{
-    if (HostEndianness == EndiannessUndefined)
+    if ((argc - argIndex) != ((options.inPlace || options.exportLabels) ? 2 : 3))
     {
-        HostEndianness = getHostEndianness();
+        printf("Usage: wav-marker WAVFILE labelFILE OUTPUTFILE\n       wav-marker --in-place WAVFILE labelFILE\n       wav-marker [--in-place] [--jobs N] --batch MANIFEST\n"
+               "       wav-marker export WAVFILE labelFILE\n       wav-marker export [--jobs N] --batch MANIFEST\n"
+               "Options: --fsync to sync the output to disk, --stats or --stats=json to print timings and I/O counters to stderr\n"
+               "         --buffer-size SIZE and --buffers N to size the copy buffers (2M and 4 by default), --huge-pages to back them with huge pages\n"
+               "         --io-uring to write the output through io_uring where the kernel has it, --direct to keep sample data out of the page cache\n"
+               "         --merge or --merge=keep to keep the existing markers, with the labels updating them or not\n"
+               "         --round=down, --round=nearest or --round=up to pick the sample for a label time between two samples (down by default)\n"
+               "         --checksum to print the CRC-32C of the output and its chunks, --checksum=verify to also read back and check the sample data\n"
+               "         --auto-silence or --auto-silence=peak to mark silences, below --silence-threshold DB (-50) for --silence-duration SECONDS (2)\n"
+               "         --snap or --snap=quiet to move each label to the nearest zero crossing or the quietest sample within --snap-window MS (5)\n"
+               "         --peaks[=SAMPLES] to write waveform peaks of SAMPLES frames each (256) to OUTPUTFILE.SAMPLES.dat, --peak-levels N for N zoom levels\n"
+               "         --loudness to print the EBU R128 integrated loudness and true peak of the output and of each segment between its markers\n"
+               "WAVFILE and OUTPUTFILE can be - to stream from stdin and to stdout\n");
+        return 1;
     }
 
-    char *uintValueBytes = (char *)&uInt32Value;
+    inFilePath = argv[argIndex];
+    labelFilePath = argv[argIndex + 1];
 
-    if (HostEndianness == LittleEndian)
+    if (options.exportLabels)
     {
-        out_LittleEndianBytes[0] = uintValueBytes[0];
-        out_LittleEndianBytes[1] = uintValueBytes[1];
-        out_LittleEndianBytes[2] = uintValueBytes[2];
-        out_LittleEndianBytes[3] = uintValueBytes[3];
+        // The labels are going to stdout, so keep quiet
+        if (strcmp(labelFilePath, "-") == 0)
+        {
+            ShowProgress = false;
+        }
+
+        wm_context *context = createContext(&options);
+        if (context == NULL)
+        {
+            return 1;
+        }
+        int returnCode = exportLabelsFromWaveFile(context, inFilePath, labelFilePath, &stats);
+        wm_context_destroy(context);
+        if (showStats)
+        {
+            printStats(stderr, &stats, showStatsAsJson);
+        }
+        return returnCode;
     }
-    else
+
+    if (!options.inPlace)
     {
-        out_LittleEndianBytes[0] = uintValueBytes[3];
-        out_LittleEndianBytes[1] = uintValueBytes[2];
-        out_LittleEndianBytes[2] = uintValueBytes[1];
-        out_LittleEndianBytes[3] = uintValueBytes[0];
+        outFilePath = argv[argIndex + 2];
     }
-}
 
-uint16_t littleEndianBytesToUInt16(char littleEndianBytes[2])
-{
-    if (HostEndianness == EndiannessUndefined)
+    bool isStreaming = (strcmp(inFilePath, "-") == 0) || (!options.inPlace && (strcmp(outFilePath, "-") == 0));
+    if (isStreaming && options.inPlace)
     {
-        HostEndianness = getHostEndianness();
+        fprintf(stderr, "--in-place needs a file, it can't update stdin\n");
+        return 1;
     }
-
-    uint16_t uInt16Value;
-    char *uintValueBytes = (char *)&uInt16Value;
-
-    if (HostEndianness == LittleEndian)
+    if (isStreaming && (options.mergeMode != WM_MERGE_NONE))
     {
-        uintValueBytes[0] = littleEndianBytes[0];
-        uintValueBytes[1] = littleEndianBytes[1];
+        fprintf(stderr, "--merge needs a file, the existing markers of a stream may come after the sample data\n");
+        return 1;
     }
-    else
+    if (isStreaming && (options.checksumMode != WM_CHECKSUM_NONE))
     {
-        uintValueBytes[0] = littleEndianBytes[1];
-        uintValueBytes[1] = littleEndianBytes[0];
+        fprintf(stderr, "--checksum needs files, it isn't taken while streaming\n");
+        return 1;
     }
-
-    return uInt16Value;
-}
-
-void uint16ToLittleEndianBytes(uint16_t uInt16Value, char out_LittleEndianBytes[2])
-{
-    if (HostEndianness == EndiannessUndefined)
+    if (isStreaming && (options.peakSamplesPerPixel > 0))
     {
-        HostEndianness = getHostEndianness();
+        fprintf(stderr, "--peaks needs files, they aren't taken while streaming\n");
+        return 1;
     }
-
-    char *uintValueBytes = (char *)&uInt16Value;
-
-    if (HostEndianness == LittleEndian)
+    if (isStreaming && options.measuresLoudness)
     {
-        out_LittleEndianBytes[0] = uintValueBytes[0];
-        out_LittleEndianBytes[1] = uintValueBytes[1];
+        fprintf(stderr, "--loudness needs files, it isn't measured while streaming\n");
+        return 1;
     }
-    else
+    if (isStreaming && (options.snapMode != WM_SNAP_OFF))
     {
-        out_LittleEndianBytes[0] = uintValueBytes[1];
-        out_LittleEndianBytes[1] = uintValueBytes[0];
+        fprintf(stderr, "--snap needs files, the markers of a stream are written before its sample data is read\n");
+        return 1;
+    }
+    if (isStreaming && (options.silenceLevel != WM_SILENCE_OFF))
+    {
+        fprintf(stderr, "--auto-silence needs files, the header of the output is written again once the silences are found\n");
+        return 1;
     }
-}
 
-uint32_t timeToIndex(float timestamp, FormatChunk formatChunk)
-{
-    uint32_t index;
-    uint32_t sampleRate = littleEndianBytesToUInt32(formatChunk.sampleRate);
-    uint16_t numberOfChannels = littleEndianBytesToUInt16(formatChunk.numberOfChannels);
-    index = timestamp * sampleRate;
-    return index;
-}
+    // The tagged wave file is going to stdout, so keep quiet
+    if (isStreaming && (strcmp(outFilePath, "-") == 0))
+    {
+        ShowProgress = false;
+    }
 
-int main(int argc, char **argv)
-{
-    char *inFilePath = NULL;
-    char *labelFilePath = NULL;
-    char *outFilePath = NULL;
+    printProgress("inFilePath = %s, labelFilePath = %s, outFilePath = %s\n",
+                  inFilePath, labelFilePath, options.inPlace ? inFilePath : outFilePath);
 
-    if (argc != 4)
+    wm_context *context = createContext(&options);
+    if (context == NULL)
     {
-        printf("Usage: wav-marker WAVFILE labelFILE OUTPUTFILE\n%d", argc);
         return 1;
     }
 
-    inFilePath = argv[1];
-    labelFilePath = argv[2];
-    outFilePath = argv[3];
+    int returnCode = isStreaming ? addLabelsToWaveStream(context, inFilePath, labelFilePath, outFilePath, &stats) : addLabelsToWaveFile(context, inFilePath, labelFilePath, outFilePath, &options, &stats);
+    wm_context_destroy(context);
 
-    printf("inFilePath = %s, labelFilePath = %s, outFilePath = %s\n",
-           inFilePath, labelFilePath, outFilePath);
+    // Stats go to stderr so they can't end up in a wave file streamed to stdout
+    if (showStats)
+    {
+        printStats(stderr, &stats, showStatsAsJson);
+    }
 
-    return addLabelsToWaveFile(inFilePath, labelFilePath, outFilePath);
+    return returnCode;
 }
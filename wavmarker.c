@@ -0,0 +1,6955 @@
+/** @file wavmarker.c
+ *
+ * @details libwavmarker, embeds cue points and text for each label of an Audacity label file into a .wav file,
+ * in a format that works with the podcasting application Forecast.  See wavmarker.h for the API
+ *
+ * Split out of wav-marker.c, which is now the command line tool built on it
+ * Extended from wavecuepoint.c
+ * Originally created by Jim McGowan on 2012-11-29
+ * Turned into a commandline utility by David Hilowitz on 2016-11-19
+ * And modified by Tim Moore on 2022-10-14
+ */
+
+#define _GNU_SOURCE // copy_file_range
+#define _FILE_OFFSET_BITS 64 // off_t, pread and friends handle files larger than 4GB on 32 bit systems too
+
+#include "wavmarker.h"
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <stdbool.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <math.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+#if defined(__SSE4_2__)
+#include <nmmintrin.h>
+#elif defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#endif
+
+#ifdef __linux__
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#include <linux/fs.h>
+#include <linux/io_uring.h>
+#endif
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+
+// Some Structs that we use to represent and manipulate Chunks in the Wave files
+
+// The header of a wave file
+typedef struct
+{
+    char chunkID[4];  // Must be "RIFF" (0x52494646), or "RF64"/"BW64" for files larger than 4GB
+    char dataSize[4]; // Byte count for the rest of the file (i.e. file length - 8 bytes), 0xFFFFFFFF in RF64 files where the ds64 chunk holds the real size
+    char riffType[4]; // Must be "WAVE" (0x57415645)
+} WaveHeader;
+
+// RF64 and BW64 files put a ds64 chunk right after the header.  It holds the 64 bit sizes of the file and the data chunk,
+// whose 32 bit size fields are set to 0xFFFFFFFF, followed by a table with the sizes of any other chunks larger than 4GB
+typedef struct
+{
+    char chunkID[4];       // String: must be "ds64"
+    char chunkDataSize[4]; // Unsigned 4-byte little endian int: 28 + 12 * tableLength
+    char riffSize[8];      // Unsigned 8-byte little endian int: the real RIFF dataSize
+    char dataSize[8];      // Unsigned 8-byte little endian int: the real size of the data chunk
+    char sampleCount[8];   // Unsigned 8-byte little endian int: the number of sample frames in the data chunk
+    char tableLength[4];   // Unsigned 4-byte little endian int: number of ChunkSize64 entries following
+} DataSize64Chunk;
+
+// An entry of the ds64 table
+typedef struct
+{
+    char chunkID[4];
+    char chunkSize[8]; // Unsigned 8-byte little endian int
+} ChunkSize64;
+
+// The format chunk of a wave file
+typedef struct
+{
+    char chunkID[4];                  // String: must be "fmt " (0x666D7420).
+    char chunkDataSize[4];            // Unsigned 4-byte little endian int: Byte count for the remainder of the chunk: 16 + extraFormatbytes.
+    char compressionCode[2];          // Unsigned 2-byte little endian int
+    char numberOfChannels[2];         // Unsigned 2-byte little endian int
+    char sampleRate[4];               // Unsigned 4-byte little endian int
+    char averageBytesPerSecond[4];    // Unsigned 4-byte little endian int: This value indicates how many bytes of wave data must be streamed to a D/A converter per second in order to play the wave file. This information is useful when determining if data can be streamed from the source fast enough to keep up with playback. = SampleRate * BlockAlign.
+    char blockAlign[2];               // Unsigned 2-byte little endian int: The number of bytes per sample slice. This value is not affected by the number of channels and can be calculated with the formula: blockAlign = significantBitsPerSample / 8 * numberOfChannels
+    char significantBitsPerSample[2]; // Unsigned 2-byte little endian int
+} FormatChunk;
+
+// CuePoint: each individual 'label' in a wave file is represented by a cue point.
+typedef struct
+{
+    char cuePointID[4];        // a unique ID for the Cue Point.
+    char playOrderPosition[4]; // Unsigned 4-byte little endian int: If a Playlist chunk is present in the Wave file, this the sample number at which this cue point will occur during playback of the entire play list as defined by the play list's order.  **Otherwise set to same as sample offset??***  Set to 0 when there is no playlist.
+    char dataChunkID[4];       // Unsigned 4-byte little endian int: The ID of the chunk containing the sample data that corresponds to this cue point.  If there is no playlist, this should be 'data'.
+    char chunkStart[4];        // Unsigned 4-byte little endian int: The byte offset into the Wave List Chunk of the chunk containing the sample that corresponds to this cue point. This is the same chunk described by the Data Chunk ID value. If no Wave List Chunk exists in the Wave file, this value is 0.
+    char blockStart[4];        // Unsigned 4-byte little endian int: The byte offset into the "data" or "slnt" Chunk to the start of the block containing the sample. The start of a block is defined as the first byte in uncompressed PCM wave data or the last byte in compressed wave data where decompression can begin to find the value of the corresponding sample value.
+    char frameOffset[4];       // Unsigned 4-byte little endian int: The offset into the block (specified by Block Start) for the sample that corresponds to the cue point.
+} CuePoint;
+
+// CuePoints are stored in a CueChunk
+typedef struct
+{
+    char chunkID[4];        // String: Must be "cue " (0x63756520).
+    char chunkDataSize[4];  // Unsigned 4-byte little endian int: Byte count for the remainder of the chunk: 4 (size of cuePointsCount) + (24 (size of CuePoint struct) * number of CuePoints).
+    char cuePointsCount[4]; // Unsigned 4-byte little endian int: Length of cuePoints[].
+    CuePoint *cuePoints;
+} CueChunk;
+
+// Cue Labels are stored in a ListChunk
+typedef struct
+{
+    char chunkID[4];       // String: Must be "LIST" (0x4C495354).
+    char chunkDataSize[4]; // Unsigned 4-byte little endian int: Byte count for the remainder of the chunk: 4 (size of TypeID) + Label chunks.
+    char typeID[4];        // String: Must be "adtl" (0x6164746C).
+    char *labelChunks;
+} ListChunk;
+
+// Some chunks we don't care about the contents and will just copy them from the input file to the output,
+// so this struct just stores positions of such chunks in the input file
+typedef struct
+{
+    off_t startOffset; // in bytes
+    uint64_t size;     // in bytes
+} ChunkLocation;
+
+// A chunk of the input file other than the format and data chunks, as the scanner found it
+typedef struct
+{
+    off_t startOffset; // in bytes, of the chunk header
+    uint64_t size;     // in bytes, the header and the data without the padding byte
+    char chunkID[4];
+    uint8_t paddingSize; // 1 if the chunk data has an odd size, whether or not the file actually has the padding byte
+    bool isMarkerChunk;  // An existing cue or adtl chunk, which is replaced rather than copied
+} IndexedChunk;
+
+// Every other chunk in file order, in an array that grows as needed and keeps its memory from one file to the next
+typedef struct
+{
+    IndexedChunk *chunks;
+    size_t count;
+    size_t capacity;
+} ChunkIndex;
+
+// Everything the chunk scanner learns about the input file in its single pass over the chunk headers
+typedef struct
+{
+    WaveHeader waveHeader;
+    bool isRF64;                 // The header says RF64 or BW64 and the real sizes are in the ds64 chunk
+    off_t dataSize64ChunkOffset; // Where the ds64 chunk is in an RF64 file
+    FormatChunk formatChunk;
+    bool hasFormatChunk;
+    ChunkLocation formatChunkExtraBytes;
+    ChunkLocation dataChunkLocation;
+    ChunkIndex chunkIndex;
+} WaveFileIndex;
+
+// The input wave file, which is either a file descriptor or a buffer of the caller's
+typedef struct
+{
+    int fd;            // -1 when the wave file is a buffer
+    const char *bytes; // The whole file, either mapped or the caller's buffer.  NULL when the file could not be mapped
+    off_t size;
+    bool isMapped; // bytes is our mapping of the file
+} WaveInput;
+
+typedef struct
+{
+    uint64_t wallStart;
+    uint64_t cpuStart;
+} PhaseTimer;
+
+// Memory that is kept by the context for the next call rather than freed
+typedef struct
+{
+    char *bytes;
+    size_t capacity;
+} ReusableBuffer;
+
+// The copy engine moves sample data through user space in a few large buffers, while a reader thread fills one buffer
+// another is being written.  The buffers are allocated the first time they are needed and kept by the context
+#define DEFAULT_COPY_BUFFER_SIZE (2 * 1024 * 1024)
+#define DEFAULT_COPY_BUFFERS_COUNT 4
+#define MAX_COPY_BUFFERS_COUNT 64
+
+// Outputs on filesystems with larger blocks than this are not padded to line their samples up for cloning
+#define MAX_CLONE_ALIGNMENT_SIZE (64 * 1024)
+
+// How much is copied through the page cache before it is written out and dropped, when direct I/O isn't possible
+#define DROP_CACHE_SLICE_SIZE (64 * 1024 * 1024)
+
+typedef struct
+{
+    size_t bufferSize; // A whole number of pages
+    int buffersCount;
+    bool useHugePages;
+    char *memory; // All the buffers back to back, page aligned
+    size_t memorySize;
+} CopyBuffers;
+
+// With the io_uring backend the writes of an output file are queued on a ring set up the first time it is needed.  Copies
+// keep every copy buffer busy with a read linked to a write, and the header and marker writes complete in the background
+// until the end of the file.  A ring never has more than two requests per copy buffer and a few writes in flight
+#define IO_RING_ENTRIES 256
+#define IO_RING_VECTORS_WRITE (1ull << 63) // Marks the user data of a header or marker write, the rest of it is the size of the write
+
+typedef struct
+{
+    int fd;             // -1 until the ring is set up
+    bool isUnavailable; // Setting up failed, so everything is written without the ring
+    wm_status status;   // The first queued write that failed
+    void *submissionRing;
+    size_t submissionRingSize;
+    void *completionRing;
+    size_t completionRingSize;
+    struct io_uring_sqe *entries;
+    size_t entriesSize;
+    unsigned *submissionHead;
+    unsigned *submissionTail;
+    unsigned *submissionArray;
+    unsigned submissionMask;
+    unsigned submissionEntriesCount;
+    unsigned *completionHead;
+    unsigned *completionTail;
+    unsigned completionMask;
+    struct io_uring_cqe *completions;
+    unsigned queuedCount;   // Requests not yet handed to the kernel
+    unsigned inFlightCount; // Requests handed to the kernel that haven't been reaped
+    char *registeredMemory; // The copy buffers, if they are registered with the ring
+} IoRing;
+
+// In streaming mode the output is written front to back in one pass, so it can go to a pipe.
+// Everything read before the data chunk is held back until the size of the output is known and the header can be written
+typedef struct
+{
+    int fd;
+    bool holding;
+    ReusableBuffer *heldBytes;
+    size_t heldSize;
+    uint64_t writtenBytes; // Everything written to the output so far, including bytes still being held
+} StreamOutput;
+
+// A range for the copy engine to copy.  Either side can be a stream instead of a file
+typedef struct
+{
+    int inputFd;
+    off_t inputOffset; // -1 to read the input as a stream
+    int outputFd;
+    off_t outputOffset;
+    StreamOutput *streamOutput; // Write through this instead of at outputOffset
+    uint64_t size;
+} CopyRange;
+
+// What the writing thread and the reader thread of one copy share
+typedef struct
+{
+    wm_context *context;
+    const CopyRange *range;
+    pthread_mutex_t lock;
+    pthread_cond_t changed;
+    size_t filledSizes[MAX_COPY_BUFFERS_COUNT];
+    int filledCount;        // Buffers that have been read and not yet written
+    bool readerDone;        // The reader has read the whole range or failed
+    wm_status readerStatus; // The reader can't touch the error message of the context, so its failure is reported by the writer
+    bool writerFailed; // Tells the reader to stop
+} CopyPipeline;
+
+// A time as exact whole seconds and nanoseconds, so it can be turned into a sample frame without rounding errors
+typedef struct
+{
+    uint32_t seconds;
+    uint32_t nanoseconds;
+} LabelTime;
+
+// A label to be added. The text is not NUL terminated, it is a view into either a label file, a buffer of the caller's
+// or the text arena of the LabelInfo that owns the label
+typedef struct
+{
+    size_t textOffset; // Offset of the label text in externalText, or in LabelInfo.text if there is none
+    size_t textLength; // in bytes, not counting a terminating NUL
+} Label;
+
+// All the labels of a context. The arrays grow as needed and are kept when the labels are replaced,
+// and the text of all labels is stored back to back in a single arena.  The start and end times are kept apart from the labels,
+// seconds and nanoseconds in arrays of their own, so they can be turned into sample frames a vector at a time.  A label that
+// ends where it starts is a point, one that ends later is a region
+typedef struct
+{
+    Label *labels;
+    uint32_t *startSeconds;
+    uint32_t *startNanoseconds;
+    uint32_t *endSeconds;
+    uint32_t *endNanoseconds;
+    uint32_t count;
+    uint32_t capacity;
+    char *text;
+    size_t textSize;
+    size_t textCapacity;
+    const char *externalText;    // When the labels were parsed from a buffer or a mapped label file they point straight into it
+    const char *mappedLabelFile; // Our own mapping of a label file, unmapped when the labels are replaced
+    size_t mappedLabelFileSize;
+} LabelInfo;
+
+// A cue point the input file already has, for merging
+typedef struct
+{
+    uint32_t cuePointID;
+    uint32_t frameOffset;
+    uint32_t firstSubchunk; // Its labl, note, ltxt and other adtl chunks are subchunksCount entries of ExistingMarkers.subchunks from here
+    uint32_t subchunksCount;
+} ExistingMarker;
+
+// A chunk of an existing adtl LIST, whose bytes are kept in ExistingMarkers.listData
+typedef struct
+{
+    char chunkID[4];
+    uint32_t cuePointID;
+    uint32_t order;      // in the input file, so sorting keeps the chunks of a cue point in their order
+    size_t dataOffset;   // of the bytes after the cue point ID
+    uint32_t dataSize;   // not counting the cue point ID
+} ExistingSubchunk;
+
+// The existing markers the scanner read from the input when merging.  All three buffers are kept for the next file
+typedef struct
+{
+    ReusableBuffer markers; // ExistingMarker
+    uint32_t count;
+    ReusableBuffer subchunks; // ExistingSubchunk
+    uint32_t subchunksCount;
+    ReusableBuffer listData; // The adtl LIST chunks, back to back
+    size_t listDataSize;
+} ExistingMarkers;
+
+// One cue point of the output, from a label, an existing marker or both when a label updates an existing marker
+#define NO_MARKER_SOURCE UINT32_MAX
+
+typedef struct
+{
+    uint32_t frameOffset;
+    uint32_t labelIndex;    // NO_MARKER_SOURCE if there is no label
+    uint32_t existingIndex; // NO_MARKER_SOURCE if there is no existing marker
+    uint32_t silenceIndex;  // NO_MARKER_SOURCE unless it marks a silence that was found in the samples
+} MergedMarker;
+
+// The sample data passes through the tap one buffer at a time, with samples and frames split anywhere.  It is turned into floats
+// from -1 to 1 a block at a time for the analysis, still interleaved
+#define DECODED_SAMPLES_COUNT 1024
+
+typedef struct
+{
+    uint16_t channelsCount;
+    uint16_t sampleSize; // Bytes per sample, blockAlign / channelsCount, with the bits of narrower samples at the top
+    bool isFloat;
+    char partialSample[8]; // The start of a sample cut off at the end of the last buffer
+    uint8_t partialSampleSize;
+    float samples[DECODED_SAMPLES_COUNT];
+} SampleDecoder;
+
+#define SILENCE_WINDOW_MILLISECONDS 10
+#define REGION_DATA_SIZE 20 // The data of an ltxt chunk, the sample length of the region then purpose, country, language, dialect and code page
+
+typedef struct
+{
+    uint64_t startFrame;
+    uint64_t endFrame;
+} Silence;
+
+// Looks for silences one window at a time as the samples go past
+typedef struct
+{
+    uint16_t channelsCount;
+    uint32_t windowSamples;     // of all channels together
+    uint32_t windowSamplesLeft; // before the current window is full
+    float windowPeak;
+    double windowSumSquares;
+    uint64_t windowStartFrame;
+    float threshold;            // The level of full scale
+    uint64_t minFrames;
+    bool isInSilence;
+    uint64_t silenceStartFrame;
+    ReusableBuffer silences;    // Silence, for the file being written
+    uint32_t silencesCount;
+    wm_status status;           // The silences could not be stored
+} SilenceDetector;
+
+#define MAX_PEAK_LEVELS 16
+
+// The smallest and largest sample and the sum of squares of one channel so far, for the peak being taken
+typedef struct
+{
+    float min;
+    float max;
+    double sumSquares;
+} PeakAccumulator;
+
+typedef struct
+{
+    uint32_t framesPerPeak;
+    uint64_t peakFrames;  // in the current peak so far
+    ReusableBuffer peaks; // wm_peak, one per channel for each peak
+    size_t peaksCount;
+} PeakLevel;
+
+// Takes the peaks of every level as the samples go past.  Only the first level sees the samples, each of the others is made of
+// pairs of peaks of the level before
+typedef struct
+{
+    uint16_t channelsCount;
+    uint16_t channel;    // of the next sample
+    uint32_t framesLeft; // before the current peak of the first level is complete
+    uint32_t sampleRate;
+    PeakLevel levels[MAX_PEAK_LEVELS];
+    int levelsCount;
+    ReusableBuffer accumulators; // PeakAccumulator, one per channel for each level
+    wm_status status;            // The peaks could not be stored
+} PeakBuilder;
+
+#define LOUDNESS_MAX_CHANNELS 32
+#define TRUE_PEAK_TAPS 49 // of the interpolation filter, split between the phases of the oversampling
+#define TRUE_PEAK_MAX_PHASE_TAPS 25
+
+// Cuts the K-weighted energy into 400 ms gating blocks overlapping by 75%, which are made of four 100 ms steps
+typedef struct
+{
+    double stepEnergies[4]; // of the last four steps
+    double stepEnergy;      // of the step being summed
+    uint32_t stepFramesLeft;
+    uint32_t stepsCount;
+} GatingBlocks;
+
+typedef struct
+{
+    uint64_t startFrame;
+    size_t blocksStart; // in LoudnessMeter.segmentBlockPowers
+    float truePeak;
+} LoudnessSegment;
+
+typedef struct
+{
+    uint16_t channelsCount;
+    uint32_t sampleRate;
+    uint32_t stepFrames;
+    double filter[2][5]; // b0, b1, b2, a1 and a2 of the pre-filter, then of the RLB high-pass filter
+    double weights[LOUDNESS_MAX_CHANNELS];
+    double filterState[4][LOUDNESS_MAX_CHANNELS]; // The two delays of each filter, transposed direct form II
+    float partialFrame[LOUDNESS_MAX_CHANNELS];    // The start of a frame cut off at the end of the last block
+    uint16_t partialFrameSize;
+
+    // The true peak is the largest sample of the signal oversampled 4 times, or twice from 96 kHz and not at all from 192 kHz
+    int oversampling;
+    int truePeakPhaseTaps;
+    float truePeakGain; // The most the filter can make of samples no larger than 1
+    float truePeakCoefficients[4][TRUE_PEAK_MAX_PHASE_TAPS];                      // Of each phase, oldest sample first
+    float truePeakHistory[LOUDNESS_MAX_CHANNELS][TRUE_PEAK_MAX_PHASE_TAPS - 1]; // The last samples of each channel, oldest first
+    float truePeakSamples[TRUE_PEAK_MAX_PHASE_TAPS - 1 + DECODED_SAMPLES_COUNT]; // The history and the frames of one channel
+
+    double frameEnergies[DECODED_SAMPLES_COUNT]; // K-weighted energy of each frame of the block being measured
+    uint64_t framesCount;                        // measured so far
+
+    GatingBlocks fileGating;
+    ReusableBuffer fileBlockPowers; // double
+    size_t fileBlocksCount;
+    GatingBlocks segmentGating;
+    ReusableBuffer segmentBlockPowers; // double, of all segments one after the other
+    size_t segmentBlocksCount;
+    ReusableBuffer segments; // LoudnessSegment
+    size_t segmentsCount;
+    size_t segmentIndex; // of the segment being measured
+
+    bool hasResults;
+    wm_loudness fileLoudness;
+    ReusableBuffer segmentLoudness; // wm_loudness
+    wm_status status;               // The blocks could not be stored
+} LoudnessMeter;
+
+// Everything written to an output file passes through here in file order when checksums are taken or the samples are analysed.
+// The tap finds the chunks in the bytes going past by itself, so the header and marker writes and the copy engine only have to
+// hand over what they write
+typedef struct
+{
+    bool isActive;
+    uint32_t fileChecksum;
+    uint64_t position;          // Bytes of the output tapped so far
+    char chunkHeader[8];        // The header of the next chunk, as it comes in
+    uint8_t chunkHeaderSize;
+    uint64_t chunkDataLeft;     // of the current chunk
+    uint64_t chunkPaddingLeft;
+    uint64_t expectedChunkSize; // The size of the next chunk if its header says 0xFFFFFFFF, for the data chunk and big chunks of an RF64 file
+    bool analysesSamples;       // The samples go to the sample analysis
+    bool isDataChunk;           // The current chunk holds the samples
+    ReusableBuffer chunks;      // wm_chunk_checksum, only when checksums are taken
+    size_t chunksCount;
+} OutputTap;
+
+struct wm_context
+{
+    wm_message_callback messageCallback;
+    void *messageUserData;
+    bool syncOutput;
+    wm_stats stats;
+    char errorMessage[512];
+
+    LabelInfo labelInfo;
+    WaveFileIndex waveFileIndex;
+    wm_merge_mode mergeMode;
+    ExistingMarkers existingMarkers;
+    wm_rounding rounding;
+    ReusableBuffer labelFrames;    // The start of each label as a sample frame, for the wave file being marked
+    ReusableBuffer labelEndFrames; // and its end
+
+    // The chunks built from the labels, their memory is kept for the next file
+    CueChunk cueChunk;
+    ListChunk listChunk;
+    size_t listChunkSize;
+    ReusableBuffer cuePoints;
+    ReusableBuffer labelChunks;
+    ReusableBuffer mergedMarkers; // MergedMarker, the cue points in the order they are written
+    ReusableBuffer exportText;    // The label file written by wm_export_labels
+
+    ReusableBuffer dataSize64Bytes; // The ds64 table or the whole ds64 chunk, whichever the current call needs
+    ReusableBuffer formatChunkExtraData;
+    ReusableBuffer alignmentChunk; // The JUNK chunk that lines the output samples up with the input samples for cloning
+    bool isCloneProbed;            // Whether a clone between cloneInputDevice and cloneOutputDevice has been tried, and canClone its result
+    bool canClone;
+    dev_t cloneInputDevice;
+    dev_t cloneOutputDevice;
+    ReusableBuffer streamHeldBytes;
+    CopyBuffers copyBuffers;
+    wm_io_backend ioBackend;
+    IoRing ioRing;
+    bool directIo;
+    wm_checksum_mode checksumMode;
+    OutputTap outputTap;
+    SampleDecoder sampleDecoder;
+
+    wm_silence_level silenceLevel;
+    double silenceThresholdDb;
+    double silenceMinSeconds;
+    ReusableBuffer silenceText;
+    size_t silenceTextLength;
+    SilenceDetector silenceDetector;
+
+    wm_snap_mode snapMode;
+    double snapWindowSeconds;
+    ReusableBuffer snapTargets; // SnapTarget, the labels to snap in sample frame order
+    ReusableBuffer snapBytes;   // The sample data around one label
+    ReusableBuffer snapSamples; // The same decoded
+    ReusableBuffer snapFlags;   // Whether each of those samples crosses zero
+
+    uint32_t peakSamplesPerPixel; // 0 when no peaks are taken
+    int peakLevelsCount;
+    PeakBuilder peakBuilder;
+    ReusableBuffer peaksFile; // The .dat file written by wm_write_peaks
+
+    bool measuresLoudness;
+    LoudnessMeter loudnessMeter;
+};
+
+// Sets the error message of the context and returns status, so errors can be reported with "return setError(...)"
+static wm_status setError(wm_context *context, wm_status status, const char *format, ...);
+
+// Progress messages and warnings go to the message callback, if there is one
+static void printProgress(wm_context *context, const char *format, ...);
+static void printWarning(wm_context *context, const char *format, ...);
+
+// Grows the buffer to at least size bytes, keeping its contents
+static wm_status reserveBuffer(wm_context *context, ReusableBuffer *buffer, size_t size, const char *description);
+
+// Count one read or write system call and the bytes it moved
+static void countRead(wm_context *context, uint64_t bytes);
+static void countWrite(wm_context *context, uint64_t bytes);
+static void startPhase(PhaseTimer *timer);
+
+// Adds the time since startPhase to the phase, a phase can be timed in several pieces
+static void endPhase(wm_context *context, PhaseTimer *timer, wm_phase phase);
+
+static void initLabelInfo(LabelInfo *labelInfo);
+static void freeLabelInfo(LabelInfo *labelInfo);
+
+// Forgets the labels but keeps the memory of the arrays for the next ones
+static void clearLabelInfo(LabelInfo *labelInfo);
+
+// Returns the text of a label, wherever it is stored
+static const char *getLabelText(const LabelInfo *labelInfo, const Label *label);
+
+// Makes room for at least extraBytes more bytes of text in the arena
+static wm_status reserveLabelText(wm_context *context, LabelInfo *labelInfo, size_t extraBytes);
+
+// Adds a label whose text has already been written to the arena at textOffset
+static wm_status appendLabel(wm_context *context, LabelInfo *labelInfo, LabelTime startTime, LabelTime endTime, size_t textOffset, size_t textLength);
+
+// The start time of a label in seconds, for messages
+static double getLabelStartTime(const LabelInfo *labelInfo, uint32_t index);
+
+// Parses the labels in buffer, the text offsets of the new labels are relative to buffer
+static wm_status parseLabels(wm_context *context, const char *buffer, size_t bufferSize);
+
+// Maps the input file if possible, so the chunk headers can be read without a system call each
+static wm_status openWaveInput(wm_context *context, int fd, WaveInput *out_Input);
+static void closeWaveInput(wm_context *context, WaveInput *input);
+
+// Builds the chunk index of the input file. The headers are read from the mapping or with pread,
+// either way they are visited in one forward pass without seeking the stream.  With readMarkers the existing cue and adtl chunks
+// are read into context->existingMarkers as well
+static wm_status scanWaveFile(wm_context *context, const WaveInput *input, WaveFileIndex *waveFileIndex, bool readMarkers);
+
+static wm_status appendIndexedChunk(wm_context *context, ChunkIndex *chunkIndex, const char *chunkID, off_t startOffset, uint64_t chunkDataSize, bool isMarkerChunk);
+
+// Read the cue points of an existing cue chunk, or the chunks of an existing adtl LIST chunk, into the existing markers to merge with
+static wm_status readExistingCueChunk(wm_context *context, const WaveInput *input, off_t chunkDataOffset, uint64_t chunkDataSize);
+static wm_status readExistingListChunk(wm_context *context, const WaveInput *input, off_t chunkDataOffset, uint64_t chunkDataSize);
+
+// Ties each existing adtl chunk to its cue point once the whole file has been scanned
+static void linkExistingMarkers(ExistingMarkers *existingMarkers);
+
+static int compareMergedMarkers(const void *a, const void *b);
+
+// Writes the existing markers as the lines of an Audacity label file to context->exportText and returns its size
+static wm_status formatExportedLabels(wm_context *context, uint32_t sampleRate, size_t *out_Size);
+
+// Puts the cue points of the output in context->mergedMarkers: every label the wave file has room for, and when merging the existing markers
+// merged with them by sample frame.  Returns the number of cue points
+static wm_status mergeMarkers(wm_context *context, const WaveInput *input, FormatChunk formatChunk, uint32_t *out_MarkersCount);
+
+// Moves the markers of labels to a zero crossing or the quietest sample frame near them, reading only the samples around them
+static wm_status snapMarkers(wm_context *context, const WaveInput *input, FormatChunk formatChunk, MergedMarker *markers, uint32_t markersCount);
+
+// Scans the input, builds the marker chunks and writes them, either to a new output file or into the input when outputFd is -1
+static wm_status addMarkersToWaveInput(wm_context *context, const WaveInput *input, int outputFd);
+
+static wm_status writeOutputFile(wm_context *context, const WaveInput *input, int outputFd);
+
+// Writes the new cue and adtl chunks straight into an existing wave file.
+// Marker chunks at the end of the file are overwritten, any others are turned into JUNK chunks, and the sample data is never touched
+static wm_status writeMarkersInPlace(wm_context *context, const WaveInput *input);
+
+// Builds the cue chunk and the adtl LIST chunk holding a cue point and a labl chunk for every label the wave file has room for.
+// The input is where the labels are snapped to the samples, NULL while streaming
+static wm_status buildCueAndListChunks(wm_context *context, const WaveInput *input, FormatChunk formatChunk);
+
+// The size of the cue and adtl LIST chunks buildCueAndListChunks built, with their headers
+static uint64_t getMarkerChunksSize(const wm_context *context);
+static size_t getAdtlChunkSize(size_t dataSize, bool addNul);
+
+// The most vectors fillCueAndListVectors needs
+#define CUE_AND_LIST_VECTORS_COUNT 5
+
+// Points vectors at the pieces of the cue chunk followed by the adtl LIST chunk, so all the generated metadata goes out in a single write.
+// Returns the number of vectors used
+static int fillCueAndListVectors(struct iovec *vectors, CueChunk *cueChunk, ListChunk *listChunk, size_t listChunkSize);
+
+// Writes all the vectors at *offset with as few pwritev calls as the kernel allows, and moves *offset past them.
+// With a NULL offset the vectors are written at the current position with writev instead, which works on pipes as well
+static int writeVectorsToFile(wm_context *context, int fd, struct iovec *vectors, int vectorsCount, off_t *offset);
+
+// For such chunks that we will copy over from input to output, this function does that at the given output offset,
+// in the kernel if possible and otherwise through the copy buffers
+static wm_status writeChunkLocationFromInputFileToOutputFile(wm_context *context, ChunkLocation chunk, const WaveInput *input, int outputFd, off_t outputOffset);
+
+// Copies the range through the buffers of the copy engine, reading ahead on a second thread when the range needs more than one buffer
+static wm_status copyThroughBuffers(wm_context *context, const CopyRange *range);
+static wm_status reserveCopyBuffers(wm_context *context);
+static wm_status readCopyPiece(wm_context *context, const CopyRange *range, uint64_t position, char *buffer, size_t size);
+
+// Copies a range between two files with O_DIRECT, or through the page cache dropping what was copied where that isn't possible
+static wm_status copyDirect(wm_context *context, const CopyRange *range);
+
+// Whether the writes of an output file go through the io_uring, which is set up the first time this is asked
+static bool useIoRing(wm_context *context);
+static void closeIoRing(IoRing *ring);
+static void unregisterCopyBuffers(wm_context *context);
+
+// Same as writeVectorsToFile, except that with the io_uring backend the write is only queued.  The vectors are taken
+// straight away, but the bytes they point at must stay put until waitForOutputWrites returns
+static bool queueVectorsToFile(wm_context *context, int fd, struct iovec *vectors, int count, off_t *offset);
+
+// Waits for every queued write and returns the first failure
+static wm_status waitForOutputWrites(wm_context *context);
+
+// Copies a range between two files by keeping every copy buffer busy on the io_uring
+static wm_status copyThroughIoRing(wm_context *context, const CopyRange *range);
+
+// Copies as much of the range as the kernel is willing to and returns the number of bytes copied from the start of the range.
+// Anything left over has to be copied in user space
+static uint64_t copyRangeInKernel(wm_context *context, int inputFd, off_t inputOffset, int outputFd, off_t outputOffset, uint64_t size);
+
+// The size of a JUNK chunk to put after headerSize bytes of output header, so the output samples start at the same position within
+// a filesystem block as the input samples at inputSamplesOffset and can be cloned.  0 when the samples won't be cloned, the filesystems
+// can't clone between them or the samples already line up
+static uint64_t getCloneAlignmentSize(wm_context *context, const WaveInput *input, int outputFd, off_t inputSamplesOffset, uint64_t samplesSize, uint64_t headerSize);
+
+// fsyncs the output if that was asked for
+static wm_status syncOutputFile(wm_context *context, int outputFd);
+
+// Starts tapping a new output file when checksums are asked for or silences looked for.  The copy engine can't hand over what
+// the kernel copies, so while the tap is active everything is copied in user space
+static wm_status startOutputTap(wm_context *context, FormatChunk formatChunk, size_t chunksCount);
+static bool isOutputTapNeeded(const wm_context *context);
+static void tapOutputBytes(wm_context *context, const void *bytes, size_t size);
+static void tapOutputVectors(wm_context *context, const struct iovec *vectors, int vectorsCount);
+
+// Fixes the checksums after size bytes at offset in the output, which have all been tapped, were changed from oldBytes to newBytes.
+// The bytes are in the data of chunk chunkIndex, with chunkBytesAfter bytes of it after them, or in no chunk if chunkIndex is SIZE_MAX
+static void retapOutputBytes(wm_context *context, uint64_t offset, const void *oldBytes, const void *newBytes, size_t size, size_t chunkIndex, uint64_t chunkBytesAfter);
+
+// Sets the decoder up for the samples of the format chunk, and returns false if it can't decode them
+static bool setUpSampleDecoder(SampleDecoder *decoder, FormatChunk formatChunk);
+static void decodeSamples(const SampleDecoder *decoder, const uint8_t *bytes, size_t count, float *out_Samples);
+
+// Decodes the sample bytes of the data chunk and hands them to the analysis, a block at a time
+static void analyseSampleBytes(wm_context *context, const char *bytes, size_t size);
+
+static void startSilenceDetection(wm_context *context, FormatChunk formatChunk);
+static void detectSilences(wm_context *context, const float *samples, size_t count);
+
+// Ends the last window and the silence it may be in, after the last sample
+static wm_status finishSilenceDetection(wm_context *context);
+
+// The most bytes the markers of the silences in size bytes of sample data can take
+static uint64_t getMaxSilenceMarkersSize(const wm_context *context, FormatChunk formatChunk, uint64_t size);
+
+static wm_status startPeaks(wm_context *context, FormatChunk formatChunk);
+static void takePeaks(wm_context *context, const float *samples, size_t count);
+
+// Ends the last peak of every level, after the last sample
+static wm_status finishPeaks(wm_context *context);
+
+// Sets the meter up for the format, with a segment starting at every marker built for the file
+static wm_status startLoudness(wm_context *context, FormatChunk formatChunk);
+static void measureLoudness(wm_context *context, const float *samples, size_t count);
+
+// Gates the blocks of the whole file and of each segment into their integrated loudness, after the last sample
+static wm_status finishLoudness(wm_context *context);
+
+// Runs the K-weighting filters over framesCount frames of channels firstChannel to firstChannel + 3, or + 1, and adds their
+// weighted energy to that of each frame
+#if defined(__AVX2__)
+static void filterFourChannels(LoudnessMeter *meter, const float *samples, size_t framesCount, uint16_t firstChannel);
+#endif
+#if defined(__SSE2__)
+static void filterTwoChannels(LoudnessMeter *meter, const float *samples, size_t framesCount, uint16_t firstChannel);
+#endif
+
+// Raises the peak to the largest true peak of framesCount frames
+static void measureTruePeaks(LoudnessMeter *meter, const float *samples, size_t framesCount, float *io_Peak);
+
+// Finds the smallest and largest sample and adds up the squares of each channel over framesCount frames
+static void measureChannels(const float *samples, size_t framesCount, uint16_t channelsCount, PeakAccumulator *io_Accumulators);
+
+// Finds the largest absolute value and adds up the squares of count samples
+static void measureSamples(const float *samples, size_t count, float *io_Peak, double *io_SumSquares);
+
+// Flags each sample from the second frame on that is zero or has the other sign from the same channel in the frame before
+static void markZeroCrossings(const float *samples, size_t count, uint16_t channelsCount, uint8_t *out_Flags);
+
+// Reads the sample data back from the output and checks it against the checksum taken from the input
+static wm_status verifyOutputSamples(wm_context *context, int outputFd, off_t offset, uint64_t size);
+
+// CRC-32C (Castagnoli) of the bytes, carrying on from crc, which is 0 for the first bytes.  In hardware where the CPU has it
+static uint32_t updateCrc32c(uint32_t crc, const void *bytes, size_t size);
+
+// What the bits of a CRC-32C turn into after bytesCount more zero bytes, without the conditioning at the start and the end
+static uint32_t shiftCrc32c(uint32_t crc, uint64_t bytesCount);
+
+// All data in a Wave file must be little endian.
+// These are functions to convert 2- and 4-byte unsigned ints to and from little endian, if needed
+
+enum HostEndiannessType
+{
+    EndiannessUndefined = 0,
+    LittleEndian,
+    BigEndian
+};
+
+static enum HostEndiannessType HostEndianness = EndiannessUndefined;
+
+static enum HostEndiannessType getHostEndianness(void);
+static uint32_t littleEndianBytesToUInt32(char littleEndianBytes[4]);
+static void uint32ToLittleEndianBytes(uint32_t uInt32Value, char out_LittleEndianBytes[4]);
+static uint16_t littleEndianBytesToUInt16(char littleEndianBytes[2]);
+static uint64_t littleEndianBytesToUInt64(char littleEndianBytes[8]);
+static void uint64ToLittleEndianBytes(uint64_t uInt64Value, char out_LittleEndianBytes[8]);
+
+// Turns a time into a sample frame, rounded the way rounding says
+static uint64_t timeToIndex(LabelTime time, uint32_t sampleRate, wm_rounding rounding);
+
+// Turns count start times into sample frames, with the same results as timeToIndex on each
+static void timesToIndices(const uint32_t *seconds, const uint32_t *nanoseconds, uint32_t count, uint32_t sampleRate, wm_rounding rounding, uint64_t *out_Frames);
+
+wm_context *wm_context_create(void)
+{
+    wm_context *context = calloc(1, sizeof(wm_context));
+    if (context == NULL)
+    {
+        return NULL;
+    }
+
+    // Set once up front, so contexts used on several threads never race to do it
+    HostEndianness = getHostEndianness();
+    initLabelInfo(&context->labelInfo);
+    context->copyBuffers.bufferSize = DEFAULT_COPY_BUFFER_SIZE;
+    context->copyBuffers.buffersCount = DEFAULT_COPY_BUFFERS_COUNT;
+    context->ioBackend = WM_IO_BACKEND_SYNC;
+    context->ioRing.fd = -1;
+    return context;
+}
+
+void wm_context_destroy(wm_context *context)
+{
+    if (context == NULL)
+    {
+        return;
+    }
+
+    freeLabelInfo(&context->labelInfo);
+    if (context->waveFileIndex.chunkIndex.chunks != NULL)
+        free(context->waveFileIndex.chunkIndex.chunks);
+    if (context->cuePoints.bytes != NULL)
+        free(context->cuePoints.bytes);
+    if (context->labelChunks.bytes != NULL)
+        free(context->labelChunks.bytes);
+    if (context->mergedMarkers.bytes != NULL)
+        free(context->mergedMarkers.bytes);
+    if (context->exportText.bytes != NULL)
+        free(context->exportText.bytes);
+    if (context->labelFrames.bytes != NULL)
+        free(context->labelFrames.bytes);
+    if (context->labelEndFrames.bytes != NULL)
+        free(context->labelEndFrames.bytes);
+    if (context->existingMarkers.markers.bytes != NULL)
+        free(context->existingMarkers.markers.bytes);
+    if (context->existingMarkers.subchunks.bytes != NULL)
+        free(context->existingMarkers.subchunks.bytes);
+    if (context->existingMarkers.listData.bytes != NULL)
+        free(context->existingMarkers.listData.bytes);
+    if (context->outputTap.chunks.bytes != NULL)
+        free(context->outputTap.chunks.bytes);
+    if (context->silenceText.bytes != NULL)
+        free(context->silenceText.bytes);
+    if (context->silenceDetector.silences.bytes != NULL)
+        free(context->silenceDetector.silences.bytes);
+    if (context->snapTargets.bytes != NULL)
+        free(context->snapTargets.bytes);
+    if (context->snapBytes.bytes != NULL)
+        free(context->snapBytes.bytes);
+    if (context->snapSamples.bytes != NULL)
+        free(context->snapSamples.bytes);
+    if (context->snapFlags.bytes != NULL)
+        free(context->snapFlags.bytes);
+    for (int i = 0; i < MAX_PEAK_LEVELS; i++)
+    {
+        if (context->peakBuilder.levels[i].peaks.bytes != NULL)
+            free(context->peakBuilder.levels[i].peaks.bytes);
+    }
+    if (context->peakBuilder.accumulators.bytes != NULL)
+        free(context->peakBuilder.accumulators.bytes);
+    if (context->peaksFile.bytes != NULL)
+        free(context->peaksFile.bytes);
+    if (context->loudnessMeter.fileBlockPowers.bytes != NULL)
+        free(context->loudnessMeter.fileBlockPowers.bytes);
+    if (context->loudnessMeter.segmentBlockPowers.bytes != NULL)
+        free(context->loudnessMeter.segmentBlockPowers.bytes);
+    if (context->loudnessMeter.segments.bytes != NULL)
+        free(context->loudnessMeter.segments.bytes);
+    if (context->loudnessMeter.segmentLoudness.bytes != NULL)
+        free(context->loudnessMeter.segmentLoudness.bytes);
+    if (context->dataSize64Bytes.bytes != NULL)
+        free(context->dataSize64Bytes.bytes);
+    if (context->formatChunkExtraData.bytes != NULL)
+        free(context->formatChunkExtraData.bytes);
+    if (context->alignmentChunk.bytes != NULL)
+        free(context->alignmentChunk.bytes);
+    if (context->streamHeldBytes.bytes != NULL)
+        free(context->streamHeldBytes.bytes);
+    closeIoRing(&context->ioRing);
+    if (context->copyBuffers.memory != NULL)
+        munmap(context->copyBuffers.memory, context->copyBuffers.memorySize);
+    free(context);
+}
+
+void wm_set_message_callback(wm_context *context, wm_message_callback callback, void *user_data)
+{
+    context->messageCallback = callback;
+    context->messageUserData = user_data;
+}
+
+void wm_set_sync_output(wm_context *context, bool sync_output)
+{
+    context->syncOutput = sync_output;
+}
+
+wm_status wm_set_copy_buffers(wm_context *context, size_t buffer_size, int buffer_count, bool huge_pages)
+{
+    if (context == NULL)
+    {
+        return WM_ERROR_INVALID_ARGUMENT;
+    }
+    if ((buffer_size == 0) || (buffer_count < 1) || (buffer_count > MAX_COPY_BUFFERS_COUNT))
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Copy buffers need a size and a count from 1 to %d", MAX_COPY_BUFFERS_COUNT);
+    }
+
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+    CopyBuffers *copyBuffers = &context->copyBuffers;
+    if (copyBuffers->memory != NULL)
+    {
+        unregisterCopyBuffers(context);
+        munmap(copyBuffers->memory, copyBuffers->memorySize);
+        copyBuffers->memory = NULL;
+        copyBuffers->memorySize = 0;
+    }
+    copyBuffers->bufferSize = (buffer_size + pageSize - 1) / pageSize * pageSize;
+    copyBuffers->buffersCount = buffer_count;
+    copyBuffers->useHugePages = huge_pages;
+    return WM_OK;
+}
+
+void wm_set_direct_io(wm_context *context, bool direct_io)
+{
+    if (context != NULL)
+    {
+        context->directIo = direct_io;
+    }
+}
+
+void wm_set_rounding(wm_context *context, wm_rounding rounding)
+{
+    if (context != NULL)
+    {
+        context->rounding = rounding;
+    }
+}
+
+void wm_set_checksums(wm_context *context, wm_checksum_mode mode)
+{
+    if (context != NULL)
+    {
+        context->checksumMode = mode;
+    }
+}
+
+size_t wm_get_checksums(const wm_context *context, uint32_t *out_file_crc32c, const wm_chunk_checksum **out_chunks)
+{
+    const OutputTap *tap = &context->outputTap;
+    if (out_file_crc32c != NULL)
+    {
+        *out_file_crc32c = tap->fileChecksum;
+    }
+    if (out_chunks != NULL)
+    {
+        *out_chunks = (const wm_chunk_checksum *)tap->chunks.bytes;
+    }
+    return tap->chunksCount;
+}
+
+wm_status wm_set_auto_silence(wm_context *context, wm_silence_level level, double threshold_db, double min_seconds, const char *text)
+{
+    if (context == NULL)
+    {
+        return WM_ERROR_INVALID_ARGUMENT;
+    }
+    if ((threshold_db > 0.0) || (min_seconds < 0.0) || (min_seconds > (double)UINT32_MAX))
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Silences need a threshold of at most 0 dBFS and a duration from 0 seconds up");
+    }
+
+    const char *silenceText = (text != NULL) ? text : "Silence";
+    size_t textLength = strlen(silenceText);
+    wm_status status = reserveBuffer(context, &context->silenceText, textLength + 1, "silence text");
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    memcpy(context->silenceText.bytes, silenceText, textLength);
+    context->silenceTextLength = textLength;
+    context->silenceLevel = level;
+    context->silenceThresholdDb = threshold_db;
+    context->silenceMinSeconds = min_seconds;
+    return WM_OK;
+}
+
+wm_status wm_set_snap(wm_context *context, wm_snap_mode mode, double window_seconds)
+{
+    if (context == NULL)
+    {
+        return WM_ERROR_INVALID_ARGUMENT;
+    }
+    if (!(window_seconds >= 0.0) || (window_seconds > 1.0))
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Labels can be snapped to a sample frame from 0 to 1 second away");
+    }
+
+    context->snapMode = mode;
+    context->snapWindowSeconds = window_seconds;
+    return WM_OK;
+}
+
+wm_status wm_set_peaks(wm_context *context, uint32_t samples_per_pixel, int levels)
+{
+    if (context == NULL)
+    {
+        return WM_ERROR_INVALID_ARGUMENT;
+    }
+    if ((samples_per_pixel > 0) && ((levels < 1) || (levels > MAX_PEAK_LEVELS) || ((uint64_t)samples_per_pixel << (levels - 1) > UINT32_MAX)))
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Peaks need 1 to %d levels, with at most %u sample frames per peak", MAX_PEAK_LEVELS, UINT32_MAX);
+    }
+
+    context->peakSamplesPerPixel = samples_per_pixel;
+    context->peakLevelsCount = levels;
+    return WM_OK;
+}
+
+size_t wm_get_peaks(const wm_context *context, int level, uint32_t *out_samples_per_pixel, uint16_t *out_channels_count, const wm_peak **out_peaks)
+{
+    if ((context == NULL) || (level < 0) || (level >= context->peakBuilder.levelsCount))
+    {
+        return 0;
+    }
+
+    const PeakLevel *peakLevel = &context->peakBuilder.levels[level];
+    if (out_samples_per_pixel != NULL)
+        *out_samples_per_pixel = peakLevel->framesPerPeak;
+    if (out_channels_count != NULL)
+        *out_channels_count = context->peakBuilder.channelsCount;
+    if (out_peaks != NULL)
+        *out_peaks = (const wm_peak *)peakLevel->peaks.bytes;
+    return peakLevel->peaksCount;
+}
+
+wm_status wm_write_peaks(wm_context *context, int level, int fd)
+{
+    if (context == NULL)
+    {
+        return WM_ERROR_INVALID_ARGUMENT;
+    }
+    const PeakBuilder *builder = &context->peakBuilder;
+    if ((level < 0) || (level >= builder->levelsCount) || (fd < 0))
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "The last call didn't take peaks at level %d", level);
+    }
+
+    // A header of version, flags (0 for 16 bit values), sample rate, frames per peak, peaks count and channels count, then the
+    // min and max of each channel for each peak
+    const PeakLevel *peakLevel = &builder->levels[level];
+    size_t valuesCount = peakLevel->peaksCount * builder->channelsCount;
+    if (peakLevel->peaksCount > UINT32_MAX)
+    {
+        return setError(context, WM_ERROR_LIMIT, "There are too many peaks for a .dat file");
+    }
+    wm_status status = reserveBuffer(context, &context->peaksFile, 24 + 4 * valuesCount, "peaks file");
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    char *bytes = context->peaksFile.bytes;
+    uint32ToLittleEndianBytes(2, &bytes[0]);
+    uint32ToLittleEndianBytes(0, &bytes[4]);
+    uint32ToLittleEndianBytes(builder->sampleRate, &bytes[8]);
+    uint32ToLittleEndianBytes(peakLevel->framesPerPeak, &bytes[12]);
+    uint32ToLittleEndianBytes((uint32_t)peakLevel->peaksCount, &bytes[16]);
+    uint32ToLittleEndianBytes(builder->channelsCount, &bytes[20]);
+    const wm_peak *peaks = (const wm_peak *)peakLevel->peaks.bytes;
+    for (size_t i = 0; i < valuesCount; i++)
+    {
+        char *value = &bytes[24 + 4 * i];
+        value[0] = (char)((uint16_t)peaks[i].min & 0xFF);
+        value[1] = (char)((uint16_t)peaks[i].min >> 8);
+        value[2] = (char)((uint16_t)peaks[i].max & 0xFF);
+        value[3] = (char)((uint16_t)peaks[i].max >> 8);
+    }
+
+    struct iovec vector = {.iov_base = bytes, .iov_len = 24 + 4 * valuesCount};
+    if (writeVectorsToFile(context, fd, &vector, 1, NULL) < 0)
+    {
+        return setError(context, WM_ERROR_IO, "Error writing peaks file\nError: %d", errno);
+    }
+    return WM_OK;
+}
+
+void wm_set_loudness(wm_context *context, bool measure_loudness)
+{
+    if (context != NULL)
+    {
+        context->measuresLoudness = measure_loudness;
+    }
+}
+
+size_t wm_get_loudness(const wm_context *context, uint32_t *out_sample_rate, wm_loudness *out_file, const wm_loudness **out_segments)
+{
+    if ((context == NULL) || !context->loudnessMeter.hasResults)
+    {
+        return 0;
+    }
+
+    const LoudnessMeter *meter = &context->loudnessMeter;
+    if (out_sample_rate != NULL)
+        *out_sample_rate = meter->sampleRate;
+    if (out_file != NULL)
+        *out_file = meter->fileLoudness;
+    if (out_segments != NULL)
+        *out_segments = (const wm_loudness *)meter->segmentLoudness.bytes;
+    return meter->segmentsCount;
+}
+
+void wm_set_merge_mode(wm_context *context, wm_merge_mode mode)
+{
+    if (context != NULL)
+    {
+        context->mergeMode = mode;
+    }
+}
+
+void wm_set_io_backend(wm_context *context, wm_io_backend backend)
+{
+    if (context == NULL)
+    {
+        return;
+    }
+
+    context->ioBackend = backend;
+    if (backend != WM_IO_BACKEND_IO_URING)
+    {
+        closeIoRing(&context->ioRing);
+    }
+    context->ioRing.isUnavailable = false;
+}
+
+// Rounds a time given as a double to the nearest nanosecond
+static LabelTime secondsToLabelTime(double seconds)
+{
+    LabelTime time = {.seconds = UINT32_MAX, .nanoseconds = 0};
+    if (seconds < (double)UINT32_MAX)
+    {
+        double wholeSeconds = (double)(uint32_t)seconds;
+        uint64_t nanoseconds = (uint64_t)((seconds - wholeSeconds) * 1e9 + 0.5);
+        time.seconds = (uint32_t)wholeSeconds;
+        time.nanoseconds = (uint32_t)nanoseconds;
+        if (nanoseconds >= 1000000000u)
+        {
+            time.seconds++;
+            time.nanoseconds = 0;
+        }
+    }
+    return time;
+}
+
+wm_status wm_set_labels(wm_context *context, const wm_label *labels, size_t count)
+{
+    if ((context == NULL) || ((labels == NULL) && (count > 0)))
+    {
+        return WM_ERROR_INVALID_ARGUMENT;
+    }
+    if (count > UINT32_MAX)
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Too many labels, a cue chunk holds at most %u", UINT32_MAX);
+    }
+
+    PhaseTimer phaseTimer;
+    startPhase(&phaseTimer);
+
+    LabelInfo *labelInfo = &context->labelInfo;
+    clearLabelInfo(labelInfo);
+
+    size_t textSize = 0;
+    for (size_t i = 0; i < count; i++)
+    {
+        if (!(labels[i].start_time >= 0) || ((labels[i].text == NULL) && (labels[i].text_length > 0)))
+        {
+            return setError(context, WM_ERROR_INVALID_ARGUMENT, "Label %zu has a negative start time or no text", i + 1);
+        }
+        textSize += labels[i].text_length;
+    }
+
+    // Copy all the text in one go, so the caller's strings can go away as soon as we return
+    wm_status status = reserveLabelText(context, labelInfo, textSize);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    for (size_t i = 0; i < count; i++)
+    {
+        if (labels[i].text_length > 0)
+        {
+            memcpy(&labelInfo->text[labelInfo->textSize], labels[i].text, labels[i].text_length);
+        }
+        LabelTime startTime = secondsToLabelTime(labels[i].start_time);
+        LabelTime endTime = labels[i].end_time > labels[i].start_time ? secondsToLabelTime(labels[i].end_time) : startTime;
+        status = appendLabel(context, labelInfo, startTime, endTime, labelInfo->textSize, labels[i].text_length);
+        if (status != WM_OK)
+        {
+            return status;
+        }
+        labelInfo->textSize += labels[i].text_length;
+    }
+
+    endPhase(context, &phaseTimer, WM_PHASE_LABELS);
+    return WM_OK;
+}
+
+wm_status wm_parse_labels(wm_context *context, const char *buffer, size_t size)
+{
+    if ((context == NULL) || ((buffer == NULL) && (size > 0)))
+    {
+        return WM_ERROR_INVALID_ARGUMENT;
+    }
+
+    PhaseTimer phaseTimer;
+    startPhase(&phaseTimer);
+
+    clearLabelInfo(&context->labelInfo);
+    context->labelInfo.externalText = buffer;
+    wm_status status = parseLabels(context, buffer, size);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    endPhase(context, &phaseTimer, WM_PHASE_LABELS);
+    printProgress(context, "Read %u cue locations from label buffer.\n", context->labelInfo.count);
+    return WM_OK;
+}
+
+wm_status wm_read_labels(wm_context *context, int fd)
+{
+    if (context == NULL)
+    {
+        return WM_ERROR_INVALID_ARGUMENT;
+    }
+
+    printProgress(context, "Reading label file.\n");
+    PhaseTimer phaseTimer;
+    startPhase(&phaseTimer);
+
+    LabelInfo *labelInfo = &context->labelInfo;
+    clearLabelInfo(labelInfo);
+
+    wm_status status = WM_OK;
+    struct stat labelFileStat;
+    void *mapping = MAP_FAILED;
+
+    if ((fstat(fd, &labelFileStat) == 0) && S_ISREG(labelFileStat.st_mode) && (labelFileStat.st_size > 0))
+    {
+        mapping = mmap(NULL, (size_t)labelFileStat.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        context->stats.map_calls++;
+    }
+
+    if (mapping != MAP_FAILED)
+    {
+        context->stats.bytes_mapped += (uint64_t)labelFileStat.st_size;
+        madvise(mapping, (size_t)labelFileStat.st_size, MADV_SEQUENTIAL);
+        labelInfo->mappedLabelFile = (const char *)mapping;
+        labelInfo->mappedLabelFileSize = (size_t)labelFileStat.st_size;
+        labelInfo->externalText = labelInfo->mappedLabelFile;
+        status = parseLabels(context, labelInfo->mappedLabelFile, labelInfo->mappedLabelFileSize);
+    }
+    else
+    {
+        // Pipes and the like can't be mapped, so read the whole file into the arena and let the labels point there instead
+        ssize_t readBytes = 0;
+        do
+        {
+            status = reserveLabelText(context, labelInfo, 65536);
+            if (status != WM_OK)
+            {
+                return status;
+            }
+            readBytes = read(fd, &labelInfo->text[labelInfo->textSize], labelInfo->textCapacity - labelInfo->textSize);
+            countRead(context, readBytes > 0 ? (uint64_t)readBytes : 0);
+            if ((readBytes < 0) && (errno != EINTR))
+            {
+                return setError(context, WM_ERROR_IO, "Error reading label file");
+            }
+            if (readBytes > 0)
+            {
+                labelInfo->textSize += (size_t)readBytes;
+            }
+        } while (readBytes != 0);
+
+        status = parseLabels(context, labelInfo->text, labelInfo->textSize);
+    }
+
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    endPhase(context, &phaseTimer, WM_PHASE_LABELS);
+    printProgress(context, "Read %u cue locations from label file.\n", labelInfo->count);
+    return WM_OK;
+}
+
+wm_status wm_add_markers(wm_context *context, int input_fd, int output_fd)
+{
+    if (context == NULL)
+    {
+        return WM_ERROR_INVALID_ARGUMENT;
+    }
+    if ((input_fd < 0) || (output_fd < 0))
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Input and output need valid file descriptors");
+    }
+
+    WaveInput input;
+    wm_status status = openWaveInput(context, input_fd, &input);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    status = addMarkersToWaveInput(context, &input, output_fd);
+    closeWaveInput(context, &input);
+    return status;
+}
+
+wm_status wm_add_markers_from_buffer(wm_context *context, const void *wave, size_t size, int output_fd)
+{
+    if (context == NULL)
+    {
+        return WM_ERROR_INVALID_ARGUMENT;
+    }
+    if ((wave == NULL) || (output_fd < 0))
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Input needs a buffer and output a valid file descriptor");
+    }
+
+    WaveInput input = {
+        .fd = -1,
+        .bytes = (const char *)wave,
+        .size = (off_t)size,
+        .isMapped = false};
+    return addMarkersToWaveInput(context, &input, output_fd);
+}
+
+wm_status wm_add_markers_in_place(wm_context *context, int fd)
+{
+    if (context == NULL)
+    {
+        return WM_ERROR_INVALID_ARGUMENT;
+    }
+    if (fd < 0)
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Wave file needs a valid file descriptor");
+    }
+
+    WaveInput input;
+    wm_status status = openWaveInput(context, fd, &input);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    status = addMarkersToWaveInput(context, &input, -1);
+    closeWaveInput(context, &input);
+    return status;
+}
+
+wm_status wm_export_labels(wm_context *context, int input_fd, int output_fd)
+{
+    if (context == NULL)
+    {
+        return WM_ERROR_INVALID_ARGUMENT;
+    }
+    if ((input_fd < 0) || (output_fd < 0))
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Input and output need valid file descriptors");
+    }
+
+    WaveInput input;
+    wm_status status = openWaveInput(context, input_fd, &input);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    printProgress(context, "Reading input wave file.\n");
+    PhaseTimer phaseTimer;
+    startPhase(&phaseTimer);
+
+    WaveFileIndex *waveFileIndex = &context->waveFileIndex;
+    status = scanWaveFile(context, &input, waveFileIndex, true);
+    closeWaveInput(context, &input);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    endPhase(context, &phaseTimer, WM_PHASE_SCAN);
+
+    uint32_t sampleRate = littleEndianBytesToUInt32(waveFileIndex->formatChunk.sampleRate);
+    if (!waveFileIndex->hasFormatChunk || (sampleRate == 0))
+    {
+        return setError(context, WM_ERROR_BAD_WAVE, "Input file did not contain any format data");
+    }
+
+    startPhase(&phaseTimer);
+
+    size_t exportSize = 0;
+    status = formatExportedLabels(context, sampleRate, &exportSize);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    endPhase(context, &phaseTimer, WM_PHASE_BUILD);
+    startPhase(&phaseTimer);
+
+    struct iovec vector = {.iov_base = context->exportText.bytes, .iov_len = exportSize};
+    if ((exportSize > 0) && (writeVectorsToFile(context, output_fd, &vector, 1, NULL) < 0))
+    {
+        return setError(context, WM_ERROR_IO, "Error writing label file\nError: %d", errno);
+    }
+
+    endPhase(context, &phaseTimer, WM_PHASE_WRITE);
+
+    status = syncOutputFile(context, output_fd);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    printProgress(context, "Exported %u labels.\n", context->existingMarkers.count);
+    return WM_OK;
+}
+
+const char *wm_status_string(wm_status status)
+{
+    switch (status)
+    {
+    case WM_OK:
+        return "Success";
+    case WM_ERROR_INVALID_ARGUMENT:
+        return "Invalid argument";
+    case WM_ERROR_NO_MEMORY:
+        return "Out of memory";
+    case WM_ERROR_IO:
+        return "Input/output error";
+    case WM_ERROR_NOT_WAVE:
+        return "Not a WAVE file";
+    case WM_ERROR_UNSUPPORTED_FORMAT:
+        return "Unsupported audio format";
+    case WM_ERROR_BAD_WAVE:
+        return "Malformed WAVE file";
+    case WM_ERROR_NO_LABELS:
+        return "No labels";
+    case WM_ERROR_LIMIT:
+        return "Limit exceeded";
+    }
+    return "Unknown error";
+}
+
+const char *wm_error_message(const wm_context *context)
+{
+    return context->errorMessage;
+}
+
+void wm_get_stats(const wm_context *context, wm_stats *out_stats)
+{
+    *out_stats = context->stats;
+}
+
+void wm_reset_stats(wm_context *context)
+{
+    memset(&context->stats, 0, sizeof(context->stats));
+}
+
+static wm_status addMarkersToWaveInput(wm_context *context, const WaveInput *input, int outputFd)
+{
+    wm_status status = WM_OK;
+    WaveFileIndex *waveFileIndex = &context->waveFileIndex;
+    PhaseTimer phaseTimer;
+
+    context->outputTap.chunksCount = 0;
+    context->outputTap.fileChecksum = 0;
+    context->silenceDetector.silencesCount = 0;
+    context->peakBuilder.levelsCount = 0;
+    context->loudnessMeter.hasResults = false;
+    if ((context->labelInfo.count < 1) && (context->silenceLevel == WM_SILENCE_OFF))
+    {
+        return setError(context, WM_ERROR_NO_LABELS, "Did not find any cue point locations in the label file");
+    }
+    if ((outputFd < 0) && (context->silenceLevel != WM_SILENCE_OFF))
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Silences are found while the sample data is copied, an in place update doesn't copy it");
+    }
+
+    // Index the chunks of the input file
+    printProgress(context, "Reading input wave file.\n");
+    startPhase(&phaseTimer);
+
+    status = scanWaveFile(context, input, waveFileIndex, context->mergeMode != WM_MERGE_NONE);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    endPhase(context, &phaseTimer, WM_PHASE_SCAN);
+
+    // Did we get enough data from the input file to proceed?
+
+    if ((!waveFileIndex->hasFormatChunk) || (waveFileIndex->dataChunkLocation.size == 0))
+    {
+        return setError(context, WM_ERROR_BAD_WAVE, "Input file did not contain any format data or did not contain any sample data");
+    }
+
+    printProgress(context, "Preparing new cue chunk.\n");
+    startPhase(&phaseTimer);
+
+    status = buildCueAndListChunks(context, input, waveFileIndex->formatChunk);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    endPhase(context, &phaseTimer, WM_PHASE_BUILD);
+    startPhase(&phaseTimer);
+
+    if (outputFd < 0)
+    {
+        status = writeMarkersInPlace(context, input);
+        outputFd = input->fd;
+    }
+    else
+    {
+        status = writeOutputFile(context, input, outputFd);
+    }
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    endPhase(context, &phaseTimer, WM_PHASE_WRITE);
+
+    status = syncOutputFile(context, outputFd);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    printProgress(context, "Finished.\n");
+    return WM_OK;
+}
+
+// Reads exactly size bytes from a file or pipe. Returns false if the input ends first
+static bool readStreamBytes(wm_context *context, int fd, void *out_Bytes, size_t size)
+{
+    char *position = (char *)out_Bytes;
+    while (size > 0)
+    {
+        ssize_t readBytes = read(fd, position, size);
+        countRead(context, readBytes > 0 ? (uint64_t)readBytes : 0);
+        if (readBytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return false;
+        }
+        if (readBytes == 0)
+        {
+            return false;
+        }
+        position += readBytes;
+        size -= (size_t)readBytes;
+    }
+
+    return true;
+}
+
+static wm_status writeStreamBytes(wm_context *context, StreamOutput *output, const void *bytes, size_t size)
+{
+    if (output->holding)
+    {
+        wm_status status = reserveBuffer(context, output->heldBytes, output->heldSize + size, "the start of the output");
+        if (status != WM_OK)
+        {
+            return status;
+        }
+        memcpy(output->heldBytes->bytes + output->heldSize, bytes, size);
+        output->heldSize += size;
+    }
+    else
+    {
+        struct iovec vector = {.iov_base = (void *)bytes, .iov_len = size};
+        if (writeVectorsToFile(context, output->fd, &vector, 1, NULL) < 0)
+        {
+            return setError(context, WM_ERROR_IO, "Error writing output\nError: %d", errno);
+        }
+    }
+
+    output->writtenBytes += size;
+    return WM_OK;
+}
+
+// Passes size bytes from the input through to the output
+static wm_status copyStreamBytes(wm_context *context, int inputFd, StreamOutput *output, uint64_t size)
+{
+    CopyRange range = {
+        .inputFd = inputFd,
+        .inputOffset = -1,
+        .outputFd = output->fd,
+        .outputOffset = 0,
+        .streamOutput = output,
+        .size = size};
+    return copyThroughBuffers(context, &range);
+}
+
+wm_status wm_add_markers_stream(wm_context *context, int input_fd, int output_fd)
+{
+    if (context == NULL)
+    {
+        return WM_ERROR_INVALID_ARGUMENT;
+    }
+    if ((input_fd < 0) || (output_fd < 0))
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Input and output need valid file descriptors");
+    }
+    if (context->labelInfo.count < 1)
+    {
+        return setError(context, WM_ERROR_NO_LABELS, "Did not find any cue point locations in the label file");
+    }
+    if (context->mergeMode != WM_MERGE_NONE)
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Existing markers can't be merged while streaming, they may come after the data chunk");
+    }
+    if (context->silenceLevel != WM_SILENCE_OFF)
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Silences can't be marked while streaming, the header would have to be written after the sample data");
+    }
+    if ((context->peakSamplesPerPixel > 0) || context->measuresLoudness)
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Peaks and loudness aren't measured while streaming");
+    }
+    if (context->snapMode != WM_SNAP_OFF)
+    {
+        return setError(context, WM_ERROR_INVALID_ARGUMENT, "Labels can't be snapped while streaming, the markers are written before the sample data is read");
+    }
+    context->outputTap.chunksCount = 0;
+    context->outputTap.fileChecksum = 0;
+
+    wm_status status = WM_OK;
+    int inputFd = input_fd;
+    StreamOutput output = {
+        .fd = output_fd,
+        .holding = true,
+        .heldBytes = &context->streamHeldBytes,
+        .heldSize = 0,
+        .writtenBytes = 0};
+    PhaseTimer phaseTimer;
+
+    // Reading the input and writing the output happen together, so apart from building the chunks the whole pass counts as writing
+    printProgress(context, "Reading input wave stream.\n");
+    startPhase(&phaseTimer);
+
+    // Get & check the input file header
+    WaveHeader waveHeader;
+    if (!readStreamBytes(context, inputFd, &waveHeader, sizeof(WaveHeader)))
+    {
+        return setError(context, WM_ERROR_BAD_WAVE, "Error reading input file");
+    }
+
+    bool isRF64 = (strncmp(waveHeader.chunkID, "RF64", 4) == 0) || (strncmp(waveHeader.chunkID, "BW64", 4) == 0);
+    if ((strncmp(waveHeader.chunkID, "RIFF", 4) != 0) && !isRF64)
+    {
+        return setError(context, WM_ERROR_NOT_WAVE, "Input file is not a RIFF file");
+    }
+
+    if (strncmp(waveHeader.riffType, "WAVE", 4) != 0)
+    {
+        return setError(context, WM_ERROR_NOT_WAVE, "Input file is not a WAVE file");
+    }
+
+    uint64_t riffSize = littleEndianBytesToUInt32(waveHeader.dataSize);
+    uint64_t remainingRiffSize = 0; // The bytes of the chunks still to come
+    uint64_t sampleDataSize64 = 0;
+    DataSize64Chunk dataSize64Chunk;
+    uint32_t dataSize64ChunkDataSize = 0;
+    char *dataSize64ChunkData = NULL;
+    ChunkSize64 *chunkSizeTable = NULL;
+    uint32_t chunkSizeTableLength = 0;
+
+    // In RF64 files the real sizes are in the ds64 chunk, which must be the first chunk.
+    // It is kept to be written out again with the new size of the file
+    if (isRF64)
+    {
+        if (!readStreamBytes(context, inputFd, &dataSize64Chunk, 8) || (strncmp(dataSize64Chunk.chunkID, "ds64", 4) != 0))
+        {
+            return setError(context, WM_ERROR_BAD_WAVE, "Input file is an RF64 file without a ds64 chunk");
+        }
+
+        dataSize64ChunkDataSize = littleEndianBytesToUInt32(dataSize64Chunk.chunkDataSize);
+        size_t dataSize64ChunkPaddedSize = (size_t)dataSize64ChunkDataSize + (dataSize64ChunkDataSize % 2);
+        status = reserveBuffer(context, &context->dataSize64Bytes, dataSize64ChunkPaddedSize, "the ds64 chunk");
+        if (status != WM_OK)
+        {
+            return status;
+        }
+        dataSize64ChunkData = context->dataSize64Bytes.bytes;
+        if ((dataSize64ChunkDataSize < sizeof(DataSize64Chunk) - 8) || !readStreamBytes(context, inputFd, dataSize64ChunkData, dataSize64ChunkPaddedSize))
+        {
+            return setError(context, WM_ERROR_BAD_WAVE, "Error reading ds64 chunk of input file");
+        }
+        memcpy(dataSize64Chunk.riffSize, dataSize64ChunkData, sizeof(DataSize64Chunk) - 8);
+
+        riffSize = littleEndianBytesToUInt64(dataSize64Chunk.riffSize);
+        sampleDataSize64 = littleEndianBytesToUInt64(dataSize64Chunk.dataSize);
+        chunkSizeTable = (ChunkSize64 *)(dataSize64ChunkData + sizeof(DataSize64Chunk) - 8);
+        chunkSizeTableLength = littleEndianBytesToUInt32(dataSize64Chunk.tableLength);
+        if (chunkSizeTableLength > (dataSize64ChunkDataSize - (sizeof(DataSize64Chunk) - 8)) / sizeof(ChunkSize64))
+        {
+            return setError(context, WM_ERROR_BAD_WAVE, "Error reading ds64 chunk of input file");
+        }
+
+        if (riffSize >= sizeof(waveHeader.riffType) + 8 + dataSize64ChunkPaddedSize)
+        {
+            remainingRiffSize = riffSize - sizeof(waveHeader.riffType) - 8 - dataSize64ChunkPaddedSize;
+        }
+        printProgress(context, "Got ds64 Chunk\n");
+    }
+    else if ((riffSize != UINT32_MAX) && (riffSize >= sizeof(waveHeader.riffType)))
+    {
+        remainingRiffSize = riffSize - sizeof(waveHeader.riffType);
+    }
+
+    // Encoders writing to a pipe can't go back to fill in the sizes, but the size of the output has to be known before the first byte of it is written
+    if (remainingRiffSize == 0)
+    {
+        return setError(context, WM_ERROR_BAD_WAVE, "Input stream does not give the size of the file in its header, streaming needs it to be filled in");
+    }
+
+    FormatChunk formatChunk;
+    bool hasFormatChunk = false;
+    uint64_t outputRiffSize = 0;
+    bool writeRF64 = isRF64;
+
+    while (remainingRiffSize >= 8)
+    {
+        char chunkHeader[8];
+        if (!readStreamBytes(context, inputFd, chunkHeader, sizeof(chunkHeader)))
+        {
+            return setError(context, WM_ERROR_BAD_WAVE, "Input ended before the end of the RIFF data");
+        }
+        remainingRiffSize -= sizeof(chunkHeader);
+
+        char *chunkID = &chunkHeader[0];
+        uint64_t chunkDataSize = littleEndianBytesToUInt32(&chunkHeader[4]);
+        bool isDataChunk = (strncmp(chunkID, "data", 4) == 0);
+
+        // An RF64 chunk too big for its size field has its real size in the ds64 chunk
+        if (isRF64 && (chunkDataSize == UINT32_MAX))
+        {
+            if (isDataChunk)
+            {
+                chunkDataSize = sampleDataSize64;
+            }
+            else
+            {
+                uint32_t i = 0;
+                while ((i < chunkSizeTableLength) && (strncmp(chunkSizeTable[i].chunkID, chunkID, 4) != 0))
+                {
+                    i++;
+                }
+                if (i == chunkSizeTableLength)
+                {
+                    return setError(context, WM_ERROR_BAD_WAVE, "Chunk \'%c%c%c%c\' has no size in the ds64 chunk", chunkID[0], chunkID[1], chunkID[2], chunkID[3]);
+                }
+                chunkDataSize = littleEndianBytesToUInt64(chunkSizeTable[i].chunkSize);
+            }
+        }
+
+        // The padding byte of the last chunk is sometimes left out
+        uint64_t chunkPaddedSize = chunkDataSize + (chunkDataSize % 2);
+        if (chunkPaddedSize == remainingRiffSize + 1)
+        {
+            chunkPaddedSize = chunkDataSize;
+        }
+        if (chunkPaddedSize > remainingRiffSize)
+        {
+            return setError(context, WM_ERROR_BAD_WAVE, "Chunk \'%c%c%c%c\' runs past the end of the RIFF data", chunkID[0], chunkID[1], chunkID[2], chunkID[3]);
+        }
+        remainingRiffSize -= chunkPaddedSize;
+
+        // Chunks are passed through as they come, apart from the few bytes we need to look at first
+        char chunkStart[sizeof(FormatChunk) - 8];
+        size_t chunkStartSize = 0;
+
+        if (strncmp(chunkID, "fmt ", 4) == 0)
+        {
+            chunkStartSize = sizeof(chunkStart);
+            if ((chunkDataSize < chunkStartSize) || !readStreamBytes(context, inputFd, chunkStart, chunkStartSize))
+            {
+                return setError(context, WM_ERROR_BAD_WAVE, "Error reading input file");
+            }
+            memcpy(&formatChunk, chunkHeader, sizeof(chunkHeader));
+            memcpy(formatChunk.compressionCode, chunkStart, chunkStartSize);
+            hasFormatChunk = true;
+
+            uint16_t compressionCode = littleEndianBytesToUInt16(formatChunk.compressionCode);
+            if (compressionCode != WAVE_FORMAT_PCM && compressionCode != WAVE_FORMAT_IEEE_FLOAT)
+            {
+                return setError(context, WM_ERROR_UNSUPPORTED_FORMAT, "Compressed audio formats are not supported");
+            }
+
+            printProgress(context, "Got Format Chunk\n");
+        }
+
+        else if (isDataChunk)
+        {
+            if (!hasFormatChunk || (chunkDataSize == 0))
+            {
+                return setError(context, WM_ERROR_BAD_WAVE, "Input file did not contain any format data or did not contain any sample data");
+            }
+            if (!output.holding)
+            {
+                return setError(context, WM_ERROR_BAD_WAVE, "Input file has more than one data chunk");
+            }
+
+            printProgress(context, "Got Data Chunk\nPreparing new cue chunk.\n");
+            endPhase(context, &phaseTimer, WM_PHASE_WRITE);
+            startPhase(&phaseTimer);
+
+            // Now that the format is known the labels can be turned into cue points, and with them comes the size of the output
+            status = buildCueAndListChunks(context, NULL, formatChunk);
+            if (status != WM_OK)
+            {
+                return status;
+            }
+            endPhase(context, &phaseTimer, WM_PHASE_BUILD);
+            startPhase(&phaseTimer);
+
+            // The input is passed through unchanged, padded to an even length, and followed by the new cue and adtl chunks
+            outputRiffSize = riffSize + (riffSize % 2);
+            outputRiffSize += 12 + sizeof(CuePoint) * littleEndianBytesToUInt32(context->cueChunk.cuePointsCount);
+            outputRiffSize += 12 + context->listChunkSize + (context->listChunkSize % 2);
+
+            // A RIFF input that grows past 4GB gets a ds64 chunk in front of the chunks it already has
+            DataSize64Chunk newDataSize64Chunk;
+            bool addDataSize64Chunk = !isRF64 && (outputRiffSize + sizeof(DataSize64Chunk) >= UINT32_MAX);
+            if (addDataSize64Chunk)
+            {
+                writeRF64 = true;
+                outputRiffSize += sizeof(DataSize64Chunk);
+
+                memcpy(waveHeader.chunkID, "RF64", 4);
+                memcpy(newDataSize64Chunk.chunkID, "ds64", 4);
+                uint32ToLittleEndianBytes(sizeof(DataSize64Chunk) - 8, newDataSize64Chunk.chunkDataSize);
+                uint64ToLittleEndianBytes(chunkDataSize, newDataSize64Chunk.dataSize);
+                uint16_t blockAlign = littleEndianBytesToUInt16(formatChunk.blockAlign);
+                uint64ToLittleEndianBytes(blockAlign > 0 ? chunkDataSize / blockAlign : 0, newDataSize64Chunk.sampleCount);
+                uint32ToLittleEndianBytes(0, newDataSize64Chunk.tableLength);
+            }
+
+            struct iovec vectors[4];
+            int vectorsCount = 0;
+            vectors[vectorsCount++] = (struct iovec){.iov_base = &waveHeader, .iov_len = sizeof(WaveHeader)};
+            if (writeRF64)
+            {
+                uint32ToLittleEndianBytes(UINT32_MAX, waveHeader.dataSize);
+                if (addDataSize64Chunk)
+                {
+                    uint64ToLittleEndianBytes(outputRiffSize, newDataSize64Chunk.riffSize);
+                    vectors[vectorsCount++] = (struct iovec){.iov_base = &newDataSize64Chunk, .iov_len = sizeof(DataSize64Chunk)};
+                }
+                else
+                {
+                    uint64ToLittleEndianBytes(outputRiffSize, dataSize64Chunk.riffSize);
+                    memcpy(dataSize64ChunkData, dataSize64Chunk.riffSize, sizeof(dataSize64Chunk.riffSize));
+                    vectors[vectorsCount++] = (struct iovec){.iov_base = &dataSize64Chunk, .iov_len = 8};
+                    vectors[vectorsCount++] = (struct iovec){.iov_base = dataSize64ChunkData, .iov_len = (size_t)dataSize64ChunkDataSize + (dataSize64ChunkDataSize % 2)};
+                }
+                uint32ToLittleEndianBytes(UINT32_MAX, &chunkHeader[4]);
+            }
+            else
+            {
+                uint32ToLittleEndianBytes((uint32_t)outputRiffSize, waveHeader.dataSize);
+            }
+
+            if (writeRF64)
+            {
+                printProgress(context, "Output is larger than 4GB, writing an %.4s file.\n", waveHeader.chunkID);
+            }
+            printProgress(context, "Writing output stream.\n");
+
+            // Write the header, then everything that was held back
+            for (int i = 0; i < vectorsCount; i++)
+            {
+                output.writtenBytes += vectors[i].iov_len;
+            }
+            if (output.heldSize > 0)
+            {
+                vectors[vectorsCount++] = (struct iovec){.iov_base = output.heldBytes->bytes, .iov_len = output.heldSize};
+            }
+            if (writeVectorsToFile(context, output.fd, vectors, vectorsCount, NULL) < 0)
+            {
+                return setError(context, WM_ERROR_IO, "Error writing output\nError: %d", errno);
+            }
+            output.holding = false;
+        }
+
+        else if (strncmp(chunkID, "cue ", 4) == 0)
+        {
+            // Existing markers can't be left out without changing the size we promised, so they are passed on as JUNK
+            memcpy(chunkID, "JUNK", 4);
+            printProgress(context, "Found Existing Cue Chunk\n");
+        }
+
+        else if ((strncmp(chunkID, "LIST", 4) == 0) && (chunkDataSize >= 4))
+        {
+            chunkStartSize = 4;
+            if (!readStreamBytes(context, inputFd, chunkStart, chunkStartSize))
+            {
+                return setError(context, WM_ERROR_BAD_WAVE, "Input ended before the end of the RIFF data");
+            }
+            if (strncmp(chunkStart, "adtl", 4) == 0)
+            {
+                memcpy(chunkID, "JUNK", 4);
+                printProgress(context, "Found Existing Label Chunk\n");
+            }
+        }
+
+        else
+        {
+            printProgress(context, "Found chunk type \'%c%c%c%c\', size: %llu bytes\n", chunkID[0], chunkID[1], chunkID[2], chunkID[3], (unsigned long long)chunkDataSize);
+        }
+
+        status = writeStreamBytes(context, &output, chunkHeader, sizeof(chunkHeader));
+        if (status == WM_OK)
+            status = writeStreamBytes(context, &output, chunkStart, chunkStartSize);
+        if (status == WM_OK)
+            status = copyStreamBytes(context, inputFd, &output, chunkPaddedSize - chunkStartSize);
+        if (status != WM_OK)
+        {
+            return status;
+        }
+    }
+
+    if (output.holding)
+    {
+        return setError(context, WM_ERROR_BAD_WAVE, "Input file did not contain any format data or did not contain any sample data");
+    }
+
+    // Whatever is left of the RIFF data is too short to be a chunk, but it was counted in the size
+    status = copyStreamBytes(context, inputFd, &output, remainingRiffSize);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    // The new chunks go at the end
+    struct iovec vectors[1 + CUE_AND_LIST_VECTORS_COUNT];
+    int vectorsCount = 0;
+    if ((output.writtenBytes % 2) != 0)
+    {
+        vectors[vectorsCount++] = (struct iovec){.iov_base = "\0", .iov_len = 1};
+    }
+    vectorsCount += fillCueAndListVectors(&vectors[vectorsCount], &context->cueChunk, &context->listChunk, context->listChunkSize);
+    for (int i = 0; i < vectorsCount; i++)
+    {
+        output.writtenBytes += vectors[i].iov_len;
+    }
+    if (writeVectorsToFile(context, output.fd, vectors, vectorsCount, NULL) < 0)
+    {
+        return setError(context, WM_ERROR_IO, "Error writing output\nError: %d", errno);
+    }
+
+    if (output.writtenBytes != outputRiffSize + 8)
+    {
+        return setError(context, WM_ERROR_BAD_WAVE, "Output size does not match the size written in its header");
+    }
+
+    endPhase(context, &phaseTimer, WM_PHASE_WRITE);
+
+    status = syncOutputFile(context, output.fd);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    printProgress(context, "Finished.\n");
+    return WM_OK;
+}
+
+static wm_status syncOutputFile(wm_context *context, int outputFd)
+{
+    if (!context->syncOutput)
+    {
+        return WM_OK;
+    }
+
+    PhaseTimer phaseTimer;
+    startPhase(&phaseTimer);
+
+    context->stats.sync_calls++;
+    // Pipes and terminals have nothing to sync
+    if ((fsync(outputFd) < 0) && (errno != EINVAL))
+    {
+        return setError(context, WM_ERROR_IO, "Error syncing output file\nError: %d", errno);
+    }
+
+    endPhase(context, &phaseTimer, WM_PHASE_FSYNC);
+    return WM_OK;
+}
+
+static bool isOutputTapNeeded(const wm_context *context)
+{
+    return (context->checksumMode != WM_CHECKSUM_NONE) || (context->silenceLevel != WM_SILENCE_OFF) || (context->peakSamplesPerPixel > 0) || context->measuresLoudness;
+}
+
+static wm_status startOutputTap(wm_context *context, FormatChunk formatChunk, size_t chunksCount)
+{
+    OutputTap *tap = &context->outputTap;
+    tap->isActive = false;
+    tap->fileChecksum = 0;
+    tap->chunksCount = 0;
+    if (!isOutputTapNeeded(context))
+    {
+        return WM_OK;
+    }
+
+    if (context->checksumMode != WM_CHECKSUM_NONE)
+    {
+        wm_status status = reserveBuffer(context, &tap->chunks, sizeof(wm_chunk_checksum) * chunksCount, "chunk checksums");
+        if (status != WM_OK)
+        {
+            return status;
+        }
+    }
+
+    tap->analysesSamples = (context->silenceLevel != WM_SILENCE_OFF) || (context->peakSamplesPerPixel > 0) || context->measuresLoudness;
+    if (tap->analysesSamples && !setUpSampleDecoder(&context->sampleDecoder, formatChunk))
+    {
+        return setError(context, WM_ERROR_UNSUPPORTED_FORMAT, "Samples can only be measured in 8 to 32 bit PCM and 32 or 64 bit float");
+    }
+    if (context->silenceLevel != WM_SILENCE_OFF)
+    {
+        startSilenceDetection(context, formatChunk);
+    }
+    if (context->peakSamplesPerPixel > 0)
+    {
+        wm_status status = startPeaks(context, formatChunk);
+        if (status != WM_OK)
+        {
+            return status;
+        }
+    }
+    if (context->measuresLoudness)
+    {
+        wm_status status = startLoudness(context, formatChunk);
+        if (status != WM_OK)
+        {
+            return status;
+        }
+    }
+
+    tap->isActive = true;
+    tap->position = 0;
+    tap->isDataChunk = false;
+    tap->chunkHeaderSize = 0;
+    tap->chunkDataLeft = 0;
+    tap->chunkPaddingLeft = 0;
+    tap->expectedChunkSize = 0;
+    return WM_OK;
+}
+
+static void tapOutputBytes(wm_context *context, const void *bytes, size_t size)
+{
+    OutputTap *tap = &context->outputTap;
+    if (!tap->isActive || (size == 0))
+    {
+        return;
+    }
+
+    bool isTakingChecksums = (context->checksumMode != WM_CHECKSUM_NONE);
+    if (isTakingChecksums)
+    {
+        tap->fileChecksum = updateCrc32c(tap->fileChecksum, bytes, size);
+    }
+
+    // The RIFF header isn't part of any chunk
+    const char *position = (const char *)bytes;
+    if (tap->position < sizeof(WaveHeader))
+    {
+        size_t headerSize = sizeof(WaveHeader) - (size_t)tap->position < size ? sizeof(WaveHeader) - (size_t)tap->position : size;
+        position += headerSize;
+        size -= headerSize;
+        tap->position += headerSize;
+    }
+
+    wm_chunk_checksum *chunks = (wm_chunk_checksum *)tap->chunks.bytes;
+    size_t chunksCapacity = tap->chunks.capacity / sizeof(wm_chunk_checksum);
+    while (size > 0)
+    {
+        size_t pieceSize;
+        if (tap->chunkDataLeft > 0)
+        {
+            pieceSize = tap->chunkDataLeft < size ? (size_t)tap->chunkDataLeft : size;
+            if (isTakingChecksums)
+            {
+                wm_chunk_checksum *chunk = &chunks[tap->chunksCount - 1];
+                chunk->crc32c = updateCrc32c(chunk->crc32c, position, pieceSize);
+            }
+            if (tap->isDataChunk && tap->analysesSamples)
+            {
+                analyseSampleBytes(context, position, pieceSize);
+            }
+            tap->chunkDataLeft -= pieceSize;
+        }
+        else if (tap->chunkPaddingLeft > 0)
+        {
+            pieceSize = 1;
+            tap->chunkPaddingLeft = 0;
+        }
+        else
+        {
+            pieceSize = sizeof(tap->chunkHeader) - tap->chunkHeaderSize < size ? sizeof(tap->chunkHeader) - tap->chunkHeaderSize : size;
+            memcpy(&tap->chunkHeader[tap->chunkHeaderSize], position, pieceSize);
+            tap->chunkHeaderSize += (uint8_t)pieceSize;
+            if (tap->chunkHeaderSize == sizeof(tap->chunkHeader))
+            {
+                uint64_t chunkDataSize = littleEndianBytesToUInt32(&tap->chunkHeader[4]);
+                if ((chunkDataSize == UINT32_MAX) && (tap->expectedChunkSize > 0))
+                {
+                    chunkDataSize = tap->expectedChunkSize;
+                }
+                tap->chunkHeaderSize = 0;
+                tap->chunkDataLeft = chunkDataSize;
+                tap->chunkPaddingLeft = chunkDataSize % 2;
+                tap->isDataChunk = (strncmp(tap->chunkHeader, "data", 4) == 0);
+
+                // Every chunk the output can have was counted up front, so this only stops checksumming chunks of a broken output
+                if (isTakingChecksums && (tap->chunksCount == chunksCapacity))
+                {
+                    tap->isActive = false;
+                    return;
+                }
+                if (isTakingChecksums)
+                {
+                    wm_chunk_checksum *chunk = &chunks[tap->chunksCount++];
+                    memcpy(chunk->chunk_id, tap->chunkHeader, 4);
+                    chunk->size = chunkDataSize;
+                    chunk->crc32c = 0;
+                }
+            }
+        }
+        position += pieceSize;
+        size -= pieceSize;
+        tap->position += pieceSize;
+    }
+}
+
+static void tapOutputVectors(wm_context *context, const struct iovec *vectors, int vectorsCount)
+{
+    for (int i = 0; i < vectorsCount; i++)
+    {
+        tapOutputBytes(context, vectors[i].iov_base, vectors[i].iov_len);
+    }
+}
+
+static void retapOutputBytes(wm_context *context, uint64_t offset, const void *oldBytes, const void *newBytes, size_t size, size_t chunkIndex, uint64_t chunkBytesAfter)
+{
+    OutputTap *tap = &context->outputTap;
+    if (context->checksumMode == WM_CHECKSUM_NONE)
+    {
+        return;
+    }
+
+    // A CRC is linear apart from its conditioning, which is the same for bytes of the same length, so the change to the checksums
+    // is the CRC of the change to the bytes pushed along by however many bytes follow them
+    uint32_t change = updateCrc32c(0, oldBytes, size) ^ updateCrc32c(0, newBytes, size);
+    tap->fileChecksum ^= shiftCrc32c(change, tap->position - offset - size);
+    if (chunkIndex < tap->chunksCount)
+    {
+        wm_chunk_checksum *chunks = (wm_chunk_checksum *)tap->chunks.bytes;
+        chunks[chunkIndex].crc32c ^= shiftCrc32c(change, chunkBytesAfter);
+    }
+}
+
+static bool setUpSampleDecoder(SampleDecoder *decoder, FormatChunk formatChunk)
+{
+    uint16_t blockAlign = littleEndianBytesToUInt16(formatChunk.blockAlign);
+    decoder->channelsCount = littleEndianBytesToUInt16(formatChunk.numberOfChannels);
+    decoder->sampleSize = decoder->channelsCount > 0 ? blockAlign / decoder->channelsCount : 0;
+    decoder->isFloat = (littleEndianBytesToUInt16(formatChunk.compressionCode) == WAVE_FORMAT_IEEE_FLOAT);
+    decoder->partialSampleSize = 0;
+
+    bool isSupported = decoder->isFloat ? ((decoder->sampleSize == 4) || (decoder->sampleSize == 8)) : ((decoder->sampleSize >= 1) && (decoder->sampleSize <= 4));
+    if (!isSupported || (decoder->sampleSize * decoder->channelsCount != blockAlign))
+    {
+        decoder->sampleSize = 0;
+        return false;
+    }
+    return true;
+}
+
+// Turns count samples of sampleSize bytes into floats from -1 to 1
+static void decodeSamples(const SampleDecoder *decoder, const uint8_t *bytes, size_t count, float *out_Samples)
+{
+    switch (decoder->isFloat ? -decoder->sampleSize : decoder->sampleSize)
+    {
+    case 1: // 8 bit samples are unsigned
+        for (size_t i = 0; i < count; i++)
+            out_Samples[i] = ((float)bytes[i] - 128.0f) * (1.0f / 128.0f);
+        break;
+    case 2:
+    {
+        // x86 is little endian, so the samples can be loaded as they are
+        size_t i = 0;
+#if defined(__AVX2__)
+        const __m256 scale = _mm256_set1_ps(1.0f / 32768.0f);
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256i values = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)&bytes[2 * i]));
+            _mm256_storeu_ps(&out_Samples[i], _mm256_mul_ps(_mm256_cvtepi32_ps(values), scale));
+        }
+#elif defined(__SSE2__)
+        const __m128 scale = _mm_set1_ps(1.0f / 32768.0f);
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128i values = _mm_loadl_epi64((const __m128i *)&bytes[2 * i]);
+            values = _mm_srai_epi32(_mm_unpacklo_epi16(values, values), 16);
+            _mm_storeu_ps(&out_Samples[i], _mm_mul_ps(_mm_cvtepi32_ps(values), scale));
+        }
+#endif
+        for (; i < count; i++)
+            out_Samples[i] = (float)(int16_t)(bytes[2 * i] | (bytes[2 * i + 1] << 8)) * (1.0f / 32768.0f);
+        break;
+    }
+    case 3:
+        for (size_t i = 0; i < count; i++)
+            out_Samples[i] = (float)((int32_t)((uint32_t)bytes[3 * i] << 8 | (uint32_t)bytes[3 * i + 1] << 16 | (uint32_t)bytes[3 * i + 2] << 24) >> 8) * (1.0f / 8388608.0f);
+        break;
+    case 4:
+        for (size_t i = 0; i < count; i++)
+            out_Samples[i] = (float)(int32_t)((uint32_t)bytes[4 * i] | (uint32_t)bytes[4 * i + 1] << 8 | (uint32_t)bytes[4 * i + 2] << 16 | (uint32_t)bytes[4 * i + 3] << 24) * (1.0f / 2147483648.0f);
+        break;
+    case -4:
+        for (size_t i = 0; i < count; i++)
+        {
+            uint32_t bits = (uint32_t)bytes[4 * i] | (uint32_t)bytes[4 * i + 1] << 8 | (uint32_t)bytes[4 * i + 2] << 16 | (uint32_t)bytes[4 * i + 3] << 24;
+            memcpy(&out_Samples[i], &bits, 4);
+        }
+        break;
+    case -8:
+        for (size_t i = 0; i < count; i++)
+        {
+            uint64_t bits = (uint64_t)littleEndianBytesToUInt32((char *)&bytes[8 * i]) | (uint64_t)littleEndianBytesToUInt32((char *)&bytes[8 * i + 4]) << 32;
+            double sample;
+            memcpy(&sample, &bits, 8);
+            out_Samples[i] = (float)sample;
+        }
+        break;
+    }
+}
+
+static void analyseDecodedSamples(wm_context *context, const float *samples, size_t count)
+{
+    if (context->silenceLevel != WM_SILENCE_OFF)
+    {
+        detectSilences(context, samples, count);
+    }
+    if (context->peakSamplesPerPixel > 0)
+    {
+        takePeaks(context, samples, count);
+    }
+    if (context->measuresLoudness)
+    {
+        measureLoudness(context, samples, count);
+    }
+}
+
+static void analyseSampleBytes(wm_context *context, const char *bytes, size_t size)
+{
+    SampleDecoder *decoder = &context->sampleDecoder;
+    if (decoder->sampleSize == 0)
+    {
+        return;
+    }
+
+    // Finish the sample the last buffer cut off
+    if (decoder->partialSampleSize > 0)
+    {
+        size_t missingSize = (size_t)(decoder->sampleSize - decoder->partialSampleSize);
+        missingSize = missingSize < size ? missingSize : size;
+        memcpy(&decoder->partialSample[decoder->partialSampleSize], bytes, missingSize);
+        decoder->partialSampleSize += (uint8_t)missingSize;
+        bytes += missingSize;
+        size -= missingSize;
+        if (decoder->partialSampleSize < decoder->sampleSize)
+        {
+            return;
+        }
+        decodeSamples(decoder, (const uint8_t *)decoder->partialSample, 1, decoder->samples);
+        analyseDecodedSamples(context, decoder->samples, 1);
+        decoder->partialSampleSize = 0;
+    }
+
+    size_t samplesCount = size / decoder->sampleSize;
+    while (samplesCount > 0)
+    {
+        size_t blockCount = samplesCount < DECODED_SAMPLES_COUNT ? samplesCount : DECODED_SAMPLES_COUNT;
+        decodeSamples(decoder, (const uint8_t *)bytes, blockCount, decoder->samples);
+        analyseDecodedSamples(context, decoder->samples, blockCount);
+        bytes += blockCount * decoder->sampleSize;
+        size -= blockCount * decoder->sampleSize;
+        samplesCount -= blockCount;
+    }
+
+    memcpy(decoder->partialSample, bytes, size);
+    decoder->partialSampleSize = (uint8_t)size;
+}
+
+static void startSilenceDetection(wm_context *context, FormatChunk formatChunk)
+{
+    SilenceDetector *detector = &context->silenceDetector;
+    uint32_t sampleRate = littleEndianBytesToUInt32(formatChunk.sampleRate);
+    uint32_t windowFrames = sampleRate / (1000 / SILENCE_WINDOW_MILLISECONDS);
+
+    detector->channelsCount = context->sampleDecoder.channelsCount;
+    detector->windowSamples = (windowFrames > 0 ? windowFrames : 1) * detector->channelsCount;
+    detector->windowSamplesLeft = detector->windowSamples;
+    detector->windowPeak = 0.0f;
+    detector->windowSumSquares = 0.0;
+    detector->windowStartFrame = 0;
+    detector->threshold = (float)pow(10.0, context->silenceThresholdDb / 20.0);
+    detector->minFrames = (uint64_t)(context->silenceMinSeconds * sampleRate + 0.5);
+    detector->isInSilence = false;
+    detector->silencesCount = 0;
+    detector->status = WM_OK;
+}
+
+static void addSilence(wm_context *context, uint64_t startFrame, uint64_t endFrame)
+{
+    SilenceDetector *detector = &context->silenceDetector;
+    if ((endFrame - startFrame < detector->minFrames) || (detector->status != WM_OK))
+    {
+        return;
+    }
+
+    detector->status = reserveBuffer(context, &detector->silences, sizeof(Silence) * ((size_t)detector->silencesCount + 1), "silences");
+    if (detector->status == WM_OK)
+    {
+        Silence *silence = &((Silence *)detector->silences.bytes)[detector->silencesCount++];
+        silence->startFrame = startFrame;
+        silence->endFrame = endFrame;
+    }
+}
+
+// Decides whether the window of samplesCount samples that just ended is silent, and starts the next one
+static void endSilenceWindow(wm_context *context, uint32_t samplesCount)
+{
+    SilenceDetector *detector = &context->silenceDetector;
+    bool isSilent = (context->silenceLevel == WM_SILENCE_PEAK) ? (detector->windowPeak < detector->threshold)
+                                                               : (detector->windowSumSquares < (double)detector->threshold * detector->threshold * samplesCount);
+    if (isSilent && !detector->isInSilence)
+    {
+        detector->isInSilence = true;
+        detector->silenceStartFrame = detector->windowStartFrame;
+    }
+    else if (!isSilent && detector->isInSilence)
+    {
+        detector->isInSilence = false;
+        addSilence(context, detector->silenceStartFrame, detector->windowStartFrame);
+    }
+
+    detector->windowStartFrame += samplesCount / detector->channelsCount;
+    detector->windowSamplesLeft = detector->windowSamples;
+    detector->windowPeak = 0.0f;
+    detector->windowSumSquares = 0.0;
+}
+
+static void detectSilences(wm_context *context, const float *samples, size_t count)
+{
+    SilenceDetector *detector = &context->silenceDetector;
+    while (count > 0)
+    {
+        size_t windowCount = count < detector->windowSamplesLeft ? count : detector->windowSamplesLeft;
+        measureSamples(samples, windowCount, &detector->windowPeak, &detector->windowSumSquares);
+        samples += windowCount;
+        count -= windowCount;
+        detector->windowSamplesLeft -= (uint32_t)windowCount;
+        if (detector->windowSamplesLeft == 0)
+        {
+            endSilenceWindow(context, detector->windowSamples);
+        }
+    }
+}
+
+static wm_status finishSilenceDetection(wm_context *context)
+{
+    SilenceDetector *detector = &context->silenceDetector;
+    uint32_t lastWindowSamples = detector->windowSamples - detector->windowSamplesLeft;
+    if (lastWindowSamples >= detector->channelsCount)
+    {
+        endSilenceWindow(context, lastWindowSamples);
+    }
+    if (detector->isInSilence)
+    {
+        detector->isInSilence = false;
+        addSilence(context, detector->silenceStartFrame, detector->windowStartFrame);
+    }
+    if (detector->status != WM_OK)
+    {
+        return detector->status;
+    }
+
+    printProgress(context, "Found %u silences.\n", detector->silencesCount);
+    return WM_OK;
+}
+
+static void resetPeakAccumulators(PeakAccumulator *accumulators, uint16_t channelsCount)
+{
+    for (uint16_t channel = 0; channel < channelsCount; channel++)
+    {
+        accumulators[channel].min = INFINITY;
+        accumulators[channel].max = -INFINITY;
+        accumulators[channel].sumSquares = 0.0;
+    }
+}
+
+static wm_status startPeaks(wm_context *context, FormatChunk formatChunk)
+{
+    PeakBuilder *builder = &context->peakBuilder;
+    builder->channelsCount = context->sampleDecoder.channelsCount;
+    builder->channel = 0;
+    builder->framesLeft = context->peakSamplesPerPixel;
+    builder->sampleRate = littleEndianBytesToUInt32(formatChunk.sampleRate);
+    builder->status = WM_OK;
+
+    wm_status status = reserveBuffer(context, &builder->accumulators, sizeof(PeakAccumulator) * builder->channelsCount * (size_t)context->peakLevelsCount, "peaks");
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    for (int level = 0; level < context->peakLevelsCount; level++)
+    {
+        builder->levels[level].framesPerPeak = context->peakSamplesPerPixel << level;
+        builder->levels[level].peakFrames = 0;
+        builder->levels[level].peaksCount = 0;
+        resetPeakAccumulators(&((PeakAccumulator *)builder->accumulators.bytes)[level * builder->channelsCount], builder->channelsCount);
+    }
+    builder->levelsCount = context->peakLevelsCount;
+    return WM_OK;
+}
+
+static int16_t toPeakValue(float sample)
+{
+    float value = sample * 32767.0f;
+    return value >= 32767.0f ? 32767 : (value <= -32768.0f ? -32768 : (int16_t)lrintf(value));
+}
+
+// Stores the current peak of a level, adds it to the peak of the next level, and stores that too if it now has both halves
+static void completePeak(wm_context *context, int level)
+{
+    PeakBuilder *builder = &context->peakBuilder;
+    PeakLevel *peakLevel = &builder->levels[level];
+    uint16_t channelsCount = builder->channelsCount;
+    PeakAccumulator *accumulators = &((PeakAccumulator *)builder->accumulators.bytes)[level * channelsCount];
+
+    if (builder->status == WM_OK)
+    {
+        builder->status = reserveBuffer(context, &peakLevel->peaks, sizeof(wm_peak) * channelsCount * (peakLevel->peaksCount + 1), "peaks");
+    }
+    if (builder->status == WM_OK)
+    {
+        wm_peak *peaks = &((wm_peak *)peakLevel->peaks.bytes)[peakLevel->peaksCount * channelsCount];
+        for (uint16_t channel = 0; channel < channelsCount; channel++)
+        {
+            peaks[channel].min = toPeakValue(accumulators[channel].min);
+            peaks[channel].max = toPeakValue(accumulators[channel].max);
+            peaks[channel].rms = toPeakValue((float)sqrt(accumulators[channel].sumSquares / (double)peakLevel->peakFrames));
+        }
+        peakLevel->peaksCount++;
+    }
+
+    bool hasNextLevel = (level + 1 < builder->levelsCount);
+    if (hasNextLevel)
+    {
+        PeakAccumulator *nextAccumulators = &accumulators[channelsCount];
+        for (uint16_t channel = 0; channel < channelsCount; channel++)
+        {
+            nextAccumulators[channel].min = accumulators[channel].min < nextAccumulators[channel].min ? accumulators[channel].min : nextAccumulators[channel].min;
+            nextAccumulators[channel].max = accumulators[channel].max > nextAccumulators[channel].max ? accumulators[channel].max : nextAccumulators[channel].max;
+            nextAccumulators[channel].sumSquares += accumulators[channel].sumSquares;
+        }
+        builder->levels[level + 1].peakFrames += peakLevel->peakFrames;
+    }
+    resetPeakAccumulators(accumulators, channelsCount);
+    peakLevel->peakFrames = 0;
+
+    if (hasNextLevel && (peakLevel->peaksCount % 2 == 0))
+    {
+        completePeak(context, level + 1);
+    }
+}
+
+static void addPeakFrames(wm_context *context, uint32_t framesCount)
+{
+    PeakBuilder *builder = &context->peakBuilder;
+    builder->levels[0].peakFrames += framesCount;
+    builder->framesLeft -= framesCount;
+    if (builder->framesLeft == 0)
+    {
+        completePeak(context, 0);
+        builder->framesLeft = builder->levels[0].framesPerPeak;
+    }
+}
+
+static void takePeaks(wm_context *context, const float *samples, size_t count)
+{
+    PeakBuilder *builder = &context->peakBuilder;
+    uint16_t channelsCount = builder->channelsCount;
+    PeakAccumulator *accumulators = (PeakAccumulator *)builder->accumulators.bytes;
+    while (count > 0)
+    {
+        // A frame split between two blocks goes a sample at a time, whole frames go to the SIMD kernel up to the end of the peak
+        if ((builder->channel > 0) || (count < channelsCount))
+        {
+            float sample = *samples++;
+            count--;
+            PeakAccumulator *accumulator = &accumulators[builder->channel];
+            accumulator->min = sample < accumulator->min ? sample : accumulator->min;
+            accumulator->max = sample > accumulator->max ? sample : accumulator->max;
+            accumulator->sumSquares += (double)sample * sample;
+            if (++builder->channel == channelsCount)
+            {
+                builder->channel = 0;
+                addPeakFrames(context, 1);
+            }
+            continue;
+        }
+
+        size_t framesCount = count / channelsCount;
+        framesCount = framesCount < builder->framesLeft ? framesCount : builder->framesLeft;
+        measureChannels(samples, framesCount, channelsCount, accumulators);
+        samples += framesCount * channelsCount;
+        count -= framesCount * channelsCount;
+        addPeakFrames(context, (uint32_t)framesCount);
+    }
+}
+
+static wm_status finishPeaks(wm_context *context)
+{
+    PeakBuilder *builder = &context->peakBuilder;
+    for (int level = 0; level < builder->levelsCount; level++)
+    {
+        if (builder->levels[level].peakFrames > 0)
+        {
+            completePeak(context, level);
+        }
+    }
+    if (builder->status != WM_OK)
+    {
+        return builder->status;
+    }
+
+    printProgress(context, "Took %zu peaks of %u sample frames.\n", builder->levels[0].peaksCount, builder->levels[0].framesPerPeak);
+    return WM_OK;
+}
+
+// The pre-filter shelf and RLB high-pass of BS.1770 as biquads for the sample rate, from the analog prototypes the standard's 48 kHz
+// coefficients come from, so other rates get the same response
+static void setUpKWeighting(LoudnessMeter *meter, uint32_t sampleRate)
+{
+    double k = tan(M_PI * 1681.974450955533 / sampleRate);
+    double q = 0.7071752369554196;
+    double vh = pow(10.0, 3.999843853973347 / 20.0);
+    double vb = pow(vh, 0.4996667741545416);
+    double a0 = 1.0 + k / q + k * k;
+    meter->filter[0][0] = (vh + vb * k / q + k * k) / a0;
+    meter->filter[0][1] = 2.0 * (k * k - vh) / a0;
+    meter->filter[0][2] = (vh - vb * k / q + k * k) / a0;
+    meter->filter[0][3] = 2.0 * (k * k - 1.0) / a0;
+    meter->filter[0][4] = (1.0 - k / q + k * k) / a0;
+
+    k = tan(M_PI * 38.13547087602444 / sampleRate);
+    q = 0.5003270373238773;
+    a0 = 1.0 + k / q + k * k;
+    meter->filter[1][0] = 1.0;
+    meter->filter[1][1] = -2.0;
+    meter->filter[1][2] = 1.0;
+    meter->filter[1][3] = 2.0 * (k * k - 1.0) / a0;
+    meter->filter[1][4] = (1.0 - k / q + k * k) / a0;
+}
+
+// A sinc interpolation filter with a Hann window, split into one phase for each oversampled point between two samples
+static void setUpTruePeak(LoudnessMeter *meter, uint32_t sampleRate)
+{
+    meter->oversampling = sampleRate < 96000 ? 4 : (sampleRate < 192000 ? 2 : 1);
+    meter->truePeakPhaseTaps = (TRUE_PEAK_TAPS + meter->oversampling - 1) / meter->oversampling;
+    meter->truePeakGain = 1.0f;
+    memset(meter->truePeakCoefficients, 0, sizeof(meter->truePeakCoefficients));
+    memset(meter->truePeakHistory, 0, sizeof(meter->truePeakHistory));
+    if (meter->oversampling == 1)
+    {
+        return;
+    }
+
+    for (int tap = 0; tap < TRUE_PEAK_TAPS; tap++)
+    {
+        double x = (double)(tap - (TRUE_PEAK_TAPS - 1) / 2) / meter->oversampling;
+        double sinc = x == 0.0 ? 1.0 : sin(M_PI * x) / (M_PI * x);
+        double window = 0.5 * (1.0 - cos(2.0 * M_PI * tap / (TRUE_PEAK_TAPS - 1)));
+        meter->truePeakCoefficients[tap % meter->oversampling][meter->truePeakPhaseTaps - 1 - tap / meter->oversampling] = (float)(sinc * window);
+    }
+    for (int phase = 0; phase < meter->oversampling; phase++)
+    {
+        float gain = 0.0f;
+        for (int tap = 0; tap < meter->truePeakPhaseTaps; tap++)
+        {
+            gain += fabsf(meter->truePeakCoefficients[phase][tap]);
+        }
+        meter->truePeakGain = gain > meter->truePeakGain ? gain : meter->truePeakGain;
+    }
+}
+
+static void startGatingBlocks(GatingBlocks *gating, uint32_t stepFrames)
+{
+    gating->stepEnergy = 0.0;
+    gating->stepFramesLeft = stepFrames;
+    gating->stepsCount = 0;
+}
+
+static int compareLoudnessSegments(const void *a, const void *b)
+{
+    uint64_t frameA = ((const LoudnessSegment *)a)->startFrame;
+    uint64_t frameB = ((const LoudnessSegment *)b)->startFrame;
+    return frameA < frameB ? -1 : (frameA > frameB ? 1 : 0);
+}
+
+static wm_status startLoudness(wm_context *context, FormatChunk formatChunk)
+{
+    LoudnessMeter *meter = &context->loudnessMeter;
+    uint16_t channelsCount = context->sampleDecoder.channelsCount;
+    if (channelsCount > LOUDNESS_MAX_CHANNELS)
+    {
+        return setError(context, WM_ERROR_UNSUPPORTED_FORMAT, "Loudness can only be measured in up to %d channels, not %u", LOUDNESS_MAX_CHANNELS, channelsCount);
+    }
+
+    uint32_t sampleRate = littleEndianBytesToUInt32(formatChunk.sampleRate);
+    meter->channelsCount = channelsCount;
+    meter->sampleRate = sampleRate;
+    meter->stepFrames = (sampleRate + 5) / 10;
+    meter->stepFrames = meter->stepFrames > 0 ? meter->stepFrames : 1;
+    setUpKWeighting(meter, sampleRate);
+    setUpTruePeak(meter, sampleRate);
+    memset(meter->filterState, 0, sizeof(meter->filterState));
+    meter->partialFrameSize = 0;
+    meter->framesCount = 0;
+    meter->status = WM_OK;
+
+    // BS.1770 weights the surround channels of 5.1 by 1.5 dB and leaves the LFE channel out
+    for (uint16_t channel = 0; channel < channelsCount; channel++)
+    {
+        meter->weights[channel] = 1.0;
+    }
+    if (channelsCount == 6)
+    {
+        meter->weights[3] = 0.0;
+        meter->weights[4] = 1.41;
+        meter->weights[5] = 1.41;
+    }
+
+    startGatingBlocks(&meter->fileGating, meter->stepFrames);
+    startGatingBlocks(&meter->segmentGating, meter->stepFrames);
+    meter->fileBlocksCount = 0;
+    meter->segmentBlocksCount = 0;
+
+    // A segment starts at the start of the file and at every marker after it, once for markers at the same frame.  The markers
+    // are only in frame order when merging, without it they keep the order of the labels and the silences come after them
+    uint32_t markersCount = littleEndianBytesToUInt32(context->cueChunk.cuePointsCount);
+    wm_status status = reserveBuffer(context, &meter->segments, sizeof(LoudnessSegment) * ((size_t)markersCount + 1), "loudness segments");
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    LoudnessSegment *segments = (LoudnessSegment *)meter->segments.bytes;
+    const MergedMarker *markers = (const MergedMarker *)context->mergedMarkers.bytes;
+    segments[0] = (LoudnessSegment){.startFrame = 0, .blocksStart = 0, .truePeak = 0.0f};
+    for (uint32_t i = 0; i < markersCount; i++)
+    {
+        segments[i + 1] = (LoudnessSegment){.startFrame = markers[i].frameOffset, .blocksStart = 0, .truePeak = 0.0f};
+    }
+    qsort(segments, (size_t)markersCount + 1, sizeof(LoudnessSegment), compareLoudnessSegments);
+    meter->segmentsCount = 1;
+    for (uint32_t i = 1; i <= markersCount; i++)
+    {
+        if (segments[i].startFrame > segments[meter->segmentsCount - 1].startFrame)
+        {
+            segments[meter->segmentsCount++] = segments[i];
+        }
+    }
+    meter->segmentIndex = 0;
+    return WM_OK;
+}
+
+// Adds the energy of a frame to the step being summed, and when that ends a 400 ms block, stores the mean energy of the block
+static void addGatingEnergy(wm_context *context, GatingBlocks *gating, ReusableBuffer *blockPowers, size_t *io_BlocksCount, double energy)
+{
+    LoudnessMeter *meter = &context->loudnessMeter;
+    gating->stepEnergy += energy;
+    if (--gating->stepFramesLeft > 0)
+    {
+        return;
+    }
+
+    gating->stepEnergies[gating->stepsCount++ % 4] = gating->stepEnergy;
+    gating->stepEnergy = 0.0;
+    gating->stepFramesLeft = meter->stepFrames;
+    if (gating->stepsCount < 4)
+    {
+        return;
+    }
+
+    if (meter->status == WM_OK)
+    {
+        meter->status = reserveBuffer(context, blockPowers, sizeof(double) * (*io_BlocksCount + 1), "loudness blocks");
+    }
+    if (meter->status == WM_OK)
+    {
+        double blockEnergy = gating->stepEnergies[0] + gating->stepEnergies[1] + gating->stepEnergies[2] + gating->stepEnergies[3];
+        ((double *)blockPowers->bytes)[(*io_BlocksCount)++] = blockEnergy / (4.0 * meter->stepFrames);
+    }
+}
+
+static void measureLoudnessFrames(wm_context *context, const float *samples, size_t framesCount)
+{
+    LoudnessMeter *meter = &context->loudnessMeter;
+    uint16_t channelsCount = meter->channelsCount;
+    memset(meter->frameEnergies, 0, sizeof(double) * framesCount);
+
+    uint16_t channel = 0;
+#if defined(__AVX2__)
+    for (; channel + 4 <= channelsCount; channel += 4)
+    {
+        filterFourChannels(meter, samples, framesCount, channel);
+    }
+#endif
+#if defined(__SSE2__)
+    for (; channel + 2 <= channelsCount; channel += 2)
+    {
+        filterTwoChannels(meter, samples, framesCount, channel);
+    }
+#endif
+    for (; channel < channelsCount; channel++)
+    {
+        const double *pre = meter->filter[0];
+        const double *rlb = meter->filter[1];
+        double s1 = meter->filterState[0][channel];
+        double s2 = meter->filterState[1][channel];
+        double s3 = meter->filterState[2][channel];
+        double s4 = meter->filterState[3][channel];
+        double weight = meter->weights[channel];
+        for (size_t frame = 0; frame < framesCount; frame++)
+        {
+            double x = samples[frame * channelsCount + channel];
+            double y = pre[0] * x + s1;
+            s1 = pre[1] * x - pre[3] * y + s2;
+            s2 = pre[2] * x - pre[4] * y;
+            double z = rlb[0] * y + s3;
+            s3 = rlb[1] * y - rlb[3] * z + s4;
+            s4 = rlb[2] * y - rlb[4] * z;
+            meter->frameEnergies[frame] += weight * z * z;
+        }
+        meter->filterState[0][channel] = s1;
+        meter->filterState[1][channel] = s2;
+        meter->filterState[2][channel] = s3;
+        meter->filterState[3][channel] = s4;
+    }
+
+    // The delays die away through digital silence, flushing them before they get denormal keeps the filters fast
+    for (int delay = 0; delay < 4; delay++)
+    {
+        for (channel = 0; channel < channelsCount; channel++)
+        {
+            if (fabs(meter->filterState[delay][channel]) < 1e-30)
+                meter->filterState[delay][channel] = 0.0;
+        }
+    }
+
+    // The frames go a segment at a time, as only whole blocks count, so the one a segment ends in is dropped and the next segment
+    // starts its blocks afresh
+    LoudnessSegment *segments = (LoudnessSegment *)meter->segments.bytes;
+    size_t frame = 0;
+    while (frame < framesCount)
+    {
+        size_t runFrames = framesCount - frame;
+        if (meter->segmentIndex + 1 < meter->segmentsCount)
+        {
+            uint64_t nextStartFrame = segments[meter->segmentIndex + 1].startFrame;
+            if (meter->framesCount == nextStartFrame)
+            {
+                meter->segmentIndex++;
+                segments[meter->segmentIndex].blocksStart = meter->segmentBlocksCount;
+                startGatingBlocks(&meter->segmentGating, meter->stepFrames);
+                continue;
+            }
+            runFrames = nextStartFrame - meter->framesCount < runFrames ? (size_t)(nextStartFrame - meter->framesCount) : runFrames;
+        }
+
+        measureTruePeaks(meter, &samples[frame * channelsCount], runFrames, &segments[meter->segmentIndex].truePeak);
+        for (size_t i = frame; i < frame + runFrames; i++)
+        {
+            addGatingEnergy(context, &meter->fileGating, &meter->fileBlockPowers, &meter->fileBlocksCount, meter->frameEnergies[i]);
+            addGatingEnergy(context, &meter->segmentGating, &meter->segmentBlockPowers, &meter->segmentBlocksCount, meter->frameEnergies[i]);
+        }
+        meter->framesCount += runFrames;
+        frame += runFrames;
+    }
+}
+
+static void measureLoudness(wm_context *context, const float *samples, size_t count)
+{
+    LoudnessMeter *meter = &context->loudnessMeter;
+    uint16_t channelsCount = meter->channelsCount;
+
+    // A frame split between two blocks is put together first, then the whole frames are measured and the rest kept for the next block
+    if (meter->partialFrameSize > 0)
+    {
+        size_t size = channelsCount - meter->partialFrameSize;
+        size = size < count ? size : count;
+        memcpy(&meter->partialFrame[meter->partialFrameSize], samples, sizeof(float) * size);
+        meter->partialFrameSize += (uint16_t)size;
+        samples += size;
+        count -= size;
+        if (meter->partialFrameSize < channelsCount)
+        {
+            return;
+        }
+        measureLoudnessFrames(context, meter->partialFrame, 1);
+        meter->partialFrameSize = 0;
+    }
+
+    size_t framesCount = count / channelsCount;
+    if (framesCount > 0)
+    {
+        measureLoudnessFrames(context, samples, framesCount);
+    }
+    meter->partialFrameSize = (uint16_t)(count - framesCount * channelsCount);
+    memcpy(meter->partialFrame, &samples[framesCount * channelsCount], sizeof(float) * meter->partialFrameSize);
+}
+
+// The mean energy of the blocks above -70 LUFS and above 10 LU under the mean of those, as LUFS
+static double getGatedLoudness(const double *blockPowers, size_t blocksCount)
+{
+    const double absoluteGate = pow(10.0, (-70.0 + 0.691) / 10.0);
+    double sum = 0.0;
+    size_t count = 0;
+    for (size_t i = 0; i < blocksCount; i++)
+    {
+        if (blockPowers[i] > absoluteGate)
+        {
+            sum += blockPowers[i];
+            count++;
+        }
+    }
+    if (count == 0)
+    {
+        return -INFINITY;
+    }
+
+    double relativeGate = sum / count * 0.1;
+    sum = 0.0;
+    count = 0;
+    for (size_t i = 0; i < blocksCount; i++)
+    {
+        if ((blockPowers[i] > absoluteGate) && (blockPowers[i] > relativeGate))
+        {
+            sum += blockPowers[i];
+            count++;
+        }
+    }
+    return count > 0 ? -0.691 + 10.0 * log10(sum / count) : -INFINITY;
+}
+
+static double toDecibels(float peak)
+{
+    return peak > 0.0f ? 20.0 * log10(peak) : -INFINITY;
+}
+
+static wm_status finishLoudness(wm_context *context)
+{
+    LoudnessMeter *meter = &context->loudnessMeter;
+    if (meter->status != WM_OK)
+    {
+        return meter->status;
+    }
+
+    // Segments of markers at or past the end of the samples have no frames and are left out
+    meter->segmentsCount = meter->segmentIndex + 1;
+    wm_status status = reserveBuffer(context, &meter->segmentLoudness, sizeof(wm_loudness) * meter->segmentsCount, "loudness segments");
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    const LoudnessSegment *segments = (const LoudnessSegment *)meter->segments.bytes;
+    const double *segmentBlockPowers = (const double *)meter->segmentBlockPowers.bytes;
+    wm_loudness *segmentLoudness = (wm_loudness *)meter->segmentLoudness.bytes;
+    float fileTruePeak = 0.0f;
+    for (size_t i = 0; i < meter->segmentsCount; i++)
+    {
+        bool isLast = (i + 1 == meter->segmentsCount);
+        uint64_t endFrame = isLast ? meter->framesCount : segments[i + 1].startFrame;
+        size_t blocksEnd = isLast ? meter->segmentBlocksCount : segments[i + 1].blocksStart;
+        segmentLoudness[i].start_frame = segments[i].startFrame;
+        segmentLoudness[i].frames_count = endFrame - segments[i].startFrame;
+        segmentLoudness[i].integrated_lufs = getGatedLoudness(&segmentBlockPowers[segments[i].blocksStart], blocksEnd - segments[i].blocksStart);
+        segmentLoudness[i].true_peak_dbtp = toDecibels(segments[i].truePeak);
+        fileTruePeak = segments[i].truePeak > fileTruePeak ? segments[i].truePeak : fileTruePeak;
+    }
+
+    meter->fileLoudness.start_frame = 0;
+    meter->fileLoudness.frames_count = meter->framesCount;
+    meter->fileLoudness.integrated_lufs = getGatedLoudness((const double *)meter->fileBlockPowers.bytes, meter->fileBlocksCount);
+    meter->fileLoudness.true_peak_dbtp = toDecibels(fileTruePeak);
+    meter->hasResults = true;
+
+    printProgress(context, "Integrated loudness %.1f LUFS, true peak %.1f dBTP, in %zu segments.\n", meter->fileLoudness.integrated_lufs, meter->fileLoudness.true_peak_dbtp, meter->segmentsCount);
+    return WM_OK;
+}
+
+static uint64_t getMaxSilenceMarkersSize(const wm_context *context, FormatChunk formatChunk, uint64_t size)
+{
+    // Silences are at least minFrames long, rounded up to whole windows, and there is at least one window that isn't silent between two
+    uint16_t blockAlign = littleEndianBytesToUInt16(formatChunk.blockAlign);
+    uint32_t sampleRate = littleEndianBytesToUInt32(formatChunk.sampleRate);
+    uint64_t framesCount = blockAlign > 0 ? size / blockAlign : 0;
+    uint64_t windowFrames = sampleRate / (1000 / SILENCE_WINDOW_MILLISECONDS);
+    uint64_t minFrames = (uint64_t)(context->silenceMinSeconds * sampleRate + 0.5);
+    uint64_t maxSilencesCount = framesCount / (minFrames + (windowFrames > 0 ? windowFrames : 1)) + 1;
+    return maxSilencesCount * (sizeof(CuePoint) + getAdtlChunkSize(context->silenceTextLength, true) + getAdtlChunkSize(REGION_DATA_SIZE, false));
+}
+
+static wm_status verifyOutputSamples(wm_context *context, int outputFd, off_t offset, uint64_t size)
+{
+    const OutputTap *tap = &context->outputTap;
+    const wm_chunk_checksum *chunks = (const wm_chunk_checksum *)tap->chunks.bytes;
+    const wm_chunk_checksum *dataChunk = NULL;
+    for (size_t i = 0; (i < tap->chunksCount) && (dataChunk == NULL); i++)
+    {
+        if (strncmp(chunks[i].chunk_id, "data", 4) == 0)
+        {
+            dataChunk = &chunks[i];
+        }
+    }
+    if ((dataChunk == NULL) || (dataChunk->size != size))
+    {
+        return setError(context, WM_ERROR_IO, "Verify: Could not find the data chunk in the output file");
+    }
+
+    wm_status status = reserveCopyBuffers(context);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    printProgress(context, "Verifying sample data.\n");
+    const CopyBuffers *copyBuffers = &context->copyBuffers;
+    CopyRange range = {.inputFd = outputFd, .inputOffset = offset, .size = size};
+    uint32_t checksum = 0;
+    uint64_t position = 0;
+    while (position < size)
+    {
+        size_t pieceSize = size - position < copyBuffers->bufferSize ? (size_t)(size - position) : copyBuffers->bufferSize;
+        if (readCopyPiece(context, &range, position, copyBuffers->memory, pieceSize) != WM_OK)
+        {
+            return setError(context, WM_ERROR_IO, "Verify: Error reading back the output file");
+        }
+        checksum = updateCrc32c(checksum, copyBuffers->memory, pieceSize);
+        position += pieceSize;
+    }
+
+    if (checksum != dataChunk->crc32c)
+    {
+        return setError(context, WM_ERROR_IO, "Verify: The sample data of the output file has CRC-32C %08x, the input has %08x", checksum, dataChunk->crc32c);
+    }
+    return WM_OK;
+}
+
+static wm_status openWaveInput(wm_context *context, int fd, WaveInput *out_Input)
+{
+    out_Input->fd = fd;
+    out_Input->bytes = NULL;
+    out_Input->size = 0;
+    out_Input->isMapped = false;
+
+    struct stat inputStat;
+    if (fstat(fd, &inputStat) < 0)
+    {
+        return setError(context, WM_ERROR_IO, "Error reading input file");
+    }
+    out_Input->size = inputStat.st_size;
+
+    // Only the pages holding chunk headers are ever touched, so mapping even a huge file is cheap
+    if (out_Input->size > 0)
+    {
+        void *mapping = mmap(NULL, (size_t)out_Input->size, PROT_READ, MAP_SHARED, fd, 0);
+        context->stats.map_calls++;
+        if (mapping != MAP_FAILED)
+        {
+            context->stats.bytes_mapped += (uint64_t)out_Input->size;
+            out_Input->bytes = (const char *)mapping;
+            out_Input->isMapped = true;
+            madvise(mapping, (size_t)out_Input->size, MADV_RANDOM);
+        }
+    }
+
+    return WM_OK;
+}
+
+static void closeWaveInput(wm_context *context, WaveInput *input)
+{
+    (void)context;
+    if (input->isMapped)
+    {
+        munmap((void *)input->bytes, (size_t)input->size);
+    }
+    input->bytes = NULL;
+    input->isMapped = false;
+}
+
+// Copies bytes of the input file out of memory, or reads them with pread when the file is not mapped.
+// Returns false if the range is not completely inside the file
+static bool readInputFileBytes(wm_context *context, const WaveInput *input, off_t offset, void *out_Bytes, size_t size)
+{
+    if ((offset < 0) || (offset + (off_t)size > input->size))
+    {
+        return false;
+    }
+
+    if (input->bytes != NULL)
+    {
+        memcpy(out_Bytes, input->bytes + offset, size);
+        return true;
+    }
+
+    countRead(context, size);
+    return pread(input->fd, out_Bytes, size, offset) == (ssize_t)size;
+}
+
+static wm_status scanWaveFile(wm_context *context, const WaveInput *input, WaveFileIndex *waveFileIndex, bool readMarkers)
+{
+    ChunkSize64 *chunkSizeTable = NULL;
+    uint32_t chunkSizeTableLength = 0;
+
+    // Only the memory of the chunk index outlives a scan
+    ChunkIndex chunkIndex = waveFileIndex->chunkIndex;
+    memset(waveFileIndex, 0, sizeof(*waveFileIndex));
+    waveFileIndex->chunkIndex = chunkIndex;
+    waveFileIndex->chunkIndex.count = 0;
+    context->existingMarkers.count = 0;
+    context->existingMarkers.subchunksCount = 0;
+    context->existingMarkers.listDataSize = 0;
+
+    // Get & check the input file header
+    WaveHeader *waveHeader = &waveFileIndex->waveHeader;
+    if (!readInputFileBytes(context, input, 0, waveHeader, sizeof(WaveHeader)))
+    {
+        return setError(context, WM_ERROR_BAD_WAVE, "Error reading input file");
+    }
+
+    waveFileIndex->isRF64 = (strncmp(&(waveHeader->chunkID[0]), "RF64", 4) == 0) || (strncmp(&(waveHeader->chunkID[0]), "BW64", 4) == 0);
+    if ((strncmp(&(waveHeader->chunkID[0]), "RIFF", 4) != 0) && !waveFileIndex->isRF64)
+    {
+        return setError(context, WM_ERROR_NOT_WAVE, "Input file is not a RIFF file");
+    }
+
+    if (strncmp(&(waveHeader->riffType[0]), "WAVE", 4) != 0)
+    {
+        return setError(context, WM_ERROR_NOT_WAVE, "Input file is not a WAVE file");
+    }
+
+    uint64_t remainingFileSize = littleEndianBytesToUInt32(waveHeader->dataSize) - sizeof(waveHeader->riffType); // dataSize does not counf the chunkID or the dataSize, so remove the riffType size to get the length of the rest of the file.
+    off_t chunkOffset = sizeof(WaveHeader);
+
+    // In RF64 files the real sizes are in the ds64 chunk, which must be the first chunk
+    uint64_t sampleDataSize64 = 0;
+    if (waveFileIndex->isRF64)
+    {
+        DataSize64Chunk dataSize64Chunk;
+        if (!readInputFileBytes(context, input, chunkOffset, &dataSize64Chunk, sizeof(DataSize64Chunk)) || (strncmp(dataSize64Chunk.chunkID, "ds64", 4) != 0))
+        {
+            return setError(context, WM_ERROR_BAD_WAVE, "Input file is an RF64 file without a ds64 chunk");
+        }
+        waveFileIndex->dataSize64ChunkOffset = chunkOffset;
+        remainingFileSize = littleEndianBytesToUInt64(dataSize64Chunk.riffSize) - sizeof(waveHeader->riffType);
+        sampleDataSize64 = littleEndianBytesToUInt64(dataSize64Chunk.dataSize);
+
+        uint32_t tableLength = littleEndianBytesToUInt32(dataSize64Chunk.tableLength);
+        if (tableLength > 0)
+        {
+            wm_status status = reserveBuffer(context, &context->dataSize64Bytes, sizeof(ChunkSize64) * tableLength, "the ds64 table");
+            if (status != WM_OK)
+            {
+                return status;
+            }
+            chunkSizeTable = (ChunkSize64 *)context->dataSize64Bytes.bytes;
+            if (!readInputFileBytes(context, input, chunkOffset + (off_t)sizeof(DataSize64Chunk), chunkSizeTable, sizeof(ChunkSize64) * tableLength))
+            {
+                return setError(context, WM_ERROR_BAD_WAVE, "Error reading ds64 chunk of input file");
+            }
+            chunkSizeTableLength = tableLength;
+        }
+
+        uint32_t dataSize64ChunkDataSize = littleEndianBytesToUInt32(dataSize64Chunk.chunkDataSize);
+        chunkOffset += 8 + (off_t)dataSize64ChunkDataSize + (off_t)(dataSize64ChunkDataSize % 2);
+        printProgress(context, "Got ds64 Chunk\n");
+    }
+
+    if (remainingFileSize <= 0)
+    {
+        return setError(context, WM_ERROR_BAD_WAVE, "Input file is an empty WAVE file");
+    }
+
+    // Walk the chunk headers.  Every chunk starts with a 4 byte ID and a 4 byte size, and the next chunk starts right after
+    // the data and its padding byte, so the position of each header is computed from the previous one
+    while (chunkOffset + 8 <= input->size)
+    {
+        char chunkHeader[8];
+        if (!readInputFileBytes(context, input, chunkOffset, chunkHeader, sizeof(chunkHeader)))
+        {
+            return setError(context, WM_ERROR_BAD_WAVE, "Error reading input file");
+        }
+
+        char *chunkID = &chunkHeader[0];
+        uint64_t chunkDataSize = littleEndianBytesToUInt32(&chunkHeader[4]);
+
+        // An RF64 chunk too big for its size field has its real size in the ds64 chunk
+        if (waveFileIndex->isRF64 && (chunkDataSize == UINT32_MAX))
+        {
+            if (strncmp(chunkID, "data", 4) == 0)
+            {
+                chunkDataSize = sampleDataSize64;
+            }
+            else
+            {
+                uint32_t i = 0;
+                while ((i < chunkSizeTableLength) && (strncmp(chunkSizeTable[i].chunkID, chunkID, 4) != 0))
+                {
+                    i++;
+                }
+                if (i == chunkSizeTableLength)
+                {
+                    return setError(context, WM_ERROR_BAD_WAVE, "Chunk \'%c%c%c%c\' has no size in the ds64 chunk", chunkID[0], chunkID[1], chunkID[2], chunkID[3]);
+                }
+                chunkDataSize = littleEndianBytesToUInt64(chunkSizeTable[i].chunkSize);
+            }
+        }
+
+        off_t chunkDataOffset = chunkOffset + (off_t)sizeof(chunkHeader);
+
+        // Chunks must be aligned to 2 byte boundaries, but any padding at the end of a chunk is not included in the chunkDataSize
+        off_t nextChunkOffset = chunkDataOffset + (off_t)chunkDataSize + (off_t)(chunkDataSize % 2);
+
+        // See which kind of chunk we have
+
+        if (strncmp(chunkID, "fmt ", 4) == 0)
+        {
+            // We found the format chunk
+            if ((chunkDataSize < 16) || !readInputFileBytes(context, input, chunkOffset, &waveFileIndex->formatChunk, sizeof(FormatChunk)))
+            {
+                return setError(context, WM_ERROR_BAD_WAVE, "Error reading input file");
+            }
+            waveFileIndex->hasFormatChunk = true;
+
+            uint16_t compressionCode = littleEndianBytesToUInt16(waveFileIndex->formatChunk.compressionCode);
+            if (compressionCode != WAVE_FORMAT_PCM && compressionCode != WAVE_FORMAT_IEEE_FLOAT)
+            {
+                return setError(context, WM_ERROR_UNSUPPORTED_FORMAT, "Compressed audio formats are not supported");
+            }
+
+            // Note: For compressed audio data there may be extra bytes appended to the format chunk,
+            // but as we are only handling uncompressed data we shouldn't encounter them
+
+            // There may or may not be extra data at the end of the fomat chunk.  For uncompressed audio there should be no need, but some files may still have it.
+            // if formatChunk.chunkDataSize > 16 (16 = the number of bytes for the format chunk, not counting the 4 byte ID and the chunkDataSize itself) there is extra data
+            uint64_t extraFormatBytesCount = chunkDataSize - 16;
+            if (extraFormatBytesCount > 0)
+            {
+                waveFileIndex->formatChunkExtraBytes.startOffset = chunkOffset + (off_t)sizeof(FormatChunk);
+                waveFileIndex->formatChunkExtraBytes.size = extraFormatBytesCount;
+            }
+
+            printProgress(context, "Got Format Chunk\n");
+        }
+
+        else if (strncmp(chunkID, "data", 4) == 0)
+        {
+            // We found the data chunk
+            waveFileIndex->dataChunkLocation.startOffset = chunkOffset;
+            waveFileIndex->dataChunkLocation.size = sizeof(chunkHeader) + chunkDataSize;
+
+            printProgress(context, "Got Data Chunk\n");
+        }
+
+        else
+        {
+            bool isMarkerChunk = false;
+
+            if (strncmp(chunkID, "cue ", 4) == 0)
+            {
+                // We found an existing Cue Chunk
+                isMarkerChunk = true;
+                printProgress(context, "Found Existing Cue Chunk\n");
+                if (readMarkers)
+                {
+                    wm_status status = readExistingCueChunk(context, input, chunkDataOffset, chunkDataSize);
+                    if (status != WM_OK)
+                    {
+                        return status;
+                    }
+                }
+            }
+            else if ((strncmp(chunkID, "LIST", 4) == 0) && (chunkDataSize >= 4))
+            {
+                char listTypeID[4];
+                if (!readInputFileBytes(context, input, chunkDataOffset, listTypeID, sizeof(listTypeID)))
+                {
+                    // The file ends inside the list chunk
+                    break;
+                }
+
+                if ((strncmp(&listTypeID[0], "adtl", 4) == 0))
+                {
+                    isMarkerChunk = true;
+                    printProgress(context, "Found Existing Label Chunk\n");
+                    if (readMarkers)
+                    {
+                        wm_status status = readExistingListChunk(context, input, chunkDataOffset + 4, chunkDataSize - 4);
+                        if (status != WM_OK)
+                        {
+                            return status;
+                        }
+                    }
+                }
+            }
+
+            // Existing markers are dropped from the output, but remember where they are for in place updates.
+            // Any other chunk type we are not going to work with is noted so we can copy it to the output file later
+            wm_status status = appendIndexedChunk(context, &waveFileIndex->chunkIndex, chunkID, chunkOffset, chunkDataSize, isMarkerChunk);
+            if (status != WM_OK)
+            {
+                return status;
+            }
+            if (!isMarkerChunk)
+            {
+                printProgress(context, "Found chunk type \'%c%c%c%c\', size: %llu bytes\n", chunkID[0], chunkID[1], chunkID[2], chunkID[3], (unsigned long long)chunkDataSize);
+            }
+        }
+
+        chunkOffset = nextChunkOffset;
+    }
+
+    if (readMarkers)
+    {
+        linkExistingMarkers(&context->existingMarkers);
+    }
+
+    return WM_OK;
+}
+
+static wm_status appendIndexedChunk(wm_context *context, ChunkIndex *chunkIndex, const char *chunkID, off_t startOffset, uint64_t chunkDataSize, bool isMarkerChunk)
+{
+    if (chunkIndex->count == chunkIndex->capacity)
+    {
+        size_t newCapacity = chunkIndex->capacity > 0 ? chunkIndex->capacity * 2 : 64;
+        IndexedChunk *newChunks = realloc(chunkIndex->chunks, sizeof(IndexedChunk) * newCapacity);
+        if (newChunks == NULL)
+        {
+            return setError(context, WM_ERROR_NO_MEMORY, "Memory Allocation Error: Could not allocate memory for the chunk index");
+        }
+        chunkIndex->chunks = newChunks;
+        chunkIndex->capacity = newCapacity;
+    }
+
+    IndexedChunk *chunk = &chunkIndex->chunks[chunkIndex->count++];
+    chunk->startOffset = startOffset;
+    chunk->size = 8 + chunkDataSize;
+    memcpy(chunk->chunkID, chunkID, 4);
+    chunk->paddingSize = (uint8_t)(chunkDataSize % 2);
+    chunk->isMarkerChunk = isMarkerChunk;
+    return WM_OK;
+}
+
+static wm_status readExistingCueChunk(wm_context *context, const WaveInput *input, off_t chunkDataOffset, uint64_t chunkDataSize)
+{
+    ExistingMarkers *existingMarkers = &context->existingMarkers;
+    char cuePointsCountBytes[4];
+    if ((chunkDataSize < 4) || !readInputFileBytes(context, input, chunkDataOffset, cuePointsCountBytes, sizeof(cuePointsCountBytes)))
+    {
+        return setError(context, WM_ERROR_BAD_WAVE, "Error reading existing cue chunk of input file");
+    }
+
+    uint32_t cuePointsCount = littleEndianBytesToUInt32(cuePointsCountBytes);
+    if (cuePointsCount > (chunkDataSize - 4) / sizeof(CuePoint))
+    {
+        cuePointsCount = (uint32_t)((chunkDataSize - 4) / sizeof(CuePoint));
+    }
+
+    // The cue points are read into the buffer of the new ones, which is only filled once the chunks are built
+    wm_status status = reserveBuffer(context, &context->cuePoints, sizeof(CuePoint) * cuePointsCount, "Cue Points data");
+    if (status == WM_OK)
+        status = reserveBuffer(context, &existingMarkers->markers, sizeof(ExistingMarker) * ((size_t)existingMarkers->count + cuePointsCount), "existing markers");
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    CuePoint *cuePoints = (CuePoint *)context->cuePoints.bytes;
+    if (!readInputFileBytes(context, input, chunkDataOffset + 4, cuePoints, sizeof(CuePoint) * cuePointsCount))
+    {
+        return setError(context, WM_ERROR_BAD_WAVE, "Error reading existing cue chunk of input file");
+    }
+
+    ExistingMarker *markers = (ExistingMarker *)existingMarkers->markers.bytes;
+    for (uint32_t i = 0; i < cuePointsCount; i++)
+    {
+        ExistingMarker *marker = &markers[existingMarkers->count++];
+        marker->cuePointID = littleEndianBytesToUInt32(cuePoints[i].cuePointID);
+        marker->frameOffset = littleEndianBytesToUInt32(cuePoints[i].frameOffset);
+        marker->firstSubchunk = 0;
+        marker->subchunksCount = 0;
+    }
+
+    printProgress(context, "Read %u existing cue points\n", cuePointsCount);
+    return WM_OK;
+}
+
+static wm_status readExistingListChunk(wm_context *context, const WaveInput *input, off_t chunkDataOffset, uint64_t chunkDataSize)
+{
+    ExistingMarkers *existingMarkers = &context->existingMarkers;
+    size_t listStart = existingMarkers->listDataSize;
+
+    // Read the whole list in one go, the chunks in it are then only noted where they are
+    wm_status status = reserveBuffer(context, &existingMarkers->listData, listStart + (size_t)chunkDataSize, "existing labels");
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    if (!readInputFileBytes(context, input, chunkDataOffset, existingMarkers->listData.bytes + listStart, (size_t)chunkDataSize))
+    {
+        return setError(context, WM_ERROR_BAD_WAVE, "Error reading existing adtl chunk of input file");
+    }
+    existingMarkers->listDataSize += (size_t)chunkDataSize;
+
+    size_t listEnd = existingMarkers->listDataSize;
+    size_t offset = listStart;
+    while (offset + 8 <= listEnd)
+    {
+        char *subchunkHeader = existingMarkers->listData.bytes + offset;
+        uint32_t subchunkDataSize = littleEndianBytesToUInt32(&subchunkHeader[4]);
+        if (subchunkDataSize > listEnd - offset - 8)
+        {
+            printWarning(context, "Existing \'%c%c%c%c\' chunk runs past the end of its adtl chunk and is left out\n", subchunkHeader[0], subchunkHeader[1], subchunkHeader[2], subchunkHeader[3]);
+            break;
+        }
+
+        // Every adtl chunk starts with the ID of its cue point, anything too short to have one is of no use
+        if (subchunkDataSize >= 4)
+        {
+            status = reserveBuffer(context, &existingMarkers->subchunks, sizeof(ExistingSubchunk) * ((size_t)existingMarkers->subchunksCount + 1), "existing labels");
+            if (status != WM_OK)
+            {
+                return status;
+            }
+            ExistingSubchunk *subchunk = &((ExistingSubchunk *)existingMarkers->subchunks.bytes)[existingMarkers->subchunksCount];
+            memcpy(subchunk->chunkID, subchunkHeader, 4);
+            subchunk->cuePointID = littleEndianBytesToUInt32(&subchunkHeader[8]);
+            subchunk->order = existingMarkers->subchunksCount;
+            subchunk->dataOffset = offset + 12;
+            subchunk->dataSize = subchunkDataSize - 4;
+            existingMarkers->subchunksCount++;
+        }
+
+        offset += 8 + (size_t)subchunkDataSize + (subchunkDataSize % 2);
+    }
+
+    return WM_OK;
+}
+
+static int compareExistingSubchunks(const void *a, const void *b)
+{
+    const ExistingSubchunk *subchunkA = (const ExistingSubchunk *)a;
+    const ExistingSubchunk *subchunkB = (const ExistingSubchunk *)b;
+
+    if (subchunkA->cuePointID != subchunkB->cuePointID)
+        return subchunkA->cuePointID < subchunkB->cuePointID ? -1 : 1;
+    return subchunkA->order < subchunkB->order ? -1 : (subchunkA->order > subchunkB->order);
+}
+
+static void linkExistingMarkers(ExistingMarkers *existingMarkers)
+{
+    ExistingMarker *markers = (ExistingMarker *)existingMarkers->markers.bytes;
+    ExistingSubchunk *subchunks = (ExistingSubchunk *)existingMarkers->subchunks.bytes;
+    uint32_t subchunksCount = existingMarkers->subchunksCount;
+
+    // Group the chunks by cue point, then find each group with a binary search.  Chunks of cue points that don't exist are dropped
+    if (subchunksCount > 1)
+    {
+        qsort(subchunks, subchunksCount, sizeof(ExistingSubchunk), compareExistingSubchunks);
+    }
+    for (uint32_t i = 0; i < existingMarkers->count; i++)
+    {
+        uint32_t low = 0;
+        uint32_t high = subchunksCount;
+        while (low < high)
+        {
+            uint32_t middle = low + (high - low) / 2;
+            if (subchunks[middle].cuePointID < markers[i].cuePointID)
+                low = middle + 1;
+            else
+                high = middle;
+        }
+        uint32_t end = low;
+        while ((end < subchunksCount) && (subchunks[end].cuePointID == markers[i].cuePointID))
+        {
+            end++;
+        }
+        markers[i].firstSubchunk = low;
+        markers[i].subchunksCount = end - low;
+    }
+}
+
+static void initLabelInfo(LabelInfo *labelInfo)
+{
+    labelInfo->labels = NULL;
+    labelInfo->startSeconds = NULL;
+    labelInfo->startNanoseconds = NULL;
+    labelInfo->endSeconds = NULL;
+    labelInfo->endNanoseconds = NULL;
+    labelInfo->count = 0;
+    labelInfo->capacity = 0;
+    labelInfo->text = NULL;
+    labelInfo->textSize = 0;
+    labelInfo->textCapacity = 0;
+    labelInfo->externalText = NULL;
+    labelInfo->mappedLabelFile = NULL;
+    labelInfo->mappedLabelFileSize = 0;
+}
+
+static void clearLabelInfo(LabelInfo *labelInfo)
+{
+    if (labelInfo->mappedLabelFile != NULL)
+        munmap((void *)labelInfo->mappedLabelFile, labelInfo->mappedLabelFileSize);
+    labelInfo->count = 0;
+    labelInfo->textSize = 0;
+    labelInfo->externalText = NULL;
+    labelInfo->mappedLabelFile = NULL;
+    labelInfo->mappedLabelFileSize = 0;
+}
+
+static void freeLabelInfo(LabelInfo *labelInfo)
+{
+    clearLabelInfo(labelInfo);
+    if (labelInfo->labels != NULL)
+        free(labelInfo->labels);
+    if (labelInfo->startSeconds != NULL)
+        free(labelInfo->startSeconds);
+    if (labelInfo->startNanoseconds != NULL)
+        free(labelInfo->startNanoseconds);
+    if (labelInfo->endSeconds != NULL)
+        free(labelInfo->endSeconds);
+    if (labelInfo->endNanoseconds != NULL)
+        free(labelInfo->endNanoseconds);
+    if (labelInfo->text != NULL)
+        free(labelInfo->text);
+    initLabelInfo(labelInfo);
+}
+
+static const char *getLabelText(const LabelInfo *labelInfo, const Label *label)
+{
+    if (labelInfo->externalText != NULL)
+    {
+        return &labelInfo->externalText[label->textOffset];
+    }
+    return &labelInfo->text[label->textOffset];
+}
+
+static wm_status reserveLabelText(wm_context *context, LabelInfo *labelInfo, size_t extraBytes)
+{
+    if (labelInfo->textSize + extraBytes <= labelInfo->textCapacity)
+    {
+        return WM_OK;
+    }
+
+    size_t newCapacity = labelInfo->textCapacity > 0 ? labelInfo->textCapacity : 4096;
+    while (newCapacity < labelInfo->textSize + extraBytes)
+    {
+        newCapacity *= 2;
+    }
+
+    char *newText = realloc(labelInfo->text, newCapacity);
+    if (newText == NULL)
+    {
+        return setError(context, WM_ERROR_NO_MEMORY, "Memory Allocation Error: Could not allocate memory for Label text");
+    }
+    labelInfo->text = newText;
+    labelInfo->textCapacity = newCapacity;
+    return WM_OK;
+}
+
+static wm_status appendLabel(wm_context *context, LabelInfo *labelInfo, LabelTime startTime, LabelTime endTime, size_t textOffset, size_t textLength)
+{
+    if (labelInfo->count == labelInfo->capacity)
+    {
+        uint32_t newCapacity = labelInfo->capacity > 0 ? labelInfo->capacity * 2 : 256;
+        Label *newLabels = realloc(labelInfo->labels, sizeof(Label) * newCapacity);
+        if (newLabels != NULL)
+        {
+            labelInfo->labels = newLabels;
+        }
+        uint32_t *newStartSeconds = realloc(labelInfo->startSeconds, sizeof(uint32_t) * newCapacity);
+        if (newStartSeconds != NULL)
+        {
+            labelInfo->startSeconds = newStartSeconds;
+        }
+        uint32_t *newStartNanoseconds = realloc(labelInfo->startNanoseconds, sizeof(uint32_t) * newCapacity);
+        if (newStartNanoseconds != NULL)
+        {
+            labelInfo->startNanoseconds = newStartNanoseconds;
+        }
+        uint32_t *newEndSeconds = realloc(labelInfo->endSeconds, sizeof(uint32_t) * newCapacity);
+        if (newEndSeconds != NULL)
+        {
+            labelInfo->endSeconds = newEndSeconds;
+        }
+        uint32_t *newEndNanoseconds = realloc(labelInfo->endNanoseconds, sizeof(uint32_t) * newCapacity);
+        if (newEndNanoseconds != NULL)
+        {
+            labelInfo->endNanoseconds = newEndNanoseconds;
+        }
+        if ((newLabels == NULL) || (newStartSeconds == NULL) || (newStartNanoseconds == NULL) || (newEndSeconds == NULL) || (newEndNanoseconds == NULL))
+        {
+            return setError(context, WM_ERROR_NO_MEMORY, "Memory Allocation Error: Could not allocate memory for Labels");
+        }
+        labelInfo->capacity = newCapacity;
+    }
+
+    labelInfo->labels[labelInfo->count].textOffset = textOffset;
+    labelInfo->labels[labelInfo->count].textLength = textLength;
+    labelInfo->startSeconds[labelInfo->count] = startTime.seconds;
+    labelInfo->startNanoseconds[labelInfo->count] = startTime.nanoseconds;
+    labelInfo->endSeconds[labelInfo->count] = endTime.seconds;
+    labelInfo->endNanoseconds[labelInfo->count] = endTime.nanoseconds;
+    labelInfo->count++;
+    return WM_OK;
+}
+
+static double getLabelStartTime(const LabelInfo *labelInfo, uint32_t index)
+{
+    return (double)labelInfo->startSeconds[index] + (double)labelInfo->startNanoseconds[index] / 1e9;
+}
+
+// Returns a pointer to the first tab, carriage return or line feed in [position, end), or end if there is none.
+// These are the only characters that matter to the label file structure, so the parser jumps from one to the next
+static const char *findLabelFileSeparator(const char *position, const char *end)
+{
+#if defined(__AVX2__)
+    const __m256i tabs = _mm256_set1_epi8('\t');
+    const __m256i carriageReturns = _mm256_set1_epi8('\r');
+    const __m256i lineFeeds = _mm256_set1_epi8('\n');
+    while (end - position >= 32)
+    {
+        __m256i bytes = _mm256_loadu_si256((const __m256i *)position);
+        __m256i matches = _mm256_or_si256(_mm256_cmpeq_epi8(bytes, tabs), _mm256_or_si256(_mm256_cmpeq_epi8(bytes, carriageReturns), _mm256_cmpeq_epi8(bytes, lineFeeds)));
+        uint32_t mask = (uint32_t)_mm256_movemask_epi8(matches);
+        if (mask != 0)
+        {
+            return position + __builtin_ctz(mask);
+        }
+        position += 32;
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i tabs16 = _mm_set1_epi8('\t');
+    const __m128i carriageReturns16 = _mm_set1_epi8('\r');
+    const __m128i lineFeeds16 = _mm_set1_epi8('\n');
+    while (end - position >= 16)
+    {
+        __m128i bytes = _mm_loadu_si128((const __m128i *)position);
+        __m128i matches = _mm_or_si128(_mm_cmpeq_epi8(bytes, tabs16), _mm_or_si128(_mm_cmpeq_epi8(bytes, carriageReturns16), _mm_cmpeq_epi8(bytes, lineFeeds16)));
+        uint32_t mask = (uint32_t)_mm_movemask_epi8(matches);
+        if (mask != 0)
+        {
+            return position + __builtin_ctz(mask);
+        }
+        position += 16;
+    }
+#endif
+    while ((position < end) && (*position != '\t') && (*position != '\r') && (*position != '\n'))
+    {
+        position++;
+    }
+    return position;
+}
+
+// Parses a decimal number like "12.345678" or "1.5e3" that must fill the whole field, apart from surrounding spaces.
+// Unlike strtod this never looks at the locale, Audacity always writes a '.' as the decimal separator.
+// The digits are kept as an exact decimal and only rounded once, to the nearest nanosecond.  Times too large for a
+// LabelTime come out as UINT32_MAX seconds
+static bool parseLabelTime(const char *field, const char *fieldEnd, LabelTime *out_Time, bool *out_IsNegative)
+{
+    static const uint64_t powersOfTen[] = {1ull, 10ull, 100ull, 1000ull, 10000ull, 100000ull, 1000000ull, 10000000ull, 100000000ull,
+                                           1000000000ull, 10000000000ull, 100000000000ull, 1000000000000ull, 10000000000000ull,
+                                           100000000000000ull, 1000000000000000ull, 10000000000000000ull, 100000000000000000ull,
+                                           1000000000000000000ull, 10000000000000000000ull};
+
+    while ((field < fieldEnd) && (*field == ' '))
+        field++;
+    while ((fieldEnd > field) && (fieldEnd[-1] == ' '))
+        fieldEnd--;
+
+    bool negative = false;
+    if ((field < fieldEnd) && ((*field == '-') || (*field == '+')))
+    {
+        negative = (*field == '-');
+        field++;
+    }
+
+    uint64_t mantissa = 0;
+    int digitCount = 0;
+    int exponent = 0;
+    bool seenPoint = false;
+    for (; field < fieldEnd; field++)
+    {
+        if ((*field >= '0') && (*field <= '9'))
+        {
+            if (mantissa < 1000000000000000000ULL)
+            {
+                mantissa = mantissa * 10 + (uint64_t)(*field - '0');
+                if (seenPoint)
+                    exponent--;
+            }
+            else if (!seenPoint)
+            {
+                exponent++; // Digits beyond what fits only scale the integer part
+            }
+            digitCount++;
+        }
+        else if ((*field == '.') && !seenPoint)
+        {
+            seenPoint = true;
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (digitCount == 0)
+    {
+        return false;
+    }
+
+    if ((field < fieldEnd) && ((*field == 'e') || (*field == 'E')))
+    {
+        field++;
+        bool negativeExponent = false;
+        if ((field < fieldEnd) && ((*field == '-') || (*field == '+')))
+        {
+            negativeExponent = (*field == '-');
+            field++;
+        }
+        if ((field == fieldEnd) || (*field < '0') || (*field > '9'))
+        {
+            return false;
+        }
+        int explicitExponent = 0;
+        for (; (field < fieldEnd) && (*field >= '0') && (*field <= '9'); field++)
+        {
+            if (explicitExponent < 10000)
+                explicitExponent = explicitExponent * 10 + (*field - '0');
+        }
+        exponent += negativeExponent ? -explicitExponent : explicitExponent;
+    }
+
+    if (field != fieldEnd)
+    {
+        return false;
+    }
+
+    // The value is mantissa * 10^exponent, turn it into whole nanoseconds, rounding half up
+    LabelTime time = {.seconds = UINT32_MAX, .nanoseconds = 0};
+    int nanosecondsExponent = exponent + 9;
+    uint64_t nanoseconds = 0;
+    bool isTooLarge = false;
+    if (mantissa == 0)
+    {
+        nanoseconds = 0;
+    }
+    else if (nanosecondsExponent >= 0)
+    {
+        isTooLarge = (nanosecondsExponent > 19) || (mantissa > UINT64_MAX / powersOfTen[nanosecondsExponent]);
+        if (!isTooLarge)
+            nanoseconds = mantissa * powersOfTen[nanosecondsExponent];
+    }
+    else if (nanosecondsExponent >= -19)
+    {
+        uint64_t divisor = powersOfTen[-nanosecondsExponent];
+        nanoseconds = mantissa / divisor + ((mantissa % divisor) >= divisor - divisor / 2 ? 1 : 0);
+    }
+    if (!isTooLarge && (nanoseconds / 1000000000u < UINT32_MAX))
+    {
+        time.seconds = (uint32_t)(nanoseconds / 1000000000u);
+        time.nanoseconds = (uint32_t)(nanoseconds % 1000000000u);
+    }
+
+    *out_Time = time;
+    *out_IsNegative = negative && ((time.seconds > 0) || (time.nanoseconds > 0));
+    return true;
+}
+
+static wm_status parseLabels(wm_context *context, const char *buffer, size_t bufferSize)
+{
+    // The label file should follow the standard format exported by audacity "startTime(sec) \t endTime(sec) \t Label \n".  A label
+    // whose endTime is after its startTime marks a region
+    LabelInfo *labelInfo = &context->labelInfo;
+    const char *end = buffer + bufferSize;
+    const char *lineStart = buffer;
+    int lineNumber = 1;
+
+    while (lineStart < end)
+    {
+        // Find the line end, noting the first two tabs along the way
+        const char *tabs[2] = {NULL, NULL};
+        int tabCount = 0;
+        const char *lineEnd = lineStart;
+        while (1)
+        {
+            lineEnd = findLabelFileSeparator(lineEnd, end);
+            if ((lineEnd == end) || (*lineEnd != '\t'))
+            {
+                break;
+            }
+            if (tabCount < 2)
+            {
+                tabs[tabCount++] = lineEnd;
+            }
+            lineEnd++;
+        }
+
+        // Blank lines are skipped, and so are the "\" lines Audacity adds after labels with a frequency range
+        if ((lineEnd > lineStart) && (*lineStart != '\\'))
+        {
+            LabelTime startTime;
+            LabelTime endTime;
+            bool isStartNegative = false;
+            bool isEndNegative = false;
+
+            // A label without text is only of use when merging, where it deletes a marker
+            bool isMissingText = (tabCount == 2) && (tabs[1] + 1 == lineEnd) && (context->mergeMode == WM_MERGE_NONE);
+            if ((tabCount < 2) || !parseLabelTime(lineStart, tabs[0], &startTime, &isStartNegative) || !parseLabelTime(tabs[0] + 1, tabs[1], &endTime, &isEndNegative) || isMissingText)
+            {
+                printWarning(context, "Line %d in label file is not formatted correctly it should be \"startTime(sec) \\t endTime(sec) \\t Label \\n\"\n", lineNumber);
+            }
+            else if (isStartNegative)
+            {
+                printWarning(context, "Line %d in label file contains a negative start time\n", lineNumber);
+            }
+            else
+            {
+                const char *labelText = tabs[1] + 1;
+                bool isRegion = !isEndNegative && ((endTime.seconds > startTime.seconds) || ((endTime.seconds == startTime.seconds) && (endTime.nanoseconds > startTime.nanoseconds)));
+                wm_status status = appendLabel(context, labelInfo, startTime, isRegion ? endTime : startTime, (size_t)(labelText - buffer), (size_t)(lineEnd - labelText));
+                if (status != WM_OK)
+                {
+                    return status;
+                }
+            }
+        }
+
+        // Step over the line ending, '\n', '\r\n' or a Classic Mac '\r'
+        lineStart = lineEnd;
+        if (lineStart < end)
+        {
+            if ((*lineStart == '\r') && (lineStart + 1 < end) && (lineStart[1] == '\n'))
+            {
+                lineStart++;
+            }
+            lineStart++;
+        }
+
+        lineNumber++;
+    }
+
+    return WM_OK;
+}
+
+static wm_status writeOutputFile(wm_context *context, const WaveInput *input, int outputFd)
+{
+    printProgress(context, "Writing output file.\n");
+
+    wm_status status = WM_OK;
+    wm_status writesStatus = WM_OK;
+    WaveFileIndex *waveFileIndex = &context->waveFileIndex;
+    WaveHeader *waveHeader = &waveFileIndex->waveHeader;
+    FormatChunk *formatChunk = &waveFileIndex->formatChunk;
+    ChunkLocation formatChunkExtraBytes = waveFileIndex->formatChunkExtraBytes;
+    ChunkLocation dataChunkLocation = waveFileIndex->dataChunkLocation;
+    const ChunkIndex *chunkIndex = &waveFileIndex->chunkIndex;
+    char *formatChunkExtraData = NULL;
+    ChunkSize64 *chunkSizeTable = NULL;
+
+    // The data chunk header is written by us rather than copied, its size field depends on whether the output is RF64
+    ChunkLocation dataChunkSamples = {
+        .startOffset = dataChunkLocation.startOffset + 8,
+        .size = dataChunkLocation.size - 8};
+
+    // Update the file header chunk to have the new data size
+    uint64_t fileDataSize = 0;
+    fileDataSize += 4; // the 4 bytes for the Riff Type "WAVE"
+    fileDataSize += sizeof(FormatChunk);
+    fileDataSize += formatChunkExtraBytes.size;
+    if (formatChunkExtraBytes.size % 2 != 0)
+    {
+        fileDataSize++; // Padding byte for 2byte alignment
+    }
+
+    fileDataSize += dataChunkLocation.size;
+    if (dataChunkLocation.size % 2 != 0)
+    {
+        fileDataSize++;
+    }
+
+    // Other chunks too big for a 32 bit size field need an entry in the ds64 chunk's table
+    uint32_t chunkSizeTableLength = 0;
+    for (size_t i = 0; i < chunkIndex->count; i++)
+    {
+        const IndexedChunk *chunk = &chunkIndex->chunks[i];
+        if (chunk->isMarkerChunk)
+        {
+            continue;
+        }
+        fileDataSize += chunk->size + chunk->paddingSize;
+        if (chunk->size - 8 >= UINT32_MAX)
+        {
+            chunkSizeTableLength++;
+        }
+    }
+    uint64_t markerChunksSize = getMarkerChunksSize(context);
+    fileDataSize += markerChunksSize;
+
+    // The markers of silences are only built once the samples have gone past, and the sizes in the header put right at the end.
+    // Until then the output has to be an RF64 file if they might not fit in a plain one
+    bool hasLateMarkers = (context->silenceLevel != WM_SILENCE_OFF);
+    uint64_t maxLateMarkersSize = hasLateMarkers ? getMaxSilenceMarkersSize(context, *formatChunk, dataChunkSamples.size) : 0;
+
+    // Anything that doesn't fit in a 32 bit size field promotes the output to RF64 (or keeps it BW64 if that is what came in).
+    // A JUNK chunk before the data chunk lines the output samples up with the input samples for cloning, its size depends on
+    // whether there is a ds64 chunk, which may only be needed because of the JUNK chunk.  Keeping RF64 then is harmless
+    size_t dataSize64ChunkSize = sizeof(DataSize64Chunk) + sizeof(ChunkSize64) * chunkSizeTableLength;
+    uint64_t headerSize = sizeof(WaveHeader) + sizeof(FormatChunk) + formatChunkExtraBytes.size + (formatChunkExtraBytes.size % 2) + 8;
+    uint64_t alignmentSize = getCloneAlignmentSize(context, input, outputFd, dataChunkSamples.startOffset, dataChunkSamples.size, headerSize);
+    bool writeRF64 = (fileDataSize + alignmentSize + maxLateMarkersSize + dataSize64ChunkSize >= UINT32_MAX) || (dataChunkSamples.size >= UINT32_MAX) || (chunkSizeTableLength > 0);
+    if (writeRF64)
+    {
+        alignmentSize = getCloneAlignmentSize(context, input, outputFd, dataChunkSamples.startOffset, dataChunkSamples.size, headerSize + dataSize64ChunkSize);
+    }
+    fileDataSize += alignmentSize;
+    if (alignmentSize > 0)
+    {
+        status = reserveBuffer(context, &context->alignmentChunk, (size_t)alignmentSize, "JUNK chunk");
+        if (status != WM_OK)
+        {
+            return status;
+        }
+        memset(context->alignmentChunk.bytes, 0, (size_t)alignmentSize);
+        memcpy(context->alignmentChunk.bytes, "JUNK", 4);
+        uint32ToLittleEndianBytes((uint32_t)(alignmentSize - 8), &context->alignmentChunk.bytes[4]);
+    }
+
+    DataSize64Chunk dataSize64Chunk;
+    char dataChunkHeader[8] = {'d', 'a', 't', 'a'};
+    if (writeRF64)
+    {
+        fileDataSize += dataSize64ChunkSize;
+
+        if (strncmp(waveHeader->chunkID, "BW64", 4) != 0)
+        {
+            memcpy(waveHeader->chunkID, "RF64", 4);
+        }
+        uint32ToLittleEndianBytes(UINT32_MAX, waveHeader->dataSize);
+
+        memcpy(dataSize64Chunk.chunkID, "ds64", 4);
+        uint32ToLittleEndianBytes((uint32_t)(dataSize64ChunkSize - 8), dataSize64Chunk.chunkDataSize);
+        uint64ToLittleEndianBytes(fileDataSize, dataSize64Chunk.riffSize);
+        uint64ToLittleEndianBytes(dataChunkSamples.size, dataSize64Chunk.dataSize);
+        uint16_t blockAlign = littleEndianBytesToUInt16(formatChunk->blockAlign);
+        uint64ToLittleEndianBytes(blockAlign > 0 ? dataChunkSamples.size / blockAlign : 0, dataSize64Chunk.sampleCount);
+        uint32ToLittleEndianBytes(chunkSizeTableLength, dataSize64Chunk.tableLength);
+
+        uint32ToLittleEndianBytes(UINT32_MAX, &dataChunkHeader[4]);
+
+        if (chunkSizeTableLength > 0)
+        {
+            status = reserveBuffer(context, &context->dataSize64Bytes, sizeof(ChunkSize64) * chunkSizeTableLength, "ds64 table");
+            if (status != WM_OK)
+            {
+                return status;
+            }
+            chunkSizeTable = (ChunkSize64 *)context->dataSize64Bytes.bytes;
+            uint32_t tableIndex = 0;
+            for (size_t i = 0; i < chunkIndex->count; i++)
+            {
+                const IndexedChunk *chunk = &chunkIndex->chunks[i];
+                if (!chunk->isMarkerChunk && (chunk->size - 8 >= UINT32_MAX))
+                {
+                    memcpy(chunkSizeTable[tableIndex].chunkID, chunk->chunkID, 4);
+                    uint64ToLittleEndianBytes(chunk->size - 8, chunkSizeTable[tableIndex].chunkSize);
+                    tableIndex++;
+                }
+            }
+        }
+
+        printProgress(context, "Output is larger than 4GB, writing an %.4s file.\n", waveHeader->chunkID);
+    }
+    else
+    {
+        memcpy(waveHeader->chunkID, "RIFF", 4);
+        uint32ToLittleEndianBytes((uint32_t)fileDataSize, waveHeader->dataSize);
+        uint32ToLittleEndianBytes((uint32_t)dataChunkSamples.size, &dataChunkHeader[4]);
+    }
+
+    // The extra format bytes are tiny, so read them in and send them out with the header and format chunk in a single write
+    if (formatChunkExtraBytes.size > 0)
+    {
+        status = reserveBuffer(context, &context->formatChunkExtraData, formatChunkExtraBytes.size, "extra format bytes");
+        if (status != WM_OK)
+        {
+            return status;
+        }
+        formatChunkExtraData = context->formatChunkExtraData.bytes;
+        if (!readInputFileBytes(context, input, formatChunkExtraBytes.startOffset, formatChunkExtraData, formatChunkExtraBytes.size))
+        {
+            return setError(context, WM_ERROR_BAD_WAVE, "Error reading extra format bytes from input file.");
+        }
+    }
+
+    // Write out the header, the ds64 chunk, the format chunk, the JUNK chunk and the data chunk header
+    off_t outputOffset = 0;
+    off_t dataChunkSamplesOffset = 0;
+    struct iovec headerVectors[8];
+    int headerVectorsCount = 0;
+    headerVectors[headerVectorsCount++] = (struct iovec){.iov_base = waveHeader, .iov_len = sizeof(*waveHeader)};
+    if (writeRF64)
+    {
+        headerVectors[headerVectorsCount++] = (struct iovec){.iov_base = &dataSize64Chunk, .iov_len = sizeof(DataSize64Chunk)};
+        if (chunkSizeTableLength > 0)
+        {
+            headerVectors[headerVectorsCount++] = (struct iovec){.iov_base = chunkSizeTable, .iov_len = sizeof(ChunkSize64) * chunkSizeTableLength};
+        }
+    }
+    headerVectors[headerVectorsCount++] = (struct iovec){.iov_base = formatChunk, .iov_len = sizeof(FormatChunk)};
+    if (formatChunkExtraBytes.size > 0)
+    {
+        headerVectors[headerVectorsCount++] = (struct iovec){.iov_base = formatChunkExtraData, .iov_len = formatChunkExtraBytes.size};
+        if (formatChunkExtraBytes.size % 2 != 0)
+        {
+            headerVectors[headerVectorsCount++] = (struct iovec){.iov_base = "\0", .iov_len = 1};
+        }
+    }
+    if (alignmentSize > 0)
+    {
+        headerVectors[headerVectorsCount++] = (struct iovec){.iov_base = context->alignmentChunk.bytes, .iov_len = (size_t)alignmentSize};
+    }
+    headerVectors[headerVectorsCount++] = (struct iovec){.iov_base = dataChunkHeader, .iov_len = sizeof(dataChunkHeader)};
+
+    // The output has the ds64, format, data, cue and LIST chunks and whichever others are copied
+    status = startOutputTap(context, *formatChunk, 5 + chunkIndex->count);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    context->outputTap.expectedChunkSize = dataChunkSamples.size;
+    tapOutputVectors(context, headerVectors, headerVectorsCount);
+
+    if (!queueVectorsToFile(context, outputFd, headerVectors, headerVectorsCount, &outputOffset))
+    {
+        status = setError(context, WM_ERROR_IO, "Error writing header to output file.");
+        goto CleanUpAndExit;
+    }
+
+    // Write out the samples of the data chunk
+    dataChunkSamplesOffset = outputOffset;
+    status = writeChunkLocationFromInputFileToOutputFile(context, dataChunkSamples, input, outputFd, outputOffset);
+    if (status != WM_OK)
+    {
+        goto CleanUpAndExit;
+    }
+    outputOffset += (off_t)dataChunkSamples.size;
+
+    if (context->peakSamplesPerPixel > 0)
+    {
+        status = finishPeaks(context);
+        if (status != WM_OK)
+        {
+            goto CleanUpAndExit;
+        }
+    }
+    if (context->measuresLoudness)
+    {
+        status = finishLoudness(context);
+        if (status != WM_OK)
+        {
+            goto CleanUpAndExit;
+        }
+    }
+
+    // Every sample has gone past, so the markers can now be built with the silences
+    if (hasLateMarkers)
+    {
+        status = finishSilenceDetection(context);
+        if (status == WM_OK)
+        {
+            status = buildCueAndListChunks(context, input, *formatChunk);
+        }
+        if (status != WM_OK)
+        {
+            goto CleanUpAndExit;
+        }
+        fileDataSize = fileDataSize - markerChunksSize + getMarkerChunksSize(context);
+    }
+
+    // Write out the data chunk's padding byte, the new cue chunk and the adtl chunk in one go
+    struct iovec markerVectors[CUE_AND_LIST_VECTORS_COUNT + 1];
+    int markerVectorsCount = 0;
+    if (dataChunkSamples.size % 2 != 0)
+    {
+        markerVectors[markerVectorsCount++] = (struct iovec){.iov_base = "\0", .iov_len = 1};
+    }
+    markerVectorsCount += fillCueAndListVectors(&markerVectors[markerVectorsCount], &context->cueChunk, &context->listChunk, context->listChunkSize);
+    tapOutputVectors(context, markerVectors, markerVectorsCount);
+
+    if (!queueVectorsToFile(context, outputFd, markerVectors, markerVectorsCount, &outputOffset))
+    {
+        status = setError(context, WM_ERROR_IO, "Error writing cue and adtl chunks to output file.");
+        goto CleanUpAndExit;
+    }
+
+    // Write out the other chunks from the input file.  Their padding bytes are left as holes which read back as zeros
+    for (size_t i = 0; i < chunkIndex->count; i++)
+    {
+        const IndexedChunk *chunk = &chunkIndex->chunks[i];
+        if (chunk->isMarkerChunk)
+        {
+            continue;
+        }
+        ChunkLocation chunkLocation = {.startOffset = chunk->startOffset, .size = chunk->size};
+        context->outputTap.expectedChunkSize = chunk->size - 8;
+        status = writeChunkLocationFromInputFileToOutputFile(context, chunkLocation, input, outputFd, outputOffset);
+        if (status != WM_OK)
+        {
+            goto CleanUpAndExit;
+        }
+        tapOutputBytes(context, "\0", chunk->paddingSize);
+        outputOffset += (off_t)(chunk->size + chunk->paddingSize);
+    }
+
+CleanUpAndExit:
+    // Queued writes point into this stack frame, so they have to be finished whatever happened
+    context->outputTap.isActive = false;
+    writesStatus = waitForOutputWrites(context);
+    if (status == WM_OK)
+    {
+        status = writesStatus;
+    }
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    // The header went out with a provisional size, which is now put right
+    if (hasLateMarkers)
+    {
+        char sizeBytes[8];
+        const char *provisionalSizeBytes = writeRF64 ? dataSize64Chunk.riffSize : waveHeader->dataSize;
+        off_t sizeOffset = writeRF64 ? (off_t)(sizeof(WaveHeader) + offsetof(DataSize64Chunk, riffSize)) : (off_t)offsetof(WaveHeader, dataSize);
+        size_t sizeSize = writeRF64 ? 8 : 4;
+        if (writeRF64)
+        {
+            uint64ToLittleEndianBytes(fileDataSize, sizeBytes);
+        }
+        else
+        {
+            uint32ToLittleEndianBytes((uint32_t)fileDataSize, sizeBytes);
+        }
+        retapOutputBytes(context, (uint64_t)sizeOffset, provisionalSizeBytes, sizeBytes, sizeSize, writeRF64 ? 0 : SIZE_MAX, dataSize64ChunkSize - 16);
+
+        struct iovec sizeVector = {.iov_base = sizeBytes, .iov_len = sizeSize};
+        if (writeVectorsToFile(context, outputFd, &sizeVector, 1, &sizeOffset) < 0)
+        {
+            return setError(context, WM_ERROR_IO, "Error writing header to output file.");
+        }
+    }
+
+    if (context->checksumMode == WM_CHECKSUM_VERIFY)
+    {
+        status = verifyOutputSamples(context, outputFd, dataChunkSamplesOffset, dataChunkSamples.size);
+        if (status != WM_OK)
+        {
+            return status;
+        }
+    }
+
+    // Make sure the file also ends with the last padding byte
+    if (ftruncate(outputFd, outputOffset) < 0)
+    {
+        return setError(context, WM_ERROR_IO, "Error writing padding character to output file.");
+    }
+
+    return WM_OK;
+}
+
+static wm_status writeMarkersInPlace(wm_context *context, const WaveInput *input)
+{
+    printProgress(context, "Writing markers in place.\n");
+
+    WaveFileIndex *waveFileIndex = &context->waveFileIndex;
+    int waveFd = input->fd;
+    const ChunkIndex *chunkIndex = &waveFileIndex->chunkIndex;
+    off_t fileEnd = input->size;
+
+    // A truncated file has a chunk that claims bytes past its end, and the new chunks would land inside that chunk's range
+    const ChunkLocation *dataChunk = &waveFileIndex->dataChunkLocation;
+    const IndexedChunk *lastChunk = chunkIndex->count > 0 ? &chunkIndex->chunks[chunkIndex->count - 1] : NULL;
+    if ((dataChunk->startOffset + (off_t)dataChunk->size > fileEnd) || ((lastChunk != NULL) && (lastChunk->startOffset + (off_t)lastChunk->size > fileEnd)))
+    {
+        return setError(context, WM_ERROR_BAD_WAVE, "The wave file is truncated, its chunks run past its end at %lld bytes", (long long)fileEnd);
+    }
+
+    // Walk backwards over any marker chunks that already sit at the end of the file, the new chunks will be written over them.
+    // The index is in file order, so they are the last entries.  The last chunk may be missing its padding byte, so accept either end position
+    off_t appendOffset = fileEnd;
+    for (size_t i = chunkIndex->count; i > 0; i--)
+    {
+        const IndexedChunk *chunk = &chunkIndex->chunks[i - 1];
+        off_t chunkEnd = chunk->startOffset + (off_t)chunk->size;
+        if (!chunk->isMarkerChunk || ((chunkEnd != appendOffset) && (chunkEnd + chunk->paddingSize != appendOffset)))
+        {
+            break;
+        }
+        appendOffset = chunk->startOffset;
+    }
+
+    // Chunks must start on a 2 byte boundary, so add the padding byte the previous chunk was missing, then the new chunks
+    struct iovec markerVectors[CUE_AND_LIST_VECTORS_COUNT + 1];
+    int markerVectorsCount = 0;
+    if (appendOffset % 2 != 0)
+    {
+        markerVectors[markerVectorsCount++] = (struct iovec){.iov_base = "\0", .iov_len = 1};
+    }
+    markerVectorsCount += fillCueAndListVectors(&markerVectors[markerVectorsCount], &context->cueChunk, &context->listChunk, context->listChunkSize);
+
+    off_t newFileEnd = appendOffset;
+    for (int i = 0; i < markerVectorsCount; i++)
+    {
+        newFileEnd += (off_t)markerVectors[i].iov_len;
+    }
+    uint64_t newRiffSize = (uint64_t)newFileEnd - 8; // dataSize does not count the chunkID or the dataSize itself
+
+    // A plain RIFF file that grows past 4GB has to become RF64, which needs room for a ds64 chunk right after the header.
+    // Writers that plan for this leave a JUNK chunk there, without one the file has to be rewritten instead
+    WaveHeader *waveHeader = &waveFileIndex->waveHeader;
+    bool promoteToRF64 = !waveFileIndex->isRF64 && (newRiffSize >= UINT32_MAX);
+    uint32_t reservedChunkDataSize = 0;
+    if (promoteToRF64)
+    {
+        char reservedChunkHeader[8];
+        bool hasReservedChunk = readInputFileBytes(context, input, sizeof(WaveHeader), reservedChunkHeader, sizeof(reservedChunkHeader)) && (strncmp(reservedChunkHeader, "JUNK", 4) == 0);
+        if (hasReservedChunk)
+        {
+            reservedChunkDataSize = littleEndianBytesToUInt32(&reservedChunkHeader[4]);
+        }
+        if (!hasReservedChunk || (reservedChunkDataSize < sizeof(DataSize64Chunk) - 8))
+        {
+            return setError(context, WM_ERROR_LIMIT, "The markers would take the wave file past 4GB and it has no JUNK chunk to turn into an RF64 ds64 chunk, write a new output file instead");
+        }
+    }
+
+    // Marker chunks in the middle of the file can't be removed without moving everything after them,
+    // so rename them to JUNK which every reader skips
+    for (size_t i = 0; i < chunkIndex->count; i++)
+    {
+        const IndexedChunk *chunk = &chunkIndex->chunks[i];
+        if (chunk->isMarkerChunk && (chunk->startOffset < appendOffset))
+        {
+            countWrite(context, 4);
+            if (pwrite(waveFd, "JUNK", 4, chunk->startOffset) != 4)
+            {
+                return setError(context, WM_ERROR_IO, "Error replacing existing marker chunk at offset %lld", (long long)chunk->startOffset);
+            }
+            printProgress(context, "Replaced existing marker chunk at offset %lld with a JUNK chunk\n", (long long)chunk->startOffset);
+        }
+    }
+
+    off_t writeOffset = appendOffset;
+    if (writeVectorsToFile(context, waveFd, markerVectors, markerVectorsCount, &writeOffset) < 0)
+    {
+        return setError(context, WM_ERROR_IO, "Error writing markers to wave file.");
+    }
+
+    // Drop whatever was left of the old marker chunks if the new ones are smaller
+    if (newFileEnd < fileEnd)
+    {
+        if (ftruncate(waveFd, newFileEnd) < 0)
+        {
+            return setError(context, WM_ERROR_IO, "Error truncating wave file.\nError: %d", errno);
+        }
+    }
+
+    // Patch the new size of the file into the header, or into the ds64 chunk of an RF64 file
+    if (waveFileIndex->isRF64 || promoteToRF64)
+    {
+        off_t dataSize64ChunkOffset = waveFileIndex->isRF64 ? waveFileIndex->dataSize64ChunkOffset : (off_t)sizeof(WaveHeader);
+        DataSize64Chunk dataSize64Chunk;
+        countRead(context, sizeof(dataSize64Chunk));
+        if (pread(waveFd, &dataSize64Chunk, sizeof(dataSize64Chunk), dataSize64ChunkOffset) != (ssize_t)sizeof(dataSize64Chunk))
+        {
+            return setError(context, WM_ERROR_IO, "Error reading ds64 chunk of wave file.");
+        }
+
+        if (promoteToRF64)
+        {
+            // Turn the JUNK chunk into a ds64 chunk of the same size
+            uint64_t sampleDataSize = waveFileIndex->dataChunkLocation.size - 8;
+            uint16_t blockAlign = littleEndianBytesToUInt16(waveFileIndex->formatChunk.blockAlign);
+            memset(&dataSize64Chunk, 0, sizeof(dataSize64Chunk));
+            memcpy(dataSize64Chunk.chunkID, "ds64", 4);
+            uint32ToLittleEndianBytes(reservedChunkDataSize, dataSize64Chunk.chunkDataSize);
+            uint64ToLittleEndianBytes(sampleDataSize, dataSize64Chunk.dataSize);
+            uint64ToLittleEndianBytes(blockAlign > 0 ? sampleDataSize / blockAlign : 0, dataSize64Chunk.sampleCount);
+            memcpy(waveHeader->chunkID, "RF64", 4);
+            printProgress(context, "Wave file is now larger than 4GB, converting it to RF64.\n");
+        }
+
+        uint64ToLittleEndianBytes(newRiffSize, dataSize64Chunk.riffSize);
+        countWrite(context, sizeof(dataSize64Chunk));
+        if (pwrite(waveFd, &dataSize64Chunk, sizeof(dataSize64Chunk), dataSize64ChunkOffset) != (ssize_t)sizeof(dataSize64Chunk))
+        {
+            return setError(context, WM_ERROR_IO, "Error writing ds64 chunk to wave file.");
+        }
+
+        uint32ToLittleEndianBytes(UINT32_MAX, waveHeader->dataSize);
+    }
+    else
+    {
+        uint32ToLittleEndianBytes((uint32_t)newRiffSize, waveHeader->dataSize);
+    }
+
+    countWrite(context, sizeof(*waveHeader));
+    if (pwrite(waveFd, waveHeader, sizeof(*waveHeader), 0) != (ssize_t)sizeof(*waveHeader))
+    {
+        return setError(context, WM_ERROR_IO, "Error writing header to wave file.");
+    }
+
+    return WM_OK;
+}
+
+// Existing markers come first at a sample frame, then labels, then silences.  A label that updated an existing marker counts as the marker
+static uint32_t getMergedMarkerRank(const MergedMarker *marker, uint32_t *out_Index)
+{
+    if (marker->existingIndex != NO_MARKER_SOURCE)
+    {
+        *out_Index = marker->existingIndex;
+        return 0;
+    }
+    if (marker->labelIndex != NO_MARKER_SOURCE)
+    {
+        *out_Index = marker->labelIndex;
+        return 1;
+    }
+    *out_Index = marker->silenceIndex;
+    return 2;
+}
+
+static int compareMergedMarkers(const void *a, const void *b)
+{
+    const MergedMarker *markerA = (const MergedMarker *)a;
+    const MergedMarker *markerB = (const MergedMarker *)b;
+
+    // By sample frame, with the existing markers at a frame before the labels there, each in their original order
+    if (markerA->frameOffset != markerB->frameOffset)
+        return markerA->frameOffset < markerB->frameOffset ? -1 : 1;
+    uint32_t indexA;
+    uint32_t indexB;
+    uint32_t rankA = getMergedMarkerRank(markerA, &indexA);
+    uint32_t rankB = getMergedMarkerRank(markerB, &indexB);
+    if (rankA != rankB)
+        return rankA < rankB ? -1 : 1;
+    return indexA < indexB ? -1 : (indexA > indexB);
+}
+
+// Adds a marker for every silence found in the samples at out_Markers, and returns how many
+static uint32_t appendSilenceMarkers(wm_context *context, MergedMarker *out_Markers)
+{
+    const SilenceDetector *silenceDetector = &context->silenceDetector;
+    const Silence *silences = (const Silence *)silenceDetector->silences.bytes;
+    uint32_t markersCount = 0;
+    for (uint32_t i = 0; i < silenceDetector->silencesCount; i++)
+    {
+        if (silences[i].startFrame > UINT32_MAX)
+        {
+            printWarning(context, "The silence at sample %llu is later than the last sample a cue point can point at\n", (unsigned long long)silences[i].startFrame);
+            continue;
+        }
+        out_Markers[markersCount].frameOffset = (uint32_t)silences[i].startFrame;
+        out_Markers[markersCount].labelIndex = NO_MARKER_SOURCE;
+        out_Markers[markersCount].existingIndex = NO_MARKER_SOURCE;
+        out_Markers[markersCount].silenceIndex = i;
+        markersCount++;
+    }
+    return markersCount;
+}
+
+static wm_status mergeMarkers(wm_context *context, const WaveInput *input, FormatChunk formatChunk, uint32_t *out_MarkersCount)
+{
+    const LabelInfo *labelInfo = &context->labelInfo;
+    const ExistingMarkers *existingMarkers = &context->existingMarkers;
+    bool isMerging = (context->mergeMode != WM_MERGE_NONE);
+    uint32_t sampleRate = littleEndianBytesToUInt32(formatChunk.sampleRate);
+    uint32_t existingCount = isMerging ? existingMarkers->count : 0;
+    const SilenceDetector *silenceDetector = &context->silenceDetector;
+
+    wm_status status = reserveBuffer(context, &context->mergedMarkers, sizeof(MergedMarker) * ((size_t)labelInfo->count + existingCount + silenceDetector->silencesCount), "merged markers");
+    if (status == WM_OK)
+        status = reserveBuffer(context, &context->labelFrames, sizeof(uint64_t) * labelInfo->count, "label positions");
+    if (status == WM_OK)
+        status = reserveBuffer(context, &context->labelEndFrames, sizeof(uint64_t) * labelInfo->count, "label positions");
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    MergedMarker *markers = (MergedMarker *)context->mergedMarkers.bytes;
+    uint32_t markersCount = 0;
+
+    // Turn every start and end time into a sample frame in one go
+    uint64_t *labelFrames = (uint64_t *)context->labelFrames.bytes;
+    timesToIndices(labelInfo->startSeconds, labelInfo->startNanoseconds, labelInfo->count, sampleRate, context->rounding, labelFrames);
+    timesToIndices(labelInfo->endSeconds, labelInfo->endNanoseconds, labelInfo->count, sampleRate, context->rounding, (uint64_t *)context->labelEndFrames.bytes);
+
+    for (uint32_t i = 0; i < labelInfo->count; i++)
+    {
+        // Cue points hold a 32 bit sample frame, so labels further into the file than that are left out
+        if (labelFrames[i] > UINT32_MAX)
+        {
+            printWarning(context, "Label %u at %.3f seconds is later than the last sample a cue point can point at\n", i + 1, getLabelStartTime(labelInfo, i));
+            continue;
+        }
+        markers[markersCount].frameOffset = (uint32_t)labelFrames[i];
+        markers[markersCount].labelIndex = i;
+        markers[markersCount].existingIndex = NO_MARKER_SOURCE;
+        markers[markersCount].silenceIndex = NO_MARKER_SOURCE;
+        markersCount++;
+    }
+
+    // Without merging the cue points keep the order of the labels, followed by the silences
+    bool isSnapping = (context->snapMode != WM_SNAP_OFF) && (input != NULL);
+    if (!isMerging)
+    {
+        if (isSnapping)
+        {
+            status = snapMarkers(context, input, formatChunk, markers, markersCount);
+            if (status != WM_OK)
+            {
+                return status;
+            }
+        }
+        *out_MarkersCount = markersCount + appendSilenceMarkers(context, &markers[markersCount]);
+        return WM_OK;
+    }
+
+    const ExistingMarker *existing = (const ExistingMarker *)existingMarkers->markers.bytes;
+    for (uint32_t i = 0; i < existingCount; i++)
+    {
+        markers[markersCount].frameOffset = existing[i].frameOffset;
+        markers[markersCount].labelIndex = NO_MARKER_SOURCE;
+        markers[markersCount].existingIndex = i;
+        markers[markersCount].silenceIndex = NO_MARKER_SOURCE;
+        markersCount++;
+    }
+    qsort(markers, markersCount, sizeof(MergedMarker), compareMergedMarkers);
+
+    // At each sample frame the labels are paired up with the existing markers in order.  A label without text deletes the marker
+    // it is paired with, otherwise the merge mode decides which text wins.  Entries that go away are left with neither source
+    uint32_t updatedCount = 0;
+    uint32_t deletedCount = 0;
+    uint32_t groupStart = 0;
+    while (groupStart < markersCount)
+    {
+        uint32_t labelsStart = groupStart;
+        while ((labelsStart < markersCount) && (markers[labelsStart].frameOffset == markers[groupStart].frameOffset) && (markers[labelsStart].labelIndex == NO_MARKER_SOURCE))
+        {
+            labelsStart++;
+        }
+        uint32_t groupEnd = labelsStart;
+        while ((groupEnd < markersCount) && (markers[groupEnd].frameOffset == markers[groupStart].frameOffset))
+        {
+            groupEnd++;
+        }
+
+        for (uint32_t i = labelsStart; i < groupEnd; i++)
+        {
+            MergedMarker *label = &markers[i];
+            uint32_t pairIndex = groupStart + (i - labelsStart);
+            MergedMarker *pair = pairIndex < labelsStart ? &markers[pairIndex] : NULL;
+            bool isDeletion = (labelInfo->labels[label->labelIndex].textLength == 0);
+
+            if (pair == NULL)
+            {
+                if (isDeletion)
+                {
+                    printWarning(context, "Label %u at %.3f seconds has no text, but there is no marker there to delete\n", label->labelIndex + 1, getLabelStartTime(labelInfo, label->labelIndex));
+                    label->labelIndex = NO_MARKER_SOURCE;
+                }
+                continue;
+            }
+
+            if (isDeletion)
+            {
+                pair->existingIndex = NO_MARKER_SOURCE;
+                deletedCount++;
+            }
+            else if (context->mergeMode == WM_MERGE_UPSERT)
+            {
+                pair->labelIndex = label->labelIndex;
+                updatedCount++;
+            }
+            label->labelIndex = NO_MARKER_SOURCE;
+        }
+
+        groupStart = groupEnd;
+    }
+
+    uint32_t keptCount = 0;
+    for (uint32_t i = 0; i < markersCount; i++)
+    {
+        if ((markers[i].labelIndex != NO_MARKER_SOURCE) || (markers[i].existingIndex != NO_MARKER_SOURCE))
+        {
+            markers[keptCount++] = markers[i];
+        }
+    }
+
+    // Only the labels that add a marker are snapped, one that updates an existing marker stays with it
+    if (isSnapping)
+    {
+        status = snapMarkers(context, input, formatChunk, markers, keptCount);
+        if (status != WM_OK)
+        {
+            return status;
+        }
+    }
+
+    // Silences go in between the others, except where there is already a marker at the sample frame, so marking the silences of
+    // a file that already has them doesn't add them twice
+    uint32_t silencesCount = appendSilenceMarkers(context, &markers[keptCount]);
+    if ((silencesCount > 0) || isSnapping)
+    {
+        qsort(markers, keptCount + silencesCount, sizeof(MergedMarker), compareMergedMarkers);
+        uint32_t markedCount = 0;
+        for (uint32_t i = 0; i < keptCount + silencesCount; i++)
+        {
+            if ((markers[i].silenceIndex == NO_MARKER_SOURCE) || (markedCount == 0) || (markers[markedCount - 1].frameOffset != markers[i].frameOffset))
+            {
+                markers[markedCount++] = markers[i];
+            }
+        }
+        keptCount = markedCount;
+    }
+
+    printProgress(context, "Merged with %u existing markers: %u updated, %u deleted, %u cue points in total.\n", existingCount, updatedCount, deletedCount, keptCount);
+    *out_MarkersCount = keptCount;
+    return WM_OK;
+}
+
+typedef struct
+{
+    uint32_t frameOffset;
+    uint32_t markerIndex;
+} SnapTarget;
+
+static int compareSnapTargets(const void *a, const void *b)
+{
+    const SnapTarget *targetA = (const SnapTarget *)a;
+    const SnapTarget *targetB = (const SnapTarget *)b;
+    if (targetA->frameOffset != targetB->frameOffset)
+        return targetA->frameOffset < targetB->frameOffset ? -1 : 1;
+    return targetA->markerIndex < targetB->markerIndex ? -1 : (targetA->markerIndex > targetB->markerIndex);
+}
+
+// Looks outwards from targetFrame, up to windowFrames either side, for a frame where every channel crosses zero, the earlier one
+// of two just as near.  The frame before the first one is only there for its signs.  Returns SIZE_MAX if there is none
+static size_t findZeroCrossingFrame(const uint8_t *flags, size_t framesCount, uint16_t channelsCount, size_t targetFrame, size_t windowFrames)
+{
+    for (size_t distance = 0; distance <= windowFrames; distance++)
+    {
+        size_t candidates[2] = {targetFrame - distance, targetFrame + distance};
+        for (int side = 0; side < (distance > 0 ? 2 : 1); side++)
+        {
+            size_t frame = candidates[side];
+            if (((side == 0) && (targetFrame < distance)) || (frame < 1) || (frame >= framesCount))
+            {
+                continue;
+            }
+            const uint8_t *frameFlags = &flags[frame * channelsCount];
+            uint16_t crossedCount = 0;
+            while ((crossedCount < channelsCount) && (frameFlags[crossedCount] != 0))
+            {
+                crossedCount++;
+            }
+            if (crossedCount == channelsCount)
+            {
+                return frame;
+            }
+        }
+    }
+    return SIZE_MAX;
+}
+
+// The frame within windowFrames of targetFrame with the smallest sum of squares across the channels, the nearest of several
+static size_t findQuietestFrame(const float *samples, size_t framesCount, uint16_t channelsCount, size_t targetFrame, size_t windowFrames)
+{
+    size_t quietestFrame = targetFrame;
+    float quietestEnergy = INFINITY;
+    for (size_t distance = 0; distance <= windowFrames; distance++)
+    {
+        size_t candidates[2] = {targetFrame - distance, targetFrame + distance};
+        for (int side = 0; side < (distance > 0 ? 2 : 1); side++)
+        {
+            size_t frame = candidates[side];
+            if (((side == 0) && (targetFrame < distance)) || (frame >= framesCount))
+            {
+                continue;
+            }
+            float energy = 0.0f;
+            for (uint16_t channel = 0; channel < channelsCount; channel++)
+            {
+                float sample = samples[frame * channelsCount + channel];
+                energy += sample * sample;
+            }
+            if (energy < quietestEnergy)
+            {
+                quietestEnergy = energy;
+                quietestFrame = frame;
+            }
+        }
+    }
+    return quietestFrame;
+}
+
+static wm_status snapMarkers(wm_context *context, const WaveInput *input, FormatChunk formatChunk, MergedMarker *markers, uint32_t markersCount)
+{
+    SampleDecoder *decoder = &context->sampleDecoder;
+    if (!setUpSampleDecoder(decoder, formatChunk))
+    {
+        return setError(context, WM_ERROR_UNSUPPORTED_FORMAT, "Labels can only be snapped in 8 to 32 bit PCM and 32 or 64 bit float samples");
+    }
+    uint16_t channelsCount = decoder->channelsCount;
+    size_t frameSize = (size_t)decoder->sampleSize * channelsCount;
+
+    // The data chunk of a truncated file ends with the file
+    ChunkLocation dataChunkLocation = context->waveFileIndex.dataChunkLocation;
+    off_t samplesOffset = dataChunkLocation.startOffset + 8;
+    uint64_t samplesSize = dataChunkLocation.size - 8;
+    if ((uint64_t)(input->size - samplesOffset) < samplesSize)
+    {
+        samplesSize = (uint64_t)(input->size - samplesOffset);
+    }
+    uint64_t framesCount = samplesSize / frameSize;
+    size_t windowFrames = (size_t)(context->snapWindowSeconds * littleEndianBytesToUInt32(formatChunk.sampleRate) + 0.5);
+
+    // Visit the labels in sample frame order, so the samples around them are read front to back
+    wm_status status = reserveBuffer(context, &context->snapTargets, sizeof(SnapTarget) * ((size_t)markersCount + 1), "snap targets");
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    SnapTarget *targets = (SnapTarget *)context->snapTargets.bytes;
+    uint32_t targetsCount = 0;
+    for (uint32_t i = 0; i < markersCount; i++)
+    {
+        if ((markers[i].labelIndex != NO_MARKER_SOURCE) && (markers[i].existingIndex == NO_MARKER_SOURCE) && (markers[i].frameOffset < framesCount))
+        {
+            targets[targetsCount].frameOffset = markers[i].frameOffset;
+            targets[targetsCount].markerIndex = i;
+            targetsCount++;
+        }
+    }
+    qsort(targets, targetsCount, sizeof(SnapTarget), compareSnapTargets);
+
+    // The window either side of a label, and the frame before it for the signs
+    size_t regionFramesCount = 2 * windowFrames + 2;
+    status = reserveBuffer(context, &context->snapBytes, regionFramesCount * frameSize, "samples around labels");
+    if (status == WM_OK)
+        status = reserveBuffer(context, &context->snapSamples, sizeof(float) * regionFramesCount * channelsCount, "samples around labels");
+    if (status == WM_OK)
+        status = reserveBuffer(context, &context->snapFlags, regionFramesCount * channelsCount, "zero crossings");
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    float *samples = (float *)context->snapSamples.bytes;
+    uint8_t *flags = (uint8_t *)context->snapFlags.bytes;
+
+    // Ask for all the pages of a mapped file up front, merging the ranges of labels that are close together, so the kernel can
+    // read them in as few requests as it likes rather than one page fault at a time
+    if (input->isMapped)
+    {
+        uintptr_t pageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+        uintptr_t adviceStart = 0;
+        uintptr_t adviceEnd = 0;
+        for (uint32_t i = 0; i <= targetsCount; i++)
+        {
+            uintptr_t rangeStart = 0;
+            uintptr_t rangeEnd = 0;
+            if (i < targetsCount)
+            {
+                uint64_t firstFrame = targets[i].frameOffset > windowFrames ? targets[i].frameOffset - windowFrames - 1 : 0;
+                uint64_t endFrame = (uint64_t)targets[i].frameOffset + windowFrames + 1 < framesCount ? targets[i].frameOffset + windowFrames + 1 : framesCount;
+                rangeStart = (uintptr_t)(input->bytes + samplesOffset + firstFrame * frameSize) & ~(pageSize - 1);
+                rangeEnd = (uintptr_t)(input->bytes + samplesOffset + endFrame * frameSize);
+                if ((adviceEnd != 0) && (rangeStart <= adviceEnd))
+                {
+                    adviceEnd = rangeEnd > adviceEnd ? rangeEnd : adviceEnd;
+                    continue;
+                }
+            }
+            if (adviceEnd != 0)
+            {
+                madvise((void *)adviceStart, adviceEnd - adviceStart, MADV_WILLNEED);
+            }
+            adviceStart = rangeStart;
+            adviceEnd = rangeEnd;
+        }
+    }
+
+    uint32_t movedCount = 0;
+    uint32_t unmovedCount = 0;
+    for (uint32_t i = 0; i < targetsCount; i++)
+    {
+        uint64_t targetFrame = targets[i].frameOffset;
+        uint64_t firstFrame = targetFrame > windowFrames ? targetFrame - windowFrames - 1 : 0;
+        uint64_t endFrame = targetFrame + windowFrames + 1 < framesCount ? targetFrame + windowFrames + 1 : framesCount;
+        size_t framesRead = (size_t)(endFrame - firstFrame);
+        if (!readInputFileBytes(context, input, samplesOffset + (off_t)(firstFrame * frameSize), context->snapBytes.bytes, framesRead * frameSize))
+        {
+            return setError(context, WM_ERROR_IO, "Error reading the samples around label %u", markers[targets[i].markerIndex].labelIndex + 1);
+        }
+        decodeSamples(decoder, (const uint8_t *)context->snapBytes.bytes, framesRead * channelsCount, samples);
+
+        size_t frame;
+        if (context->snapMode == WM_SNAP_ZERO_CROSSING)
+        {
+            markZeroCrossings(samples, framesRead * channelsCount, channelsCount, flags);
+            frame = findZeroCrossingFrame(flags, framesRead, channelsCount, (size_t)(targetFrame - firstFrame), windowFrames);
+        }
+        else
+        {
+            frame = findQuietestFrame(samples, framesRead, channelsCount, (size_t)(targetFrame - firstFrame), windowFrames);
+        }
+
+        if (frame == SIZE_MAX)
+        {
+            unmovedCount++;
+        }
+        else if (firstFrame + frame != targetFrame)
+        {
+            markers[targets[i].markerIndex].frameOffset = (uint32_t)(firstFrame + frame);
+            movedCount++;
+        }
+    }
+
+    if (unmovedCount > 0)
+    {
+        printWarning(context, "%u labels had no zero crossing within %.1f ms and were left where they are\n", unmovedCount, context->snapWindowSeconds * 1000.0);
+    }
+    printProgress(context, "Snapped %u of %u labels.\n", movedCount, targetsCount);
+    return WM_OK;
+}
+
+// Writes a sample frame as seconds with six decimals, the way Audacity writes label times, and returns the number of characters.
+// The time is rounded up to the next microsecond, never down, so that timeToIndex with the default WM_ROUND_DOWN lands on the same
+// frame when the labels are read back: the error is under a microsecond, which is less than a frame at rates up to 1 MHz.  Faster
+// rates get nine decimals, rounded up to the nanosecond the same way
+static size_t putExportTime(char *out_Text, uint64_t frame, uint32_t sampleRate)
+{
+    uint32_t unitsPerSecond = (sampleRate <= 1000000u) ? 1000000u : 1000000000u;
+    uint64_t units = (frame * unitsPerSecond + sampleRate - 1) / sampleRate;
+    char digits[24];
+    size_t digitsCount = 0;
+    uint64_t seconds = units / unitsPerSecond;
+    do
+    {
+        digits[digitsCount++] = (char)('0' + seconds % 10);
+        seconds /= 10;
+    } while (seconds > 0);
+
+    size_t length = 0;
+    while (digitsCount > 0)
+    {
+        out_Text[length++] = digits[--digitsCount];
+    }
+    out_Text[length++] = '.';
+    uint32_t fraction = (uint32_t)(units % unitsPerSecond);
+    for (uint32_t divisor = unitsPerSecond / 10; divisor > 0; divisor /= 10)
+    {
+        out_Text[length++] = (char)('0' + fraction / divisor % 10);
+    }
+    return length;
+}
+
+static wm_status formatExportedLabels(wm_context *context, uint32_t sampleRate, size_t *out_Size)
+{
+    const ExistingMarkers *existingMarkers = &context->existingMarkers;
+    const ExistingMarker *existing = (const ExistingMarker *)existingMarkers->markers.bytes;
+    const ExistingSubchunk *subchunks = (const ExistingSubchunk *)existingMarkers->subchunks.bytes;
+    const char *listData = existingMarkers->listData.bytes;
+
+    // Put the cue points in sample frame order, they can be in any order in the cue chunk
+    wm_status status = reserveBuffer(context, &context->mergedMarkers, sizeof(MergedMarker) * existingMarkers->count, "exported labels");
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    MergedMarker *markers = (MergedMarker *)context->mergedMarkers.bytes;
+    for (uint32_t i = 0; i < existingMarkers->count; i++)
+    {
+        markers[i].frameOffset = existing[i].frameOffset;
+        markers[i].labelIndex = NO_MARKER_SOURCE;
+        markers[i].existingIndex = i;
+    }
+    if (existingMarkers->count > 1)
+    {
+        qsort(markers, existingMarkers->count, sizeof(MergedMarker), compareMergedMarkers);
+    }
+
+    // Two times of at most 20 digits, a point and 6 decimals each, two tabs and a line feed, and the text
+    size_t size = 0;
+    for (uint32_t i = 0; i < existingMarkers->count; i++)
+    {
+        const ExistingMarker *marker = &existing[markers[i].existingIndex];
+        const char *text = NULL;
+        size_t textLength = 0;
+        uint64_t sampleLength = 0;
+        bool hasRegion = false;
+
+        for (uint32_t j = marker->firstSubchunk; j < marker->firstSubchunk + marker->subchunksCount; j++)
+        {
+            const ExistingSubchunk *subchunk = &subchunks[j];
+            if ((text == NULL) && (strncmp(subchunk->chunkID, "labl", 4) == 0))
+            {
+                text = listData + subchunk->dataOffset;
+                textLength = subchunk->dataSize;
+                while ((textLength > 0) && (text[textLength - 1] == 0))
+                {
+                    textLength--;
+                }
+            }
+            else if (!hasRegion && (strncmp(subchunk->chunkID, "ltxt", 4) == 0) && (subchunk->dataSize >= 4))
+            {
+                char sampleLengthBytes[4];
+                memcpy(sampleLengthBytes, listData + subchunk->dataOffset, sizeof(sampleLengthBytes));
+                sampleLength = littleEndianBytesToUInt32(sampleLengthBytes);
+                hasRegion = true;
+            }
+        }
+
+        status = reserveBuffer(context, &context->exportText, size + 2 * 27 + 3 + textLength, "exported labels");
+        if (status != WM_OK)
+        {
+            return status;
+        }
+        char *exportText = context->exportText.bytes;
+        size += putExportTime(&exportText[size], marker->frameOffset, sampleRate);
+        exportText[size++] = '\t';
+        size += putExportTime(&exportText[size], marker->frameOffset + sampleLength, sampleRate);
+        exportText[size++] = '\t';
+
+        // Tabs and line breaks would end the label early, so they become spaces
+        for (size_t k = 0; k < textLength; k++)
+        {
+            char character = text[k];
+            exportText[size++] = ((character == '\t') || (character == '\r') || (character == '\n')) ? ' ' : character;
+        }
+        exportText[size++] = '\n';
+    }
+
+    *out_Size = size;
+    return WM_OK;
+}
+
+// The size of an adtl chunk of dataSize bytes after the cue point ID, and a NUL if addNul, with its padding byte
+static size_t getAdtlChunkSize(size_t dataSize, bool addNul)
+{
+    size_t chunkDataSize = 4 + dataSize + (addNul ? 1 : 0);
+    return 8 + chunkDataSize + (chunkDataSize % 2);
+}
+
+// Writes an adtl chunk at out_Bytes and returns its size
+static size_t putAdtlChunk(char *out_Bytes, const char *chunkID, const char cuePointID[4], const char *data, size_t dataSize, bool addNul)
+{
+    size_t chunkDataSize = 4 + dataSize + (addNul ? 1 : 0);
+    memcpy(&out_Bytes[0], chunkID, 4);
+    uint32ToLittleEndianBytes((uint32_t)chunkDataSize, &out_Bytes[4]);
+    memcpy(&out_Bytes[8], cuePointID, 4);
+    if (dataSize > 0)
+    {
+        memcpy(&out_Bytes[12], data, dataSize);
+    }
+    size_t index = 12 + dataSize;
+    if (addNul)
+    {
+        out_Bytes[index++] = 0;
+    }
+    // add padding if odd length
+    if ((chunkDataSize % 2) != 0)
+    {
+        out_Bytes[index++] = 0;
+    }
+    return index;
+}
+
+// The data of the ltxt chunk that makes a cue point the start of a region of sampleLength samples
+static void putRegionData(char out_Data[REGION_DATA_SIZE], uint64_t sampleLength)
+{
+    memset(out_Data, 0, REGION_DATA_SIZE);
+    uint32ToLittleEndianBytes(sampleLength < UINT32_MAX ? (uint32_t)sampleLength : UINT32_MAX, &out_Data[0]);
+    memcpy(&out_Data[4], "rgn ", 4); // purpose ID, followed by zeros for the country, language, dialect and code page
+}
+
+// The sample length of the region a label marks from the sample frame of its marker, which snapping may have moved, or 0
+static uint64_t getLabelRegionLength(const wm_context *context, const MergedMarker *marker)
+{
+    if (marker->labelIndex == NO_MARKER_SOURCE)
+    {
+        return 0;
+    }
+    uint64_t endFrame = ((const uint64_t *)context->labelEndFrames.bytes)[marker->labelIndex];
+    const LabelInfo *labelInfo = &context->labelInfo;
+    bool isRegion = (labelInfo->endSeconds[marker->labelIndex] != labelInfo->startSeconds[marker->labelIndex]) ||
+                    (labelInfo->endNanoseconds[marker->labelIndex] != labelInfo->startNanoseconds[marker->labelIndex]);
+    return isRegion && (endFrame > marker->frameOffset) ? endFrame - marker->frameOffset : 0;
+}
+
+// Whether an existing adtl chunk goes into the output, the labl of a marker is replaced when a label updates it, and so is its
+// ltxt when the label is a region
+static bool isExistingSubchunkKept(const ExistingSubchunk *subchunk, const MergedMarker *marker, bool hasLabelRegion)
+{
+    if (marker->labelIndex == NO_MARKER_SOURCE)
+    {
+        return true;
+    }
+    return (strncmp(subchunk->chunkID, "labl", 4) != 0) && (!hasLabelRegion || (strncmp(subchunk->chunkID, "ltxt", 4) != 0));
+}
+
+static wm_status buildCueAndListChunks(wm_context *context, const WaveInput *input, FormatChunk formatChunk)
+{
+    const LabelInfo *labelInfo = &context->labelInfo;
+    const ExistingMarkers *existingMarkers = &context->existingMarkers;
+    CueChunk *cueChunk = &context->cueChunk;
+    ListChunk *listChunk = &context->listChunk;
+    size_t listChunkSize = 0;
+    uint32_t cuePointsCount = 0;
+
+    printProgress(context, "Preparing new label chunk.\n");
+
+    wm_status status = mergeMarkers(context, input, formatChunk, &cuePointsCount);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    const MergedMarker *markers = (const MergedMarker *)context->mergedMarkers.bytes;
+    const ExistingMarker *existing = (const ExistingMarker *)existingMarkers->markers.bytes;
+    const ExistingSubchunk *subchunks = (const ExistingSubchunk *)existingMarkers->subchunks.bytes;
+    const Silence *silences = (const Silence *)context->silenceDetector.silences.bytes;
+
+    // Merging can delete every marker and a file can be without silences, which leaves an empty cue chunk,
+    // but labels that all failed to make it are an error
+    if ((cuePointsCount < 1) && (context->mergeMode == WM_MERGE_NONE) && (context->silenceLevel == WM_SILENCE_OFF))
+    {
+        return setError(context, WM_ERROR_NO_LABELS, "Did not find any cue point locations in the label file");
+    }
+
+    // calculate size of List Chunk
+    for (uint32_t i = 0; i < cuePointsCount; i++)
+    {
+        bool hasLabelRegion = (getLabelRegionLength(context, &markers[i]) > 0);
+        if (markers[i].labelIndex != NO_MARKER_SOURCE)
+        {
+            // chunkID (4) + Chunk Data Size (4) + Cuepoint ID (4) + Text + NUL + padding
+            listChunkSize += getAdtlChunkSize(labelInfo->labels[markers[i].labelIndex].textLength, true);
+        }
+        if (hasLabelRegion)
+        {
+            listChunkSize += getAdtlChunkSize(REGION_DATA_SIZE, false);
+        }
+        if (markers[i].silenceIndex != NO_MARKER_SOURCE)
+        {
+            listChunkSize += getAdtlChunkSize(context->silenceTextLength, true) + getAdtlChunkSize(REGION_DATA_SIZE, false);
+        }
+        if (markers[i].existingIndex != NO_MARKER_SOURCE)
+        {
+            const ExistingMarker *marker = &existing[markers[i].existingIndex];
+            for (uint32_t j = marker->firstSubchunk; j < marker->firstSubchunk + marker->subchunksCount; j++)
+            {
+                if (isExistingSubchunkKept(&subchunks[j], &markers[i], hasLabelRegion))
+                {
+                    listChunkSize += getAdtlChunkSize(subchunks[j].dataSize, false);
+                }
+            }
+        }
+    }
+
+    // Create CuePointStructs for each cue location, in memory kept from the previous file if it is big enough
+    status = reserveBuffer(context, &context->cuePoints, sizeof(CuePoint) * cuePointsCount, "Cue Points data");
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    status = reserveBuffer(context, &context->labelChunks, listChunkSize, "Label data");
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    cueChunk->cuePoints = (CuePoint *)context->cuePoints.bytes;
+    listChunk->labelChunks = context->labelChunks.bytes;
+
+    size_t listChunkIndex = 0;
+
+    for (uint32_t i = 0; i < cuePointsCount; i++)
+    {
+        // Cues
+        CuePoint *cuePoint = &cueChunk->cuePoints[i];
+        uint32_t location = markers[i].frameOffset;
+        uint32ToLittleEndianBytes(i + 1, cuePoint->cuePointID);
+        uint32ToLittleEndianBytes(location, cuePoint->playOrderPosition);
+        cuePoint->dataChunkID[0] = 'd';
+        cuePoint->dataChunkID[1] = 'a';
+        cuePoint->dataChunkID[2] = 't';
+        cuePoint->dataChunkID[3] = 'a';
+        uint32ToLittleEndianBytes(0, cuePoint->chunkStart);
+        uint32ToLittleEndianBytes(0, cuePoint->blockStart);
+        uint32ToLittleEndianBytes(location, cuePoint->frameOffset);
+
+        // Labels, and the region of a label with an end time after its start
+        uint64_t regionLength = getLabelRegionLength(context, &markers[i]);
+        if (markers[i].labelIndex != NO_MARKER_SOURCE)
+        {
+            const Label *label = &labelInfo->labels[markers[i].labelIndex];
+            listChunkIndex += putAdtlChunk(&listChunk->labelChunks[listChunkIndex], "labl", cuePoint->cuePointID, getLabelText(labelInfo, label), label->textLength, true);
+        }
+        if (regionLength > 0)
+        {
+            char regionData[REGION_DATA_SIZE];
+            putRegionData(regionData, regionLength);
+            listChunkIndex += putAdtlChunk(&listChunk->labelChunks[listChunkIndex], "ltxt", cuePoint->cuePointID, regionData, REGION_DATA_SIZE, false);
+        }
+
+        // A silence is a region as long as the silence
+        if (markers[i].silenceIndex != NO_MARKER_SOURCE)
+        {
+            const Silence *silence = &silences[markers[i].silenceIndex];
+            char regionData[REGION_DATA_SIZE];
+            putRegionData(regionData, silence->endFrame - silence->startFrame);
+            listChunkIndex += putAdtlChunk(&listChunk->labelChunks[listChunkIndex], "labl", cuePoint->cuePointID, context->silenceText.bytes, context->silenceTextLength, true);
+            listChunkIndex += putAdtlChunk(&listChunk->labelChunks[listChunkIndex], "ltxt", cuePoint->cuePointID, regionData, REGION_DATA_SIZE, false);
+        }
+
+        // The notes, regions and anything else of an existing marker, renumbered to its new cue point
+        if (markers[i].existingIndex != NO_MARKER_SOURCE)
+        {
+            const ExistingMarker *marker = &existing[markers[i].existingIndex];
+            for (uint32_t j = marker->firstSubchunk; j < marker->firstSubchunk + marker->subchunksCount; j++)
+            {
+                if (isExistingSubchunkKept(&subchunks[j], &markers[i], regionLength > 0))
+                {
+                    listChunkIndex += putAdtlChunk(&listChunk->labelChunks[listChunkIndex], subchunks[j].chunkID, cuePoint->cuePointID,
+                                                   existingMarkers->listData.bytes + subchunks[j].dataOffset, subchunks[j].dataSize, false);
+                }
+            }
+        }
+    }
+
+    // Populate the CueChunk Struct
+    cueChunk->chunkID[0] = 'c';
+    cueChunk->chunkID[1] = 'u';
+    cueChunk->chunkID[2] = 'e';
+    cueChunk->chunkID[3] = ' ';
+    uint32ToLittleEndianBytes(4 + (sizeof(CuePoint) * cuePointsCount), cueChunk->chunkDataSize); // See struct definition
+    uint32ToLittleEndianBytes(cuePointsCount, cueChunk->cuePointsCount);
+
+    listChunk->chunkID[0] = 'L';
+    listChunk->chunkID[1] = 'I';
+    listChunk->chunkID[2] = 'S';
+    listChunk->chunkID[3] = 'T';
+    uint32ToLittleEndianBytes(4 + (sizeof(char) * listChunkSize), listChunk->chunkDataSize);
+    listChunk->typeID[0] = 'a';
+    listChunk->typeID[1] = 'd';
+    listChunk->typeID[2] = 't';
+    listChunk->typeID[3] = 'l';
+
+    context->listChunkSize = listChunkSize;
+    return WM_OK;
+}
+
+static uint64_t getMarkerChunksSize(const wm_context *context)
+{
+    uint64_t size = 0;
+    size += 4; // 4 bytes for CueChunk ID "cue "
+    size += 4; // UInt32 for CueChunk.chunkDataSize
+    size += 4; // UInt32 for CueChunk.cuePointsCount
+    size += (sizeof(CuePoint) * littleEndianBytesToUInt32((char *)context->cueChunk.cuePointsCount));
+
+    size += 4; // 4 bytes for ListChunk ID "LIST"
+    size += 4; // UInt32 for ListChunk.chunkDataSize
+    size += 4; // 4 bytes for TypeID "adtl"
+    size += (sizeof(char) * context->listChunkSize);
+    return size;
+}
+
+static int fillCueAndListVectors(struct iovec *vectors, CueChunk *cueChunk, ListChunk *listChunk, size_t listChunkSize)
+{
+    int vectorsCount = 0;
+
+    // The start of new Cue Chunk: chunkID, dataSize and cuePointsCount, then the Cue Points
+    vectors[vectorsCount++] = (struct iovec){.iov_base = cueChunk, .iov_len = sizeof(cueChunk->chunkID) + sizeof(cueChunk->chunkDataSize) + sizeof(cueChunk->cuePointsCount)};
+    vectors[vectorsCount++] = (struct iovec){.iov_base = cueChunk->cuePoints, .iov_len = sizeof(CuePoint) * littleEndianBytesToUInt32(cueChunk->cuePointsCount)};
+
+    // The start of new List Chunk: chunkID, dataSize and TypeID, then the Labels
+    vectors[vectorsCount++] = (struct iovec){.iov_base = listChunk, .iov_len = sizeof(listChunk->chunkID) + sizeof(listChunk->chunkDataSize) + sizeof(listChunk->typeID)};
+    vectors[vectorsCount++] = (struct iovec){.iov_base = listChunk->labelChunks, .iov_len = listChunkSize};
+
+    if ((listChunkSize % 2) != 0)
+    {
+        vectors[vectorsCount++] = (struct iovec){.iov_base = "\0", .iov_len = 1};
+    }
+
+    return vectorsCount;
+}
+
+static int writeVectorsToFile(wm_context *context, int fd, struct iovec *vectors, int vectorsCount, off_t *offset)
+{
+    while (vectorsCount > 0)
+    {
+        ssize_t writtenBytes = (offset != NULL) ? pwritev(fd, vectors, vectorsCount, *offset) : writev(fd, vectors, vectorsCount);
+        countWrite(context, writtenBytes > 0 ? (uint64_t)writtenBytes : 0);
+        if (writtenBytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return -1;
+        }
+        if (offset != NULL)
+        {
+            *offset += writtenBytes;
+        }
+
+        // Step past whatever the kernel managed to write, a short write can stop in the middle of a vector
+        while ((vectorsCount > 0) && ((size_t)writtenBytes >= vectors[0].iov_len))
+        {
+            writtenBytes -= (ssize_t)vectors[0].iov_len;
+            vectors++;
+            vectorsCount--;
+        }
+        if (vectorsCount > 0)
+        {
+            vectors[0].iov_base = (char *)vectors[0].iov_base + writtenBytes;
+            vectors[0].iov_len -= (size_t)writtenBytes;
+        }
+    }
+
+    return 0;
+}
+
+static wm_status writeChunkLocationFromInputFileToOutputFile(wm_context *context, ChunkLocation chunk, const WaveInput *input, int outputFd, off_t outputOffset)
+{
+    // A wave file in memory goes straight out of the caller's buffer
+    if (input->fd < 0)
+    {
+        if (chunk.startOffset + (off_t)chunk.size > input->size)
+        {
+            return setError(context, WM_ERROR_BAD_WAVE, "Copy chunk: Error reading input file");
+        }
+        struct iovec bufferVector = {.iov_base = (void *)(input->bytes + chunk.startOffset), .iov_len = (size_t)chunk.size};
+        if (writeVectorsToFile(context, outputFd, &bufferVector, 1, &outputOffset) < 0)
+        {
+            return setError(context, WM_ERROR_IO, "Copy chunk: Error writing output file");
+        }
+        tapOutputBytes(context, input->bytes + chunk.startOffset, (size_t)chunk.size);
+        context->stats.copied_bytes[WM_COPY_READ_WRITE] += chunk.size;
+        return WM_OK;
+    }
+
+    // Let the kernel copy what it can, unless the bytes are needed for the checksums
+    bool isTapped = context->outputTap.isActive;
+    uint64_t copiedBytes = isTapped ? 0 : copyRangeInKernel(context, input->fd, chunk.startOffset, outputFd, outputOffset, chunk.size);
+    chunk.startOffset += (off_t)copiedBytes;
+    chunk.size -= copiedBytes;
+    outputOffset += (off_t)copiedBytes;
+
+    if (chunk.size == 0)
+    {
+        return WM_OK;
+    }
+
+    CopyRange range = {
+        .inputFd = input->fd,
+        .inputOffset = chunk.startOffset,
+        .outputFd = outputFd,
+        .outputOffset = outputOffset,
+        .streamOutput = NULL,
+        .size = chunk.size};
+    if (context->directIo)
+    {
+        // O_DIRECT applies to every write on the file while it is set, including any still queued on the io_uring
+        wm_status status = waitForOutputWrites(context);
+        if (status != WM_OK)
+        {
+            return status;
+        }
+        return copyDirect(context, &range);
+    }
+    return (!isTapped && useIoRing(context)) ? copyThroughIoRing(context, &range) : copyThroughBuffers(context, &range);
+}
+
+// Allocates the buffers of the copy engine if they haven't been yet.  Huge pages are taken from the huge page pool if it has
+// any, otherwise transparent huge pages are asked for
+static wm_status reserveCopyBuffers(wm_context *context)
+{
+    CopyBuffers *copyBuffers = &context->copyBuffers;
+    if (copyBuffers->memory != NULL)
+    {
+        return WM_OK;
+    }
+
+    size_t memorySize = copyBuffers->bufferSize * (size_t)copyBuffers->buffersCount;
+    void *memory = MAP_FAILED;
+#ifdef MAP_HUGETLB
+    if (copyBuffers->useHugePages)
+    {
+        const size_t hugePageSize = 2 * 1024 * 1024;
+        size_t hugeMemorySize = (memorySize + hugePageSize - 1) / hugePageSize * hugePageSize;
+        memory = mmap(NULL, hugeMemorySize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (memory != MAP_FAILED)
+        {
+            memorySize = hugeMemorySize;
+        }
+    }
+#endif
+    if (memory == MAP_FAILED)
+    {
+        memory = mmap(NULL, memorySize, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (memory == MAP_FAILED)
+        {
+            return setError(context, WM_ERROR_NO_MEMORY, "Memory Allocation Error: Could not allocate %zu bytes of copy buffers", memorySize);
+        }
+#ifdef MADV_HUGEPAGE
+        if (copyBuffers->useHugePages)
+        {
+            madvise(memory, memorySize, MADV_HUGEPAGE);
+        }
+#endif
+    }
+
+    copyBuffers->memory = (char *)memory;
+    copyBuffers->memorySize = memorySize;
+    return WM_OK;
+}
+
+// Fills the buffer with the piece of the range that starts position bytes in. Runs on the reader thread, so it only reports
+// what went wrong and leaves the error message to the writer
+static wm_status readCopyPiece(wm_context *context, const CopyRange *range, uint64_t position, char *buffer, size_t size)
+{
+    if (range->inputOffset < 0)
+    {
+        if (!readStreamBytes(context, range->inputFd, buffer, size))
+        {
+            return WM_ERROR_BAD_WAVE;
+        }
+        return WM_OK;
+    }
+
+    off_t inputOffset = range->inputOffset + (off_t)position;
+    while (size > 0)
+    {
+        ssize_t readBytes = pread(range->inputFd, buffer, size, inputOffset);
+        countRead(context, readBytes > 0 ? (uint64_t)readBytes : 0);
+        if (readBytes < 0)
+        {
+            if (errno == EINTR)
+                continue;
+            return WM_ERROR_IO;
+        }
+        if (readBytes == 0)
+        {
+            return WM_ERROR_BAD_WAVE;
+        }
+        buffer += readBytes;
+        inputOffset += readBytes;
+        size -= (size_t)readBytes;
+    }
+
+    return WM_OK;
+}
+
+static wm_status setCopyReadError(wm_context *context, const CopyRange *range, wm_status status)
+{
+    if (range->inputOffset < 0)
+    {
+        return setError(context, status, "Input ended before the end of the RIFF data");
+    }
+    return setError(context, status, "Copy chunk: Error reading input file");
+}
+
+static wm_status writeCopyPiece(wm_context *context, const CopyRange *range, uint64_t position, char *buffer, size_t size)
+{
+    if (range->streamOutput != NULL)
+    {
+        return writeStreamBytes(context, range->streamOutput, buffer, size);
+    }
+
+    off_t outputOffset = range->outputOffset + (off_t)position;
+    struct iovec bufferVector = {.iov_base = buffer, .iov_len = size};
+    if (writeVectorsToFile(context, range->outputFd, &bufferVector, 1, &outputOffset) < 0)
+    {
+        return setError(context, WM_ERROR_IO, "Copy chunk: Error writing output file");
+    }
+    return WM_OK;
+}
+
+static void *runCopyReader(void *argument)
+{
+    CopyPipeline *pipeline = (CopyPipeline *)argument;
+    const CopyRange *range = pipeline->range;
+    const CopyBuffers *copyBuffers = &pipeline->context->copyBuffers;
+    wm_status status = WM_OK;
+    uint64_t position = 0;
+    int bufferIndex = 0;
+
+    while (position < range->size)
+    {
+        // Wait for the writer to hand back a buffer
+        pthread_mutex_lock(&pipeline->lock);
+        while ((pipeline->filledCount == copyBuffers->buffersCount) && !pipeline->writerFailed)
+        {
+            pthread_cond_wait(&pipeline->changed, &pipeline->lock);
+        }
+        bool writerFailed = pipeline->writerFailed;
+        pthread_mutex_unlock(&pipeline->lock);
+        if (writerFailed)
+        {
+            break;
+        }
+
+        size_t pieceSize = range->size - position < copyBuffers->bufferSize ? (size_t)(range->size - position) : copyBuffers->bufferSize;
+        status = readCopyPiece(pipeline->context, range, position, copyBuffers->memory + (size_t)bufferIndex * copyBuffers->bufferSize, pieceSize);
+        if (status != WM_OK)
+        {
+            break;
+        }
+
+        pthread_mutex_lock(&pipeline->lock);
+        pipeline->filledSizes[bufferIndex] = pieceSize;
+        pipeline->filledCount++;
+        pthread_cond_broadcast(&pipeline->changed);
+        pthread_mutex_unlock(&pipeline->lock);
+
+        bufferIndex = (bufferIndex + 1) % copyBuffers->buffersCount;
+        position += pieceSize;
+    }
+
+    pthread_mutex_lock(&pipeline->lock);
+    pipeline->readerDone = true;
+    pipeline->readerStatus = status;
+    pthread_cond_broadcast(&pipeline->changed);
+    pthread_mutex_unlock(&pipeline->lock);
+
+    return NULL;
+}
+
+static wm_status copyThroughBuffers(wm_context *context, const CopyRange *range)
+{
+    wm_status status = reserveCopyBuffers(context);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    const CopyBuffers *copyBuffers = &context->copyBuffers;
+    CopyPipeline pipeline = {
+        .context = context,
+        .range = range,
+        .filledCount = 0,
+        .readerDone = false,
+        .readerStatus = WM_OK,
+        .writerFailed = false};
+    pthread_t readerThread;
+    bool readAhead = (copyBuffers->buffersCount > 1) && (range->size > copyBuffers->bufferSize);
+
+    if (readAhead)
+    {
+        pthread_mutex_init(&pipeline.lock, NULL);
+        pthread_cond_init(&pipeline.changed, NULL);
+        if (pthread_create(&readerThread, NULL, runCopyReader, &pipeline) != 0)
+        {
+            pthread_mutex_destroy(&pipeline.lock);
+            pthread_cond_destroy(&pipeline.changed);
+            readAhead = false;
+        }
+    }
+
+    // A range that fits in one buffer isn't worth a thread, and without a second buffer there is nothing to overlap
+    if (!readAhead)
+    {
+        uint64_t position = 0;
+        while (position < range->size)
+        {
+            size_t pieceSize = range->size - position < copyBuffers->bufferSize ? (size_t)(range->size - position) : copyBuffers->bufferSize;
+            status = readCopyPiece(context, range, position, copyBuffers->memory, pieceSize);
+            if (status != WM_OK)
+            {
+                return setCopyReadError(context, range, status);
+            }
+            status = writeCopyPiece(context, range, position, copyBuffers->memory, pieceSize);
+            if (status != WM_OK)
+            {
+                return status;
+            }
+            tapOutputBytes(context, copyBuffers->memory, pieceSize);
+            context->stats.copied_bytes[WM_COPY_READ_WRITE] += pieceSize;
+            position += pieceSize;
+        }
+        return WM_OK;
+    }
+
+    uint64_t position = 0;
+    int bufferIndex = 0;
+    while (1)
+    {
+        pthread_mutex_lock(&pipeline.lock);
+        while ((pipeline.filledCount == 0) && !pipeline.readerDone)
+        {
+            pthread_cond_wait(&pipeline.changed, &pipeline.lock);
+        }
+        size_t pieceSize = pipeline.filledCount > 0 ? pipeline.filledSizes[bufferIndex] : 0;
+        pthread_mutex_unlock(&pipeline.lock);
+        if (pieceSize == 0)
+        {
+            break;
+        }
+
+        char *buffer = copyBuffers->memory + (size_t)bufferIndex * copyBuffers->bufferSize;
+        status = writeCopyPiece(context, range, position, buffer, pieceSize);
+        if (status == WM_OK)
+        {
+            tapOutputBytes(context, buffer, pieceSize);
+        }
+
+        pthread_mutex_lock(&pipeline.lock);
+        pipeline.writerFailed = (status != WM_OK);
+        pipeline.filledCount--;
+        pthread_cond_broadcast(&pipeline.changed);
+        pthread_mutex_unlock(&pipeline.lock);
+
+        if (status != WM_OK)
+        {
+            break;
+        }
+        context->stats.copied_bytes[WM_COPY_READ_WRITE] += pieceSize;
+        bufferIndex = (bufferIndex + 1) % copyBuffers->buffersCount;
+        position += pieceSize;
+    }
+
+    pthread_join(readerThread, NULL);
+    pthread_mutex_destroy(&pipeline.lock);
+    pthread_cond_destroy(&pipeline.changed);
+
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    if (pipeline.readerStatus != WM_OK)
+    {
+        return setCopyReadError(context, range, pipeline.readerStatus);
+    }
+    return WM_OK;
+}
+
+// The alignment direct I/O needs for offsets, sizes and memory on the file, or 0 if it can't do direct I/O at all.
+// Where the kernel doesn't say, a page is a safe guess and the copy finds out soon enough if the file can't do it
+static size_t getDirectIoAlignment(int fd)
+{
+    size_t pageSize = (size_t)sysconf(_SC_PAGESIZE);
+#if defined(__linux__) && defined(STATX_DIOALIGN)
+    struct statx fileStatus;
+    if ((statx(fd, "", AT_EMPTY_PATH, STATX_DIOALIGN, &fileStatus) == 0) && ((fileStatus.stx_mask & STATX_DIOALIGN) != 0))
+    {
+        if (fileStatus.stx_dio_offset_align == 0)
+        {
+            return 0;
+        }
+        return fileStatus.stx_dio_offset_align > fileStatus.stx_dio_mem_align ? fileStatus.stx_dio_offset_align : fileStatus.stx_dio_mem_align;
+    }
+#else
+    (void)fd;
+#endif
+    return pageSize;
+}
+
+// Copies through the page cache, but writes out and drops each slice of both files from the cache as soon as it is copied
+static wm_status copyDroppingCache(wm_context *context, const CopyRange *range)
+{
+    uint64_t position = 0;
+    while (position < range->size)
+    {
+        CopyRange slice = *range;
+        slice.inputOffset = range->inputOffset + (off_t)position;
+        slice.outputOffset = range->outputOffset + (off_t)position;
+        slice.size = range->size - position < DROP_CACHE_SLICE_SIZE ? range->size - position : DROP_CACHE_SLICE_SIZE;
+
+        wm_status status = copyThroughBuffers(context, &slice);
+        if (status != WM_OK)
+        {
+            return status;
+        }
+
+        // Dirty pages can't be dropped, so they have to reach the disk first
+        context->stats.sync_calls++;
+#ifdef __linux__
+        sync_file_range(slice.outputFd, slice.outputOffset, (off_t)slice.size, SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE | SYNC_FILE_RANGE_WAIT_AFTER);
+#else
+        fdatasync(slice.outputFd);
+#endif
+        posix_fadvise(slice.inputFd, slice.inputOffset, (off_t)slice.size, POSIX_FADV_DONTNEED);
+        posix_fadvise(slice.outputFd, slice.outputOffset, (off_t)slice.size, POSIX_FADV_DONTNEED);
+        position += slice.size;
+    }
+
+    return WM_OK;
+}
+
+// Copies a range whose output offset and size are multiples of the alignment, with O_DIRECT already set on both files.
+// The input offset can be anything: each piece is read from the aligned offset before it and moved down to the start of the buffer.
+// Sets *out_IsUnsupported if the very first read or write is refused, which is how filesystems without direct I/O answer
+static wm_status copyAlignedRange(wm_context *context, const CopyRange *range, size_t alignment, bool *out_IsUnsupported)
+{
+    const CopyBuffers *copyBuffers = &context->copyBuffers;
+    char *buffer = copyBuffers->memory;
+    size_t maxPieceSize = copyBuffers->bufferSize - alignment;
+    off_t readOffset = range->inputOffset - (range->inputOffset % (off_t)alignment);
+    size_t shift = (size_t)(range->inputOffset - readOffset);
+    uint64_t position = 0;
+
+    *out_IsUnsupported = false;
+    while (position < range->size)
+    {
+        size_t pieceSize = range->size - position < maxPieceSize ? (size_t)(range->size - position) : maxPieceSize;
+        size_t readSize = (shift + pieceSize + alignment - 1) / alignment * alignment;
+
+        // A direct read can only come up short at the end of the file, which is fine as long as the piece itself is all there
+        ssize_t readBytes;
+        do
+        {
+            readBytes = pread(range->inputFd, buffer, readSize, readOffset);
+        } while ((readBytes < 0) && (errno == EINTR));
+        countRead(context, readBytes > 0 ? (uint64_t)readBytes : 0);
+        if ((readBytes < 0) || ((size_t)readBytes < shift + pieceSize))
+        {
+            *out_IsUnsupported = (position == 0) && (readBytes < 0) && (errno == EINVAL);
+            return setError(context, readBytes < 0 ? WM_ERROR_IO : WM_ERROR_BAD_WAVE, "Copy chunk: Error reading input file");
+        }
+        if (shift > 0)
+        {
+            memmove(buffer, buffer + shift, pieceSize);
+        }
+
+        ssize_t writtenBytes;
+        do
+        {
+            writtenBytes = pwrite(range->outputFd, buffer, pieceSize, range->outputOffset + (off_t)position);
+        } while ((writtenBytes < 0) && (errno == EINTR));
+        countWrite(context, writtenBytes > 0 ? (uint64_t)writtenBytes : 0);
+        if ((writtenBytes < 0) || ((size_t)writtenBytes != pieceSize))
+        {
+            *out_IsUnsupported = (position == 0) && (writtenBytes < 0) && (errno == EINVAL);
+            return setError(context, WM_ERROR_IO, "Copy chunk: Error writing output file");
+        }
+        tapOutputBytes(context, buffer, pieceSize);
+
+        context->stats.copied_bytes[WM_COPY_DIRECT] += pieceSize;
+        readOffset += (off_t)pieceSize;
+        position += pieceSize;
+    }
+
+    return WM_OK;
+}
+
+static wm_status copyDirect(wm_context *context, const CopyRange *range)
+{
+    wm_status status = reserveCopyBuffers(context);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+
+    size_t inputAlignment = getDirectIoAlignment(range->inputFd);
+    size_t outputAlignment = getDirectIoAlignment(range->outputFd);
+    size_t alignment = inputAlignment > outputAlignment ? inputAlignment : outputAlignment;
+    if ((inputAlignment == 0) || (outputAlignment == 0) || (alignment > (size_t)sysconf(_SC_PAGESIZE)) || (context->copyBuffers.bufferSize < 2 * alignment))
+    {
+        return copyDroppingCache(context, range);
+    }
+
+    // Only the output offsets of the middle are aligned, so the unaligned head and tail go through the page cache
+    uint64_t headSize = (alignment - (uint64_t)range->outputOffset % alignment) % alignment;
+    if (headSize > range->size)
+    {
+        headSize = range->size;
+    }
+    CopyRange middle = *range;
+    middle.inputOffset += (off_t)headSize;
+    middle.outputOffset += (off_t)headSize;
+    middle.size = (range->size - headSize) / alignment * alignment;
+    if (middle.size == 0)
+    {
+        return copyDroppingCache(context, range);
+    }
+    CopyRange head = *range;
+    head.size = headSize;
+    CopyRange tail = *range;
+    tail.inputOffset = middle.inputOffset + (off_t)middle.size;
+    tail.outputOffset = middle.outputOffset + (off_t)middle.size;
+    tail.size = range->size - headSize - middle.size;
+
+    // The pieces are copied in file order, which the checksums need
+    status = copyDroppingCache(context, &head);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    CopyRange rest = *range;
+    rest.inputOffset = middle.inputOffset;
+    rest.outputOffset = middle.outputOffset;
+    rest.size = range->size - headSize;
+
+    // O_DIRECT is switched on for just this copy, the rest of the file is read and written as usual
+    int inputFlags = fcntl(range->inputFd, F_GETFL);
+    int outputFlags = fcntl(range->outputFd, F_GETFL);
+    if ((inputFlags < 0) || (outputFlags < 0) || (fcntl(range->inputFd, F_SETFL, inputFlags | O_DIRECT) < 0))
+    {
+        return copyDroppingCache(context, &rest);
+    }
+    if (fcntl(range->outputFd, F_SETFL, outputFlags | O_DIRECT) < 0)
+    {
+        fcntl(range->inputFd, F_SETFL, inputFlags);
+        return copyDroppingCache(context, &rest);
+    }
+
+    bool isUnsupported = false;
+    status = copyAlignedRange(context, &middle, alignment, &isUnsupported);
+    fcntl(range->inputFd, F_SETFL, inputFlags);
+    fcntl(range->outputFd, F_SETFL, outputFlags);
+    if (isUnsupported)
+    {
+        return copyDroppingCache(context, &rest);
+    }
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    return copyDroppingCache(context, &tail);
+}
+
+#ifdef __NR_io_uring_setup
+
+static bool useIoRing(wm_context *context)
+{
+    if (context->ioBackend != WM_IO_BACKEND_IO_URING)
+    {
+        return false;
+    }
+
+    IoRing *ring = &context->ioRing;
+    if (ring->fd >= 0)
+    {
+        return true;
+    }
+    if (ring->isUnavailable)
+    {
+        return false;
+    }
+
+    // Kernels older than 5.5 can't take submissions that point at memory which goes away before they complete, so they don't get the ring
+    struct io_uring_params parameters;
+    memset(&parameters, 0, sizeof(parameters));
+    int fd = (int)syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &parameters);
+    if ((fd >= 0) && ((parameters.features & IORING_FEAT_SUBMIT_STABLE) == 0))
+    {
+        close(fd);
+        fd = -1;
+        errno = ENOSYS;
+    }
+    if (fd < 0)
+    {
+        ring->isUnavailable = true;
+        printWarning(context, "io_uring is not available (error %d), writing without it\n", errno);
+        return false;
+    }
+
+    ring->submissionRingSize = parameters.sq_off.array + parameters.sq_entries * sizeof(unsigned);
+    ring->completionRingSize = parameters.cq_off.cqes + parameters.cq_entries * sizeof(struct io_uring_cqe);
+    bool isSingleMapping = (parameters.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (isSingleMapping)
+    {
+        if (ring->completionRingSize > ring->submissionRingSize)
+        {
+            ring->submissionRingSize = ring->completionRingSize;
+        }
+        ring->completionRingSize = ring->submissionRingSize;
+    }
+    ring->entriesSize = parameters.sq_entries * sizeof(struct io_uring_sqe);
+
+    ring->submissionRing = mmap(NULL, ring->submissionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+    ring->completionRing = isSingleMapping ? ring->submissionRing
+                                           : mmap(NULL, ring->completionRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+    ring->entries = mmap(NULL, ring->entriesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+    ring->fd = fd;
+    if ((ring->submissionRing == MAP_FAILED) || (ring->completionRing == MAP_FAILED) || (ring->entries == MAP_FAILED))
+    {
+        closeIoRing(ring);
+        ring->isUnavailable = true;
+        printWarning(context, "io_uring could not be mapped (error %d), writing without it\n", errno);
+        return false;
+    }
+
+    char *submissionRing = (char *)ring->submissionRing;
+    char *completionRing = (char *)ring->completionRing;
+    ring->submissionHead = (unsigned *)(submissionRing + parameters.sq_off.head);
+    ring->submissionTail = (unsigned *)(submissionRing + parameters.sq_off.tail);
+    ring->submissionMask = *(unsigned *)(submissionRing + parameters.sq_off.ring_mask);
+    ring->submissionEntriesCount = parameters.sq_entries;
+    ring->submissionArray = (unsigned *)(submissionRing + parameters.sq_off.array);
+    ring->completionHead = (unsigned *)(completionRing + parameters.cq_off.head);
+    ring->completionTail = (unsigned *)(completionRing + parameters.cq_off.tail);
+    ring->completionMask = *(unsigned *)(completionRing + parameters.cq_off.ring_mask);
+    ring->completions = (struct io_uring_cqe *)(completionRing + parameters.cq_off.cqes);
+    ring->status = WM_OK;
+
+    return true;
+}
+
+static void closeIoRing(IoRing *ring)
+{
+    if (ring->fd < 0)
+    {
+        return;
+    }
+
+    if ((ring->entries != NULL) && (ring->entries != MAP_FAILED))
+        munmap(ring->entries, ring->entriesSize);
+    if ((ring->completionRing != NULL) && (ring->completionRing != MAP_FAILED) && (ring->completionRing != ring->submissionRing))
+        munmap(ring->completionRing, ring->completionRingSize);
+    if ((ring->submissionRing != NULL) && (ring->submissionRing != MAP_FAILED))
+        munmap(ring->submissionRing, ring->submissionRingSize);
+
+    // Closing the ring also unregisters the copy buffers
+    close(ring->fd);
+    ring->fd = -1;
+    ring->entries = NULL;
+    ring->completionRing = NULL;
+    ring->submissionRing = NULL;
+    ring->registeredMemory = NULL;
+}
+
+// Hands the copy buffers to the kernel once, so reads and writes through them skip mapping the pages on every request.
+// Registering needs locked memory, and the ring works just as well with plain reads and writes when there isn't enough
+static void registerCopyBuffers(wm_context *context)
+{
+    IoRing *ring = &context->ioRing;
+    const CopyBuffers *copyBuffers = &context->copyBuffers;
+    if (ring->registeredMemory == copyBuffers->memory)
+    {
+        return;
+    }
+    if (ring->registeredMemory != NULL)
+    {
+        syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        ring->registeredMemory = NULL;
+    }
+
+    struct iovec bufferVectors[MAX_COPY_BUFFERS_COUNT];
+    for (int i = 0; i < copyBuffers->buffersCount; i++)
+    {
+        bufferVectors[i] = (struct iovec){.iov_base = copyBuffers->memory + (size_t)i * copyBuffers->bufferSize, .iov_len = copyBuffers->bufferSize};
+    }
+    if (syscall(__NR_io_uring_register, ring->fd, IORING_REGISTER_BUFFERS, bufferVectors, (unsigned)copyBuffers->buffersCount) == 0)
+    {
+        ring->registeredMemory = copyBuffers->memory;
+    }
+}
+
+// Called before the copy buffers are unmapped
+static void unregisterCopyBuffers(wm_context *context)
+{
+    IoRing *ring = &context->ioRing;
+    if ((ring->fd >= 0) && (ring->registeredMemory != NULL))
+    {
+        syscall(__NR_io_uring_register, ring->fd, IORING_UNREGISTER_BUFFERS, NULL, 0);
+        ring->registeredMemory = NULL;
+    }
+}
+
+// Hands the queued requests to the kernel and waits for at least waitCount of them to complete
+static bool submitToIoRing(wm_context *context, unsigned waitCount)
+{
+    IoRing *ring = &context->ioRing;
+    int result;
+    do
+    {
+        context->stats.ring_calls++;
+        result = (int)syscall(__NR_io_uring_enter, ring->fd, ring->queuedCount, waitCount, waitCount > 0 ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while ((result < 0) && (errno == EINTR));
+
+    if (result < 0)
+    {
+        return false;
+    }
+    ring->queuedCount -= (unsigned)result;
+    ring->inFlightCount += (unsigned)result;
+    return true;
+}
+
+static void queueIoRingRequest(wm_context *context, uint8_t opcode, int fd, const void *address, uint32_t length, off_t offset, int bufferIndex, uint8_t flags, uint64_t userData)
+{
+    IoRing *ring = &context->ioRing;
+    unsigned tail = *ring->submissionTail;
+    if (tail - __atomic_load_n(ring->submissionHead, __ATOMIC_ACQUIRE) == ring->submissionEntriesCount)
+    {
+        submitToIoRing(context, 0);
+    }
+
+    unsigned index = tail & ring->submissionMask;
+    struct io_uring_sqe *entry = &ring->entries[index];
+    memset(entry, 0, sizeof(*entry));
+    entry->opcode = opcode;
+    entry->flags = flags;
+    entry->fd = fd;
+    entry->off = (uint64_t)offset;
+    entry->addr = (uint64_t)(uintptr_t)address;
+    entry->len = length;
+    entry->buf_index = (uint16_t)(bufferIndex < 0 ? 0 : bufferIndex);
+    entry->user_data = userData;
+    ring->submissionArray[index] = index;
+    __atomic_store_n(ring->submissionTail, tail + 1, __ATOMIC_RELEASE);
+    ring->queuedCount++;
+}
+
+// Takes the next completion off the ring, waiting for one if none is ready
+static bool reapIoRingCompletion(wm_context *context, uint64_t *out_UserData, int *out_Result)
+{
+    IoRing *ring = &context->ioRing;
+    unsigned head = *ring->completionHead;
+    while (head == __atomic_load_n(ring->completionTail, __ATOMIC_ACQUIRE))
+    {
+        if (!submitToIoRing(context, 1))
+        {
+            return false;
+        }
+    }
+
+    const struct io_uring_cqe *completion = &ring->completions[head & ring->completionMask];
+    *out_UserData = completion->user_data;
+    *out_Result = completion->res;
+    __atomic_store_n(ring->completionHead, head + 1, __ATOMIC_RELEASE);
+    ring->inFlightCount--;
+    return true;
+}
+
+// Queued header and marker writes only report back when they fail, and the first failure is kept until waitForOutputWrites
+static void completeIoRingWrite(wm_context *context, uint64_t userData, int result)
+{
+    IoRing *ring = &context->ioRing;
+    size_t expectedSize = (size_t)(userData & ~IO_RING_VECTORS_WRITE);
+    if (result >= 0)
+    {
+        context->stats.bytes_written += (uint64_t)result;
+    }
+    if (((result < 0) || ((size_t)result != expectedSize)) && (ring->status == WM_OK))
+    {
+        ring->status = setError(context, WM_ERROR_IO, "Error writing output file.\nError: %d", result < 0 ? -result : ENOSPC);
+    }
+}
+
+static bool queueVectorsToFile(wm_context *context, int fd, struct iovec *vectors, int count, off_t *offset)
+{
+    if (!useIoRing(context))
+    {
+        return writeVectorsToFile(context, fd, vectors, count, offset) >= 0;
+    }
+
+    size_t size = 0;
+    for (int i = 0; i < count; i++)
+    {
+        size += vectors[i].iov_len;
+    }
+    queueIoRingRequest(context, IORING_OP_WRITEV, fd, vectors, (uint32_t)count, *offset, -1, 0, IO_RING_VECTORS_WRITE | size);
+    if (!submitToIoRing(context, 0))
+    {
+        return false;
+    }
+    *offset += (off_t)size;
+    return true;
+}
+
+static wm_status waitForOutputWrites(wm_context *context)
+{
+    IoRing *ring = &context->ioRing;
+    if (ring->fd < 0)
+    {
+        return WM_OK;
+    }
+
+    while ((ring->queuedCount > 0) || (ring->inFlightCount > 0))
+    {
+        uint64_t userData;
+        int result;
+        if (!reapIoRingCompletion(context, &userData, &result))
+        {
+            // The requests can't be accounted for any more, so don't hand out this ring again
+            setError(context, WM_ERROR_IO, "Error waiting for io_uring\nError: %d", errno);
+            closeIoRing(ring);
+            ring->isUnavailable = true;
+            return WM_ERROR_IO;
+        }
+        completeIoRingWrite(context, userData, result);
+    }
+
+    wm_status status = ring->status;
+    ring->status = WM_OK;
+    return status;
+}
+
+static wm_status copyThroughIoRing(wm_context *context, const CopyRange *range)
+{
+    wm_status status = reserveCopyBuffers(context);
+    if (status != WM_OK)
+    {
+        return status;
+    }
+    registerCopyBuffers(context);
+
+    IoRing *ring = &context->ioRing;
+    const CopyBuffers *copyBuffers = &context->copyBuffers;
+    bool isRegistered = ring->registeredMemory != NULL;
+    struct
+    {
+        uint64_t position;
+        size_t size;
+        int readResult;
+        bool isBusy;
+    } pieces[MAX_COPY_BUFFERS_COUNT];
+    memset(pieces, 0, sizeof(pieces));
+    int busyCount = 0;
+    uint64_t position = 0;
+
+    while (((position < range->size) && (status == WM_OK)) || (busyCount > 0))
+    {
+        // Every idle buffer gets the next piece of the range as a read linked to a write, so the write starts
+        // as soon as its read is done without coming back to us
+        for (int i = 0; (i < copyBuffers->buffersCount) && (position < range->size) && (status == WM_OK); i++)
+        {
+            if (pieces[i].isBusy)
+            {
+                continue;
+            }
+            size_t pieceSize = range->size - position < copyBuffers->bufferSize ? (size_t)(range->size - position) : copyBuffers->bufferSize;
+            char *buffer = copyBuffers->memory + (size_t)i * copyBuffers->bufferSize;
+            queueIoRingRequest(context, isRegistered ? IORING_OP_READ_FIXED : IORING_OP_READ, range->inputFd, buffer, (uint32_t)pieceSize,
+                               range->inputOffset + (off_t)position, isRegistered ? i : -1, IOSQE_IO_LINK, (uint64_t)i * 2);
+            queueIoRingRequest(context, isRegistered ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE, range->outputFd, buffer, (uint32_t)pieceSize,
+                               range->outputOffset + (off_t)position, isRegistered ? i : -1, 0, (uint64_t)i * 2 + 1);
+            pieces[i].position = position;
+            pieces[i].size = pieceSize;
+            pieces[i].readResult = 0;
+            pieces[i].isBusy = true;
+            busyCount++;
+            position += pieceSize;
+        }
+
+        uint64_t userData;
+        int result;
+        if (!reapIoRingCompletion(context, &userData, &result))
+        {
+            // The kernel may still be using the buffers, so they are given up along with the ring
+            status = setError(context, WM_ERROR_IO, "Error waiting for io_uring\nError: %d", errno);
+            closeIoRing(ring);
+            ring->isUnavailable = true;
+            context->copyBuffers.memory = NULL;
+            context->copyBuffers.memorySize = 0;
+            return status;
+        }
+        if ((userData & IO_RING_VECTORS_WRITE) != 0)
+        {
+            completeIoRingWrite(context, userData, result);
+            continue;
+        }
+
+        int bufferIndex = (int)(userData / 2);
+        char *buffer = copyBuffers->memory + (size_t)bufferIndex * copyBuffers->bufferSize;
+        if (userData % 2 == 0)
+        {
+            pieces[bufferIndex].readResult = result;
+            if (result > 0)
+            {
+                context->stats.bytes_read += (uint64_t)result;
+            }
+            continue;
+        }
+
+        pieces[bufferIndex].isBusy = false;
+        busyCount--;
+        if (status != WM_OK)
+        {
+            continue;
+        }
+
+        size_t pieceSize = pieces[bufferIndex].size;
+        int readResult = pieces[bufferIndex].readResult;
+        if (result == -ECANCELED)
+        {
+            // A short read cancels the write linked to it, so finish the piece here
+            if (readResult < 0)
+            {
+                status = setError(context, WM_ERROR_IO, "Copy chunk: Error reading input file");
+                continue;
+            }
+            status = readCopyPiece(context, range, pieces[bufferIndex].position + (uint64_t)readResult, buffer + readResult, pieceSize - (size_t)readResult);
+            if (status != WM_OK)
+            {
+                status = setCopyReadError(context, range, status);
+                continue;
+            }
+            status = writeCopyPiece(context, range, pieces[bufferIndex].position, buffer, pieceSize);
+        }
+        else if (result < 0)
+        {
+            status = setError(context, WM_ERROR_IO, "Copy chunk: Error writing output file");
+        }
+        else
+        {
+            context->stats.bytes_written += (uint64_t)result;
+            if ((size_t)result < pieceSize)
+            {
+                status = writeCopyPiece(context, range, pieces[bufferIndex].position + (uint64_t)result, buffer + result, pieceSize - (size_t)result);
+            }
+        }
+        if (status == WM_OK)
+        {
+            context->stats.copied_bytes[WM_COPY_READ_WRITE] += pieceSize;
+        }
+    }
+
+    return status;
+}
+
+#else
+
+static bool useIoRing(wm_context *context)
+{
+    if ((context->ioBackend == WM_IO_BACKEND_IO_URING) && !context->ioRing.isUnavailable)
+    {
+        context->ioRing.isUnavailable = true;
+        printWarning(context, "io_uring is not available on this platform, writing without it\n");
+    }
+    return false;
+}
+
+static void closeIoRing(IoRing *ring)
+{
+    (void)ring;
+}
+
+static void unregisterCopyBuffers(wm_context *context)
+{
+    (void)context;
+}
+
+static bool queueVectorsToFile(wm_context *context, int fd, struct iovec *vectors, int count, off_t *offset)
+{
+    return writeVectorsToFile(context, fd, vectors, count, offset) >= 0;
+}
+
+static wm_status waitForOutputWrites(wm_context *context)
+{
+    (void)context;
+    return WM_OK;
+}
+
+static wm_status copyThroughIoRing(wm_context *context, const CopyRange *range)
+{
+    return copyThroughBuffers(context, range);
+}
+
+#endif
+
+#ifdef __linux__
+
+// The most we ask the kernel to copy in one call, which keeps the length in range of a 32 bit size_t
+static size_t getCopyPieceSize(uint64_t remainingBytes)
+{
+    const uint64_t maxPieceSize = 1 << 30;
+    return (size_t)(remainingBytes < maxPieceSize ? remainingBytes : maxPieceSize);
+}
+
+// Writes a small range with pread/pwrite, used for the unaligned edges around a reflinked range
+static bool copySmallRange(wm_context *context, int inputFd, off_t inputOffset, int outputFd, off_t outputOffset, size_t size)
+{
+    char buffer[4096];
+
+    while (size > 0)
+    {
+        size_t pieceSize = size < sizeof(buffer) ? size : sizeof(buffer);
+        ssize_t readBytes = pread(inputFd, buffer, pieceSize, inputOffset);
+        countRead(context, readBytes > 0 ? (uint64_t)readBytes : 0);
+        if (readBytes <= 0)
+        {
+            return false;
+        }
+        countWrite(context, (uint64_t)readBytes);
+        if (pwrite(outputFd, buffer, (size_t)readBytes, outputOffset) != readBytes)
+        {
+            return false;
+        }
+        inputOffset += readBytes;
+        outputOffset += readBytes;
+        size -= (size_t)readBytes;
+    }
+
+    return true;
+}
+
+// Clones the block aligned middle of the range and copies the unaligned head and tail. Only possible when
+// the input and output offsets sit at the same position within a filesystem block, and both files are on the same reflink capable filesystem
+static bool cloneRange(wm_context *context, int inputFd, off_t inputOffset, int outputFd, off_t outputOffset, uint64_t size)
+{
+    struct stat outputStat;
+    if (fstat(outputFd, &outputStat) < 0 || outputStat.st_blksize <= 0)
+    {
+        return false;
+    }
+
+    off_t blockSize = outputStat.st_blksize;
+    if ((inputOffset % blockSize) != (outputOffset % blockSize))
+    {
+        return false;
+    }
+
+    size_t headSize = (size_t)((blockSize - (inputOffset % blockSize)) % blockSize);
+    if (size < headSize + (uint64_t)blockSize)
+    {
+        return false;
+    }
+    uint64_t cloneSize = ((size - headSize) / (uint64_t)blockSize) * (uint64_t)blockSize;
+    size_t tailSize = (size_t)(size - headSize - cloneSize);
+
+    // Write the head first so the clone never lands beyond the end of the output file
+    if (!copySmallRange(context, inputFd, inputOffset, outputFd, outputOffset, headSize))
+    {
+        return false;
+    }
+
+    struct file_clone_range cloneRange = {
+        .src_fd = inputFd,
+        .src_offset = (uint64_t)(inputOffset + (off_t)headSize),
+        .src_length = cloneSize,
+        .dest_offset = (uint64_t)(outputOffset + (off_t)headSize)};
+    context->stats.copy_calls++;
+    if (ioctl(outputFd, FICLONERANGE, &cloneRange) < 0)
+    {
+        return false;
+    }
+
+    return copySmallRange(context, inputFd, inputOffset + (off_t)(headSize + cloneSize), outputFd, outputOffset + (off_t)(headSize + cloneSize), tailSize);
+}
+
+static uint64_t getCloneAlignmentSize(wm_context *context, const WaveInput *input, int outputFd, off_t inputSamplesOffset, uint64_t samplesSize, uint64_t headerSize)
+{
+    // Tapped outputs and wave files in memory are copied in user space, and with the other copies the offsets don't matter
+    struct stat inputStat;
+    struct stat outputStat;
+    if ((input->fd < 0) || isOutputTapNeeded(context) || (fstat(input->fd, &inputStat) < 0) || (fstat(outputFd, &outputStat) < 0) ||
+        !S_ISREG(outputStat.st_mode) || (outputStat.st_blksize <= 0) || (outputStat.st_blksize > MAX_CLONE_ALIGNMENT_SIZE))
+    {
+        return 0;
+    }
+
+    // cloneRange needs at least one whole block after the unaligned head
+    uint64_t blockSize = (uint64_t)outputStat.st_blksize;
+    uint64_t inputPosition = (uint64_t)inputSamplesOffset % blockSize;
+    if (samplesSize < (blockSize - inputPosition) % blockSize + blockSize)
+    {
+        return 0;
+    }
+
+    // Most filesystems can't clone at all, and their outputs keep the layout they would have without cloning.  Whether a pair of
+    // filesystems can is found out once, by cloning the first block of the input to the start of the output, which the header
+    // and the samples overwrite anyway since the output is longer than the samples
+    if (!context->isCloneProbed || (context->cloneInputDevice != inputStat.st_dev) || (context->cloneOutputDevice != outputStat.st_dev))
+    {
+        struct file_clone_range probeRange = {.src_fd = input->fd, .src_offset = 0, .src_length = blockSize, .dest_offset = 0};
+        context->canClone = (ioctl(outputFd, FICLONERANGE, &probeRange) == 0);
+        context->isCloneProbed = true;
+        context->cloneInputDevice = inputStat.st_dev;
+        context->cloneOutputDevice = outputStat.st_dev;
+    }
+    if (!context->canClone)
+    {
+        return 0;
+    }
+
+    uint64_t size = (inputPosition + blockSize - headerSize % blockSize) % blockSize;
+    if ((size > 0) && (size < 8))
+    {
+        size += blockSize; // Room for the chunk header
+    }
+    return size % 2 == 0 ? size : 0; // Chunks start at even offsets, so an odd gap can't be filled
+}
+
+static uint64_t copyRangeInKernel(wm_context *context, int inputFd, off_t inputOffset, int outputFd, off_t outputOffset, uint64_t size)
+{
+    if (cloneRange(context, inputFd, inputOffset, outputFd, outputOffset, size))
+    {
+        context->stats.copied_bytes[WM_COPY_CLONE] += size;
+        return size;
+    }
+
+    // copy_file_range and sendfile go through the page cache, which is what direct I/O is there to stay out of
+    if (context->directIo)
+    {
+        return 0;
+    }
+
+    uint64_t copiedBytes = 0;
+
+    // copy_file_range keeps the bytes in the kernel and lets NFS, SMB and friends offload the copy to the server
+    while (copiedBytes < size)
+    {
+        off_t fromOffset = inputOffset + (off_t)copiedBytes;
+        off_t toOffset = outputOffset + (off_t)copiedBytes;
+        ssize_t result = copy_file_range(inputFd, &fromOffset, outputFd, &toOffset, getCopyPieceSize(size - copiedBytes), 0);
+        context->stats.copy_calls++;
+        if (result <= 0)
+        {
+            break;
+        }
+        context->stats.copied_bytes[WM_COPY_FILE_RANGE] += (uint64_t)result;
+        copiedBytes += (uint64_t)result;
+    }
+
+    if (copiedBytes == size)
+    {
+        return copiedBytes;
+    }
+
+    // sendfile writes at the current position of the output descriptor, so put it where we need it
+    if (lseek(outputFd, outputOffset + (off_t)copiedBytes, SEEK_SET) < 0)
+    {
+        return copiedBytes;
+    }
+    while (copiedBytes < size)
+    {
+        off_t fromOffset = inputOffset + (off_t)copiedBytes;
+        ssize_t result = sendfile(outputFd, inputFd, &fromOffset, getCopyPieceSize(size - copiedBytes));
+        context->stats.copy_calls++;
+        if (result <= 0)
+        {
+            break;
+        }
+        context->stats.copied_bytes[WM_COPY_SENDFILE] += (uint64_t)result;
+        copiedBytes += (uint64_t)result;
+    }
+
+    return copiedBytes;
+}
+
+#else
+
+static uint64_t getCloneAlignmentSize(wm_context *context, const WaveInput *input, int outputFd, off_t inputSamplesOffset, uint64_t samplesSize, uint64_t headerSize)
+{
+    // Nothing is cloned on this platform
+    (void)context;
+    (void)input;
+    (void)outputFd;
+    (void)inputSamplesOffset;
+    (void)samplesSize;
+    (void)headerSize;
+    return 0;
+}
+
+static uint64_t copyRangeInKernel(wm_context *context, int inputFd, off_t inputOffset, int outputFd, off_t outputOffset, uint64_t size)
+{
+    // No kernel side copy on this platform, everything goes through user space
+    (void)context;
+    (void)inputFd;
+    (void)inputOffset;
+    (void)outputFd;
+    (void)outputOffset;
+    (void)size;
+    return 0;
+}
+
+#endif
+
+static wm_status setError(wm_context *context, wm_status status, const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    vsnprintf(context->errorMessage, sizeof(context->errorMessage), format, arguments);
+    va_end(arguments);
+    return status;
+}
+
+static void printMessage(wm_context *context, wm_message_type type, const char *format, va_list arguments)
+{
+    if (context->messageCallback == NULL)
+    {
+        return;
+    }
+
+    char message[1024];
+    vsnprintf(message, sizeof(message), format, arguments);
+    context->messageCallback(context->messageUserData, type, message);
+}
+
+static void printProgress(wm_context *context, const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    printMessage(context, WM_MESSAGE_PROGRESS, format, arguments);
+    va_end(arguments);
+}
+
+static void printWarning(wm_context *context, const char *format, ...)
+{
+    va_list arguments;
+    va_start(arguments, format);
+    printMessage(context, WM_MESSAGE_WARNING, format, arguments);
+    va_end(arguments);
+}
+
+static wm_status reserveBuffer(wm_context *context, ReusableBuffer *buffer, size_t size, const char *description)
+{
+    if (size <= buffer->capacity)
+    {
+        return WM_OK;
+    }
+
+    size_t newCapacity = buffer->capacity > 0 ? buffer->capacity : 4096;
+    while (newCapacity < size)
+    {
+        newCapacity *= 2;
+    }
+
+    char *newBytes = realloc(buffer->bytes, newCapacity);
+    if (newBytes == NULL)
+    {
+        return setError(context, WM_ERROR_NO_MEMORY, "Memory Allocation Error: Could not allocate memory for %s", description);
+    }
+    buffer->bytes = newBytes;
+    buffer->capacity = newCapacity;
+    return WM_OK;
+}
+
+static void countRead(wm_context *context, uint64_t bytes)
+{
+    context->stats.read_calls++;
+    context->stats.bytes_read += bytes;
+}
+
+static void countWrite(wm_context *context, uint64_t bytes)
+{
+    context->stats.write_calls++;
+    context->stats.bytes_written += bytes;
+}
+
+static uint64_t getClockNanoseconds(clockid_t clock)
+{
+    struct timespec now;
+    clock_gettime(clock, &now);
+    return (uint64_t)now.tv_sec * 1000000000u + (uint64_t)now.tv_nsec;
+}
+
+static void startPhase(PhaseTimer *timer)
+{
+    timer->wallStart = getClockNanoseconds(CLOCK_MONOTONIC);
+    timer->cpuStart = getClockNanoseconds(CLOCK_THREAD_CPUTIME_ID);
+}
+
+static void endPhase(wm_context *context, PhaseTimer *timer, wm_phase phase)
+{
+    context->stats.phase_wall_nanoseconds[phase] += getClockNanoseconds(CLOCK_MONOTONIC) - timer->wallStart;
+    context->stats.phase_cpu_nanoseconds[phase] += getClockNanoseconds(CLOCK_THREAD_CPUTIME_ID) - timer->cpuStart;
+}
+
+static enum HostEndiannessType getHostEndianness()
+{
+    int i = 1;
+    char *p = (char *)&i;
+
+    if (p[0] == 1)
+        return LittleEndian;
+    else
+        return BigEndian;
+}
+
+
+static uint32_t littleEndianBytesToUInt32(char littleEndianBytes[4])
+{
+    if (HostEndianness == EndiannessUndefined)
+    {
+        HostEndianness = getHostEndianness();
+    }
+
+    uint32_t uInt32Value;
+    char *uintValueBytes = (char *)&uInt32Value;
+
+    if (HostEndianness == LittleEndian)
+    {
+        uintValueBytes[0] = littleEndianBytes[0];
+        uintValueBytes[1] = littleEndianBytes[1];
+        uintValueBytes[2] = littleEndianBytes[2];
+        uintValueBytes[3] = littleEndianBytes[3];
+    }
+    else
+    {
+        uintValueBytes[0] = littleEndianBytes[3];
+        uintValueBytes[1] = littleEndianBytes[2];
+        uintValueBytes[2] = littleEndianBytes[1];
+        uintValueBytes[3] = littleEndianBytes[0];
+    }
+
+    return uInt32Value;
+}
+
+static void uint32ToLittleEndianBytes(uint32_t uInt32Value, char out_LittleEndianBytes[4])
+{
+    if (HostEndianness == EndiannessUndefined)
+    {
+        HostEndianness = getHostEndianness();
+    }
+
+    char *uintValueBytes = (char *)&uInt32Value;
+
+    if (HostEndianness == LittleEndian)
+    {
+        out_LittleEndianBytes[0] = uintValueBytes[0];
+        out_LittleEndianBytes[1] = uintValueBytes[1];
+        out_LittleEndianBytes[2] = uintValueBytes[2];
+        out_LittleEndianBytes[3] = uintValueBytes[3];
+    }
+    else
+    {
+        out_LittleEndianBytes[0] = uintValueBytes[3];
+        out_LittleEndianBytes[1] = uintValueBytes[2];
+        out_LittleEndianBytes[2] = uintValueBytes[1];
+        out_LittleEndianBytes[3] = uintValueBytes[0];
+    }
+}
+
+static uint16_t littleEndianBytesToUInt16(char littleEndianBytes[2])
+{
+    if (HostEndianness == EndiannessUndefined)
+    {
+        HostEndianness = getHostEndianness();
+    }
+
+    uint16_t uInt16Value;
+    char *uintValueBytes = (char *)&uInt16Value;
+
+    if (HostEndianness == LittleEndian)
+    {
+        uintValueBytes[0] = littleEndianBytes[0];
+        uintValueBytes[1] = littleEndianBytes[1];
+    }
+    else
+    {
+        uintValueBytes[0] = littleEndianBytes[1];
+        uintValueBytes[1] = littleEndianBytes[0];
+    }
+
+    return uInt16Value;
+}
+
+static uint64_t littleEndianBytesToUInt64(char littleEndianBytes[8])
+{
+    return (uint64_t)littleEndianBytesToUInt32(&littleEndianBytes[0]) | ((uint64_t)littleEndianBytesToUInt32(&littleEndianBytes[4]) << 32);
+}
+
+static void uint64ToLittleEndianBytes(uint64_t uInt64Value, char out_LittleEndianBytes[8])
+{
+    uint32ToLittleEndianBytes((uint32_t)(uInt64Value & 0xFFFFFFFF), &out_LittleEndianBytes[0]);
+    uint32ToLittleEndianBytes((uint32_t)(uInt64Value >> 32), &out_LittleEndianBytes[4]);
+}
+
+static uint64_t timeToIndex(LabelTime time, uint32_t sampleRate, wm_rounding rounding)
+{
+    // The whole seconds are whole frames, only the nanoseconds need rounding.  Both products fit in 64 bits
+    uint64_t fraction = (uint64_t)time.nanoseconds * sampleRate;
+    uint64_t index = (uint64_t)time.seconds * sampleRate;
+    switch (rounding)
+    {
+    case WM_ROUND_NEAREST:
+        return index + (fraction + 500000000u) / 1000000000u;
+    case WM_ROUND_UP:
+        return index + (fraction + 999999999u) / 1000000000u;
+    case WM_ROUND_DOWN:
+    default:
+        return index + fraction / 1000000000u;
+    }
+}
+
+// Sample rates below this keep nanoseconds * sampleRate under 2^50, where the product is exact in a double and the quotient by 10^9
+// is never rounded across a whole number, because it is always at least 10^-9 away from one and a double has 2^-32 to spare there
+#define MAX_VECTOR_SAMPLE_RATE (1u << 20)
+
+static void timesToIndices(const uint32_t *seconds, const uint32_t *nanoseconds, uint32_t count, uint32_t sampleRate, wm_rounding rounding, uint64_t *out_Frames)
+{
+    uint32_t i = 0;
+#if defined(__AVX2__)
+    if (sampleRate < MAX_VECTOR_SAMPLE_RATE)
+    {
+        const __m256d rate = _mm256_set1_pd((double)sampleRate);
+        const __m256d nanosecondsPerSecond = _mm256_set1_pd(1e9);
+        const __m256d bias = _mm256_set1_pd(rounding == WM_ROUND_NEAREST ? 5e8 : 0.0);
+        const __m256i rate64 = _mm256_set1_epi64x(sampleRate);
+        for (; i + 4 <= count; i += 4)
+        {
+            // The fraction of a second in frames, in doubles
+            __m256d fraction = _mm256_cvtepi32_pd(_mm_loadu_si128((const __m128i *)&nanoseconds[i]));
+            __m256d frames = _mm256_div_pd(_mm256_add_pd(_mm256_mul_pd(fraction, rate), bias), nanosecondsPerSecond);
+            frames = (rounding == WM_ROUND_UP) ? _mm256_ceil_pd(frames) : _mm256_floor_pd(frames);
+            __m256i fractionFrames = _mm256_cvtepi32_epi64(_mm256_cvttpd_epi32(frames));
+
+            // The whole seconds in frames, multiplied as 32 bit numbers into 64 bit products
+            __m256i wholeFrames = _mm256_mul_epu32(_mm256_cvtepu32_epi64(_mm_loadu_si128((const __m128i *)&seconds[i])), rate64);
+            _mm256_storeu_si256((__m256i *)&out_Frames[i], _mm256_add_epi64(wholeFrames, fractionFrames));
+        }
+    }
+#elif defined(__SSE2__)
+    if (sampleRate < MAX_VECTOR_SAMPLE_RATE)
+    {
+        // SSE2 has no floor or ceil, so the rounding is done the way timeToIndex does it, by adding a bias before the quotient is
+        // truncated.  The numerator is a whole number, so the quotient is either exact or at least 10^-9 away from the next frame
+        const __m128d rate = _mm_set1_pd((double)sampleRate);
+        const __m128d nanosecondsPerSecond = _mm_set1_pd(1e9);
+        const __m128d bias = _mm_set1_pd(rounding == WM_ROUND_NEAREST ? 5e8 : (rounding == WM_ROUND_UP ? 999999999.0 : 0.0));
+        const __m128i rate64 = _mm_set1_epi64x(sampleRate);
+        const __m128i zero = _mm_setzero_si128();
+        for (; i + 2 <= count; i += 2)
+        {
+            // The fraction of a second in frames, which is never negative, so it widens to 64 bits with zeros
+            __m128d fraction = _mm_cvtepi32_pd(_mm_loadl_epi64((const __m128i *)&nanoseconds[i]));
+            __m128d frames = _mm_div_pd(_mm_add_pd(_mm_mul_pd(fraction, rate), bias), nanosecondsPerSecond);
+            __m128i fractionFrames = _mm_unpacklo_epi32(_mm_cvttpd_epi32(frames), zero);
+
+            // The whole seconds in frames, multiplied as 32 bit numbers into 64 bit products
+            __m128i wholeFrames = _mm_mul_epu32(_mm_unpacklo_epi32(_mm_loadl_epi64((const __m128i *)&seconds[i]), zero), rate64);
+            _mm_storeu_si128((__m128i *)&out_Frames[i], _mm_add_epi64(wholeFrames, fractionFrames));
+        }
+    }
+#endif
+    for (; i < count; i++)
+    {
+        LabelTime time = {.seconds = seconds[i], .nanoseconds = nanoseconds[i]};
+        out_Frames[i] = timeToIndex(time, sampleRate, rounding);
+    }
+}
+
+#if !defined(__SSE4_2__) && !defined(__ARM_FEATURE_CRC32)
+// Slicing by 8 tables, filled in the first time they are needed
+static uint32_t Crc32cTable[8][256];
+static pthread_once_t Crc32cTableOnce = PTHREAD_ONCE_INIT;
+
+static void fillCrc32cTable(void)
+{
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        uint32_t crc = i;
+        for (int bit = 0; bit < 8; bit++)
+        {
+            crc = (crc >> 1) ^ (0x82F63B78u & (0u - (crc & 1)));
+        }
+        Crc32cTable[0][i] = crc;
+    }
+    for (uint32_t i = 0; i < 256; i++)
+    {
+        for (int slice = 1; slice < 8; slice++)
+        {
+            Crc32cTable[slice][i] = (Crc32cTable[slice - 1][i] >> 8) ^ Crc32cTable[0][Crc32cTable[slice - 1][i] & 0xFF];
+        }
+    }
+}
+#endif
+
+static uint32_t updateCrc32c(uint32_t crc, const void *bytes, size_t size)
+{
+    const uint8_t *position = (const uint8_t *)bytes;
+    crc = ~crc;
+
+#if defined(__SSE4_2__) && defined(__x86_64__)
+    for (; (size > 0) && (((uintptr_t)position & 7) != 0); size--)
+    {
+        crc = _mm_crc32_u8(crc, *position++);
+    }
+    uint64_t crc64 = crc;
+    for (; size >= 8; size -= 8, position += 8)
+    {
+        uint64_t word;
+        memcpy(&word, position, 8);
+        crc64 = _mm_crc32_u64(crc64, word);
+    }
+    crc = (uint32_t)crc64;
+    for (; size > 0; size--)
+    {
+        crc = _mm_crc32_u8(crc, *position++);
+    }
+#elif defined(__SSE4_2__)
+    for (; size >= 4; size -= 4, position += 4)
+    {
+        uint32_t word;
+        memcpy(&word, position, 4);
+        crc = _mm_crc32_u32(crc, word);
+    }
+    for (; size > 0; size--)
+    {
+        crc = _mm_crc32_u8(crc, *position++);
+    }
+#elif defined(__ARM_FEATURE_CRC32)
+    for (; size >= 8; size -= 8, position += 8)
+    {
+        uint64_t word;
+        memcpy(&word, position, 8);
+        crc = __crc32cd(crc, word);
+    }
+    for (; size > 0; size--)
+    {
+        crc = __crc32cb(crc, *position++);
+    }
+#else
+    pthread_once(&Crc32cTableOnce, fillCrc32cTable);
+    for (; size >= 8; size -= 8, position += 8)
+    {
+        crc = Crc32cTable[7][(position[0] ^ crc) & 0xFF] ^ Crc32cTable[6][(position[1] ^ (crc >> 8)) & 0xFF] ^
+              Crc32cTable[5][(position[2] ^ (crc >> 16)) & 0xFF] ^ Crc32cTable[4][position[3] ^ (crc >> 24)] ^
+              Crc32cTable[3][position[4]] ^ Crc32cTable[2][position[5]] ^ Crc32cTable[1][position[6]] ^ Crc32cTable[0][position[7]];
+    }
+    for (; size > 0; size--)
+    {
+        crc = (crc >> 8) ^ Crc32cTable[0][(crc ^ *position++) & 0xFF];
+    }
+#endif
+
+    return ~crc;
+}
+
+static uint32_t multiplyCrc32c(uint32_t a, uint32_t b)
+{
+    // Polynomials modulo the CRC-32C polynomial, with the bits reflected the way the CRC keeps them
+    uint32_t product = 0;
+    for (uint32_t bit = 1u << 31; bit != 0; bit >>= 1)
+    {
+        if ((a & bit) != 0)
+        {
+            product ^= b;
+        }
+        b = (b >> 1) ^ (0x82F63B78u & (0u - (b & 1)));
+    }
+    return product;
+}
+
+static uint32_t shiftCrc32c(uint32_t crc, uint64_t bytesCount)
+{
+    // Multiplies by x^(8 * bytesCount), going through the powers x^8, x^16, x^32... for the bits of bytesCount
+    uint32_t power = 1u << 23; // x^8
+    while (bytesCount > 0)
+    {
+        if ((bytesCount & 1) != 0)
+        {
+            crc = multiplyCrc32c(power, crc);
+        }
+        power = multiplyCrc32c(power, power);
+        bytesCount >>= 1;
+    }
+    return crc;
+}
+
+static void measureSamples(const float *samples, size_t count, float *io_Peak, double *io_SumSquares)
+{
+    size_t i = 0;
+    float peak = *io_Peak;
+    float sumSquares = 0.0f;
+#if defined(__AVX2__)
+    const __m256 signMask = _mm256_set1_ps(-0.0f);
+    __m256 peaks = _mm256_setzero_ps();
+    __m256 sums = _mm256_setzero_ps();
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 values = _mm256_loadu_ps(&samples[i]);
+        peaks = _mm256_max_ps(peaks, _mm256_andnot_ps(signMask, values));
+        sums = _mm256_add_ps(sums, _mm256_mul_ps(values, values));
+    }
+    float lanes[8];
+    _mm256_storeu_ps(lanes, peaks);
+    for (int lane = 0; lane < 8; lane++)
+        peak = lanes[lane] > peak ? lanes[lane] : peak;
+    _mm256_storeu_ps(lanes, sums);
+    for (int lane = 0; lane < 8; lane++)
+        sumSquares += lanes[lane];
+#elif defined(__SSE2__)
+    const __m128 signMask = _mm_set1_ps(-0.0f);
+    __m128 peaks = _mm_setzero_ps();
+    __m128 sums = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 values = _mm_loadu_ps(&samples[i]);
+        peaks = _mm_max_ps(peaks, _mm_andnot_ps(signMask, values));
+        sums = _mm_add_ps(sums, _mm_mul_ps(values, values));
+    }
+    float lanes[4];
+    _mm_storeu_ps(lanes, peaks);
+    for (int lane = 0; lane < 4; lane++)
+        peak = lanes[lane] > peak ? lanes[lane] : peak;
+    _mm_storeu_ps(lanes, sums);
+    for (int lane = 0; lane < 4; lane++)
+        sumSquares += lanes[lane];
+#endif
+    for (; i < count; i++)
+    {
+        float magnitude = fabsf(samples[i]);
+        peak = magnitude > peak ? magnitude : peak;
+        sumSquares += samples[i] * samples[i];
+    }
+
+    *io_Peak = peak;
+    *io_SumSquares += sumSquares;
+}
+
+static void markZeroCrossings(const float *samples, size_t count, uint16_t channelsCount, uint8_t *out_Flags)
+{
+    // The sign bit of the two samples XORed together is set where the sign changes
+    size_t i = channelsCount;
+#if defined(__AVX2__)
+    const __m256 zero = _mm256_setzero_ps();
+    for (; i + 8 <= count; i += 8)
+    {
+        __m256 current = _mm256_loadu_ps(&samples[i]);
+        __m256 previous = _mm256_loadu_ps(&samples[i - channelsCount]);
+        int crossings = _mm256_movemask_ps(_mm256_or_ps(_mm256_xor_ps(current, previous), _mm256_cmp_ps(current, zero, _CMP_EQ_OQ)));
+        for (int lane = 0; lane < 8; lane++)
+            out_Flags[i + lane] = (uint8_t)((crossings >> lane) & 1);
+    }
+#elif defined(__SSE2__)
+    const __m128 zero = _mm_setzero_ps();
+    for (; i + 4 <= count; i += 4)
+    {
+        __m128 current = _mm_loadu_ps(&samples[i]);
+        __m128 previous = _mm_loadu_ps(&samples[i - channelsCount]);
+        int crossings = _mm_movemask_ps(_mm_or_ps(_mm_xor_ps(current, previous), _mm_cmpeq_ps(current, zero)));
+        for (int lane = 0; lane < 4; lane++)
+            out_Flags[i + lane] = (uint8_t)((crossings >> lane) & 1);
+    }
+#endif
+    for (; i < count; i++)
+    {
+        out_Flags[i] = (samples[i] == 0.0f) || (signbit(samples[i]) != signbit(samples[i - channelsCount]));
+    }
+}
+
+static void measureChannels(const float *samples, size_t framesCount, uint16_t channelsCount, PeakAccumulator *io_Accumulators)
+{
+    // With a number of channels that divides the lanes, each lane always holds the same channel
+    size_t count = framesCount * channelsCount;
+    size_t i = 0;
+#if defined(__AVX2__)
+    if (8 % channelsCount == 0)
+    {
+        __m256 mins = _mm256_set1_ps(INFINITY);
+        __m256 maxs = _mm256_set1_ps(-INFINITY);
+        __m256 sums = _mm256_setzero_ps();
+        for (; i + 8 <= count; i += 8)
+        {
+            __m256 values = _mm256_loadu_ps(&samples[i]);
+            mins = _mm256_min_ps(mins, values);
+            maxs = _mm256_max_ps(maxs, values);
+            sums = _mm256_add_ps(sums, _mm256_mul_ps(values, values));
+        }
+        float laneMins[8];
+        float laneMaxs[8];
+        float laneSums[8];
+        _mm256_storeu_ps(laneMins, mins);
+        _mm256_storeu_ps(laneMaxs, maxs);
+        _mm256_storeu_ps(laneSums, sums);
+        for (int lane = 0; lane < 8; lane++)
+        {
+            PeakAccumulator *accumulator = &io_Accumulators[lane % channelsCount];
+            accumulator->min = laneMins[lane] < accumulator->min ? laneMins[lane] : accumulator->min;
+            accumulator->max = laneMaxs[lane] > accumulator->max ? laneMaxs[lane] : accumulator->max;
+            accumulator->sumSquares += laneSums[lane];
+        }
+    }
+#elif defined(__SSE2__)
+    if (4 % channelsCount == 0)
+    {
+        __m128 mins = _mm_set1_ps(INFINITY);
+        __m128 maxs = _mm_set1_ps(-INFINITY);
+        __m128 sums = _mm_setzero_ps();
+        for (; i + 4 <= count; i += 4)
+        {
+            __m128 values = _mm_loadu_ps(&samples[i]);
+            mins = _mm_min_ps(mins, values);
+            maxs = _mm_max_ps(maxs, values);
+            sums = _mm_add_ps(sums, _mm_mul_ps(values, values));
+        }
+        float laneMins[4];
+        float laneMaxs[4];
+        float laneSums[4];
+        _mm_storeu_ps(laneMins, mins);
+        _mm_storeu_ps(laneMaxs, maxs);
+        _mm_storeu_ps(laneSums, sums);
+        for (int lane = 0; lane < 4; lane++)
+        {
+            PeakAccumulator *accumulator = &io_Accumulators[lane % channelsCount];
+            accumulator->min = laneMins[lane] < accumulator->min ? laneMins[lane] : accumulator->min;
+            accumulator->max = laneMaxs[lane] > accumulator->max ? laneMaxs[lane] : accumulator->max;
+            accumulator->sumSquares += laneSums[lane];
+        }
+    }
+#endif
+    for (; i < count; i += channelsCount)
+    {
+        for (uint16_t channel = 0; channel < channelsCount; channel++)
+        {
+            float sample = samples[i + channel];
+            PeakAccumulator *accumulator = &io_Accumulators[channel];
+            accumulator->min = sample < accumulator->min ? sample : accumulator->min;
+            accumulator->max = sample > accumulator->max ? sample : accumulator->max;
+            accumulator->sumSquares += (double)sample * sample;
+        }
+    }
+}
+
+#if defined(__AVX2__)
+static void filterFourChannels(LoudnessMeter *meter, const float *samples, size_t framesCount, uint16_t firstChannel)
+{
+    // The same filters run on four channels side by side, one frame at a time, as the delays of each frame depend on the last
+    __m256d pre[5];
+    __m256d rlb[5];
+    for (int i = 0; i < 5; i++)
+    {
+        pre[i] = _mm256_set1_pd(meter->filter[0][i]);
+        rlb[i] = _mm256_set1_pd(meter->filter[1][i]);
+    }
+    __m256d s1 = _mm256_loadu_pd(&meter->filterState[0][firstChannel]);
+    __m256d s2 = _mm256_loadu_pd(&meter->filterState[1][firstChannel]);
+    __m256d s3 = _mm256_loadu_pd(&meter->filterState[2][firstChannel]);
+    __m256d s4 = _mm256_loadu_pd(&meter->filterState[3][firstChannel]);
+    __m256d weights = _mm256_loadu_pd(&meter->weights[firstChannel]);
+    uint16_t channelsCount = meter->channelsCount;
+    for (size_t frame = 0; frame < framesCount; frame++)
+    {
+        __m256d x = _mm256_cvtps_pd(_mm_loadu_ps(&samples[frame * channelsCount + firstChannel]));
+        __m256d y = _mm256_add_pd(_mm256_mul_pd(pre[0], x), s1);
+        s1 = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(pre[1], x), _mm256_mul_pd(pre[3], y)), s2);
+        s2 = _mm256_sub_pd(_mm256_mul_pd(pre[2], x), _mm256_mul_pd(pre[4], y));
+        __m256d z = _mm256_add_pd(_mm256_mul_pd(rlb[0], y), s3);
+        s3 = _mm256_add_pd(_mm256_sub_pd(_mm256_mul_pd(rlb[1], y), _mm256_mul_pd(rlb[3], z)), s4);
+        s4 = _mm256_sub_pd(_mm256_mul_pd(rlb[2], y), _mm256_mul_pd(rlb[4], z));
+
+        __m256d energies = _mm256_mul_pd(weights, _mm256_mul_pd(z, z));
+        __m128d sums = _mm_add_pd(_mm256_castpd256_pd128(energies), _mm256_extractf128_pd(energies, 1));
+        meter->frameEnergies[frame] += _mm_cvtsd_f64(_mm_add_sd(sums, _mm_unpackhi_pd(sums, sums)));
+    }
+    _mm256_storeu_pd(&meter->filterState[0][firstChannel], s1);
+    _mm256_storeu_pd(&meter->filterState[1][firstChannel], s2);
+    _mm256_storeu_pd(&meter->filterState[2][firstChannel], s3);
+    _mm256_storeu_pd(&meter->filterState[3][firstChannel], s4);
+}
+#endif
+
+#if defined(__SSE2__)
+static void filterTwoChannels(LoudnessMeter *meter, const float *samples, size_t framesCount, uint16_t firstChannel)
+{
+    __m128d pre[5];
+    __m128d rlb[5];
+    for (int i = 0; i < 5; i++)
+    {
+        pre[i] = _mm_set1_pd(meter->filter[0][i]);
+        rlb[i] = _mm_set1_pd(meter->filter[1][i]);
+    }
+    __m128d s1 = _mm_loadu_pd(&meter->filterState[0][firstChannel]);
+    __m128d s2 = _mm_loadu_pd(&meter->filterState[1][firstChannel]);
+    __m128d s3 = _mm_loadu_pd(&meter->filterState[2][firstChannel]);
+    __m128d s4 = _mm_loadu_pd(&meter->filterState[3][firstChannel]);
+    __m128d weights = _mm_loadu_pd(&meter->weights[firstChannel]);
+    uint16_t channelsCount = meter->channelsCount;
+    for (size_t frame = 0; frame < framesCount; frame++)
+    {
+        __m128d x = _mm_cvtps_pd(_mm_castsi128_ps(_mm_loadl_epi64((const __m128i *)&samples[frame * channelsCount + firstChannel])));
+        __m128d y = _mm_add_pd(_mm_mul_pd(pre[0], x), s1);
+        s1 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(pre[1], x), _mm_mul_pd(pre[3], y)), s2);
+        s2 = _mm_sub_pd(_mm_mul_pd(pre[2], x), _mm_mul_pd(pre[4], y));
+        __m128d z = _mm_add_pd(_mm_mul_pd(rlb[0], y), s3);
+        s3 = _mm_add_pd(_mm_sub_pd(_mm_mul_pd(rlb[1], y), _mm_mul_pd(rlb[3], z)), s4);
+        s4 = _mm_sub_pd(_mm_mul_pd(rlb[2], y), _mm_mul_pd(rlb[4], z));
+
+        __m128d energies = _mm_mul_pd(weights, _mm_mul_pd(z, z));
+        meter->frameEnergies[frame] += _mm_cvtsd_f64(_mm_add_sd(energies, _mm_unpackhi_pd(energies, energies)));
+    }
+    _mm_storeu_pd(&meter->filterState[0][firstChannel], s1);
+    _mm_storeu_pd(&meter->filterState[1][firstChannel], s2);
+    _mm_storeu_pd(&meter->filterState[2][firstChannel], s3);
+    _mm_storeu_pd(&meter->filterState[3][firstChannel], s4);
+}
+#endif
+
+static void measureTruePeaks(LoudnessMeter *meter, const float *samples, size_t framesCount, float *io_Peak)
+{
+    uint16_t channelsCount = meter->channelsCount;
+    int phaseTaps = meter->truePeakPhaseTaps;
+    int historySize = phaseTaps - 1;
+
+    float largestSample = 0.0f;
+    for (size_t i = 0; i < framesCount * channelsCount; i++)
+    {
+        largestSample = fabsf(samples[i]) > largestSample ? fabsf(samples[i]) : largestSample;
+    }
+    float peak = largestSample > *io_Peak ? largestSample : *io_Peak;
+    if (meter->oversampling == 1)
+    {
+        *io_Peak = peak;
+        return;
+    }
+
+    // Interpolating costs a run of multiplications for every sample, and once the loudest part of a segment has gone by there is
+    // nothing to find.  When the largest sample in reach of the filter can't make a larger peak, only the history is kept up
+    for (uint16_t channel = 0; channel < channelsCount; channel++)
+    {
+        for (int i = 0; i < historySize; i++)
+        {
+            float sample = fabsf(meter->truePeakHistory[channel][i]);
+            largestSample = sample > largestSample ? sample : largestSample;
+        }
+    }
+    bool interpolates = (largestSample * meter->truePeakGain > peak);
+
+    // Each channel goes on its own after its history, so consecutive outputs of a phase come from consecutive samples and are
+    // worked out side by side, with every sample loaded once for all the phases
+    float *channelSamples = meter->truePeakSamples;
+    for (uint16_t channel = 0; channel < channelsCount; channel++)
+    {
+        float *history = meter->truePeakHistory[channel];
+        memcpy(channelSamples, history, sizeof(float) * historySize);
+        for (size_t frame = 0; frame < framesCount; frame++)
+        {
+            channelSamples[historySize + frame] = samples[frame * channelsCount + channel];
+        }
+
+        size_t frame = 0;
+#if defined(__AVX2__)
+        if (interpolates)
+        {
+            __m256 peaks = _mm256_set1_ps(peak);
+            const __m256 signBits = _mm256_set1_ps(-0.0f);
+            for (; frame + 8 <= framesCount; frame += 8)
+            {
+                // The sums of the four phases are kept apart so they stay in registers
+                __m256 sums0 = _mm256_setzero_ps();
+                __m256 sums1 = _mm256_setzero_ps();
+                __m256 sums2 = _mm256_setzero_ps();
+                __m256 sums3 = _mm256_setzero_ps();
+                for (int tap = 0; tap < phaseTaps; tap++)
+                {
+                    __m256 values = _mm256_loadu_ps(&channelSamples[frame + tap]);
+                    sums0 = _mm256_add_ps(sums0, _mm256_mul_ps(values, _mm256_broadcast_ss(&meter->truePeakCoefficients[0][tap])));
+                    sums1 = _mm256_add_ps(sums1, _mm256_mul_ps(values, _mm256_broadcast_ss(&meter->truePeakCoefficients[1][tap])));
+                    sums2 = _mm256_add_ps(sums2, _mm256_mul_ps(values, _mm256_broadcast_ss(&meter->truePeakCoefficients[2][tap])));
+                    sums3 = _mm256_add_ps(sums3, _mm256_mul_ps(values, _mm256_broadcast_ss(&meter->truePeakCoefficients[3][tap])));
+                }
+                peaks = _mm256_max_ps(peaks, _mm256_andnot_ps(signBits, sums0));
+                peaks = _mm256_max_ps(peaks, _mm256_andnot_ps(signBits, sums1));
+                peaks = _mm256_max_ps(peaks, _mm256_andnot_ps(signBits, sums2));
+                peaks = _mm256_max_ps(peaks, _mm256_andnot_ps(signBits, sums3));
+            }
+            float lanePeaks[8];
+            _mm256_storeu_ps(lanePeaks, peaks);
+            for (int lane = 0; lane < 8; lane++)
+            {
+                peak = lanePeaks[lane] > peak ? lanePeaks[lane] : peak;
+            }
+        }
+#elif defined(__SSE2__)
+        if (interpolates)
+        {
+            __m128 peaks = _mm_set1_ps(peak);
+            const __m128 signBits = _mm_set1_ps(-0.0f);
+            for (; frame + 4 <= framesCount; frame += 4)
+            {
+                // The sums of the four phases are kept apart so they stay in registers
+                __m128 sums0 = _mm_setzero_ps();
+                __m128 sums1 = _mm_setzero_ps();
+                __m128 sums2 = _mm_setzero_ps();
+                __m128 sums3 = _mm_setzero_ps();
+                for (int tap = 0; tap < phaseTaps; tap++)
+                {
+                    __m128 values = _mm_loadu_ps(&channelSamples[frame + tap]);
+                    sums0 = _mm_add_ps(sums0, _mm_mul_ps(values, _mm_set1_ps(meter->truePeakCoefficients[0][tap])));
+                    sums1 = _mm_add_ps(sums1, _mm_mul_ps(values, _mm_set1_ps(meter->truePeakCoefficients[1][tap])));
+                    sums2 = _mm_add_ps(sums2, _mm_mul_ps(values, _mm_set1_ps(meter->truePeakCoefficients[2][tap])));
+                    sums3 = _mm_add_ps(sums3, _mm_mul_ps(values, _mm_set1_ps(meter->truePeakCoefficients[3][tap])));
+                }
+                peaks = _mm_max_ps(peaks, _mm_andnot_ps(signBits, sums0));
+                peaks = _mm_max_ps(peaks, _mm_andnot_ps(signBits, sums1));
+                peaks = _mm_max_ps(peaks, _mm_andnot_ps(signBits, sums2));
+                peaks = _mm_max_ps(peaks, _mm_andnot_ps(signBits, sums3));
+            }
+            float lanePeaks[4];
+            _mm_storeu_ps(lanePeaks, peaks);
+            for (int lane = 0; lane < 4; lane++)
+            {
+                peak = lanePeaks[lane] > peak ? lanePeaks[lane] : peak;
+            }
+        }
+#endif
+        for (; interpolates && (frame < framesCount); frame++)
+        {
+            for (int phase = 0; phase < meter->oversampling; phase++)
+            {
+                float sum = 0.0f;
+                for (int tap = 0; tap < phaseTaps; tap++)
+                {
+                    sum += channelSamples[frame + tap] * meter->truePeakCoefficients[phase][tap];
+                }
+                peak = fabsf(sum) > peak ? fabsf(sum) : peak;
+            }
+        }
+        memcpy(history, &channelSamples[framesCount], sizeof(float) * historySize);
+    }
+    *io_Peak = peak;
+}
@@ -0,0 +1,287 @@
+/** @file wavmarker.h
+ *
+ * @details libwavmarker embeds cue points and labels into .wav files, it is the library behind the wav-marker command line tool.
+ *
+ * All the work happens through a wm_context, which owns every buffer the library needs and keeps them from one call to the next,
+ * so a long running process can tag any number of files with a single context and no repeated allocations.
+ * A context must only be used by one thread at a time, but any number of contexts can be used in parallel.
+ *
+ * A typical use sets the labels, then adds them to one or more wave files:
+ *
+ *     wm_context *context = wm_context_create();
+ *     wm_read_labels(context, labelFd);
+ *     if (wm_add_markers(context, inputFd, outputFd) != WM_OK)
+ *         fprintf(stderr, "%s\n", wm_error_message(context));
+ *     wm_context_destroy(context);
+ *
+ * The library never opens files by path and never prints anything, errors are returned as a wm_status with the details in
+ * wm_error_message, and progress and warnings go to the message callback if one is set.
+ */
+
+#ifndef WAVMARKER_H
+#define WAVMARKER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C"
+{
+#endif
+
+typedef enum
+{
+    WM_OK = 0,
+    WM_ERROR_INVALID_ARGUMENT = -1,
+    WM_ERROR_NO_MEMORY = -2,
+    WM_ERROR_IO = -3,                 // A read, write or sync failed
+    WM_ERROR_NOT_WAVE = -4,           // The input is not a RIFF, RF64 or BW64 WAVE file
+    WM_ERROR_UNSUPPORTED_FORMAT = -5, // Compressed audio
+    WM_ERROR_BAD_WAVE = -6,           // The chunks of the input are broken, truncated or missing
+    WM_ERROR_NO_LABELS = -7,          // There are no labels that could be turned into cue points
+    WM_ERROR_LIMIT = -8               // The input goes beyond what the library or the file format can handle
+} wm_status;
+
+typedef struct wm_context wm_context;
+
+// A label to add, at startTime seconds from the start of the audio
+typedef struct
+{
+    double start_time;
+    const char *text; // Need not be NUL terminated
+    size_t text_length;
+    double end_time; // A label that ends after it starts marks a region up to here, otherwise it is a point
+} wm_label;
+
+typedef enum
+{
+    WM_MESSAGE_PROGRESS,
+    WM_MESSAGE_WARNING // Something was skipped, like a label that could not be parsed
+} wm_message_type;
+
+// Receives each progress message or warning as a complete line
+typedef void (*wm_message_callback)(void *user_data, wm_message_type type, const char *message);
+
+// The phases of a call that are timed in wm_stats.  The library never opens files itself,
+// WM_PHASE_OPEN is there for callers that want to add the time they spent opening them
+typedef enum
+{
+    WM_PHASE_OPEN,
+    WM_PHASE_SCAN,
+    WM_PHASE_LABELS,
+    WM_PHASE_BUILD,
+    WM_PHASE_WRITE,
+    WM_PHASE_FSYNC,
+    WM_PHASES_COUNT
+} wm_phase;
+
+// The ways chunk data gets from the input file to the output file, fastest first
+typedef enum
+{
+    WM_COPY_CLONE,
+    WM_COPY_FILE_RANGE,
+    WM_COPY_SENDFILE,
+    WM_COPY_READ_WRITE,
+    WM_COPY_DIRECT, // read/write with O_DIRECT
+    WM_COPY_STRATEGIES_COUNT
+} wm_copy_strategy;
+
+// Timings and I/O counters, summed over every call since the context was created or the stats were reset
+typedef struct
+{
+    uint64_t phase_wall_nanoseconds[WM_PHASES_COUNT];
+    uint64_t phase_cpu_nanoseconds[WM_PHASES_COUNT]; // CPU time of the calling thread
+    uint64_t bytes_read;                             // through user space, with read and pread
+    uint64_t bytes_written;                          // through user space, with write, pwrite and friends
+    uint64_t bytes_mapped;
+    uint64_t read_calls;
+    uint64_t write_calls;
+    uint64_t copy_calls; // FICLONERANGE, copy_file_range and sendfile
+    uint64_t map_calls;
+    uint64_t sync_calls;
+    uint64_t ring_calls; // io_uring_enter
+    uint64_t copied_bytes[WM_COPY_STRATEGIES_COUNT];
+} wm_stats;
+
+// Returns NULL if there is not enough memory
+wm_context *wm_context_create(void);
+void wm_context_destroy(wm_context *context);
+
+void wm_set_message_callback(wm_context *context, wm_message_callback callback, void *user_data);
+
+// fsync the output before a call returns
+void wm_set_sync_output(wm_context *context, bool sync_output);
+
+// Copy sample data with O_DIRECT so it doesn't push everything else out of the page cache.  O_DIRECT is set on the file descriptors
+// for the length of each copy, and where the filesystem can't do direct I/O the copied ranges are written out and dropped from
+// the cache instead.  Only used by wm_add_markers, and clones are still made where the filesystem can
+void wm_set_direct_io(wm_context *context, bool direct_io);
+
+// How the output file is written
+typedef enum
+{
+    WM_IO_BACKEND_SYNC,     // pwritev and a reader thread for the copy buffers
+    WM_IO_BACKEND_IO_URING  // Queue the writes and copies on an io_uring, where the kernel has one
+} wm_io_backend;
+
+// The io_uring backend is only used by wm_add_markers and wm_add_markers_from_buffer.  Where io_uring isn't available,
+// because the kernel is too old or it is blocked, there is a warning and the output is written the usual way
+void wm_set_io_backend(wm_context *context, wm_io_backend backend);
+
+// Sample data the kernel can't copy by itself is copied through buffer_count buffers of buffer_size bytes, rounded up to whole
+// pages, with the next buffer read while the last one is written.  huge_pages asks for them to be backed by huge pages.
+// The defaults are four buffers of 2 MB
+wm_status wm_set_copy_buffers(wm_context *context, size_t buffer_size, int buffer_count, bool huge_pages);
+
+// How label times that fall between two samples are turned into a sample frame
+typedef enum
+{
+    WM_ROUND_DOWN,    // The sample the time falls in, the default
+    WM_ROUND_NEAREST, // The nearest sample, halfway goes up
+    WM_ROUND_UP       // The first sample at or after the time
+} wm_rounding;
+
+// Label times are exact to the nanosecond, times read from a label file are parsed as decimals without going through floating point
+void wm_set_rounding(wm_context *context, wm_rounding rounding);
+
+typedef enum
+{
+    WM_CHECKSUM_NONE,
+    WM_CHECKSUM_COMPUTE, // CRC-32C of the output file and each of its chunks, taken from the copy buffers as they are written
+    WM_CHECKSUM_VERIFY   // Also read the sample data back from the output and fail if it doesn't match what was read from the input
+} wm_checksum_mode;
+
+// The checksum of one chunk of the output, over its data without the chunk header or the padding byte
+typedef struct
+{
+    char chunk_id[4];
+    uint64_t size;
+    uint32_t crc32c;
+} wm_chunk_checksum;
+
+// Checksums are only taken by wm_add_markers and wm_add_markers_from_buffer.  Sample data is then copied through the copy buffers
+// rather than in the kernel, so the checksums cost no extra reads, but it does turn off clones and the io_uring copies
+void wm_set_checksums(wm_context *context, wm_checksum_mode mode);
+
+// The CRC-32C of the whole output file written by the last call, and of each of its chunks in file order.  Returns the number of chunks,
+// 0 if the last call didn't take checksums.  The chunks stay valid until the next call on the context
+size_t wm_get_checksums(const wm_context *context, uint32_t *out_file_crc32c, const wm_chunk_checksum **out_chunks);
+
+// How the level of a window of samples is measured when looking for silences
+typedef enum
+{
+    WM_SILENCE_OFF,
+    WM_SILENCE_RMS,
+    WM_SILENCE_PEAK
+} wm_silence_level;
+
+// Finds the silences in the sample data as it is copied, and marks each with a cue point at its start, a labl chunk of text
+// ("Silence" if text is NULL) and an ltxt region as long as the silence.  A silence is at least min_seconds of 10 ms windows whose level,
+// across all channels, is below threshold_db dBFS.  The silence markers come on top of the labels, which can then be empty.
+// Only done by wm_add_markers and wm_add_markers_from_buffer, which then copy the sample data through the copy buffers and write
+// the sizes in the header once the markers are known, so the output must be a seekable file
+wm_status wm_set_auto_silence(wm_context *context, wm_silence_level level, double threshold_db, double min_seconds, const char *text);
+
+// Where the cue point of a label is moved to, so that an editor cutting at it doesn't make a click
+typedef enum
+{
+    WM_SNAP_OFF,
+    WM_SNAP_ZERO_CROSSING, // The nearest sample frame at which every channel crosses zero
+    WM_SNAP_QUIET          // The sample frame with the least energy across all channels, the nearest of them if there are several
+} wm_snap_mode;
+
+// Moves the cue point of each label to a sample frame at most window_seconds (up to 1) away.  Only the sample data around each label
+// is read, in sample frame order.  Labels without a zero crossing near them stay where they are, and when merging, labels that update
+// or delete an existing marker are never moved.  Not done by wm_add_markers_stream, which writes the markers before the samples
+wm_status wm_set_snap(wm_context *context, wm_snap_mode mode, double window_seconds);
+
+// The waveform overview of one channel over samples_per_pixel sample frames, with full scale at 32767
+typedef struct
+{
+    int16_t min;
+    int16_t max;
+    int16_t rms;
+} wm_peak;
+
+// Takes waveform peaks of the sample data as it is copied, at samples_per_pixel sample frames per peak and at levels - 1 (up to 15)
+// more resolutions, each with twice as many frames per peak as the one before.  0 samples_per_pixel turns them off.  Only done by
+// wm_add_markers and wm_add_markers_from_buffer, which then copy the sample data through the copy buffers
+wm_status wm_set_peaks(wm_context *context, uint32_t samples_per_pixel, int levels);
+
+// The peaks of one level taken by the last call, for each peak one per channel.  Returns the number of peaks per channel, 0 if the
+// last call didn't take peaks.  The peaks stay valid until the next call on the context
+size_t wm_get_peaks(const wm_context *context, int level, uint32_t *out_samples_per_pixel, uint16_t *out_channels_count, const wm_peak **out_peaks);
+
+// Writes one level of the peaks as an audiowaveform .dat file (version 2, 16 bit min and max), which is what waveform players read
+wm_status wm_write_peaks(wm_context *context, int level, int fd);
+
+// The loudness of the whole output, or of the segment of it from one marker to the next
+typedef struct
+{
+    uint64_t start_frame;
+    uint64_t frames_count;
+    double integrated_lufs; // -INFINITY when every 400 ms block is gated out, or there is none because the segment is shorter
+    double true_peak_dbtp;  // -INFINITY for digital silence
+} wm_loudness;
+
+// Measures the integrated loudness (EBU R128, ITU-R BS.1770-4) and the true peak of the sample data as it is copied, for the whole
+// file and for each segment from a marker, or the start of the file, to the next marker or the end of the file.  Channels are weighted
+// as L, R, C, LFE, Ls, Rs when there are 6 of them, and all the same otherwise, up to 32.  Only done by wm_add_markers and
+// wm_add_markers_from_buffer, which then copy the sample data through the copy buffers
+void wm_set_loudness(wm_context *context, bool measure_loudness);
+
+// The sample rate and the loudness of the whole file written by the last call and of each of its segments in sample frame order.
+// Returns the number of segments, 0 if the last call didn't measure loudness.  The segments stay valid until the next call on the context
+size_t wm_get_loudness(const wm_context *context, uint32_t *out_sample_rate, wm_loudness *out_file, const wm_loudness **out_segments);
+
+// What happens to the cue points and labl, note and ltxt chunks a wave file already has
+typedef enum
+{
+    WM_MERGE_NONE,   // They are replaced by the labels
+    WM_MERGE_UPSERT, // They are kept, and a label at the same sample frame as one of them replaces its text
+    WM_MERGE_KEEP    // They are kept, and a label at the same sample frame as one of them is left out
+} wm_merge_mode;
+
+// When merging, the markers are written in sample frame order, and a label with no text deletes the marker at its sample frame.
+// Set the mode before reading a label file, lines without label text are only accepted when merging.
+// Merging needs to read the existing markers before writing, so wm_add_markers_stream refuses to merge
+void wm_set_merge_mode(wm_context *context, wm_merge_mode mode);
+
+// Each of these replaces the labels of the context, which are then added to every wave file until they are replaced again.
+// wm_set_labels copies the label text, wm_parse_labels parses an Audacity label file in memory without copying it, so the buffer must
+// stay valid until the labels are replaced or the context is destroyed, and wm_read_labels reads an Audacity label file from a file
+// descriptor, which can be closed once it returns
+wm_status wm_set_labels(wm_context *context, const wm_label *labels, size_t count);
+wm_status wm_parse_labels(wm_context *context, const char *buffer, size_t size);
+wm_status wm_read_labels(wm_context *context, int fd);
+
+// Writes the input wave file with the labels added to the output, which must be a seekable file
+wm_status wm_add_markers(wm_context *context, int input_fd, int output_fd);
+
+// Same as wm_add_markers for a wave file that is already in memory
+wm_status wm_add_markers_from_buffer(wm_context *context, const void *wave, size_t size, int output_fd);
+
+// Adds the labels to a wave file opened for reading and writing without rewriting its sample data
+wm_status wm_add_markers_in_place(wm_context *context, int fd);
+
+// Reads the input and writes the output front to back in one pass, so both can be pipes.  The sizes in the input header must be filled in
+wm_status wm_add_markers_stream(wm_context *context, int input_fd, int output_fd);
+
+// Writes the markers of a wave file to the output as an Audacity label file, one line per cue point in sample frame order with the
+// text of its labl chunk.  The end time is the end of its ltxt region if it has one, otherwise the start time.  Only the chunk headers,
+// the format chunk and the marker chunks are read, never the sample data.  The output can be a pipe
+wm_status wm_export_labels(wm_context *context, int input_fd, int output_fd);
+
+// Describes the status in general terms, wm_error_message has the details of the last failure of a context
+const char *wm_status_string(wm_status status);
+const char *wm_error_message(const wm_context *context);
+
+void wm_get_stats(const wm_context *context, wm_stats *out_stats);
+void wm_reset_stats(wm_context *context);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif